@@ -249,6 +249,11 @@ const char *device_control_name(ULONG ioctl_code)
 	case vhci::ioctl::PLUGOUT_HARDWARE: return "vhci_plugout_hardware";
 	case vhci::ioctl::GET_IMPORTED_DEVICES: return "vhci_get_imported_devices";
 	case vhci::ioctl::DRIVER_REGISTRY_PATH: return "vhci_driver_registry_path";
+	case vhci::ioctl::GET_DEVICE_STATISTICS: return "vhci_get_device_statistics";
+	case vhci::ioctl::SET_URB_TRACE: return "vhci_set_urb_trace";
+	case vhci::ioctl::GET_URB_TRACE: return "vhci_get_urb_trace";
+	case vhci::ioctl::PLUGIN_HARDWARE_BATCH: return "vhci_plugin_hardware_batch";
+	case vhci::ioctl::CLEAR_DESCRIPTOR_CACHE: return "vhci_clear_descriptor_cache";
 
 	case IOCTL_USB_DIAG_IGNORE_HUBS_ON: return "USB_DIAG_IGNORE_HUBS_ON";
 	case IOCTL_USB_DIAG_IGNORE_HUBS_OFF: return "USB_DIAG_IGNORE_HUBS_OFF";
@@ -122,6 +122,35 @@ NTSTATUS usbip::Mdl::prepare_paged(_In_ LOCK_OPERATION Operation)
         return lock(Operation);
 }
 
+/*
+ * Reuse partial MDL for another range of SourceMdl without reallocation.
+ * The range must fit into the MDL, it's enough if it is not longer than the original one.
+ */
+NTSTATUS usbip::Mdl::rebuild_partial(_In_ MDL *SourceMdl, _In_ ULONG Offset, _In_ ULONG Length)
+{
+        if (!m_mdl) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        if (nonmanaged() || !partial()) {
+                return STATUS_INVALID_DEVICE_REQUEST;
+        }
+
+        NT_ASSERT(!SourceMdl->Next);
+        NT_ASSERT(Offset + Length <= MmGetMdlByteCount(SourceMdl));
+
+        auto va = (char*)MmGetMdlVirtualAddress(SourceMdl) + Offset;
+        if (m_mdl->Size < MmSizeOfMdl(va, Length)) {
+                return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        MmPrepareMdlForReuse(m_mdl);
+        IoBuildPartialMdl(SourceMdl, m_mdl, va, Length);
+
+        NT_ASSERT(partial());
+        return STATUS_SUCCESS;
+}
+
 void usbip::Mdl::unprepare()
 {
         if (m_mdl && managed()) {
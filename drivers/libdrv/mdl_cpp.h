@@ -49,6 +49,7 @@ public:
 
         NTSTATUS prepare_nonpaged();
         NTSTATUS prepare_paged(_In_ LOCK_OPERATION Operation);
+        NTSTATUS rebuild_partial(_In_ MDL *SourceMdl, _In_ ULONG Offset, _In_ ULONG Length);
 
         void unprepare();
 
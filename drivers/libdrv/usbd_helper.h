@@ -18,6 +18,18 @@ inline auto to_windows_status_isoch(int usbip_status) { return to_windows_status
 ULONG to_windows_flags(UINT32 transfer_flags, bool dir_in);
 UINT32 to_linux_flags(ULONG TransferFlags, bool dir_in);
 
+/*
+ * Frame number of the emulated bus, 1ms frames of KeQueryInterruptTime.
+ * usbip2_filter returns it for URB_FUNCTION_GET_CURRENT_FRAME_NUMBER and QueryBusTime,
+ * usbip2_ude maps it to frame numbers of a server.
+ */
+inline ULONG get_host_frame_number(_In_ ULONG64 interrupt_time)
+{
+	return ULONG(interrupt_time/10'000);
+}
+
+inline auto get_host_frame_number() { return get_host_frame_number(KeQueryInterruptTime()); }
+
 constexpr auto IsTransferDirectionIn(ULONG TransferFlags)
 {
 	return USBD_TRANSFER_DIRECTION_FLAG(TransferFlags) == USBD_TRANSFER_DIRECTION_IN;
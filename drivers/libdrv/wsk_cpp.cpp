@@ -663,6 +663,157 @@ PAGED auto wsk::for_each(
         return nullptr;
 }
 
+namespace
+{
+
+struct connect_attempt
+{
+        const ADDRINFOEXW *ai;
+        wsk::SOCKET *sock;
+        IRP *irp;
+        KEVENT *completed; // shared by all attempts
+        volatile LONG done; // IRP is completed
+        bool harvested; // the result is handled
+};
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS connect_completion(_In_ DEVICE_OBJECT*, _In_ IRP*, _In_ void *Context)
+{
+        auto &a = *static_cast<connect_attempt*>(Context);
+
+        InterlockedExchange(&a.done, true);
+        KeSetEvent(a.completed, IO_NO_INCREMENT, false);
+
+        return StopCompletion;
+}
+
+/*
+ * @return false if the attempt can't be started, the socket is closed in this case
+ */
+_IRQL_requires_max_(APC_LEVEL)
+PAGED auto start_attempt(
+        _Inout_ connect_attempt &a, _In_ ULONG Flags, _In_opt_ void *SocketContext, _In_opt_ const void *Dispatch,
+        _In_ wsk::addrinfo_f prepare, _Inout_opt_ void *ctx)
+{
+        PAGED_CODE();
+        auto &ai = *a.ai;
+
+        if (wsk::socket(a.sock, static_cast<ADDRESS_FAMILY>(ai.ai_family), static_cast<USHORT>(ai.ai_socktype),
+                        ai.ai_protocol, Flags, SocketContext, Dispatch)) {
+                NT_ASSERT(!a.sock);
+                return false;
+        }
+
+        if (auto err = prepare(a.sock, ai, ctx); err || !(a.irp = IoAllocateIrp(1, false))) {
+                NT_VERIFY(NT_SUCCESS(wsk::close(a.sock)));
+                a.sock = nullptr;
+                return false;
+        }
+
+        IoSetCompletionRoutine(a.irp, connect_completion, &a, true, true, true);
+
+        auto sock = a.sock;
+        sock->invoke(sock->Connection->WskConnect, sock->Self, ai.ai_addr, 0, a.irp); // completion is always called
+        return true;
+}
+
+} // namespace
+
+
+_IRQL_requires_max_(APC_LEVEL)
+PAGED auto wsk::connect_race(
+        _In_ ULONG Flags, _In_opt_ void *SocketContext, _In_opt_ const void *Dispatch,
+        _In_ const ADDRINFOEXW *head, _In_ addrinfo_f prepare, _Inout_opt_ void *ctx,
+        _In_ ULONG delay, _Out_opt_ const ADDRINFOEXW* *winner) -> SOCKET*
+{
+        PAGED_CODE();
+        
+        enum { MAX_ATTEMPTS = 8, MSEC = 10'000 }; // 100-nanosecond units
+
+        KEVENT completed;
+        KeInitializeEvent(&completed, SynchronizationEvent, false);
+
+        connect_attempt v[MAX_ATTEMPTS]{};
+        ULONG cnt = 0; // started
+        ULONG pending = 0;
+        connect_attempt *won{};
+
+        auto ai = head;
+        ULONG64 next_start = 0; // KeQueryInterruptTime
+
+        while (!won) {
+                auto now = KeQueryInterruptTime();
+
+                if (ai && cnt < ARRAYSIZE(v) && (!pending || now >= next_start)) {
+                        auto &a = v[cnt];
+                        a.ai = ai;
+                        a.completed = &completed;
+
+                        ai = ai->ai_next;
+
+                        if (start_attempt(a, Flags, SocketContext, Dispatch, prepare, ctx)) {
+                                ++cnt;
+                                ++pending;
+                                next_start = now + ULONG64(delay)*MSEC;
+                        } else {
+                                a = connect_attempt{};
+                        }
+                        continue;
+                }
+
+                if (!pending) {
+                        break; // all attempts failed
+                }
+
+                LARGE_INTEGER timeout{ .QuadPart = -LONG64(next_start > now ? next_start - now : 0) }; // relative
+                bool can_start = ai && cnt < ARRAYSIZE(v);
+
+                KeWaitForSingleObject(&completed, Executive, KernelMode, false, can_start ? &timeout : nullptr);
+
+                for (ULONG i = 0; i < cnt && !won; ++i) {
+                        auto &a = v[i];
+                        if (a.harvested || !ReadAcquire(&a.done)) {
+                                continue;
+                        }
+
+                        a.harvested = true;
+                        --pending;
+
+                        if (NT_SUCCESS(a.irp->IoStatus.Status)) {
+                                won = &a;
+                        } else {
+                                next_start = 0; // start the next attempt immediately
+                        }
+                }
+        }
+
+        for (ULONG i = 0; i < cnt; ++i) { // cancel the rest
+                if (auto &a = v[i]; !ReadAcquire(&a.done)) {
+                        IoCancelIrp(a.irp);
+                }
+        }
+
+        for (ULONG i = 0; i < cnt; ++i) {
+                auto &a = v[i];
+
+                while (!ReadAcquire(&a.done)) {
+                        KeWaitForSingleObject(&completed, Executive, KernelMode, false, nullptr);
+                }
+
+                if (&a != won) { // a connection could be established too
+                        NT_VERIFY(NT_SUCCESS(close(a.sock)));
+                }
+
+                IoFreeIrp(a.irp);
+        }
+
+        if (winner) {
+                *winner = won ? won->ai : nullptr;
+        }
+
+        return won ? won->sock : nullptr;
+}
+
 /*
  * Error if optval is ULONG, one byte is written actually.
  */
@@ -120,6 +120,21 @@ PAGED SOCKET *for_each(
         _In_ ULONG Flags, _In_opt_ void *SocketContext, _In_opt_ const void *Dispatch, // for FN_WSK_SOCKET
         _In_ const ADDRINFOEXW *head, _In_ addrinfo_f f, _Inout_opt_ void *ctx);
 
+/*
+ * Happy Eyeballs, RFC 8305. Connection attempts are started one after another and run concurrently,
+ * the next one is started after the delay or when the previous one fails.
+ * The first established connection is returned, other attempts are cancelled.
+ * 
+ * @param prepare is called for a socket before connect, f.e. to set options and bind it
+ * @param delay between attempts in milliseconds, "Connection Attempt Delay"
+ * @param winner address of returned socket
+ */
+_IRQL_requires_max_(APC_LEVEL)
+PAGED SOCKET *connect_race(
+        _In_ ULONG Flags, _In_opt_ void *SocketContext, _In_opt_ const void *Dispatch, // for FN_WSK_SOCKET
+        _In_ const ADDRINFOEXW *head, _In_ addrinfo_f prepare, _Inout_opt_ void *ctx,
+        _In_ ULONG delay, _Out_opt_ const ADDRINFOEXW* *winner = nullptr);
+
 enum { RECEIVE_EVENT_FLAGS_BUFBZ = 64 };
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
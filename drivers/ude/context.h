@@ -9,6 +9,7 @@
 #include <libdrv\wdf_cpp.h>
 
 #include <usbip\proto.h>
+#include <usbip\pdu_codec.h>
 
 #include <wdfusb.h>
 #include <UdeCx.h>
@@ -33,14 +34,29 @@ namespace usbip
 enum { 
         USB2_PORTS = 30,
         USB3_PORTS = USB2_PORTS,
-        TOTAL_PORTS = USB2_PORTS + USB3_PORTS
+        TOTAL_PORTS = USB2_PORTS + USB3_PORTS, // of each vhci instance
+        MAX_VHCI = 16, // root-enumerated instances of the driver, @see vhci_ctx::index
+        MAX_PORTS = MAX_VHCI*TOTAL_PORTS
 };
 
+enum { REQUESTS_BUCKETS = 256 }; // power of two, @see device_ctx::requests
+enum { ENDPOINT_ADDR_SLOTS = 32, ENDPOINT_HANDLE_SLOTS = 32 }; // @see endpoint_list.cpp
+
+/*
+ * Port numbers are unique across vhci instances, port = vhci_ctx::index*TOTAL_PORTS + roothub port.
+ */
 constexpr auto is_valid_port(int port)
 {
-        return port > 0 && port <= TOTAL_PORTS;
+        return port > 0 && port <= MAX_PORTS;
 }
 
+constexpr auto make_port(int vhci_index, int roothub_port) { return vhci_index*TOTAL_PORTS + roothub_port; }
+
+constexpr auto get_vhci_index(int port) { return (port - 1)/TOTAL_PORTS; }
+constexpr auto get_roothub_port(int port) { return (port - 1) % TOTAL_PORTS + 1; }
+
+struct resolver_cache;
+
 /*
  * Context space for WDFDEVICE, Virtual Host Controller Interface.
  * Parent is WDFDRIVER.
@@ -48,10 +64,15 @@ constexpr auto is_valid_port(int port)
 struct vhci_ctx
 {
         UDECXUSBDEVICE devices[TOTAL_PORTS]; // do not access directly, functions must be used
-        KSPIN_LOCK lock;
+        KSPIN_LOCK lock; // for devices
+        LONG claimed[(TOTAL_PORTS + 31)/32]; // bitmap of roothub ports, a bit is set before devices[] is assigned
+        int index; // of this instance, @see is_valid_port
 
         _KTHREAD *attach_thread;
         KEVENT attach_thread_stop;
+
+        resolver_cache *resolver; // @see resolver.h, must be free-d
+        WDFQUEUE batch_queue; // PLUGIN_HARDWARE_BATCH requests are pending there
 };
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(vhci_ctx, get_vhci_ctx)
 
@@ -63,6 +84,85 @@ inline auto get_device(_In_ vhci_ctx *ctx)
 
 struct wsk_context;
 struct device_ctx;
+struct endpoint_ctx;
+struct receive_buffer;
+struct drain_buffer;
+struct urb_trace;
+struct descriptor_cache;
+
+/*
+ * @see receive_mode_value_name
+ */
+enum class receive_mode : ULONG
+{
+        header, // WSK_FLAG_WAITALL receive for every usbip_header and its payload
+        stream, // read all available data into receive_buffer and parse as many messages as it has
+        event // WskReceiveEvent parses data indications without a workitem
+};
+
+/*
+ * For receive_mode::event.
+ */
+struct receive_event_state
+{
+        ULONG hdr_len; // received bytes of wsk_context::hdr
+        MDL *payload; // destination, nullptr if the payload must be discarded
+        size_t offset; // received bytes of the payload
+        size_t length; // payload size
+        bool failed;
+};
+
+/*
+ * Priority classes of transmit scheduler, from the highest.
+ * @see device_ioctl.cpp
+ */
+enum send_class { SEND_CONTROL, SEND_INTERRUPT, SEND_ISOCH, SEND_BULK, SEND_CLASSES };
+
+struct send_queue
+{
+        wsk_context *head;
+        wsk_context *tail;
+        ULONG count;
+};
+
+/*
+ * Times are in 100-nanosecond units.
+ */
+struct send_statistics
+{
+        ULONG64 sends; // WskSend calls
+        ULONG64 pdus; // PDUs sent by these calls, pdus/sends is PDUs per send
+
+        ULONG64 queue_time; // sum of time in queue of all PDUs
+        ULONG64 max_queue_time;
+
+        ULONG64 send_time; // sum of time from WskSend till its completion
+        ULONG64 max_send_time;
+
+        ULONG max_queued; // max queue depth
+};
+
+/*
+ * Mapping of host frame numbers to frame numbers of the server's HCD, @see frame_clock.h
+ * Offsets and jitter are in 1/256 of frame.
+ */
+struct frame_clock
+{
+        KSPIN_LOCK lock; // for the members below
+        ULONG mask; // server frame numbers wrap around at mask + 1, zero if there were no samples
+        ULONG offset; // server - host, modulo 256*(mask + 1)
+        ULONG jitter; // mean deviation of samples from offset
+        ULONG samples; // since the last resync
+        ULONG resyncs;
+
+        ULONG last_frame; // host frame of the last sample
+        ULONG last_start_frame; // of the last sample
+        bool wrapped; // start_frame was seen wrapping around at mask + 1, the mask is not a guess
+
+        ULONG drift_frame; // host frame of drift_offset
+        ULONG drift_offset;
+        LONG drift; // ppm
+};
 
 /*
  * Context extention for device_ctx. 
@@ -88,6 +188,7 @@ struct device_ctx_ext
         //
         
         vhci::imported_device_properties dev; // for ioctl::get_imported_devices
+        UINT16 bcdDevice; // from OP_REP_IMPORT, for descriptor_cache
 };
 
 /*
@@ -102,12 +203,15 @@ struct device_ctx
         auto devid() const { return ext->dev.devid; }
 
         WDFDEVICE vhci; // parent, virtual (emulated) host controller interface
-        WDFQUEUE queue; // requests that are waiting for USBIP_RET_SUBMIT from a server
+        KSPIN_LOCK requests_lock; // for request_ctx::entry
+        LIST_ENTRY requests[REQUESTS_BUCKETS]; // requests that are waiting for USBIP_RET_SUBMIT, by seqnum
 
         UDECXUSBENDPOINT ep0; // default control pipe
-        KSPIN_LOCK endpoint_list_lock; // for endpoint_ctx::entry
+        KSPIN_LOCK endpoint_list_lock; // for endpoint_ctx::entry and the tables below
+        endpoint_ctx *endpoint_by_addr[ENDPOINT_ADDR_SLOTS]; // @see find_endpoint
+        endpoint_ctx *endpoint_by_handle[ENDPOINT_HANDLE_SLOTS];
 
-        int port; // vhci_ctx.devices[port - 1]
+        int port; // @see is_valid_port
         volatile bool unplugged;
         seqnum_t seqnum; // @see next_seqnum
 
@@ -116,6 +220,29 @@ struct device_ctx
         using received_fn = NTSTATUS (wsk_context&);
         received_fn *received;
         size_t receive_size;
+
+        receive_mode recv_mode;
+        receive_buffer *recv_buf; // for receive_mode::stream, must be free-d
+        receive_event_state recv_event;
+
+        drain_buffer *drain_buf; // for receive_mode::header, must be free-d
+        size_t drain_size; // bytes of payload left to discard
+        ULONG64 discarded_bytes; // payload of requests that were not found, in all receive modes
+
+        // transmit scheduler, @see device_ioctl.cpp
+        KSPIN_LOCK send_lock; // for the members below
+        send_queue send_queues[SEND_CLASSES];
+        ULONG send_queued; // total number of PDUs in send_queues
+        ULONG sends_inflight;
+        bool send_pumping; // a thread calls WskSend, @see pump_sends
+        ULONG max_sends_inflight; // @see max_sends_inflight_value_name
+        send_statistics send_stats;
+
+        frame_clock fclock;
+
+        vhci::transfer_statistics stats; // @see statistics.h
+        urb_trace *trace; // @see urb_trace.h, must be free-d
+        descriptor_cache *dcache; // @see descriptor_cache.h, must be free-d
 };        
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(device_ctx, get_device_ctx)
 
@@ -125,12 +252,6 @@ inline auto get_device(_In_ device_ctx *ctx)
         return static_cast<UDECXUSBDEVICE>(WdfObjectContextGetObject(ctx));
 }
 
-WDF_DECLARE_CONTEXT_TYPE(UDECXUSBDEVICE); // WdfObjectGet_UDECXUSBDEVICE
-inline auto& get_device(_In_ WDFQUEUE queue) // for device_ctx.queue
-{
-        return *WdfObjectGet_UDECXUSBDEVICE(queue);
-}
-
 /*
  * Context space for UDECXUSBENDPOINT.
  */
@@ -145,11 +266,13 @@ struct endpoint_ctx
 
         USBD_PIPE_HANDLE PipeHandle;
         LIST_ENTRY entry; // list head if default control pipe, protected by device_ctx::endpoint_list_lock
+
+        vhci::transfer_statistics stats;
 };        
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(endpoint_ctx, get_endpoint_ctx)
 
 WDF_DECLARE_CONTEXT_TYPE(UDECXUSBENDPOINT); // WdfObjectGet_UDECXUSBENDPOINT
-inline auto& get_endpoint(_In_ WDFQUEUE queue) // use get_device() for device_ctx.queue
+inline auto& get_endpoint(_In_ WDFQUEUE queue) // for endpoint_ctx.queue
 {
         return *WdfObjectGet_UDECXUSBENDPOINT(queue);
 }
@@ -165,6 +288,13 @@ struct request_ctx
         seqnum_t seqnum;
         request_status status;
         UDECXUSBENDPOINT endpoint;
+        LIST_ENTRY entry; // device_ctx::requests[], protected by device_ctx::requests_lock
+        ULONG64 submit_time; // @see KeQueryInterruptTime
+        ULONG64 send_time; // for urb_trace
+        ULONG64 recv_time;
+        bool start_asap; // isoch CMD_SUBMIT has URB_ISO_ASAP, start_frame is chosen by the server
+        bool submit_queued; // CMD_SUBMIT was put into send queue, protected by device_ctx::send_lock
+        bool unsent_canceled; // canceled before CMD_SUBMIT was queued, protected by device_ctx::send_lock
 };
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(request_ctx, get_request_ctx)
 
@@ -190,9 +320,9 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 seqnum_t next_seqnum(_Inout_ device_ctx &dev, _In_ bool dir_in);
 
-constexpr auto extract_num(seqnum_t seqnum) { return seqnum >> 1; }
-constexpr auto extract_dir(seqnum_t seqnum) { return usbip_dir(seqnum & 1); }
-constexpr bool is_valid_seqnum(seqnum_t seqnum) { return extract_num(seqnum); }
+using pdu::extract_num;
+using pdu::extract_dir;
+using pdu::is_valid_seqnum;
 
 constexpr UINT32 make_devid(UINT16 busnum, UINT16 devnum)
 {
@@ -0,0 +1,546 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "descriptor_cache.h"
+#include "trace.h"
+#include "descriptor_cache.tmh"
+
+#include "driver.h"
+
+#include <libdrv\lock.h>
+#include <libdrv\ch9.h>
+
+#include <ntstrsafe.h>
+
+namespace
+{
+
+using namespace usbip;
+
+enum { MAX_CACHE_SIZE = 64*1024, MIN_CAPACITY = 1024 };
+enum { MAX_CACHED_DEVICES = 64 }; // values under Parameters\DescriptorCache, up to 4MB
+
+struct descriptor_record
+{
+        UCHAR type; // bDescriptorType
+        UCHAR index;
+        USHORT lang_id; // for string descriptors, zero for others
+        USHORT length; // of the data that follows
+};
+static_assert(sizeof(descriptor_record) == 6);
+
+inline auto data(_In_ const descriptor_record &r) { return reinterpret_cast<const char*>(&r + 1); }
+inline auto next(_In_ const descriptor_record &r) { return data(r) + r.length; }
+
+constexpr auto is_cacheable(_In_ UCHAR type)
+{
+        switch (type) {
+        case USB_DEVICE_DESCRIPTOR_TYPE:
+        case USB_CONFIGURATION_DESCRIPTOR_TYPE:
+        case USB_STRING_DESCRIPTOR_TYPE:
+        case USB_BOS_DESCRIPTOR_TYPE:
+                return true;
+        }
+
+        return false;
+}
+
+/*
+ * @return type of the descriptor or zero if this is not a standard GET_DESCRIPTOR for the device
+ */
+inline UCHAR get_descriptor_type(_In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt)
+{
+        auto ok = pkt.bmRequestType.B == (USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE) &&
+                  pkt.bRequest == USB_REQUEST_GET_DESCRIPTOR &&
+                  is_cacheable(pkt.wValue.HiByte);
+
+        return ok ? pkt.wValue.HiByte : 0;
+}
+
+/*
+ * @return true if the whole descriptor (with subordinate ones) is received
+ */
+auto is_complete(_In_ UCHAR type, _In_ const void *data, _In_ ULONG length)
+{
+        auto d = static_cast<const UCHAR*>(data);
+
+        if (length < 2 || d[1] != type) {
+                return false;
+        }
+
+        switch (type) {
+        case USB_DEVICE_DESCRIPTOR_TYPE:
+                return length == sizeof(USB_DEVICE_DESCRIPTOR) && d[0] == length;
+        case USB_CONFIGURATION_DESCRIPTOR_TYPE:
+        case USB_BOS_DESCRIPTOR_TYPE: // wTotalLength has the same offset
+                return length >= 4 && (d[2] | d[3] << 8) == length;
+        }
+
+        return d[0] == length;
+}
+
+} // namespace
+
+
+struct usbip::descriptor_cache
+{
+        KSPIN_LOCK lock;
+        bool validated; // device descriptor from the server matches the cached one
+        bool dirty;
+
+        ULONG size;
+        ULONG capacity;
+        char *records; // descriptor_record[]
+};
+
+
+namespace
+{
+
+void destroy(_In_opt_ descriptor_cache *c)
+{
+        if (c) {
+                if (c->records) {
+                        ExFreePoolWithTag(c->records, pooltag);
+                }
+                ExFreePoolWithTag(c, pooltag);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto find(_In_ descriptor_cache &c, _In_ UCHAR type, _In_ UCHAR index, _In_ USHORT lang_id)
+{
+        for (auto p = c.records, end = p + c.size; p < end; ) {
+                auto &r = *reinterpret_cast<descriptor_record*>(p);
+                if (r.type == type && r.index == index && r.lang_id == lang_id) {
+                        return &r;
+                }
+                p = const_cast<char*>(next(r));
+        }
+
+        return static_cast<descriptor_record*>(nullptr);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void erase(_Inout_ descriptor_cache &c, _In_ descriptor_record &r)
+{
+        auto p = reinterpret_cast<char*>(&r);
+        auto sz = ULONG(next(r) - p);
+
+        RtlMoveMemory(p, p + sz, c.records + c.size - (p + sz));
+        c.size -= sz;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto reserve(_Inout_ descriptor_cache &c, _In_ ULONG capacity)
+{
+        if (capacity <= c.capacity) {
+                return STATUS_SUCCESS;
+        } else if (capacity > MAX_CACHE_SIZE) {
+                return STATUS_BUFFER_OVERFLOW;
+        }
+
+        capacity = max(capacity, max(2*c.capacity, ULONG(MIN_CAPACITY)));
+        if (capacity > MAX_CACHE_SIZE) {
+                capacity = MAX_CACHE_SIZE;
+        }
+
+        auto buf = (char*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, capacity, pooltag);
+        if (!buf) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        if (auto old = c.records) {
+                RtlCopyMemory(buf, old, c.size);
+                ExFreePoolWithTag(old, pooltag);
+        }
+
+        c.records = buf;
+        c.capacity = capacity;
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto insert(
+        _Inout_ descriptor_cache &c, _In_ UCHAR type, _In_ UCHAR index, _In_ USHORT lang_id,
+        _In_ const void *data, _In_ ULONG length)
+{
+        if (auto r = find(c, type, index, lang_id)) {
+                if (r->length == length && RtlEqualMemory(::data(*r), data, length)) {
+                        return STATUS_SUCCESS;
+                }
+                erase(c, *r);
+        }
+
+        if (auto err = reserve(c, c.size + sizeof(descriptor_record) + length)) {
+                return err;
+        }
+
+        auto &r = *reinterpret_cast<descriptor_record*>(c.records + c.size);
+        r = descriptor_record{ .type = type, .index = index, .lang_id = lang_id, .length = USHORT(length) };
+
+        RtlCopyMemory(const_cast<char*>(::data(r)), data, length);
+        c.size += sizeof(r) + length;
+
+        c.dirty = true;
+        return STATUS_SUCCESS;
+}
+
+/*
+ * The serial number is what distinguishes devices of the same model, the string is always read from the device.
+ * The device descriptor is the first record, @see is_valid.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto is_serial_number(_In_ const descriptor_cache &c, _In_ UCHAR type, _In_ UCHAR index)
+{
+        if (type != USB_STRING_DESCRIPTOR_TYPE || !index || c.size < sizeof(descriptor_record)) {
+                return false;
+        }
+
+        auto &r = *reinterpret_cast<const descriptor_record*>(c.records);
+        NT_ASSERT(r.type == USB_DEVICE_DESCRIPTOR_TYPE);
+
+        auto &d = *reinterpret_cast<const USB_DEVICE_DESCRIPTOR*>(data(r));
+        return d.iSerialNumber == index;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void erase_serial_number(_Inout_ descriptor_cache &c)
+{
+        for (auto p = c.records; p < c.records + c.size; ) {
+                auto &r = *reinterpret_cast<descriptor_record*>(p);
+                if (is_serial_number(c, r.type, r.index)) {
+                        erase(c, r);
+                        c.dirty = true;
+                } else {
+                        p = const_cast<char*>(next(r));
+                }
+        }
+}
+
+/*
+ * @return true if records are well-formed and the device descriptor is the first one
+ */
+auto is_valid(_In_ const char *records, _In_ ULONG size)
+{
+        auto end = records + size;
+        auto first = true;
+
+        for (auto p = records; p < end; first = false) {
+                auto &r = *reinterpret_cast<const descriptor_record*>(p);
+
+                if (p + sizeof(r) > end || next(r) > end || !is_complete(r.type, data(r), r.length)) {
+                        return false;
+                } else if (first && r.type != USB_DEVICE_DESCRIPTOR_TYPE) {
+                        return false;
+                }
+
+                p = next(r);
+        }
+
+        return true;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto make_value_name(_Out_ UNICODE_STRING &name, _In_ const device_ctx_ext &ext)
+{
+        PAGED_CODE();
+        auto &d = ext.dev;
+
+        return RtlUnicodeStringPrintf(&name, L"%wZ,%wZ,%04x:%04x:%04x",
+                                      &ext.node_name, &ext.busid, d.vendor, d.product, ext.bcdDevice);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto open_cache_key(_In_ ACCESS_MASK DesiredAccess, _In_ bool create)
+{
+        PAGED_CODE();
+        Registry key;
+
+        auto params = open_parameters_key(create ? KEY_CREATE_SUB_KEY : KEY_QUERY_VALUE);
+        if (!params) {
+                return key;
+        }
+
+        UNICODE_STRING name;
+        RtlUnicodeStringInit(&name, descriptor_cache_key_name);
+
+        WDFKEY h{};
+        auto err = create ?
+                WdfRegistryCreateKey(params.get(), &name, DesiredAccess, REG_OPTION_NON_VOLATILE, nullptr,
+                                     WDF_NO_OBJECT_ATTRIBUTES, &h) :
+                WdfRegistryOpenKey(params.get(), &name, DesiredAccess, WDF_NO_OBJECT_ATTRIBUTES, &h);
+
+        if (!err) {
+                key.reset(h);
+        } else if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+                Trace(TRACE_LEVEL_ERROR, "Open '%!USTR!' %!STATUS!", &name, err);
+        }
+
+        return key;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void load(_Inout_ descriptor_cache &c, _In_ const UNICODE_STRING &value_name)
+{
+        PAGED_CODE();
+
+        auto key = open_cache_key(KEY_QUERY_VALUE, false);
+        if (!key) {
+                return;
+        }
+
+        ULONG size{};
+        ULONG type{};
+
+        if (auto err = WdfRegistryQueryValue(key.get(), &value_name, 0, nullptr, &size, &type);
+            err != STATUS_BUFFER_OVERFLOW) {
+                if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryValue('%!USTR!') %!STATUS!", &value_name, err);
+                }
+                return;
+        } else if (type != REG_BINARY || !size || size > MAX_CACHE_SIZE) {
+                Trace(TRACE_LEVEL_ERROR, "'%!USTR!': type %lu, size %lu", &value_name, type, size);
+                return;
+        }
+
+        if (auto err = reserve(c, size)) {
+                Trace(TRACE_LEVEL_ERROR, "reserve(%lu) %!STATUS!", size, err);
+                return;
+        }
+
+        if (auto err = WdfRegistryQueryValue(key.get(), &value_name, size, c.records, &size, &type)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryValue('%!USTR!') %!STATUS!", &value_name, err);
+        } else if (!is_valid(c.records, size)) {
+                Trace(TRACE_LEVEL_ERROR, "'%!USTR!' is malformed", &value_name);
+        } else {
+                c.size = size;
+                erase_serial_number(c); // could be saved by previous versions
+        }
+}
+
+/*
+ * Registry enumerates values in order of their creation, assigning an existing value does not change it.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void evict(_In_ WDFKEY key, _In_ const UNICODE_STRING &value_name)
+{
+        PAGED_CODE();
+
+        ULONG size{};
+        ULONG type{};
+
+        if (WdfRegistryQueryValue(key, &value_name, 0, nullptr, &size, &type) == STATUS_BUFFER_OVERFLOW) {
+                return; // will be overwritten
+        }
+
+        auto h = WdfRegistryWdmGetHandle(key);
+
+        KEY_FULL_INFORMATION info;
+        ULONG len;
+
+        if (auto err = ZwQueryKey(h, KeyFullInformation, &info, sizeof(info), &len);
+            !(NT_SUCCESS(err) || err == STATUS_BUFFER_OVERFLOW)) { // class name does not fit
+                Trace(TRACE_LEVEL_ERROR, "ZwQueryKey %!STATUS!", err);
+                return;
+        }
+
+        union {
+                KEY_VALUE_BASIC_INFORMATION basic;
+                char buf[sizeof(KEY_VALUE_BASIC_INFORMATION) + 256*sizeof(WCHAR)];
+        } v;
+
+        for (auto cnt = info.Values; cnt >= MAX_CACHED_DEVICES; --cnt) {
+
+                if (auto err = ZwEnumerateValueKey(h, 0, KeyValueBasicInformation, &v, sizeof(v), &len)) {
+                        Trace(TRACE_LEVEL_ERROR, "ZwEnumerateValueKey %!STATUS!", err);
+                        break;
+                }
+
+                UNICODE_STRING name{
+                        .Length = USHORT(v.basic.NameLength),
+                        .MaximumLength = USHORT(v.basic.NameLength),
+                        .Buffer = v.basic.Name
+                };
+
+                if (auto err = ZwDeleteValueKey(h, &name)) {
+                        Trace(TRACE_LEVEL_ERROR, "ZwDeleteValueKey('%!USTR!') %!STATUS!", &name, err);
+                        break;
+                }
+
+                TraceDbg("'%!USTR!' evicted", &name);
+        }
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::load_descriptor_cache(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+        NT_ASSERT(!dev.dcache);
+
+        auto c = (descriptor_cache*)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(descriptor_cache), pooltag);
+        if (!c) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate descriptor_cache");
+                return;
+        }
+
+        KeInitializeSpinLock(&c->lock);
+        dev.dcache = c;
+
+        WCHAR buf[256];
+        UNICODE_STRING name{ .MaximumLength = sizeof(buf), .Buffer = buf };
+
+        if (auto err = make_value_name(name, *dev.ext)) {
+                Trace(TRACE_LEVEL_ERROR, "make_value_name %!STATUS!", err);
+        } else {
+                load(*c, name);
+                TraceDbg("dev %04x, '%!USTR!', %lu bytes", ptr04x(get_device(&dev)), &name, c->size);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::save_descriptor_cache(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        auto c = dev.dcache;
+        if (!c) {
+                return;
+        }
+        dev.dcache = nullptr;
+
+        WCHAR buf[256];
+        UNICODE_STRING name{ .MaximumLength = sizeof(buf), .Buffer = buf };
+
+        if (!(c->dirty && c->validated && c->size)) {
+                // nothing to save
+        } else if (auto err = make_value_name(name, *dev.ext)) {
+                Trace(TRACE_LEVEL_ERROR, "make_value_name %!STATUS!", err);
+        } else if (auto key = open_cache_key(KEY_QUERY_VALUE | KEY_SET_VALUE, true)) {
+                evict(key.get(), name);
+                if (auto err = WdfRegistryAssignValue(key.get(), &name, REG_BINARY, c->size, c->records)) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryAssignValue('%!USTR!') %!STATUS!", &name, err);
+                } else {
+                        TraceDbg("dev %04x, '%!USTR!', %lu bytes", ptr04x(get_device(&dev)), &name, c->size);
+                }
+        }
+
+        destroy(c);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::clear_descriptor_cache(_Inout_ device_ctx &dev)
+{
+        auto c = dev.dcache;
+        if (!c) {
+                return;
+        }
+
+        Lock lck(c->lock);
+
+        c->size = 0;
+        c->validated = false; // the device descriptor must be the first record
+        c->dirty = false;
+
+        lck.release(); // explicit call to satisfy code analyzer and get rid of warning C28166
+
+        TraceDbg("dev %04x", ptr04x(get_device(&dev)));
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::get_cached_descriptor(
+        _Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt,
+        _Inout_ ULONG &length)
+{
+        auto c = dev.dcache;
+        auto type = get_descriptor_type(pkt);
+
+        if (!(c && type) || type == USB_DEVICE_DESCRIPTOR_TYPE || !c->validated) { // device descriptor validates
+                return false;
+        }
+
+        UCHAR *buf;
+        ULONG buf_len;
+
+        if (auto err = UdecxUrbRetrieveBuffer(request, &buf, &buf_len)) {
+                Trace(TRACE_LEVEL_ERROR, "UdecxUrbRetrieveBuffer %!STATUS!", err);
+                return false;
+        } else if (buf_len < length) {
+                return false;
+        }
+
+        auto lang_id = type == USB_STRING_DESCRIPTOR_TYPE ? pkt.wIndex.W : USHORT();
+
+        Lock lck(c->lock);
+
+        if (is_serial_number(*c, type, pkt.wValue.LowByte)) {
+                return false;
+        }
+
+        auto r = find(*c, type, pkt.wValue.LowByte, lang_id);
+        if (!r) {
+                return false;
+        }
+
+        if (length > r->length) {
+                length = r->length;
+        }
+
+        RtlCopyMemory(buf, data(*r), length);
+        return true;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::cache_descriptor(
+        _Inout_ device_ctx &dev, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt,
+        _In_reads_bytes_(length) const void *data, _In_ ULONG length)
+{
+        auto c = dev.dcache;
+        auto type = get_descriptor_type(pkt);
+
+        if (!(c && type && is_complete(type, data, length))) {
+                return;
+        }
+
+        auto lang_id = type == USB_STRING_DESCRIPTOR_TYPE ? pkt.wIndex.W : USHORT();
+
+        Lock lck(c->lock);
+
+        if (type == USB_DEVICE_DESCRIPTOR_TYPE) {
+                auto r = find(*c, type, 0, 0);
+                auto same = r && r->length == length && RtlEqualMemory(::data(*r), data, length);
+
+                if (!same) {
+                        c->size = 0;
+                }
+
+                c->validated = true;
+                TraceDbg("dev %04x, cache %s", ptr04x(get_device(&dev)), same ? "is valid" : "is reset");
+        } else if (!c->validated || is_serial_number(*c, type, pkt.wValue.LowByte)) {
+                return;
+        }
+
+        if (auto err = insert(*c, type, pkt.wValue.LowByte, lang_id, data, length)) {
+                TraceDbg("dev %04x, insert %!STATUS!", ptr04x(get_device(&dev)), err);
+        }
+}
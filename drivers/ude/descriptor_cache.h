@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "context.h"
+
+/*
+ * Standard descriptors of a remote device persisted under Parameters\DescriptorCache.
+ * A value name is "host,busid,vid:pid:bcdDevice", the data is a sequence of descriptor records.
+ *
+ * The cache is validated by the device descriptor received from a server during enumeration.
+ * After that, GET_DESCRIPTOR requests for configuration, BOS and string descriptors
+ * are completed locally if the descriptor is cached, otherwise the response is cached.
+ * The string descriptor referenced by iSerialNumber is never cached.
+ * If the device descriptor differs, the cache is cleared and refilled.
+ *
+ * The number of cached devices is limited, the earliest added values are evicted first.
+ */
+
+namespace usbip
+{
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void load_descriptor_cache(_Inout_ device_ctx &dev);
+
+/*
+ * Saves the cache if it was modified and releases it.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void save_descriptor_cache(_Inout_ device_ctx &dev);
+
+/*
+ * Drops cached descriptors, the cache is not saved unless it is refilled after the device descriptor is received.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void clear_descriptor_cache(_Inout_ device_ctx &dev);
+
+/*
+ * Copy cached descriptor to the transfer buffer of the request.
+ * @param length wLength, it will be set to the number of copied bytes if true is returned
+ * @return true if the request can be completed
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool get_cached_descriptor(
+        _Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt,
+        _Inout_ ULONG &length);
+
+/*
+ * Response of GET_DESCRIPTOR is received from a server.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void cache_descriptor(
+        _Inout_ device_ctx &dev, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt,
+        _In_reads_bytes_(length) const void *data, _In_ ULONG length);
+
+} // namespace usbip
@@ -14,6 +14,8 @@
 #include "device_ioctl.h"
 #include "wsk_receive.h"
 #include "ioctl.h"
+#include "urb_trace.h"
+#include "descriptor_cache.h"
 
 #include <libdrv\dbgcommon.h>
 
@@ -52,9 +54,14 @@ PAGED void NTAPI device_destroy(_In_ WDFOBJECT Object)
         PAGED_CODE();
 
         auto device = static_cast<UDECXUSBDEVICE>(Object);
-        TraceDbg("dev %04x", ptr04x(device));
+        auto &dev = *get_device_ctx(device);
+
+        TraceDbg("dev %04x, discarded %I64u bytes", ptr04x(device), dev.discarded_bytes);
+        free_receive_buffer(dev);
+        free_urb_trace(dev);
+        save_descriptor_cache(dev);
 
-        if (auto &dev = *get_device_ctx(device); auto ptr = dev.ext) {
+        if (auto ptr = dev.ext) {
                 free(ptr);
         }
 }
@@ -74,7 +81,7 @@ PAGED void device_cleanup(_In_ WDFOBJECT Object)
         vhci::reclaim_roothub_port(dev);
         close_socket(ctx.ext->sock);
 
-        NT_ASSERT(WDF_IO_QUEUE_PURGED(WdfIoQueueGetState(ctx.queue, nullptr, nullptr)));
+        NT_ASSERT(!device::has_queued_requests(ctx)); // endpoint_purge unlinks them
 }
 
 /*
@@ -143,13 +150,9 @@ _IRQL_requires_same_
 void endpoint_purge(_In_ UDECXUSBENDPOINT endpoint)
 {
         auto &endp = *get_endpoint_ctx(endpoint);
-        auto &dev = *get_device_ctx(endp.device);
-
         TraceDbg("dev %04x, endp %04x, queue %04x", ptr04x(endp.device), ptr04x(endpoint), ptr04x(endp.queue));
 
-        while (auto request = device::dequeue_request(dev, endpoint)) {
-                device::send_cmd_unlink(endp.device, request);
-        }
+        device::unlink_requests(endp.device, endpoint);
 
         auto purge_complete = [] ([[maybe_unused]] auto queue, auto ctx) // EVT_WDF_IO_QUEUE_STATE
         { 
@@ -453,17 +456,17 @@ PAGED auto prepare_init(_In_ _UDECXUSBDEVICE_INIT *init, _In_ device_ctx_ext &ex
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto init_device(_In_ UDECXUSBDEVICE dev, _Inout_ device_ctx &ctx)
+PAGED auto init_device(_Inout_ device_ctx &ctx)
 {
         PAGED_CODE();
 
+        device::init_queue(ctx); // device_cleanup checks it
+
         if (auto err = init_receive_usbip_header(ctx)) {
                 return err;
         }
 
-        if (auto err = device::create_queue(dev)) {
-                return err;
-        }
+        load_descriptor_cache(ctx);
 
         return STATUS_SUCCESS;
 }
@@ -502,8 +505,15 @@ PAGED NTSTATUS usbip::device::create(_Out_ UDECXUSBDEVICE &dev, _In_ WDFDEVICE v
         ctx.ext = ext;
         ext->ctx = &ctx;
         KeInitializeSpinLock(&ctx.endpoint_list_lock);
+        KeInitializeSpinLock(&ctx.send_lock);
+        KeInitializeSpinLock(&ctx.fclock.lock);
+
+        ctx.max_sends_inflight = query_parameter(max_sends_inflight_value_name, 4);
+        if (!ctx.max_sends_inflight) {
+                ctx.max_sends_inflight = 1;
+        }
 
-        if (auto err = init_device(dev, ctx)) {
+        if (auto err = init_device(ctx)) {
                 return err;
         }
 
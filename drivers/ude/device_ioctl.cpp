@@ -16,6 +16,9 @@
 #include "wsk_receive.h"
 
 #include "filter_request.h"
+#include "statistics.h"
+#include "descriptor_cache.h"
+#include "frame_clock.h"
 #include <ude_filter\request.h>
 
 #include <libdrv\pdu.h>
@@ -25,6 +28,7 @@
 #include <libdrv\wsk_cpp.h>
 #include <libdrv\usb_util.h>
 #include <libdrv\dbgcommon.h>
+#include <libdrv\lock.h>
 #include <libdrv\usbd_helper.h>
 
 namespace
@@ -40,20 +44,18 @@ using namespace usbip;
  *
  * To avoid copying of URB's transfer buffer, it must not be completed until this handler will be called.
  * This means that:
- * 1.EvtIoCanceledOnQueue must not complete IRP if it's called before send_complete because WskSend can still access
+ * 1.EvtIoCanceledOnQueue must not complete IRP if it's called before complete_send because WskSend can still access
  *   IRP transfer buffer.
- * 2.WskReceive must not complete IRP if it's called before send_complete because send_complete modifies request_context.status.
+ * 2.WskReceive must not complete IRP if it's called before complete_send because complete_send modifies request_context.status.
  * 3.EvtIoCanceledOnQueue and WskReceive are mutually exclusive because IRP is dequeued from the CSQ.
- * 4.Thus, send_complete can run concurrently with EvtIoCanceledOnQueue or WskReceive.
+ * 4.Thus, complete_send can run concurrently with EvtIoCanceledOnQueue or WskReceive.
  * 
  * @see wsk_receive.cpp, complete 
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS send_complete(
-        _In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_Inexpressible_("varies")) void *Context)
+void complete_send(_In_ wsk_context_ptr &ctx, _In_ IRP *wsk_irp)
 {
-        wsk_context_ptr ctx(static_cast<wsk_context*>(Context), true);
         auto request = ctx->request;
 
         request_ctx *req_ctx;
@@ -63,6 +65,7 @@ NTSTATUS send_complete(
         if (request) { // NULL for send_cmd_unlink
                 req_ctx = get_request_ctx(request);
                 seqnum = req_ctx->seqnum;
+                req_ctx->send_time = KeQueryInterruptTime(); // request can be completed after the next call
                 old_status = atomic_set_status(*req_ctx, REQ_SEND_COMPLETE);
         } else {
                 req_ctx = nullptr;
@@ -97,10 +100,347 @@ NTSTATUS send_complete(
                 auto hdev = get_device(ctx->dev);
                 device::sched_plugout_and_delete(hdev);
         }
+}
+
+/*
+ * Transmit scheduler.
+ * 
+ * PDUs are queued by priority classes and WskSend is called if the number of sends in flight is below the limit.
+ * The last slot is reserved for control and interrupt transfers, so bulk traffic can't starve them.
+ * Only one thread calls WskSend at a time, @see pump_sends. This keeps the order of PDUs on the wire
+ * and bounds the stack if WskSend completes inline.
+ * 
+ * PDUs of the same class that are waiting in the queue are coalesced: their MDL chains 
+ * (header, transfer buffer, isoc descriptors) are linked together and sent by a single WskSend.
+ * Each PDU has an exact MDL chain for that reason. The first wsk_context owns WSK IRP of the send.
+ */
+enum { SEND_COALESCE_MAX_PDUS = 32, SEND_COALESCE_MAX_BYTES = 64*1024 };
+
+/*
+ * CMD_UNLINK has the highest priority to not wait behind the traffic it cancels.
+ * It is never sent ahead of CMD_SUBMIT it refers to, such CMD_SUBMIT is removed from the queue instead.
+ * @see cancel_unsent
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_send_class(_In_opt_ UDECXUSBENDPOINT endpoint)
+{
+        if (!endpoint) { // CMD_UNLINK
+                return SEND_CONTROL;
+        }
+
+        switch (usb_endpoint_type(get_endpoint_ctx(endpoint)->descriptor)) {
+        case UsbdPipeTypeControl:
+                return SEND_CONTROL;
+        case UsbdPipeTypeInterrupt:
+                return SEND_INTERRUPT;
+        case UsbdPipeTypeIsochronous:
+                return SEND_ISOCH;
+        }
+
+        return SEND_BULK;
+}
+
+constexpr auto get_inflight_limit(_In_ const device_ctx &dev, _In_ send_class cls)
+{
+        auto max = dev.max_sends_inflight;
+        return cls <= SEND_INTERRUPT || max == 1 ? max : max - 1;
+}
+
+/*
+ * @param next the first MDL of the next PDU that is linked to the tail of ctx's chain
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void unlink_mdl_chain(_In_ wsk_context &ctx, _In_ MDL *next)
+{
+        for (auto m = ctx.mdl_hdr.get(); m; m = m->Next) {
+                if (m->Next == next) {
+                        m->Next = nullptr;
+                        break;
+                }
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void update_max(_Inout_ ULONG64 &max, _In_ ULONG64 val)
+{
+        if (val > max) {
+                max = val;
+        }
+}
+
+/*
+ * Must be called under device_ctx::send_lock.
+ * @return PDUs of the highest priority class to send or nullptr
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+wsk_context *take_pdus(_Inout_ device_ctx &dev)
+{
+        int cls = 0;
+        for ( ; cls < SEND_CLASSES && !dev.send_queues[cls].head; ++cls);
+
+        if (cls == SEND_CLASSES || dev.sends_inflight >= get_inflight_limit(dev, send_class(cls))) {
+                return nullptr;
+        }
+
+        auto &q = dev.send_queues[cls];
+        auto &stat = dev.send_stats;
+
+        auto now = KeQueryInterruptTime();
+
+        auto head = q.head;
+        auto last = head;
+
+        ULONG cnt = 0;
+        size_t bytes = 0;
+
+        for (auto ctx = head; ctx; ctx = ctx->next) {
+                auto len = size(ctx->mdl_hdr); // chains are null-terminated while in the queue
+                if (cnt && (cnt == SEND_COALESCE_MAX_PDUS || bytes + len > SEND_COALESCE_MAX_BYTES)) {
+                        break;
+                }
+
+                auto queue_time = now - ctx->timestamp;
+                stat.queue_time += queue_time;
+                update_max(stat.max_queue_time, queue_time);
+
+                last = ctx;
+                ++cnt;
+                bytes += len;
+        }
+
+        q.head = last->next;
+        if (!q.head) {
+                q.tail = nullptr;
+        }
+        last->next = nullptr;
+
+        q.count -= cnt;
+        dev.send_queued -= cnt;
+
+        ++dev.sends_inflight;
+        ++stat.sends;
+        stat.pdus += cnt;
+
+        head->timestamp = now; // is used by send_pdus_complete
+        return head;
+}
+
+/*
+ * Must be called under device_ctx::send_lock.
+ * @return true if the caller must call pump_sends
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+auto start_pumping(_Inout_ device_ctx &dev)
+{
+        if (dev.send_pumping) {
+                return false; // its loop will take our PDUs
+        }
+
+        dev.send_pumping = true;
+        return true;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void pump_sends(_Inout_ device_ctx &dev);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS send_pdus_complete(
+        _In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_Inexpressible_("varies")) void *Context)
+{
+        auto head = static_cast<wsk_context*>(Context);
+        auto &dev = *head->dev;
+
+        Lock lck(dev.send_lock);
+
+        auto send_time = KeQueryInterruptTime() - head->timestamp;
+        dev.send_stats.send_time += send_time;
+        update_max(dev.send_stats.max_send_time, send_time);
+
+        NT_ASSERT(dev.sends_inflight);
+        --dev.sends_inflight;
+
+        auto pump = start_pumping(dev); // false if called inline from WskSend of pump_sends
+        lck.release(); // explicit call to satisfy code analyzer and get rid of warning C28166
+
+        if (pump) {
+                pump_sends(dev);
+        }
+
+        wsk_context_ptr leader(head, true); // owns wsk_irp, must be freed the last
+
+        for (auto ctx = head; ctx; ) {
+                auto nxt = ctx->next;
+                ctx->next = nullptr;
+
+                unlink_mdl_chain(*ctx, nxt ? nxt->mdl_hdr.get() : nullptr);
+
+                if (ctx == head) {
+                        complete_send(leader, wsk_irp);
+                } else {
+                        wsk_context_ptr ptr(ctx, true);
+                        complete_send(ptr, wsk_irp); // IoStatus of the coalesced send
+                }
+
+                ctx = nxt;
+        }
 
         return StopCompletion;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void send_pdus(_Inout_ device_ctx &dev, _In_ wsk_context *head)
+{
+        WSK_BUF buf{ .Mdl = head->mdl_hdr.get() };
+        ULONG cnt = 0;
+
+        for (auto ctx = head; ctx; ctx = ctx->next, ++cnt) {
+                auto t = tail(ctx->mdl_hdr); // chains are null-terminated before linking
+                buf.Length += size(ctx->mdl_hdr);
+
+                if (auto next = ctx->next) {
+                        t->Next = next->mdl_hdr.get();
+                }
+        }
+
+        auto wsk_irp = head->wsk_irp;
+        IoSetCompletionRoutine(wsk_irp, send_pdus_complete, head, true, true, true);
+
+        auto st = send(dev.sock(), &buf, WSK_FLAG_NODELAY, wsk_irp);
+        NT_ASSERT(st != STATUS_NOT_SUPPORTED); // send_pdus_complete will not be called for this status only
+
+        if (st == STATUS_PENDING) {
+                TraceWSK("wsk irp %04x, %lu PDUs, %Iu bytes", ptr04x(wsk_irp), cnt, buf.Length);
+        } else {
+                TraceDbg("wsk irp %04x, %lu PDUs, %Iu bytes, %!STATUS!", ptr04x(wsk_irp), cnt, buf.Length, st);
+        }
+}
+
+/*
+ * Sends batches until there is nothing to send or the limit of sends in flight is reached.
+ * send_pdus_complete that runs inline leaves the next batch for this loop instead of recursion.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void pump_sends(_Inout_ device_ctx &dev)
+{
+        while (true) {
+                Lock lck(dev.send_lock);
+                NT_ASSERT(dev.send_pumping);
+
+                auto batch = take_pdus(dev);
+                if (!batch) {
+                        dev.send_pumping = false;
+                }
+
+                lck.release(); // explicit call to satisfy code analyzer and get rid of warning C28166
+
+                if (!batch) {
+                        break;
+                }
+
+                send_pdus(dev, batch);
+        }
+}
+
+/*
+ * Must be called under device_ctx::send_lock.
+ * @param head PDUs linked by wsk_context::next
+ * @return true if the caller must call pump_sends
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+auto push_pdus(_Inout_ device_ctx &dev, _In_ wsk_context *head, _In_ send_class cls)
+{
+        auto now = KeQueryInterruptTime();
+
+        auto last = head;
+        ULONG cnt = 1;
+
+        for (head->timestamp = now; last->next; last = last->next, ++cnt) {
+                last->next->timestamp = now;
+        }
+
+        auto &q = dev.send_queues[cls];
+
+        if (auto &t = q.tail) {
+                t->next = head;
+        } else {
+                q.head = head;
+        }
+        q.tail = last;
+
+        q.count += cnt;
+        if ((dev.send_queued += cnt) > dev.send_stats.max_queued) {
+                dev.send_stats.max_queued = dev.send_queued;
+        }
+
+        return start_pumping(dev);
+}
+
+/*
+ * @param head PDUs linked by wsk_context::next, they are queued under a single acquisition of the lock
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void queue_send(_Inout_ device_ctx &dev, _In_ wsk_context *head, _In_ send_class cls)
+{
+        Lock lck(dev.send_lock);
+        auto pump = push_pdus(dev, head, cls);
+        lck.release(); // explicit call to satisfy code analyzer and get rid of warning C28166
+
+        if (pump) {
+                pump_sends(dev);
+        }
+}
+
+/*
+ * The request is cancelable since enqueue_request, cancel_unsent can be called before CMD_SUBMIT
+ * is queued. CMD_SUBMIT is queued under the lock that cancel_unsent takes, so cancel_unsent either
+ * finds it in the send queue or marks the request, then CMD_SUBMIT is dropped here.
+ * Otherwise CMD_UNLINK of SEND_CONTROL class could be sent ahead of its CMD_SUBMIT.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void queue_cmd_submit(_Inout_ device_ctx &dev, _In_ wsk_context *ctx, _In_ send_class cls)
+{
+        auto request = ctx->request;
+        auto &req = *get_request_ctx(request);
+
+        Lock lck(dev.send_lock);
+
+        auto canceled = req.unsent_canceled;
+        auto pump = !canceled && push_pdus(dev, ctx, cls);
+
+        req.submit_queued = true;
+        lck.release(); // explicit call to satisfy code analyzer and get rid of warning C28166
+
+        if (canceled) {
+                free(ctx, false); // WskSend will not access the transfer buffer
+
+                [[maybe_unused]] auto old_status = atomic_set_status(req, REQ_CANCELED);
+                NT_ASSERT(old_status == REQ_ZERO);
+
+                TraceDbg("seqnum %u, canceled before CMD_SUBMIT was queued", req.seqnum);
+                complete(request, STATUS_CANCELLED);
+        }
+
+        if (pump) {
+                pump_sends(dev);
+        }
+}
+
+/*
+ * MDL chain must have the size of PDU because it can be linked with another one.
+ * @see send_pdus
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto prepare_wsk_buf(_Inout_ WSK_BUF &buf, _Inout_ wsk_context &ctx, _Inout_opt_ const URB *transfer_buffer)
@@ -108,7 +448,8 @@ auto prepare_wsk_buf(_Inout_ WSK_BUF &buf, _Inout_ wsk_context &ctx, _Inout_opt_
         NT_ASSERT(!ctx.mdl_buf);
 
         if (transfer_buffer && is_transfer_dir_out(ctx.hdr)) { // TransferFlags can have wrong direction
-                if (auto err = make_transfer_buffer_mdl(ctx.mdl_buf, URB_BUF_LEN, ctx.is_isoc, IoReadAccess, *transfer_buffer)) {
+                auto mdl_size = ULONG(ctx.hdr.u.cmd_submit.transfer_buffer_length);
+                if (auto err = make_transfer_buffer_mdl(ctx.mdl_buf, mdl_size, true, IoReadAccess, *transfer_buffer)) {
                         Trace(TRACE_LEVEL_ERROR, "make_transfer_buffer_mdl %!STATUS!", err);
                         return err;
                 }
@@ -121,13 +462,14 @@ auto prepare_wsk_buf(_Inout_ WSK_BUF &buf, _Inout_ wsk_context &ctx, _Inout_opt_
                 byteswap(ctx.isoc, number_of_packets(ctx));
                 auto t = tail(ctx.mdl_hdr); // ctx.mdl_buf can be a chain
                 t->Next = ctx.mdl_isoc.get();
+                ctx.mdl_isoc.next(nullptr);
         }
 
         buf.Mdl = ctx.mdl_hdr.get();
         buf.Offset = 0;
         buf.Length = get_total_size(ctx.hdr);
 
-        NT_ASSERT(verify(buf, ctx.is_isoc));
+        NT_ASSERT(verify(buf, true));
         return STATUS_SUCCESS;
 }
 
@@ -157,26 +499,28 @@ auto send(_In_opt_ UDECXUSBENDPOINT endpoint, _In_ wsk_context_ptr &ctx, _In_ de
                 NT_ASSERT(endpoint);
                 req.endpoint = endpoint;
 
-                if (auto err = WdfRequestForwardToIoQueue(request, dev.queue)) {
-                        Trace(TRACE_LEVEL_ERROR, "WdfRequestForwardToIoQueue %!STATUS!", err);
+                req.submit_time = KeQueryInterruptTime();
+                req.send_time = 0;
+                req.recv_time = 0;
+                stat_submit(request);
+
+                req.submit_queued = false; // the request is not cancelable yet, the lock is not required
+                req.unsent_canceled = false;
+
+                if (auto err = device::enqueue_request(dev, request)) {
+                        stat_complete(request, err, USBD_STATUS_SUCCESS, nullptr); // the caller will complete it
                         return err;
                 }
         }
 
         byteswap_header(ctx->hdr, swap_dir::host2net);
 
-        auto wsk_irp = ctx->wsk_irp; // do not access ctx or wsk_irp after send
-        IoSetCompletionRoutine(wsk_irp, send_complete, ctx.release(), true, true, true);
-
-        auto st = send(dev.sock(), &buf, WSK_FLAG_NODELAY, wsk_irp);
-        NT_ASSERT(st != STATUS_NOT_SUPPORTED); // send_complete will not be called for this status only
-
-        if (st == STATUS_PENDING) {
-                TraceWSK("wsk irp %04x, %Iu bytes", ptr04x(wsk_irp), buf.Length);
+        if (auto cls = get_send_class(endpoint); ctx->request) {
+                queue_cmd_submit(dev, ctx.release(), cls);
         } else {
-                TraceDbg("wsk irp %04x, %Iu bytes, %!STATUS!", ptr04x(wsk_irp), buf.Length, st);
+                queue_send(dev, ctx.release(), cls);
         }
-        
+
         return STATUS_PENDING;
 }
 
@@ -225,6 +569,12 @@ auto control_transfer(
                 return STATUS_INVALID_PARAMETER;
         }
 
+        if (buf_len && get_cached_descriptor(dev, request, pkt, buf_len)) {
+                r.TransferBufferLength = buf_len;
+                TraceUrb("req %04x <- %lu bytes from descriptor cache", ptr04x(request), buf_len);
+                return STATUS_SUCCESS;
+        }
+
         wsk_context_ptr ctx(&dev, request);
         if (!ctx) {
                 return STATUS_INSUFFICIENT_RESOURCES;
@@ -309,7 +659,8 @@ auto repack(_In_ usbip_iso_packet_descriptor *d, _In_ const _URB_ISOCH_TRANSFER
 }
 
 /*
- * USBD_START_ISO_TRANSFER_ASAP is appended because URB_GET_CURRENT_FRAME_NUMBER is not implemented.
+ * Explicit StartFrame is a host frame number, it is mapped to the server's one.
+ * USBD_START_ISO_TRANSFER_ASAP is appended if the frame clock is not synchronized yet.
  */
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _Function_class_(urb_function_t)
@@ -348,8 +699,17 @@ auto isoch_transfer(
                 return STATUS_INSUFFICIENT_RESOURCES;
         }
 
-        if (auto err = set_cmd_submit_usbip_header(ctx->hdr, dev, endp.descriptor, 
-                               r.TransferFlags | USBD_START_ISO_TRANSFER_ASAP, r.TransferBufferLength)) {
+        auto start_frame = r.StartFrame;
+        auto flags = r.TransferFlags;
+
+        auto &req = *get_request_ctx(request);
+        req.start_asap = (flags & USBD_START_ISO_TRANSFER_ASAP) || !to_server_frame(dev, start_frame, r.StartFrame);
+
+        if (req.start_asap) {
+                flags |= USBD_START_ISO_TRANSFER_ASAP;
+        }
+
+        if (auto err = set_cmd_submit_usbip_header(ctx->hdr, dev, endp.descriptor, flags, r.TransferBufferLength)) {
                 return err;
         }
 
@@ -358,7 +718,7 @@ auto isoch_transfer(
         }
 
         if (auto cmd = &ctx->hdr.u.cmd_submit) {
-                cmd->start_frame = r.StartFrame;
+                cmd->start_frame = start_frame;
                 cmd->number_of_packets = r.NumberOfPackets;
         }
 
@@ -427,6 +787,131 @@ auto send_ep0_out(
         return ::send(dev.ep0, ctx, dev, true);
 }
 
+/*
+ * Must be called under device_ctx::send_lock.
+ * @return CMD_SUBMIT of the request that is still in the send queue or nullptr
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+wsk_context *remove_queued(_Inout_ device_ctx &dev, _In_ WDFREQUEST request)
+{
+        for (auto &q: dev.send_queues) {
+                wsk_context *prev{};
+
+                for (auto ctx = q.head; ctx; prev = ctx, ctx = ctx->next) {
+                        if (ctx->request != request) {
+                                continue;
+                        }
+
+                        (prev ? prev->next : q.head) = ctx->next;
+                        if (q.tail == ctx) {
+                                q.tail = prev;
+                        }
+                        ctx->next = nullptr;
+
+                        --q.count;
+                        --dev.send_queued;
+                        return ctx;
+                }
+        }
+
+        return nullptr;
+}
+
+/*
+ * If CMD_SUBMIT was not sent yet, it is dropped and the request is completed, CMD_UNLINK is not required.
+ * If CMD_SUBMIT was not queued yet, queue_cmd_submit will drop it and complete the request.
+ * @return true if the request was (will be) completed
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool cancel_unsent(_Inout_ device_ctx &dev, _In_ WDFREQUEST request)
+{
+        auto &req = *get_request_ctx(request);
+
+        Lock lck(dev.send_lock);
+
+        auto victim = remove_queued(dev, request);
+        auto unqueued = !victim && !req.submit_queued;
+
+        if (unqueued) {
+                req.unsent_canceled = true;
+        }
+
+        lck.release(); // explicit call to satisfy code analyzer and get rid of warning C28166
+
+        if (unqueued) {
+                TraceDbg("seqnum %u, CMD_SUBMIT is not queued yet", req.seqnum);
+                return true;
+        } else if (!victim) {
+                return false;
+        }
+
+        free(victim, false); // WskSend will not access the transfer buffer
+
+        [[maybe_unused]] auto old_status = atomic_set_status(req, REQ_CANCELED);
+        NT_ASSERT(old_status == REQ_ZERO);
+
+        TraceDbg("seqnum %u, CMD_SUBMIT was not sent", req.seqnum);
+        complete(request, STATUS_CANCELLED);
+
+        return true;
+}
+
+/*
+ * @return CMD_UNLINK ready to be passed to queue_send or nullptr
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+wsk_context *make_cmd_unlink(_In_ device_ctx &dev, _In_ WDFREQUEST request)
+{
+        auto &req = *get_request_ctx(request);
+
+        if (!dev.sock()) {
+                TraceDbg("Socket is closed");
+                return nullptr;
+        }
+
+        wsk_context_ptr ctx(&dev, WDFREQUEST(WDF_NO_HANDLE));
+        if (!ctx) {
+                Trace(TRACE_LEVEL_ERROR, "seqnum %u, wsk_context_ptr error", req.seqnum);
+                return nullptr;
+        }
+
+        set_cmd_unlink_usbip_header(ctx->hdr, dev, req.seqnum);
+        stat_unlink(request);
+
+        WSK_BUF buf{};
+
+        if (auto err = prepare_wsk_buf(buf, *ctx, nullptr)) {
+                Trace(TRACE_LEVEL_ERROR, "seqnum %u, %!STATUS!", req.seqnum, err);
+                return nullptr;
+        } else {
+                char str[DBG_USBIP_HDR_BUFSZ];
+                TraceEvents(TRACE_LEVEL_VERBOSE, FLAG_USBIP, "-> %Iu%s",
+                        buf.Length, dbg_usbip_hdr(str, sizeof(str), &ctx->hdr, false));
+        }
+
+        byteswap_header(ctx->hdr, swap_dir::host2net);
+        return ctx.release();
+}
+
+/*
+ * The request is completed here if its CMD_SUBMIT has been sent, otherwise by complete_send.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void set_canceled(_In_ WDFREQUEST request)
+{
+        auto &req = *get_request_ctx(request);
+
+        if (auto old_status = atomic_set_status(req, REQ_CANCELED); old_status == REQ_SEND_COMPLETE) {
+                complete(request, STATUS_CANCELLED);
+        } else {
+                NT_ASSERT(old_status != REQ_RECV_COMPLETE);
+        }
+}
+
 } // namespace
 
 
@@ -452,24 +937,53 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
 void usbip::device::send_cmd_unlink(_In_ UDECXUSBDEVICE device, _In_ WDFREQUEST request)
 {
         auto &dev = *get_device_ctx(device);
-        auto &req = *get_request_ctx(request);
+        TraceDbg("dev %04x, seqnum %u", ptr04x(device), get_request_ctx(request)->seqnum);
 
-        TraceDbg("dev %04x, seqnum %u", ptr04x(device), req.seqnum);
+        if (cancel_unsent(dev, request)) {
+                return;
+        }
 
-        if (!dev.sock()) {
-                TraceDbg("Socket is closed");
-        } else if (auto ctx = wsk_context_ptr(&dev, WDFREQUEST(WDF_NO_HANDLE))) {
-                set_cmd_unlink_usbip_header(ctx->hdr, dev, req.seqnum);
-                ::send(WDF_NO_HANDLE, ctx, dev, false); // ignore error
-        } else {
-                Trace(TRACE_LEVEL_ERROR, "dev %04x, seqnum %u, wsk_context_ptr error", ptr04x(device), req.seqnum);
+        if (auto ctx = make_cmd_unlink(dev, request)) {
+                queue_send(dev, ctx, get_send_class(WDF_NO_HANDLE));
         }
 
-        if (auto old_status = atomic_set_status(req, REQ_CANCELED); old_status == REQ_SEND_COMPLETE) {
-                complete(request, STATUS_CANCELLED);
-        } else {
-                NT_ASSERT(old_status != REQ_RECV_COMPLETE);
+        set_canceled(request);
+}
+
+/*
+ * CMD_UNLINK-s are queued together and coalesced by the transmit scheduler,
+ * a purge of N requests costs about N/SEND_COALESCE_MAX_PDUS sends instead of N.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG usbip::device::unlink_requests(_In_ UDECXUSBDEVICE device, _In_ UDECXUSBENDPOINT endpoint)
+{
+        auto &dev = *get_device_ctx(device);
+
+        wsk_context *head{};
+        auto tail = &head;
+        ULONG cnt = 0;
+
+        while (auto request = dequeue_request(dev, endpoint)) {
+                ++cnt;
+
+                if (cancel_unsent(dev, request)) {
+                        continue;
+                }
+
+                if (auto ctx = make_cmd_unlink(dev, request)) {
+                        *tail = ctx;
+                        tail = &ctx->next;
+                }
+                set_canceled(request);
+        }
+
+        if (head) {
+                queue_send(dev, head, get_send_class(WDF_NO_HANDLE));
         }
+
+        TraceDbg("dev %04x, endp %04x, %lu request(s)", ptr04x(device), ptr04x(endpoint), cnt);
+        return cnt;
 }
 
 _IRQL_requires_same_
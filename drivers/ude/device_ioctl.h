@@ -17,6 +17,14 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void send_cmd_unlink(_In_ UDECXUSBDEVICE device, _In_ WDFREQUEST request);
 
+/*
+ * Cancel requests of the endpoint that are waiting for USBIP_RET_SUBMIT.
+ * @return number of canceled requests
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG unlink_requests(_In_ UDECXUSBDEVICE device, _In_ UDECXUSBENDPOINT endpoint);
+
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 USB_DEFAULT_PIPE_SETUP_PACKET make_set_configuration(_In_ UCHAR ConfigurationValue);
@@ -9,60 +9,164 @@
 #include "context.h"
 #include "device_ioctl.h"
 
+#include <libdrv\lock.h>
+
 namespace
 {
 
 using namespace usbip;
 
+constexpr auto get_bucket(_In_ seqnum_t seqnum)
+{
+        static_assert(!(REQUESTS_BUCKETS & (REQUESTS_BUCKETS - 1)));
+        return extract_num(seqnum) & (REQUESTS_BUCKETS - 1); // seqnums are sequential
+}
+
+/*
+ * requests_lock must be acquired.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+void remove_entry(_Inout_ request_ctx &req)
+{
+        auto e = &req.entry;
+        RemoveEntryList(e); // works if entry was just InitializeListHead-ed
+        InitializeListHead(e);
+}
+
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto matches(_In_ WDFREQUEST request, _In_ const device::request_search &crit)
+void remove_index(_Inout_ device_ctx &dev, _Inout_ request_ctx &req)
 {
-        auto &req = *get_request_ctx(request);
-        return crit.use_endp? crit.endpoint == req.endpoint : 
-                              crit.seqnum == req.seqnum;
+        Lock lck(dev.requests_lock);
+        remove_entry(req);
 }
 
-_Function_class_(EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE)
+/*
+ * requests_lock must be acquired, cancel_request acquires it too.
+ * If the request is being canceled, it is left in the index for cancel_request.
+ * @return true if the request is not cancelable anymore and was removed from the index
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+auto take(_In_ WDFREQUEST request)
+{
+        switch (auto st = WdfRequestUnmarkCancelable(request)) {
+        case STATUS_SUCCESS:
+                break;
+        case STATUS_CANCELLED: // cancel_request will be called
+                return false;
+        default:
+                Trace(TRACE_LEVEL_ERROR, "WdfRequestUnmarkCancelable %!STATUS!", st);
+                NT_ASSERT(!"WdfRequestUnmarkCancelable");
+        }
+
+        remove_entry(*get_request_ctx(request));
+        return true;
+}
+
+/*
+ * The request is completed by send_cmd_unlink or later by complete_send.
+ */
+_Function_class_(EVT_WDF_REQUEST_CANCEL)
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-void NTAPI canceled_on_queue(_In_ WDFQUEUE queue, _In_ WDFREQUEST request)
+void NTAPI cancel_request(_In_ WDFREQUEST request)
 {
-        auto dev = get_device(queue);
+        auto &req = *get_request_ctx(request);
+        auto dev = get_endpoint_ctx(req.endpoint)->device; // endpoint can't be deleted while it has a request
+
         TraceDbg("dev %04x, request %04x", ptr04x(dev), ptr04x(request));
+
+        remove_index(*get_device_ctx(dev), req);
         device::send_cmd_unlink(dev, request);
 }
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto dequeue_by_endpoint(_In_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint) -> WDFREQUEST
+{
+        Lock lck(dev.requests_lock);
+
+        for (auto &head: dev.requests) {
+                for (auto entry = head.Flink; entry != &head; entry = entry->Flink) {
+                        auto req = CONTAINING_RECORD(entry, request_ctx, entry);
+                        if (req->endpoint != endpoint) {
+                                continue;
+                        }
+
+                        if (auto request = static_cast<WDFREQUEST>(WdfObjectContextGetObject(req)); take(request)) {
+                                lck.release(); // explicit call to satisfy code analyzer and get rid of warning C28166
+                                return request;
+                        }
+                }
+        }
+
+        lck.release();
+        return WDF_NO_HANDLE;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto dequeue_by_seqnum(_In_ device_ctx &dev, _In_ seqnum_t seqnum) -> WDFREQUEST
+{
+        auto head = dev.requests + get_bucket(seqnum);
+        WDFREQUEST request{};
+
+        Lock lck(dev.requests_lock);
+
+        for (auto entry = head->Flink; entry != head; entry = entry->Flink) {
+                if (auto req = CONTAINING_RECORD(entry, request_ctx, entry); req->seqnum == seqnum) {
+                        if (auto r = static_cast<WDFREQUEST>(WdfObjectContextGetObject(req)); take(r)) {
+                                request = r;
+                        }
+                        break;
+                }
+        }
+
+        lck.release(); // explicit call to satisfy code analyzer and get rid of warning C28166
+        return request;
+}
+
 } // namespace
 
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED NTSTATUS usbip::device::create_queue(_In_ UDECXUSBDEVICE dev)
+PAGED void usbip::device::init_queue(_Inout_ device_ctx &ctx)
 {
         PAGED_CODE();
-        auto &ctx = *get_device_ctx(dev);
-
-        WDF_IO_QUEUE_CONFIG cfg;
-        WDF_IO_QUEUE_CONFIG_INIT(&cfg, WdfIoQueueDispatchManual);
-        cfg.EvtIoCanceledOnQueue = canceled_on_queue;
-        cfg.PowerManaged = WdfFalse;
-
-        WDF_OBJECT_ATTRIBUTES attrs;
-        WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attrs, UDECXUSBDEVICE);
-        attrs.EvtCleanupCallback = [] (auto) { TraceDbg("Device queue cleanup"); };
-//      attrs.SynchronizationScope = WdfSynchronizationScopeQueue; // EvtIoCanceledOnQueue is used only
-        attrs.ParentObject = dev;
-
-        if (auto err = WdfIoQueueCreate(ctx.vhci, &cfg, &attrs, &ctx.queue)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfIoQueueCreate %!STATUS!", err);
-                return err;
+
+        KeInitializeSpinLock(&ctx.requests_lock);
+        for (auto &head: ctx.requests) {
+                InitializeListHead(&head);
         }
+}
 
-        get_device(ctx.queue) = dev;
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS usbip::device::enqueue_request(_In_ device_ctx &dev, _In_ WDFREQUEST request)
+{
+        auto &req = *get_request_ctx(request);
+        NT_ASSERT(is_valid_seqnum(req.seqnum));
+
+        auto head = dev.requests + get_bucket(req.seqnum);
+
+        Lock lck(dev.requests_lock); // cancel_request can be called right after marking
+        InsertTailList(head, &req.entry);
+
+        auto err = WdfRequestMarkCancelableEx(request, cancel_request);
+        if (err) { // STATUS_CANCELLED, cancel_request will not be called
+                remove_entry(req);
+        }
 
-        TraceDbg("dev %04x, queue %04x", ptr04x(dev), ptr04x(ctx.queue));
-        return STATUS_SUCCESS;
+        lck.release(); // explicit call to satisfy code analyzer and get rid of warning C28166
+
+        if (err) {
+                Trace(TRACE_LEVEL_ERROR, "WdfRequestMarkCancelableEx %!STATUS!", err);
+        }
+
+        return err;
 }
 
 _IRQL_requires_same_
@@ -70,40 +174,23 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
 WDFREQUEST usbip::device::dequeue_request(_In_ device_ctx &dev, _In_ const request_search &crit)
 {
         NT_ASSERT(crit.endpoint); // largest in union
+        return crit.use_endp ? dequeue_by_endpoint(dev, crit.endpoint) : dequeue_by_seqnum(dev, crit.seqnum);
+}
 
-        for (WDFREQUEST prev{}, cur; ; prev = cur) {
-
-                auto st = WdfIoQueueFindRequest(dev.queue, prev, WDF_NO_HANDLE, nullptr, &cur);
-                if (prev) {
-                        WdfObjectDereference(prev);
-                }
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::device::has_queued_requests(_In_ device_ctx &dev)
+{
+        Lock lck(dev.requests_lock);
 
-                switch (st) {
-                case STATUS_SUCCESS:
-                        if (matches(cur, crit)) {
-                                st = WdfIoQueueRetrieveFoundRequest(dev.queue, cur, &prev);
-                                WdfObjectDereference(cur);
-
-                                switch (st) {
-                                case STATUS_SUCCESS:
-                                        return prev;
-                                case STATUS_NOT_FOUND: // cur was canceled and removed from queue
-                                        cur = WDF_NO_HANDLE; // restart the loop
-                                        break;
-                                default:
-                                        Trace(TRACE_LEVEL_ERROR, "WdfIoQueueRetrieveFoundRequest %!STATUS!", st);
-                                        return WDF_NO_HANDLE;
-                                }
-                        }
+        auto found = false;
+        for (auto &head: dev.requests) {
+                if (!IsListEmpty(&head)) {
+                        found = true;
                         break;
-                case STATUS_NOT_FOUND: // prev was canceled and removed from queue
-                        NT_ASSERT(!cur); // restart the loop
-                        break;
-                case STATUS_NO_MORE_ENTRIES: // not found
-                        return WDF_NO_HANDLE;
-                default:
-                        Trace(TRACE_LEVEL_ERROR, "WdfIoQueueFindRequest %!STATUS!", st);
-                        return WDF_NO_HANDLE;
                 }
         }
+
+        lck.release(); // explicit call to satisfy code analyzer and get rid of warning C28166
+        return found;
 }
@@ -23,7 +23,7 @@ namespace usbip::device
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED NTSTATUS create_queue(_In_ UDECXUSBDEVICE dev);
+PAGED void init_queue(_Inout_ device_ctx &ctx);
 
 struct request_search
 {
@@ -40,12 +40,23 @@ struct request_search
 };
 
 /*
- * @param queue device_ctx.queue 
+ * Add request to the index by seqnum and mark it cancelable, the driver owns the requests
+ * that are waiting for RET_SUBMIT, they are not kept in a framework queue.
+ * request_ctx.seqnum must be set.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS enqueue_request(_In_ device_ctx &dev, _In_ WDFREQUEST request);
+
+/*
+ * Remove request from the index if it is not being canceled.
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 WDFREQUEST dequeue_request(_In_ device_ctx &dev, _In_ const request_search &crit);
 
-// @see WdfIoQueueRetrieveNextRequest
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool has_queued_requests(_In_ device_ctx &dev);
 
 } // namespace usbip::device
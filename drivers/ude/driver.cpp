@@ -12,6 +12,8 @@
 
 #include <libdrv\wsk_cpp.h>
 
+#include <ntstrsafe.h>
+
 namespace
 {
 
@@ -73,6 +75,45 @@ CS_INIT auto init()
 } // namespace
 
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto usbip::open_parameters_key(_In_ ACCESS_MASK DesiredAccess) -> Registry
+{
+	PAGED_CODE();
+	Registry key;
+
+	if (WDFKEY h; 
+	    auto err = WdfDriverOpenParametersRegistryKey(WdfGetDriver(), DesiredAccess, WDF_NO_OBJECT_ATTRIBUTES, &h)) {
+		Trace(TRACE_LEVEL_ERROR, "WdfDriverOpenParametersRegistryKey %!STATUS!", err);
+	} else {
+		key.reset(h);
+	}
+
+	return key;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED ULONG usbip::query_parameter(_In_ PCWSTR value_name, _In_ ULONG default_value)
+{
+	PAGED_CODE();
+	auto val = default_value;
+
+	if (auto key = open_parameters_key()) {
+		UNICODE_STRING name;
+		RtlUnicodeStringInit(&name, value_name);
+
+		if (auto err = WdfRegistryQueryULong(key.get(), &name, &val)) {
+			if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+				Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryULong('%!USTR!') %!STATUS!", &name, err);
+			}
+			val = default_value;
+		}
+	}
+
+	return val;
+}
+
 _Function_class_(DRIVER_INITIALIZE)
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
@@ -4,11 +4,23 @@
 
 #pragma once
 
-#include <ntdef.h>
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
 
 namespace usbip
 {
 
 const ULONG pooltag = 'ICHV';
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED Registry open_parameters_key(_In_ ACCESS_MASK DesiredAccess = KEY_QUERY_VALUE);
+
+/*
+ * @return REG_DWORD value from Parameters key or default_value if it does not exist
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED ULONG query_parameter(_In_ PCWSTR value_name, _In_ ULONG default_value);
+
 } // namespace usbip
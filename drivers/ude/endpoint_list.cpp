@@ -8,6 +8,16 @@
 
 #include <libdrv\lock.h>
 
+/*
+ * The list of endpoints is rooted at ep0 and protected by device_ctx::endpoint_list_lock.
+ *
+ * device_ctx::endpoint_by_addr is direct-mapped by bEndpointAddress and holds the newest endpoint
+ * with that address, device_ctx::endpoint_by_handle is hashed by PipeHandle.
+ * Slots are read and written under the lock too. endpoint_cleanup clears a slot and then WDF frees
+ * the context, so a slot can't be dereferenced without the lock, the endpoint may be already freed.
+ * A slot that matches saves the scan of the list, the lock is held for a constant time.
+ */
+
 namespace
 {
 
@@ -21,6 +31,80 @@ auto get_endpoint_list_head(_In_ device_ctx &dev)
         return &ep0->entry;
 }
 
+/*
+ * OUT endpoints occupy slots 0-15, IN endpoints 16-31.
+ */
+constexpr auto addr_slot(_In_ UCHAR addr)
+{
+        static_assert(ENDPOINT_ADDR_SLOTS == 2*(USB_ENDPOINT_ADDRESS_MASK + 1));
+        return (addr & USB_ENDPOINT_ADDRESS_MASK) | (USB_ENDPOINT_DIRECTION_IN(addr) ? 0x10 : 0);
+}
+
+inline auto handle_slot(_In_ USBD_PIPE_HANDLE handle)
+{
+        static_assert(!(ENDPOINT_HANDLE_SLOTS & (ENDPOINT_HANDLE_SLOTS - 1)));
+
+        auto v = reinterpret_cast<ULONG_PTR>(handle);
+        return ULONG(v ^ (v >> 5) ^ (v >> 10)) & (ENDPOINT_HANDLE_SLOTS - 1);
+}
+
+/*
+ * endpoint_list_lock must be acquired.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+endpoint_ctx *scan(_In_ device_ctx &dev, _In_ const compare_endpoint &compare)
+{
+        auto head = get_endpoint_list_head(dev);
+
+        for (auto entry = head->Flink; entry != head; entry = entry->Flink) {
+                auto endp = CONTAINING_RECORD(entry, endpoint_ctx, entry);
+                if (compare(*endp)) {
+                        return endp;
+                }
+        }
+
+        return nullptr;
+}
+
+/*
+ * The slot is checked first, the list is scanned if it does not match and the endpoint that was found
+ * is stored to the slot.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto find_cached(_In_ device_ctx &dev, _In_ const compare_endpoint &compare, _Inout_ endpoint_ctx* &slot)
+{
+        Lock lck(dev.endpoint_list_lock);
+
+        auto endp = slot;
+
+        if (!(endp && compare(*endp)) && (endp = scan(dev, compare))) {
+                slot = endp;
+        }
+
+        lck.release();
+        return endp;
+}
+
+/*
+ * endpoint_list_lock must be acquired.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+void unpublish(_Inout_ device_ctx &dev, _In_ const endpoint_ctx &endp)
+{
+        if (auto &slot = dev.endpoint_by_addr[addr_slot(endp.descriptor.bEndpointAddress)]; slot == &endp) {
+                slot = nullptr;
+        }
+
+        for (auto &slot: dev.endpoint_by_handle) { // PipeHandle can be changed after publication
+                if (slot == &endp) {
+                        slot = nullptr;
+                }
+        }
+}
+
 } // namespace
 
 
@@ -33,6 +117,7 @@ void usbip::insert_endpoint_list(_In_ endpoint_ctx &endp)
         if (auto &dev = *get_device_ctx(endp.device); auto head = get_endpoint_list_head(dev)) {
                 Lock lck(dev.endpoint_list_lock);
                 InsertHeadList(head, &endp.entry); // outdated, but still not removed endpoints will be at end
+                dev.endpoint_by_addr[addr_slot(endp.descriptor.bEndpointAddress)] = &endp;
         }
 }
 
@@ -44,28 +129,53 @@ void usbip::remove_endpoint_list(_In_ endpoint_ctx &endp)
 
         if (auto dev = get_device_ctx(endp.device)) {
                 Lock lck(dev->endpoint_list_lock);
+                unpublish(*dev, endp);
                 RemoveEntryList(e); // works if entry was just InitializeListHead-ed
+                InitializeListHead(e); // set_pipe_handle checks it
+        } else {
+                InitializeListHead(e);
         }
-
-        InitializeListHead(e);
 }
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto usbip::find_endpoint(_In_ device_ctx &dev, _In_ const compare_endpoint &compare) -> endpoint_ctx*
 {
-        auto head = get_endpoint_list_head(dev);
-
         Lock lck(dev.endpoint_list_lock);
+        return scan(dev, compare);
+}
 
-        for (auto entry = head->Flink; entry != head; entry = entry->Flink) {
-                auto endp = CONTAINING_RECORD(entry, endpoint_ctx, entry);
-                if (compare(*endp)) {
-                        return endp;
-                }
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto usbip::find_endpoint(_In_ device_ctx &dev, _In_ USBD_PIPE_HANDLE handle) -> endpoint_ctx*
+{
+        compare_endpoint_handle compare(handle);
+        return find_cached(dev, compare, dev.endpoint_by_handle[handle_slot(handle)]);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto usbip::find_endpoint(_In_ device_ctx &dev, _In_ const USBD_PIPE_INFORMATION &pipe) -> endpoint_ctx*
+{
+        compare_endpoint_descr compare(pipe);
+        return find_cached(dev, compare, dev.endpoint_by_addr[addr_slot(pipe.EndpointAddress)]);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::set_pipe_handle(_In_ device_ctx &dev, _Inout_ endpoint_ctx &endp, _In_ USBD_PIPE_HANDLE handle)
+{
+        endp.PipeHandle = handle;
+
+        if (!handle) {
+                return;
         }
 
-        return nullptr;
+        Lock lck(dev.endpoint_list_lock);
+
+        if (!IsListEmpty(&endp.entry)) { // was not removed
+                dev.endpoint_by_handle[handle_slot(handle)] = &endp;
+        }
 }
 
 bool usbip::compare_endpoint_descr::operator() (const endpoint_ctx &endp) const
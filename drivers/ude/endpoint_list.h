@@ -43,4 +43,20 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 endpoint_ctx *find_endpoint(_In_ device_ctx &dev, _In_ const compare_endpoint &compare);
 
+/*
+ * These lookups check device_ctx::endpoint_by_addr/endpoint_by_handle first,
+ * the list is searched if the slot does not match.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+endpoint_ctx *find_endpoint(_In_ device_ctx &dev, _In_ USBD_PIPE_HANDLE handle);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+endpoint_ctx *find_endpoint(_In_ device_ctx &dev, _In_ const USBD_PIPE_INFORMATION &pipe);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void set_pipe_handle(_In_ device_ctx &dev, _Inout_ endpoint_ctx &endp, _In_ USBD_PIPE_HANDLE handle);
+
 } // namespace usbip
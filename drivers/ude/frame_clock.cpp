@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "frame_clock.h"
+#include "trace.h"
+#include "frame_clock.tmh"
+
+#include <libdrv\lock.h>
+#include <libdrv\usbd_helper.h>
+
+namespace
+{
+
+using namespace usbip;
+
+enum : ULONG {
+        FRAC_BITS = 8, // frame_clock offsets are in 1/256 of frame
+        GAIN = 16, // an offset and a jitter move by 1/GAIN of a sample's deviation
+        MIN_MASK = 0xFF,
+        MAX_MASK = 0xFFFF, // a larger start_frame is not a frame number
+        SYNC_SAMPLES = 8, // required by to_server_frame
+        RESYNC_FRAMES = 32, // a sample that deviates more resets the clock
+        STALE_FRAMES = 1'000, // to_server_frame requires a sample that is not older
+        DRIFT_FRAMES = 60'000, // min interval of drift measurement
+};
+
+constexpr auto fixed(_In_ ULONG frames) { return frames << FRAC_BITS; }
+constexpr auto fixed_mask(_In_ ULONG mask) { return fixed(mask) | (fixed(1) - 1); }
+
+/*
+ * @return signed difference in [-(mask + 1)/2, (mask + 1)/2)
+ */
+constexpr LONG wrap(_In_ ULONG diff, _In_ ULONG mask)
+{
+        diff &= mask;
+        return diff > mask/2 ? LONG(diff - mask - 1) : LONG(diff);
+}
+
+/*
+ * @return offset rounded to frames
+ */
+constexpr auto offset_frames(_In_ const frame_clock &c)
+{
+        return ((c.offset + fixed(1)/2) >> FRAC_BITS) & c.mask;
+}
+
+/*
+ * @return 2^N - 1 that is not less than frame
+ */
+auto get_mask(_In_ ULONG frame)
+{
+        ULONG idx;
+        _BitScanReverse(&idx, frame | MIN_MASK);
+        return (2UL << idx) - 1;
+}
+
+/*
+ * Server frame numbers advance as host ones. If start_frame is less than the previous one and
+ * the advance through mask + 1 matches the elapsed host frames, it has wrapped around exactly at mask + 1.
+ * A smaller start_frame that does not match is jitter or a reordered sample.
+ */
+void check_wrap(_Inout_ frame_clock &c, _In_ ULONG host_frame, _In_ ULONG start_frame)
+{
+        if (start_frame >= c.last_start_frame) {
+                return;
+        }
+
+        auto elapsed = LONG(host_frame - c.last_frame);
+        auto advance = LONG(start_frame + c.mask + 1 - c.last_start_frame);
+
+        if (elapsed >= 0 && abs(advance - elapsed) <= LONG(RESYNC_FRAMES)) {
+                c.wrapped = true;
+        }
+}
+
+void resync(_Inout_ frame_clock &c, _In_ ULONG host_frame, _In_ ULONG sample)
+{
+        c.offset = sample;
+        c.jitter = 0;
+        c.samples = 1;
+
+        c.drift_frame = host_frame;
+        c.drift_offset = sample;
+}
+
+inline void set_last(_Inout_ frame_clock &c, _In_ ULONG host_frame, _In_ ULONG start_frame)
+{
+        c.last_frame = host_frame;
+        c.last_start_frame = start_frame;
+}
+
+void update_drift(_Inout_ frame_clock &c, _In_ ULONG host_frame)
+{
+        auto elapsed = host_frame - c.drift_frame;
+        if (elapsed < DRIFT_FRAMES) {
+                return;
+        }
+
+        auto delta = wrap(c.offset - c.drift_offset, fixed_mask(c.mask));
+        c.drift = LONG(LONG64(delta)*1'000'000/(LONG64(elapsed) << FRAC_BITS));
+
+        c.drift_frame = host_frame;
+        c.drift_offset = c.offset;
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::add_frame_sample(_Inout_ device_ctx &dev, _In_ ULONG host_frame, _In_ ULONG start_frame)
+{
+        if (start_frame > MAX_MASK) {
+                TraceDbg("dev %04x, start_frame %lu ignored", ptr04x(get_device(&dev)), start_frame);
+                return;
+        }
+
+        auto &c = dev.fclock;
+        Lock lck(c.lock);
+
+        if (!c.mask || start_frame > c.mask) { // the first sample or a wider frame counter
+                c.mask = get_mask(start_frame);
+                c.wrapped = false;
+                resync(c, host_frame, fixed(start_frame - host_frame) & fixed_mask(c.mask));
+                set_last(c, host_frame, start_frame);
+                return;
+        }
+
+        auto mask = fixed_mask(c.mask);
+
+        auto sample = fixed(start_frame - host_frame) & mask;
+        auto diff = wrap(sample - c.offset, mask);
+        auto deviation = diff < 0 ? -diff : diff;
+
+        if (ULONG(deviation) > fixed(RESYNC_FRAMES)) {
+                ++c.resyncs;
+                resync(c, host_frame, sample);
+        } else {
+                c.offset = (c.offset + diff/LONG(GAIN)) & mask;
+                c.jitter = ULONG(LONG(c.jitter) + (deviation - LONG(c.jitter))/LONG(GAIN));
+                ++c.samples;
+                update_drift(c, host_frame);
+
+                if (!c.wrapped) {
+                        check_wrap(c, host_frame, start_frame);
+                }
+        }
+
+        set_last(c, host_frame, start_frame);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::to_server_frame(_Inout_ device_ctx &dev, _Inout_ ULONG &server_frame, _In_ ULONG host_frame)
+{
+        auto &c = dev.fclock;
+        Lock lck(c.lock);
+
+        auto ok = c.samples >= SYNC_SAMPLES && c.wrapped && get_host_frame_number() - c.last_frame < STALE_FRAMES;
+        if (ok) {
+                server_frame = (host_frame + offset_frames(c)) & c.mask;
+        }
+
+        return ok;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::to_host_frame(
+        _Inout_ device_ctx &dev, _Inout_ ULONG &host_frame, _In_ ULONG server_frame, _In_ ULONG near_frame)
+{
+        auto &c = dev.fclock;
+        Lock lck(c.lock);
+
+        auto ok = c.mask != 0;
+        if (ok) {
+                host_frame = near_frame + wrap(server_frame - offset_frames(c) - near_frame, c.mask);
+        }
+
+        return ok;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::get_frame_clock_statistics(_Inout_ device_ctx &dev, _Out_ vhci::frame_clock_statistics &st)
+{
+        auto &c = dev.fclock;
+        Lock lck(c.lock);
+
+        st.samples = c.samples;
+        st.resyncs = c.resyncs;
+        st.modulus = c.mask ? c.mask + 1 : 0;
+        st.offset = c.mask ? wrap(offset_frames(c), c.mask) : 0;
+        st.jitter = c.jitter*1'000/fixed(1); // 1ms frames
+        st.drift = c.drift;
+}
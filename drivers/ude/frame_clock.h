@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "context.h"
+
+/*
+ * Host frame numbers are get_host_frame_number() that usbip2_filter returns for URB_FUNCTION_GET_CURRENT_FRAME_NUMBER.
+ * The offset to frame numbers of the server is estimated from start_frame of RET_SUBMIT for isoch transfers
+ * that were submitted with URB_ISO_ASAP. It includes the time till the server's HCD schedules a transfer,
+ * so explicit StartFrame is mapped to the frame that URB_ISO_ASAP would have been given.
+ *
+ * The modulus of server frame numbers is not known in advance. It is guessed from the largest start_frame
+ * and trusted after start_frame was seen wrapping around. Explicit StartFrame is not mapped if the last
+ * sample is older than a second, such transfer is sent with URB_ISO_ASAP to get a fresh one.
+ */
+
+namespace usbip
+{
+
+/*
+ * @param host_frame when CMD_SUBMIT was sent
+ * @param start_frame of RET_SUBMIT
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void add_frame_sample(_Inout_ device_ctx &dev, _In_ ULONG host_frame, _In_ ULONG start_frame);
+
+/*
+ * @return false if the clock is not synchronized or the samples are stale, server_frame is not changed in such case
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool to_server_frame(_Inout_ device_ctx &dev, _Inout_ ULONG &server_frame, _In_ ULONG host_frame);
+
+/*
+ * @param near_frame host frame that is close to the result, server frame numbers wrap around often
+ * @return false if there were no samples, host_frame is not changed in such case
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool to_host_frame(_Inout_ device_ctx &dev, _Inout_ ULONG &host_frame, _In_ ULONG server_frame, _In_ ULONG near_frame);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void get_frame_clock_statistics(_Inout_ device_ctx &dev, _Out_ vhci::frame_clock_statistics &st);
+
+} // namespace usbip
@@ -42,12 +42,14 @@ NTSTATUS make_transfer_buffer_mdl(_Inout_ Mdl &mdl, _In_ ULONG mdl_size, _In_ bo
 _IRQL_requires_max_(DISPATCH_LEVEL)
 inline auto verify(_In_ const WSK_BUF &buf, _In_ bool exact)
 {
-	if (buf.Offset || !buf.Length) {
+	if (!buf.Length) {
 		return false;
 	}
 
+	auto len = buf.Offset + buf.Length;
 	auto sz = size(buf.Mdl);
-	return exact ? buf.Length == sz : buf.Length <= sz;
+
+	return exact ? len == sz : len <= sz;
 }
 
 } // namespace usbip
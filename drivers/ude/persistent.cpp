@@ -7,8 +7,12 @@
 #include "persistent.tmh"
 
 #include "context.h"
+#include "driver.h"
+#include "vhci.h"
+#include "vhci_ioctl.h"
 
 #include <libdrv\strconv.h>
+#include <libdrv\lock.h>
 #include <resources/messages.h>
 
 #include <ntstrsafe.h>
@@ -80,57 +84,86 @@ PAGED auto parse_string(_Out_ vhci::ioctl::plugin_hardware &r, _In_ const UNICOD
                     r.busid, sizeof(r.busid), busid);
 }
 
+enum { 
+        _100_NSEC = 1,  // in units of 100 nanoseconds
+        USEC = 10*_100_NSEC, // microsecond
+        MSEC = 1000*USEC, // millisecond
+        SEC = 1000*MSEC, // second
+};
+
+enum { MAX_WORKERS = 16 };
+
+struct attach_device
+{
+        vhci::ioctl::plugin_hardware req;
+        UNICODE_STRING line; // WDFSTRING of the collection
+        bool done;
+};
+
 /*
- * Target is self. 
+ * Devices of the same host are attached one by one by the worker that owns the group,
+ * a backoff of unreachable host does not delay devices of other hosts.
  */
-_IRQL_requires_same_
-_IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto make_target(_In_ WDFDEVICE vhci)
+struct host_group
 {
-        PAGED_CODE();
-        wdf::ObjectDelete target;
+        attach_device *devices; // subrange of attach_context::devices
+        ULONG count;
 
-        if (WDFIOTARGET t; auto err = WdfIoTargetCreate(vhci, WDF_NO_OBJECT_ATTRIBUTES, &t)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetCreate %!STATUS!", err);
-                return target;
-        } else {
-                target.reset(t);
-        }
+        ULONG failures; // in a row, accessed by the owner only
+        ULONG64 due; // KeQueryInterruptTime, the next attempt is not allowed before
 
-        auto fdo = WdfDeviceWdmGetDeviceObject(vhci);
+        bool busy; // owned by a worker
+        bool done; // all devices are attached or excluded
+};
 
-        WDF_IO_TARGET_OPEN_PARAMS params;
-        WDF_IO_TARGET_OPEN_PARAMS_INIT_EXISTING_DEVICE(&params, fdo);
+struct attach_context
+{
+        vhci_ctx *vhci;
+        WDFKEY key;
+        ULONG64 start; // KeQueryInterruptTime
 
-        if (auto err = WdfIoTargetOpen(target.get<WDFIOTARGET>(), &params)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetOpen %!STATUS!", err);
-                target.reset();
-        }
+        KSPIN_LOCK lock; // for host_group::busy, due, done
+        host_group *groups; // must be free-d
+        ULONG group_cnt;
 
-        return target;
-}
+        attach_device *devices; // the same memory block as groups
+        ULONG device_cnt;
+};
 
-constexpr auto get_delay(_In_ ULONG attempt, _In_ ULONG cnt)
+/*
+ * Exponential backoff with "equal jitter": a half of the delay is random,
+ * so devices of different hosts do not retry in lockstep.
+ * 
+ * @param failures in a row
+ * @return milliseconds
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+PAGED auto get_delay(_In_ ULONG failures, _Inout_ ULONG &seed)
 {
-        NT_ASSERT(cnt);
-        enum { UNIT = 10, MAX_DELAY = 30*60 }; // seconds
-        return attempt > 1 ? min(UNIT*attempt/cnt, MAX_DELAY) : 0; // first two attempts without a delay
+        PAGED_CODE();
+        enum { UNIT = 10*1000, MAX_DELAY = 30*60*1000 }; // milliseconds
+
+        if (failures < 2) {
+                return 0UL; // first two attempts without a delay
+        }
+
+        auto shift = min(failures - 2, 8UL); // UNIT << 8 > MAX_DELAY
+        auto delay = min(ULONG(UNIT) << shift, ULONG(MAX_DELAY));
+
+        return delay/2 + RtlRandomEx(&seed) % (delay/2 + 1);
 }
 
+/*
+ * @return false if thread stop was requested
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(APC_LEVEL)
-PAGED auto sleep(_Inout_ vhci_ctx &ctx, _In_ ULONG seconds)
+PAGED auto sleep(_Inout_ vhci_ctx &ctx, _In_ ULONG msec)
 {
         PAGED_CODE();
         
-        enum { 
-                _100_NSEC = 1,  // in units of 100 nanoseconds
-                USEC = 10*_100_NSEC, // microsecond
-                MSEC = 1000*USEC, // millisecond
-                SEC = 1000*MSEC, // second
-        };
-
-        LARGE_INTEGER timeout{ .QuadPart = seconds*SEC };
+        LARGE_INTEGER timeout{ .QuadPart = LONG64(msec)*MSEC };
         timeout.QuadPart *= -1; // relative
 
         switch (auto st = KeWaitForSingleObject(&ctx.attach_thread_stop, Executive, KernelMode, false, &timeout)) {
@@ -149,6 +182,8 @@ PAGED auto sleep(_Inout_ vhci_ctx &ctx, _In_ ULONG seconds)
 /*
  * WskGetAddressInfo() can return STATUS_INTERNAL_ERROR(0xC00000E5), but after some delay it will succeed.
  * This can happen after reboot if dnscache(?) service is not ready yet.
+ * 
+ * These errors relate to a host rather than a device.
  */
 constexpr auto can_retry(_In_ DWORD error)
 {
@@ -162,123 +197,271 @@ constexpr auto can_retry(_In_ DWORD error)
         return false;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto contains(_In_ WDFCOLLECTION col, _In_ const UNICODE_STRING &str)
+{
+        PAGED_CODE();
+        
+        for (ULONG i = 0, cnt = WdfCollectionGetCount(col); i < cnt; ++i) {
+                auto item = (WDFSTRING)WdfCollectionGetItem(col, i);
+
+                UNICODE_STRING s{};
+                WdfStringGetUnicodeString(item, &s);
+                        
+                if (RtlEqualUnicodeString(&s, &str, true)) {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+inline void swap(_Inout_ attach_device &a, _Inout_ attach_device &b)
+{
+        auto tmp = a;
+        a = b;
+        b = tmp;
+}
+
 /*
- * @return true - do not try to connect to this device again
+ * Parse the strings and group devices by host, malformed strings are skipped.
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto plugin_hardware(
-        _In_ const UNICODE_STRING &line, 
-        _In_ WDFIOTARGET target,
-        _Inout_ vhci::ioctl::plugin_hardware &req,
-        _Inout_ WDF_MEMORY_DESCRIPTOR &input,
-        _Inout_ WDF_MEMORY_DESCRIPTOR &output,
-        [[maybe_unused]] _In_ const ULONG outlen)
+PAGED auto init_devices(_Inout_ attach_context &ac, _In_ WDFCOLLECTION col)
 {
         PAGED_CODE();
 
-        if (auto err = parse_string(req, line)) {
-                Trace(TRACE_LEVEL_ERROR, "'%!USTR!' parse %!STATUS!", &line, err);
-                return true; // remove malformed string
+        auto cnt = min(WdfCollectionGetCount(col), ULONG(MAX_PORTS));
+        auto sz = cnt*(sizeof(*ac.groups) + sizeof(*ac.devices));
+
+        ac.groups = (host_group*)ExAllocatePool2(POOL_FLAG_NON_PAGED, sz, pooltag);
+        if (!ac.groups) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", sz);
+                return false;
         }
 
-        Trace(TRACE_LEVEL_INFORMATION, "%s:%s/%s", req.host, req.service, req.busid);
-        req.port = 0;
+        ac.devices = reinterpret_cast<attach_device*>(ac.groups + cnt);
 
-        if (ULONG_PTR BytesReturned; // send IOCTL to itself
-            auto err = WdfIoTargetSendIoctlSynchronously(target, WDF_NO_HANDLE, vhci::ioctl::PLUGIN_HARDWARE, 
-                                                         &input, &output, nullptr, &BytesReturned)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetSendIoctlSynchronously %!STATUS!", err);
-                return !can_retry(err);
-        } else {
-                NT_ASSERT(BytesReturned == outlen);
-                return true;
+        for (ULONG i = 0; i < cnt; ++i) {
+                UNICODE_STRING str{};
+                if (auto s = (WDFSTRING)WdfCollectionGetItem(col, i)) {
+                        WdfStringGetUnicodeString(s, &str);
+                }
+
+                auto &d = ac.devices[ac.device_cnt];
+                d.req.size = sizeof(d.req);
+
+                if (auto err = parse_string(d.req, str)) {
+                        Trace(TRACE_LEVEL_ERROR, "'%!USTR!' parse %!STATUS!", &str, err);
+                        RtlZeroMemory(&d, sizeof(d));
+                } else {
+                        d.line = str;
+                        ++ac.device_cnt;
+                }
         }
+
+        for (ULONG i = 0; i < ac.device_cnt; ) {
+                auto &g = ac.groups[ac.group_cnt++];
+                g.devices = ac.devices + i;
+                g.count = 1;
+
+                for (auto j = i + 1; j < ac.device_cnt; ++j) {
+                        if (!_stricmp(ac.devices[j].req.host, g.devices->req.host)) {
+                                swap(g.devices[g.count++], ac.devices[j]);
+                        }
+                }
+
+                i += g.count;
+        }
+
+        return ac.device_cnt > 0;
 }
 
+/*
+ * @param wait time till the nearest due of not owned groups, zero if there are no such groups
+ * @return group to attach or nullptr if there is nothing to do now
+ */
 _IRQL_requires_same_
-_IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto open_parameters_key()
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto acquire_group(_Inout_ attach_context &ac, _Out_ ULONG64 &wait)
 {
-        PAGED_CODE();
-        wdf::Registry key;
+        host_group *ready{};
+        wait = 0;
 
-        if (WDFKEY h; 
-            auto err = WdfDriverOpenParametersRegistryKey(WdfGetDriver(), KEY_QUERY_VALUE, 
-                                                          WDF_NO_OBJECT_ATTRIBUTES, &h)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfDriverOpenParametersRegistryKey %!STATUS!", err);
-        } else {
-                key.reset(h);
+        auto now = KeQueryInterruptTime();
+        Lock lck(ac.lock);
+
+        for (ULONG i = 0; i < ac.group_cnt; ++i) {
+                auto &g = ac.groups[i];
+
+                if (g.busy || g.done) {
+                        continue;
+                } else if (g.due <= now) {
+                        g.busy = true;
+                        ready = &g;
+                        break;
+                } else if (auto t = g.due - now; !wait || t < wait) {
+                        wait = t;
+                }
         }
 
-        return key;
+        lck.release();
+        return ready;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void release_group(_Inout_ attach_context &ac, _Inout_ host_group &g, _In_ bool done, _In_ ULONG delay)
+{
+        auto due = KeQueryInterruptTime() + ULONG64(delay)*MSEC;
+
+        Lock lck(ac.lock);
+        g.busy = false;
+        g.done = done;
+        g.due = due;
+        lck.release();
+}
+
+/*
+ * For "usbip port". The device could be detached already.
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto contains(_In_ WDFCOLLECTION col, _In_ const UNICODE_STRING &str)
+PAGED void set_attach_stats(_In_ const attach_context &ac, _In_ int port, _In_ ULONG attempts)
 {
         PAGED_CODE();
-        
-        for (ULONG i = 0, cnt = WdfCollectionGetCount(col); i < cnt; ++i) {
-                auto item = (WDFSTRING)WdfCollectionGetItem(col, i);
 
-                UNICODE_STRING s{};
-                WdfStringGetUnicodeString(item, &s);
-                        
-                if (RtlEqualUnicodeString(&s, &str, true)) {
-                        return true;
-                }
-        }
+        auto delay = static_cast<UINT32>((KeQueryInterruptTime() - ac.start)/MSEC);
+        Trace(TRACE_LEVEL_INFORMATION, "port %d, attempt #%lu, %lu ms", port, attempts, delay);
 
-        return false;
+        if (auto dev = vhci::find_device(port)) {
+                auto &d = get_device_ctx(dev.get<UDECXUSBDEVICE>())->ext->dev;
+                d.attach_attempts = attempts;
+                d.attach_delay = delay;
+        }
 }
 
 /*
- * Remove from collection A items absent in collection B.
+ * Refreshing allows to remove devices that constantly fail to attach.
+ * @return true if all devices of the group are attached or excluded
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED void intersection(_In_ WDFCOLLECTION a, _In_ WDFCOLLECTION b)
+PAGED auto attach_host(_Inout_ attach_context &ac, _Inout_ host_group &g)
 {
         PAGED_CODE();
 
-        for (ULONG i = 0, cnt = WdfCollectionGetCount(a); i < cnt; ) {
-                auto item = (WDFSTRING)WdfCollectionGetItem(a, i);
+        if (!g.failures) {
+                //
+        } else if (auto col = get_persistent_devices(ac.key)) {
+                for (ULONG i = 0; i < g.count; ++i) {
+                        if (auto &d = g.devices[i]; !(d.done || contains(col.get<WDFCOLLECTION>(), d.line))) {
+                                TraceDbg("exclude %!USTR!", &d.line);
+                                d.done = true;
+                        }
+                }
+        } else {
+                return true;
+        }
 
-                UNICODE_STRING s{};
-                WdfStringGetUnicodeString(item, &s);
+        auto hci = get_device(ac.vhci);
+
+        for (ULONG i = 0; i < g.count; ++i) {
+                auto &d = g.devices[i];
+                if (d.done) {
+                        continue;
+                } else if (!sleep(*ac.vhci, 0)) {
+                        return false;
+                }
+
+                Trace(TRACE_LEVEL_INFORMATION, "%s:%s/%s, attempt #%lu", d.req.host, d.req.service, d.req.busid, 
+                                                g.failures + 1);
 
-                if (contains(b, s)) {
-                        ++i;
+                if (auto err = vhci::plugin_hardware(hci, d.req)) {
+                        if (can_retry(err)) {
+                                return false; // the rest of devices of this host will fail too
+                        }
+                        TraceDbg("exclude %!USTR!, error %#lx", &d.line, err);
                 } else {
-                        TraceDbg("exclude %!USTR!", &s);
-                        WdfCollectionRemoveItem(a, i);
-                        --cnt;
+                        set_attach_stats(ac, d.req.port, g.failures + 1);
                 }
+
+                d.done = true;
         }
+
+        return true;
 }
 
 /*
- * Refreshing allows to remove devices that constantly fail to attach.
+ * Workers take host groups which are due, a group is owned by one worker at a time. 
+ * A worker exits if all remaining groups are owned by other workers, at least one worker
+ * that owns a group continues to work.
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED ULONG get_count(_In_ WDFCOLLECTION col, _In_ WDFKEY key, _In_ bool refresh)
+PAGED void attach_devices(_Inout_ attach_context &ac)
 {
         PAGED_CODE();
+        auto seed = static_cast<ULONG>(KeQueryPerformanceCounter(nullptr).QuadPart);
 
-        if (!refresh) {
-                //
-        } else if (auto newcol = get_persistent_devices(key)) {
-                intersection(col, newcol.get<WDFCOLLECTION>());
+        while (sleep(*ac.vhci, 0)) {
+                ULONG64 wait;
+
+                if (auto g = acquire_group(ac, wait)) {
+                        auto done = attach_host(ac, *g);
+                        auto delay = done ? 0 : get_delay(++g->failures, seed);
+
+                        if (delay) {
+                                TraceDbg("%s, %lu failure(s), retry after %lu ms", g->devices->req.host, g->failures, delay);
+                        }
+
+                        release_group(ac, *g, done, delay);
+                } else if (!wait) {
+                        break;
+                } else if (!sleep(*ac.vhci, static_cast<ULONG>(wait/MSEC) + 1)) {
+                        break;
+                }
+        }
+}
+
+_IRQL_requires_same_
+_Function_class_(KSTART_ROUTINE)
+PAGED void attach_worker(_In_ void *ctx)
+{
+        PAGED_CODE();
+        KeSetPriorityThread(KeGetCurrentThread(), LOW_PRIORITY + 1);
+
+        attach_devices(*static_cast<attach_context*>(ctx));
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto start_worker(_In_ attach_context &ac)
+{
+        PAGED_CODE();
+
+        const auto access = THREAD_ALL_ACCESS;
+        auto fdo = WdfDeviceWdmGetDeviceObject(get_device(ac.vhci));
+
+        PVOID thread{};
+
+        if (HANDLE handle; 
+            auto err = IoCreateSystemThread(fdo, &handle, access, nullptr, nullptr, nullptr, attach_worker, &ac)) {
+                Trace(TRACE_LEVEL_ERROR, "IoCreateSystemThread %!STATUS!", err);
         } else {
-                return 0;
+                NT_VERIFY(NT_SUCCESS(ObReferenceObjectByHandle(handle, access, *PsThreadType, KernelMode, 
+                                                               &thread, nullptr)));
+                NT_VERIFY(NT_SUCCESS(ZwClose(handle)));
         }
 
-        return min(WdfCollectionGetCount(col), ARRAYSIZE(vhci_ctx::devices));
+        return static_cast<_KTHREAD*>(thread);
 }
 
+/*
+ * The calling thread is a worker too, it joins the others.
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED void plugin_persistent_devices(_In_ vhci_ctx &ctx)
@@ -295,52 +478,43 @@ PAGED void plugin_persistent_devices(_In_ vhci_ctx &ctx)
                 return;
         }
 
-        auto vhci = get_device(&ctx);
+        attach_context ac{ .vhci = &ctx, .key = key.get(), .start = KeQueryInterruptTime() };
+        KeInitializeSpinLock(&ac.lock);
 
-        auto target = make_target(vhci);
-        if (!target) {
+        if (!init_devices(ac, devices.get<WDFCOLLECTION>())) {
+                if (ac.groups) {
+                        ExFreePoolWithTag(ac.groups, pooltag);
+                }
                 return;
         }
 
-        vhci::ioctl::plugin_hardware req{{ .size = sizeof(req) }};
-
-        WDF_MEMORY_DESCRIPTOR input;
-        WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(&input, &req, sizeof(req));
-
-        constexpr auto outlen = offsetof(vhci::ioctl::plugin_hardware, port) + sizeof(req.port);
+        auto workers = query_parameter(persistent_attach_workers_value_name, 4);
+        workers = max(1UL, min(workers, min(ac.group_cnt, ULONG(MAX_WORKERS))));
 
-        WDF_MEMORY_DESCRIPTOR output;
-        WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(&output, &req, outlen);
+        _KTHREAD* threads[MAX_WORKERS - 1]{};
+        ULONG started = 0;
 
-        for (ULONG attempt = 0; true; ++attempt) {
-
-                auto cnt = get_count(devices.get<WDFCOLLECTION>(), key.get(), attempt);
-                if (!cnt) {
+        for ( ; started < workers - 1; ++started) {
+                if (!(threads[started] = start_worker(ac))) {
                         break;
                 }
+        }
 
-                if (auto secs = get_delay(attempt, cnt)) {
-                        TraceDbg("attempt #%lu, %lu device(s), sleep %lu sec.", attempt, cnt, secs);
-                        if (!sleep(ctx, secs)) {
-                                break;
-                        }
-                }
+        TraceDbg("%lu device(s), %lu host(s), %lu worker(s)", ac.device_cnt, ac.group_cnt, started + 1);
+        attach_devices(ac);
 
-                for (ULONG i = 0; i < cnt && sleep(ctx, 0); ) {
-                        UNICODE_STRING str{};
-                        if (auto s = (WDFSTRING)WdfCollectionGetItem(devices.get<WDFCOLLECTION>(), i)) {
-                                WdfStringGetUnicodeString(s, &str);
-                        }
+        for (ULONG i = 0; i < started; ++i) {
+                auto thread = threads[i];
 
-                        if (plugin_hardware(str, target.get<WDFIOTARGET>(), req, input, output, outlen)) {
-                                TraceDbg("exclude %!USTR!", &str);
-                                WdfCollectionRemoveItem(devices.get<WDFCOLLECTION>(), i);
-                                --cnt;
-                        } else {
-                                ++i;
-                        }
+                if (auto err = KeWaitForSingleObject(thread, Executive, KernelMode, false, nullptr)) {
+                        Trace(TRACE_LEVEL_ERROR, "KeWaitForSingleObject %!STATUS!", err);
                 }
+
+                ObDereferenceObject(thread);
         }
+
+        TraceDbg("done in %I64u ms", (KeQueryInterruptTime() - ac.start)/MSEC);
+        ExFreePoolWithTag(ac.groups, pooltag);
 }
 
 /*
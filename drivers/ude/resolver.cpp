@@ -0,0 +1,321 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "resolver.h"
+#include "trace.h"
+#include "resolver.tmh"
+
+#include "context.h"
+#include "driver.h"
+
+#include <libdrv\lock.h>
+#include <libdrv\wsk_cpp.h>
+
+namespace
+{
+
+using namespace usbip;
+
+enum { CACHE_SIZE = 16, STALE_TTL = 60*60 }; // seconds
+enum { MSEC = 10'000, SEC = 1000*MSEC }; // in units of 100 nanoseconds
+
+struct resolver_entry
+{
+        UNICODE_STRING node_name; // Buffer must be free-d, it is shared with service_name
+        UNICODE_STRING service_name;
+        ULONG64 time; // KeQueryInterruptTime of the resolution, zero if the entry is empty
+        address_list addrs;
+};
+
+} // namespace
+
+
+struct usbip::resolver_cache
+{
+        KSPIN_LOCK lock; // for entries
+        ULONG64 ttl; // in units of 100 nanoseconds
+        resolver_entry entries[CACHE_SIZE];
+};
+
+
+namespace
+{
+
+/*
+ * RtlEqualUnicodeString can't be called at DISPATCH_LEVEL, names are compared case-sensitively.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto equal(_In_ const UNICODE_STRING &a, _In_ const UNICODE_STRING &b)
+{
+        return a.Length == b.Length && RtlEqualMemory(a.Buffer, b.Buffer, a.Length);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto match(_In_ const resolver_entry &e, _In_ const UNICODE_STRING &node_name, _In_ const UNICODE_STRING &service_name)
+{
+        return e.time && equal(e.node_name, node_name) && equal(e.service_name, service_name);
+}
+
+/*
+ * ai_addr and ai_next point to the members of the same object.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void relink(_Inout_ address_list &v)
+{
+        for (ULONG i = 0; i < v.count; ++i) {
+                auto &ai = v.ai[i];
+                ai.ai_addr = reinterpret_cast<SOCKADDR*>(v.addr + i);
+                ai.ai_next = i + 1 < v.count ? v.ai + i + 1 : nullptr;
+        }
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void copy(_Out_ address_list &dst, _In_ const address_list &src)
+{
+        dst = src;
+        relink(dst);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void push_back(_Inout_ address_list &v, _In_ const ADDRINFOEXW &src)
+{
+        NT_ASSERT(v.count < ARRAYSIZE(v.ai));
+        NT_ASSERT(src.ai_addrlen <= sizeof(*v.addr));
+
+        v.ai[v.count] = ADDRINFOEXW{ .ai_family = src.ai_family, .ai_socktype = src.ai_socktype,
+                                     .ai_protocol = src.ai_protocol, .ai_addrlen = src.ai_addrlen };
+
+        RtlCopyMemory(v.addr + v.count, src.ai_addr, src.ai_addrlen);
+        ++v.count;
+}
+
+/*
+ * Interleave address families starting from IPv6, "First Address Family Count" is one.
+ * See: RFC 8305, 4. Sorting Addresses.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void assign(_Out_ address_list &v, _In_opt_ const ADDRINFOEXW *head)
+{
+        const ADDRINFOEXW *inet6[MAX_RESOLVED_ADDRESSES];
+        const ADDRINFOEXW *inet[MAX_RESOLVED_ADDRESSES];
+
+        ULONG cnt6 = 0;
+        ULONG cnt = 0;
+
+        for (auto ai = head; ai; ai = ai->ai_next) {
+                if (!(ai->ai_addr && ai->ai_addrlen <= sizeof(*v.addr))) {
+                        //
+                } else if (ai->ai_family == AF_INET6 && cnt6 < ARRAYSIZE(inet6)) {
+                        inet6[cnt6++] = ai;
+                } else if (ai->ai_family == AF_INET && cnt < ARRAYSIZE(inet)) {
+                        inet[cnt++] = ai;
+                }
+        }
+
+        v.count = 0;
+
+        for (ULONG i = 0; i < max(cnt6, cnt); ++i) {
+                if (i < cnt6 && v.count < ARRAYSIZE(v.ai)) {
+                        push_back(v, *inet6[i]);
+                }
+                if (i < cnt && v.count < ARRAYSIZE(v.ai)) {
+                        push_back(v, *inet[i]);
+                }
+        }
+
+        relink(v);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void clear(_Inout_ resolver_entry &e)
+{
+        if (auto buf = e.node_name.Buffer) {
+                ExFreePoolWithTag(buf, pooltag);
+        }
+
+        RtlZeroMemory(&e, sizeof(e));
+}
+
+/*
+ * @param age of the entry, in units of 100 nanoseconds
+ * @return true if the entry is found
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto lookup(
+        _Inout_ resolver_cache &c, _Out_ address_list &result, _Out_ ULONG64 &age,
+        _In_ const UNICODE_STRING &node_name, _In_ const UNICODE_STRING &service_name)
+{
+        auto now = KeQueryInterruptTime();
+        bool found = false;
+
+        Lock lck(c.lock);
+
+        for (auto &e: c.entries) {
+                if (match(e, node_name, service_name)) {
+                        copy(result, e.addrs);
+                        age = now - e.time;
+                        found = true;
+                        break;
+                }
+        }
+
+        lck.release();
+        return found;
+}
+
+/*
+ * Replace the entry with the same names, an empty or the oldest one.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void store(
+        _Inout_ resolver_cache &c, _In_ const address_list &addrs,
+        _In_ const UNICODE_STRING &node_name, _In_ const UNICODE_STRING &service_name)
+{
+        PAGED_CODE();
+
+        ULONG sz = node_name.Length + service_name.Length;
+
+        auto buf = (char*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, sz, pooltag);
+        if (!buf) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %lu bytes", sz);
+                return;
+        }
+
+        RtlCopyMemory(buf, node_name.Buffer, node_name.Length);
+        RtlCopyMemory(buf + node_name.Length, service_name.Buffer, service_name.Length);
+
+        Lock lck(c.lock);
+
+        auto e = c.entries;
+        for (auto &i: c.entries) {
+                if (match(i, node_name, service_name) || !i.time) {
+                        e = &i;
+                        break;
+                } else if (i.time < e->time) {
+                        e = &i;
+                }
+        }
+
+        auto old = e->node_name.Buffer;
+
+        e->node_name = UNICODE_STRING{ node_name.Length, node_name.Length, reinterpret_cast<WCHAR*>(buf) };
+        e->service_name = UNICODE_STRING{ service_name.Length, service_name.Length, 
+                                          reinterpret_cast<WCHAR*>(buf + node_name.Length) };
+
+        e->time = KeQueryInterruptTime();
+        copy(e->addrs, addrs);
+
+        lck.release();
+
+        if (old) {
+                ExFreePoolWithTag(old, pooltag);
+        }
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::init_resolver(_Inout_ vhci_ctx &vhci)
+{
+        PAGED_CODE();
+        NT_ASSERT(!vhci.resolver);
+
+        auto ttl = query_parameter(resolver_cache_ttl_value_name, 60);
+        if (!ttl) {
+                TraceDbg("resolver cache is disabled");
+                return STATUS_SUCCESS;
+        }
+
+        auto c = (resolver_cache*)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(*vhci.resolver), pooltag);
+        if (!c) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate resolver_cache");
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        KeInitializeSpinLock(&c->lock);
+        c->ttl = ULONG64(ttl)*SEC;
+
+        TraceDbg("ttl %lu sec.", ttl);
+        vhci.resolver = c;
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::free_resolver(_Inout_ vhci_ctx &vhci)
+{
+        PAGED_CODE();
+
+        if (auto c = vhci.resolver) {
+                for (auto &e: c->entries) {
+                        clear(e);
+                }
+                ExFreePoolWithTag(c, pooltag);
+                vhci.resolver = nullptr;
+        }
+}
+
+/*
+ * WskGetAddressInfo() can return STATUS_INTERNAL_ERROR(0xC00000E5), but after some delay it will succeed.
+ * This can happen after reboot if dnscache(?) service is not ready yet.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::resolve(
+        _Inout_ vhci_ctx &vhci, _Out_ address_list &result,
+        _In_ const UNICODE_STRING &node_name, _In_ const UNICODE_STRING &service_name)
+{
+        PAGED_CODE();
+
+        auto c = vhci.resolver;
+        ULONG64 age = 0;
+
+        auto cached = c && lookup(*c, result, age, node_name, service_name);
+
+        if (cached && age < c->ttl) {
+                TraceDbg("%!USTR!:%!USTR! -> %lu address(es), cached %I64u ms ago",
+                          &node_name, &service_name, result.count, age/MSEC);
+                return STATUS_SUCCESS;
+        }
+
+        ADDRINFOEXW hints{};
+        hints.ai_flags = AI_NUMERICSERV;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP; // zero isn't work
+
+        ADDRINFOEXW *ai{};
+
+        if (auto err = wsk::getaddrinfo(ai, const_cast<UNICODE_STRING*>(&node_name),
+                                        const_cast<UNICODE_STRING*>(&service_name), &hints)) {
+                Trace(TRACE_LEVEL_ERROR, "getaddrinfo('%!USTR!', '%!USTR!') %!STATUS!", &node_name, &service_name, err);
+
+                if (!(cached && age < ULONG64(STALE_TTL)*SEC)) {
+                        return err;
+                }
+
+                Trace(TRACE_LEVEL_WARNING, "%!USTR!:%!USTR! -> %lu address(es), use stale entry resolved %I64u sec. ago",
+                                            &node_name, &service_name, result.count, age/SEC);
+                return STATUS_SUCCESS;
+        }
+
+        assign(result, ai);
+        wsk::free(ai);
+
+        TraceDbg("%!USTR!:%!USTR! -> %lu address(es)", &node_name, &service_name, result.count);
+
+        if (!result.count) {
+                return STATUS_NOT_FOUND;
+        }
+
+        if (c) {
+                store(*c, result, node_name, service_name);
+        }
+
+        return STATUS_SUCCESS;
+}
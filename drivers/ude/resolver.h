@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <wsk.h>
+
+/*
+ * Cache of name resolution results, entries expire after Parameters\ResolverCacheTtl seconds.
+ * If WskGetAddressInfo fails, an expired entry is used if it is not older than an hour.
+ */
+
+namespace usbip
+{
+
+struct vhci_ctx;
+
+enum { MAX_RESOLVED_ADDRESSES = 8 };
+
+/*
+ * Addresses are ordered for Happy Eyeballs (RFC 8305), address families are interleaved
+ * starting from IPv6.
+ */
+struct address_list
+{
+        ADDRINFOEXW *head() { return count ? ai : nullptr; }
+
+        ULONG count;
+        ADDRINFOEXW ai[MAX_RESOLVED_ADDRESSES]; // linked by ai_next, ai_addr points to addr[]
+        SOCKADDR_INET addr[MAX_RESOLVED_ADDRESSES];
+};
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS init_resolver(_Inout_ vhci_ctx &vhci);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void free_resolver(_Inout_ vhci_ctx &vhci);
+
+/*
+ * @param result must be allocated from NonPagedPool
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS resolve(
+        _Inout_ vhci_ctx &vhci, _Out_ address_list &result,
+        _In_ const UNICODE_STRING &node_name, _In_ const UNICODE_STRING &service_name);
+
+} // namespace usbip
@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "statistics.h"
+#include "trace.h"
+#include "statistics.tmh"
+
+#include "urbtransfer.h"
+
+#include <libdrv\lock.h>
+#include <libdrv\usbd_helper.h>
+
+namespace
+{
+
+using namespace usbip;
+
+inline void add(_Inout_ UINT64 &counter, _In_ UINT64 value)
+{
+        static_assert(sizeof(counter) == sizeof(LONG64));
+        InterlockedAdd64(reinterpret_cast<LONG64*>(&counter), value);
+}
+
+inline auto add(_Inout_ UINT32 &counter, _In_ LONG value)
+{
+        static_assert(sizeof(counter) == sizeof(LONG));
+        return UINT32(InterlockedAdd(reinterpret_cast<LONG*>(&counter), value));
+}
+
+void update_max(_Inout_ UINT32 &max, _In_ UINT32 value)
+{
+        auto target = reinterpret_cast<LONG*>(&max);
+
+        for (auto cur = *target; value > UINT32(cur); ) {
+                auto prev = InterlockedCompareExchange(target, value, cur);
+                if (prev == cur) {
+                        break;
+                }
+                cur = prev;
+        }
+}
+
+/*
+ * Error slots are claimed in order and never released, the rest of statuses are counted by errors only.
+ */
+void add_error(_Inout_ vhci::transfer_statistics &st, _In_ USBD_STATUS urb_st)
+{
+        add(st.errors, 1);
+
+        if (!USBD_ERROR(urb_st)) {
+                return;
+        }
+
+        for (auto &i: st.error_status) {
+                if (auto prev = InterlockedCompareExchange(&i.status, urb_st, USBD_STATUS_SUCCESS); 
+                    prev == USBD_STATUS_SUCCESS || prev == urb_st) {
+                        add(i.count, 1);
+                        break;
+                }
+        }
+}
+
+/*
+ * @param rtt round-trip time in microseconds
+ */
+auto get_latency_bucket(_In_ ULONG64 rtt)
+{
+        ULONG idx;
+        return _BitScanReverse64(&idx, rtt) ? min(idx, ULONG(vhci::STATISTICS_LATENCY_BUCKETS - 1)) : 0;
+}
+
+/*
+ * TransferBufferLength of IN transfer is actual length, except isoch.
+ */
+auto get_transferred(_In_ URB &urb, _In_ bool dir_in)
+{
+        auto tr = TryAsUrbTransfer(&urb);
+        if (!tr) {
+                return 0UL;
+        }
+
+        if (!(dir_in && is_isoch(urb))) {
+                return tr->TransferBufferLength;
+        }
+
+        auto &r = urb.UrbIsochronousTransfer;
+        ULONG total = 0;
+
+        for (ULONG i = 0; i < r.NumberOfPackets; ++i) {
+                total += r.IsoPacket[i].Length;
+        }
+
+        return total;
+}
+
+auto& get_endpoint(_In_ WDFREQUEST request)
+{
+        auto &req = *get_request_ctx(request);
+        NT_ASSERT(req.endpoint);
+        return *get_endpoint_ctx(req.endpoint);
+}
+
+void copy(_Out_ vhci::endpoint_statistics &dst, _In_ const endpoint_ctx &endp)
+{
+        static_cast<vhci::transfer_statistics&>(dst) = endp.stats;
+
+        dst.address = endp.descriptor.bEndpointAddress;
+        dst.type = static_cast<UINT8>(usb_endpoint_type(endp.descriptor));
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::stat_submit(_In_ WDFREQUEST request)
+{
+        auto &endp = get_endpoint(request);
+        auto &dev = *get_device_ctx(endp.device);
+
+        vhci::transfer_statistics *v[] { &endp.stats, &dev.stats };
+        for (auto st: v) {
+                add(st->submitted, 1);
+                auto cnt = add(st->inflight, 1);
+                update_max(st->max_inflight, cnt);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::stat_unlink(_In_ WDFREQUEST request)
+{
+        auto &endp = get_endpoint(request);
+        auto &dev = *get_device_ctx(endp.device);
+
+        vhci::transfer_statistics *v[] { &endp.stats, &dev.stats };
+        for (auto st: v) {
+                add(st->unlinks, 1);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::stat_complete(_In_ WDFREQUEST request, _In_ NTSTATUS status, _In_ USBD_STATUS urb_st, _In_opt_ URB *urb)
+{
+        auto &req = *get_request_ctx(request);
+        auto &endp = get_endpoint(request);
+        auto &dev = *get_device_ctx(endp.device);
+
+        auto rtt = (KeQueryInterruptTime() - req.submit_time)/10; // 100-nanosecond units to microseconds
+        auto bucket = get_latency_bucket(rtt);
+
+        auto failed = !NT_SUCCESS(status) || USBD_ERROR(urb_st);
+        auto dir_in = extract_dir(req.seqnum) == USBIP_DIR_IN;
+        auto bytes = urb && !failed ? get_transferred(*urb, dir_in) : 0;
+
+        vhci::transfer_statistics *v[] { &endp.stats, &dev.stats };
+        for (auto st: v) {
+                add(st->completed, 1);
+                add(st->inflight, -1);
+                add(st->latency[bucket], 1);
+
+                if (failed) {
+                        add_error(*st, urb_st);
+                } else if (bytes) {
+                        add(dir_in ? st->bytes_in : st->bytes_out, bytes);
+                }
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG usbip::get_endpoint_statistics(
+        _In_ device_ctx &dev, _Out_writes_(max_cnt) vhci::endpoint_statistics *v, _In_ ULONG max_cnt)
+{
+        if (!max_cnt) {
+                return 0;
+        }
+
+        auto &ep0 = *get_endpoint_ctx(dev.ep0);
+        copy(v[0], ep0);
+
+        ULONG cnt = 1;
+        auto head = &ep0.entry; // @see endpoint_list.cpp
+
+        Lock lck(dev.endpoint_list_lock);
+
+        for (auto entry = head->Flink; entry != head && cnt < max_cnt; entry = entry->Flink) {
+                auto endp = CONTAINING_RECORD(entry, endpoint_ctx, entry);
+                copy(v[cnt++], *endp);
+        }
+
+        lck.release(); // explicit call to satisfy code analyzer and get rid of warning C28166
+        return cnt;
+}
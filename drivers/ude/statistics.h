@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "context.h"
+
+/*
+ * Per-device and per-endpoint URB counters, @see vhci::ioctl::get_device_statistics.
+ * Counters are updated with interlocked operations and can be read without synchronization.
+ */
+
+namespace usbip
+{
+
+/*
+ * CMD_SUBMIT is about to be sent, request_ctx must be initialized.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void stat_submit(_In_ WDFREQUEST request);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void stat_unlink(_In_ WDFREQUEST request);
+
+/*
+ * @param urb_st USBD_STATUS_SUCCESS if request does not have URB
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void stat_complete(_In_ WDFREQUEST request, _In_ NTSTATUS status, _In_ USBD_STATUS urb_st, _In_opt_ URB *urb);
+
+/*
+ * @return number of copied items, default control pipe is the first one
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG get_endpoint_statistics(
+        _In_ device_ctx &dev, _Out_writes_(max_cnt) vhci::endpoint_statistics *v, _In_ ULONG max_cnt);
+
+} // namespace usbip
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "urb_trace.h"
+#include "trace.h"
+#include "urb_trace.tmh"
+
+#include "driver.h"
+#include "urbtransfer.h"
+
+#include <libdrv\ch9.h>
+
+namespace
+{
+
+using namespace usbip;
+
+enum { URB_TRACE_RECORDS = 4096 }; // must be a power of two
+static_assert(!(URB_TRACE_RECORDS & (URB_TRACE_RECORDS - 1)));
+
+struct urb_trace_slot
+{
+        LONG64 seq; // index of the record plus one, zero while it is being written
+        vhci::urb_trace_record rec;
+};
+
+} // namespace
+
+
+/*
+ * Indexes grow monotonically, a slot is slots[index % URB_TRACE_RECORDS].
+ */
+struct usbip::urb_trace
+{
+        LONG64 head; // index of the next record to write
+        LONG64 tail; // index of the next record to read
+        volatile bool enabled;
+        urb_trace_slot slots[URB_TRACE_RECORDS];
+};
+
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::trace_urb(_In_ WDFREQUEST request, _In_ NTSTATUS status, _In_ USBD_STATUS urb_st, _In_opt_ URB *urb)
+{
+        auto &req = *get_request_ctx(request);
+        auto &endp = *get_endpoint_ctx(req.endpoint);
+
+        auto t = get_device_ctx(endp.device)->trace;
+        if (!(t && t->enabled)) {
+                return;
+        }
+
+        auto idx = InterlockedIncrement64(&t->head) - 1;
+        auto &slot = t->slots[idx & (URB_TRACE_RECORDS - 1)];
+
+        InterlockedExchange64(&slot.seq, 0); // the reader must not take a partially written record
+
+        auto tr = urb ? TryAsUrbTransfer(urb) : nullptr;
+
+        slot.rec = vhci::urb_trace_record {
+                .seqnum = req.seqnum,
+                .length = tr ? tr->TransferBufferLength : 0,
+                .status = status,
+                .urb_status = urb_st,
+                .endpoint = endp.descriptor.bEndpointAddress,
+                .type = static_cast<UINT8>(usb_endpoint_type(endp.descriptor)),
+                .submit_time = req.submit_time,
+                .send_time = req.send_time,
+                .recv_time = req.recv_time,
+                .complete_time = KeQueryInterruptTime(),
+        };
+
+        WriteRelease64(&slot.seq, idx + 1);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::enable_urb_trace(_Inout_ device_ctx &dev, _In_ bool enable)
+{
+        PAGED_CODE();
+
+        if (!dev.trace) {
+                if (!enable) {
+                        return STATUS_SUCCESS;
+                }
+
+                auto t = (urb_trace*)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(*t), pooltag);
+                if (!t) {
+                        Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", sizeof(*t));
+                        return STATUS_INSUFFICIENT_RESOURCES;
+                }
+
+                InterlockedExchangePointer(reinterpret_cast<void**>(&dev.trace), t);
+        }
+
+        dev.trace->enabled = enable;
+
+        TraceDbg("dev %04x, enable %d", ptr04x(get_device(&dev)), enable);
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG usbip::read_urb_trace(
+        _Inout_ device_ctx &dev, _Out_writes_(max_cnt) vhci::urb_trace_record *v, _In_ ULONG max_cnt,
+        _Out_ UINT32 &dropped)
+{
+        dropped = 0;
+
+        auto t = dev.trace;
+        if (!t) {
+                return 0;
+        }
+
+        auto head = ReadAcquire64(&t->head);
+        auto &tail = t->tail;
+
+        if (auto cnt = head - tail; cnt > URB_TRACE_RECORDS) {
+                dropped = static_cast<UINT32>(cnt - URB_TRACE_RECORDS);
+                tail = head - URB_TRACE_RECORDS;
+        }
+
+        ULONG cnt = 0;
+
+        for ( ; tail < head && cnt < max_cnt; ++tail) {
+                auto &slot = t->slots[tail & (URB_TRACE_RECORDS - 1)];
+
+                auto seq = ReadAcquire64(&slot.seq);
+                if (seq < tail + 1) { // is not written yet
+                        break;
+                } else if (seq > tail + 1) { // overwritten
+                        ++dropped;
+                        continue;
+                }
+
+                v[cnt] = slot.rec;
+                KeMemoryBarrier();
+
+                if (ReadAcquire64(&slot.seq) == seq) {
+                        ++cnt;
+                } else { // was overwritten while copying
+                        ++dropped;
+                }
+        }
+
+        return cnt;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::free_urb_trace(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        if (auto &t = dev.trace) {
+                ExFreePoolWithTag(t, pooltag);
+                t = nullptr;
+        }
+}
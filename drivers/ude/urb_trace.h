@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "context.h"
+
+/*
+ * Per-device ring buffer of vhci::urb_trace_record, @see vhci::ioctl::set_urb_trace.
+ * Writers are lock-free, there is the only reader because IOCTLs of vhci are serialized.
+ */
+
+namespace usbip
+{
+
+/*
+ * Record completed request if the trace is enabled.
+ * @param urb_st USBD_STATUS_SUCCESS if request does not have URB
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void trace_urb(_In_ WDFREQUEST request, _In_ NTSTATUS status, _In_ USBD_STATUS urb_st, _In_opt_ URB *urb);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS enable_urb_trace(_Inout_ device_ctx &dev, _In_ bool enable);
+
+/*
+ * @param dropped records that were overwritten or torn
+ * @return number of copied records
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG read_urb_trace(
+        _Inout_ device_ctx &dev, _Out_writes_(max_cnt) vhci::urb_trace_record *v, _In_ ULONG max_cnt,
+        _Out_ UINT32 &dropped);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void free_urb_trace(_Inout_ device_ctx &dev);
+
+} // namespace usbip
@@ -10,6 +10,7 @@
 #include "vhci_ioctl.h"
 #include "context.h"
 #include "persistent.h"
+#include "resolver.h"
 
 #include <libdrv/lock.h>
 
@@ -27,6 +28,78 @@ namespace
 
 using namespace usbip;
 
+/*
+ * Root-enumerated devices of the driver, @see vhci_ctx::index.
+ * The lock does not need initialization, KeInitializeSpinLock just zeroes it.
+ */
+struct
+{
+        KSPIN_LOCK lock;
+        WDFDEVICE devices[MAX_VHCI];
+} instances;
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto register_instance(_In_ WDFDEVICE vhci)
+{
+        auto &ctx = *get_vhci_ctx(vhci);
+        ctx.index = -1;
+
+        Lock lck(instances.lock);
+
+        for (int i = 0; i < ARRAYSIZE(instances.devices); ++i) {
+                if (auto &dev = instances.devices[i]; !dev) {
+                        dev = vhci;
+                        ctx.index = i;
+                        break;
+                }
+        }
+
+        lck.release();
+
+        if (ctx.index < 0) {
+                Trace(TRACE_LEVEL_ERROR, "vhci %04x, all %d instances are registered", ptr04x(vhci), MAX_VHCI);
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        TraceDbg("vhci %04x, index %d", ptr04x(vhci), ctx.index);
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void unregister_instance(_In_ WDFDEVICE vhci)
+{
+        auto &ctx = *get_vhci_ctx(vhci);
+        if (ctx.index < 0) {
+                return;
+        }
+
+        Lock lck(instances.lock);
+
+        if (auto &dev = instances.devices[ctx.index]; dev == vhci) {
+                dev = WDF_NO_HANDLE;
+        }
+
+        lck.release();
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_instance(_In_ int index)
+{
+        NT_ASSERT(index >= 0 && index < MAX_VHCI);
+        wdf::ObjectRef vhci;
+
+        Lock lck(instances.lock);
+        if (auto dev = instances.devices[index]) {
+                vhci.reset(dev); // adds reference
+        }
+        lck.release();
+
+        return vhci;
+}
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 void attach_thread_join(_In_ WDFDEVICE vhci)
@@ -64,6 +137,9 @@ PAGED void vhci_cleanup(_In_ WDFOBJECT Object)
         
         attach_thread_join(vhci);
         vhci::destroy_all_devices(vhci);
+        unregister_instance(vhci);
+
+        free_resolver(*get_vhci_ctx(vhci));
 }
 
 using init_func_t = NTSTATUS(WDFDEVICE);
@@ -79,7 +155,11 @@ PAGED auto init_context(_In_ WDFDEVICE vhci)
         KeInitializeSpinLock(&ctx.lock);
         KeInitializeEvent(&ctx.attach_thread_stop, NotificationEvent, false);
 
-        return STATUS_SUCCESS;
+        if (auto err = register_instance(vhci)) {
+                return err;
+        }
+
+        return init_resolver(ctx);
 }
 
 _Function_class_(init_func_t)
@@ -294,7 +374,8 @@ PAGED auto create_vhci(_Out_ WDFDEVICE &vhci, _In_ WDFDEVICE_INIT *init)
         }
 
         init_func_t* const functions[] { init_context, configure, create_interfaces, 
-                                         add_usbdevice_emulation, vhci::create_default_queue };
+                                         add_usbdevice_emulation, vhci::create_default_queue, 
+                                         vhci::create_batch_queue };
 
         for (auto f: functions) {
                 if (auto err = f(vhci)) {
@@ -322,46 +403,70 @@ auto get_port_range(_In_ usb_device_speed speed)
         return r;
 }
 
+/*
+ * A port is found and claimed by setting its bit.
+ * @return zero-based index of the roothub port or -1 if all ports for the speed are claimed
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+int claim_free_port(_Inout_ vhci_ctx &ctx, _In_ usb_device_speed speed)
+{
+        auto [begin, end] = get_port_range(speed);
+
+        for (auto i = begin; i < end; ++i) {
+                if (!(BitTest(ctx.claimed, i) || InterlockedBitTestAndSet(ctx.claimed, i))) {
+                        return i;
+                }
+        }
+
+        return -1;
+}
+
 } // namespace
 
 
 /*
- * usb2.0 devices don't work in usb3.x ports, and visa versa, tested.
+ * The port was claimed by select_instance, the lock is acquired only to publish the device.
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-int usbip::vhci::claim_roothub_port(_In_ UDECXUSBDEVICE dev)
+void usbip::vhci::assign_roothub_port(_In_ UDECXUSBDEVICE dev, _In_ int port)
 {
         auto &dev_ctx = *get_device_ctx(dev);
 
         auto vhci = dev_ctx.vhci;
         auto &vhci_ctx = *get_vhci_ctx(vhci); 
 
-        auto &port = dev_ctx.port;
-        NT_ASSERT(!port);
+        NT_ASSERT(!dev_ctx.port);
+        NT_ASSERT(is_valid_port(port));
+        NT_ASSERT(get_vhci_index(port) == vhci_ctx.index);
 
-        auto [begin, end] = get_port_range(dev_ctx.speed());
+        auto i = get_roothub_port(port) - 1;
+        NT_ASSERT(BitTest(vhci_ctx.claimed, i));
+
+        WdfObjectReference(dev);
 
         Lock lck(vhci_ctx.lock); // function must be resident, do not use PAGED
+        NT_ASSERT(!vhci_ctx.devices[i]);
+        vhci_ctx.devices[i] = dev;
+        dev_ctx.port = port;
+        lck.release();
 
-        for (auto i = begin; i < end; ++i) {
-                NT_ASSERT(i < ARRAYSIZE(vhci_ctx.devices));
-                auto &handle = vhci_ctx.devices[i];
-                if (!handle) {
-                        WdfObjectReference(handle = dev);
-                        port = i + 1;
-                        NT_ASSERT(is_valid_port(port));
-                        break;
-                }
-        }
+        TraceDbg("dev %04x, port %d", ptr04x(dev), port);
+}
 
-        lck.release();
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::vhci::release_roothub_port(_In_ WDFDEVICE vhci, _In_ int port)
+{
+        auto &ctx = *get_vhci_ctx(vhci);
+        NT_ASSERT(get_vhci_index(port) == ctx.index);
 
-        if (port) {
-                TraceDbg("dev %04x, port %d", ptr04x(dev), port);
-        }
+        auto i = get_roothub_port(port) - 1;
+        NT_ASSERT(!ctx.devices[i]);
 
-        return port;
+        NT_VERIFY(InterlockedBitTestAndReset(ctx.claimed, i));
+        TraceDbg("port %d", port);
 }
 
 _IRQL_requires_same_
@@ -375,15 +480,14 @@ void usbip::vhci::reclaim_roothub_port(_In_ UDECXUSBDEVICE dev)
 
         auto &port = dev_ctx.port;
         int old_port = 0;
-        bool removed = false;
 
         Lock lck(vhci_ctx.lock); 
         if (port) {
                 old_port = port;
-                removed = true;
 
                 NT_ASSERT(is_valid_port(port));
-                auto &handle = vhci_ctx.devices[port - 1];
+                NT_ASSERT(get_vhci_index(port) == vhci_ctx.index);
+                auto &handle = vhci_ctx.devices[get_roothub_port(port) - 1];
 
                 NT_ASSERT(handle == dev);
                 handle = WDF_NO_HANDLE;
@@ -393,25 +497,63 @@ void usbip::vhci::reclaim_roothub_port(_In_ UDECXUSBDEVICE dev)
         }
         lck.release(); // explicit call to satisfy code analyzer and get rid of warning C28166
 
-        if (removed) {
+        if (old_port) {
+                NT_VERIFY(InterlockedBitTestAndReset(vhci_ctx.claimed, get_roothub_port(old_port) - 1));
                 TraceDbg("dev %04x, port %ld", ptr04x(dev), old_port);
                 WdfObjectDereference(dev);
         }
 }
 
+/*
+ * usb2.0 devices don't work in usb3.x ports, and visa versa, tested.
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-wdf::ObjectRef usbip::vhci::find_device(_In_ WDFDEVICE vhci, _In_ int port)
+wdf::ObjectRef usbip::vhci::select_instance(_In_ usb_device_speed speed, _Out_ int &port)
+{
+        port = 0;
+
+        for (int i = 0; i < MAX_VHCI; ++i) {
+                auto vhci = get_instance(i);
+                if (!vhci) {
+                        continue;
+                }
+
+                auto &ctx = *get_vhci_ctx(vhci.get<WDFDEVICE>());
+
+                if (auto idx = claim_free_port(ctx, speed); idx >= 0) {
+                        port = make_port(ctx.index, idx + 1);
+                        NT_ASSERT(is_valid_port(port));
+                        return vhci;
+                }
+        }
+
+        return wdf::ObjectRef();
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+wdf::ObjectRef usbip::vhci::find_device(_In_ int port)
 {
         wdf::ObjectRef dev;
         if (!is_valid_port(port)) {
                 return dev;
         }
 
-        auto &ctx = *get_vhci_ctx(vhci);
+        auto vhci = get_instance(get_vhci_index(port));
+        if (!vhci) {
+                return dev;
+        }
+
+        auto &ctx = *get_vhci_ctx(vhci.get<WDFDEVICE>());
+        auto i = get_roothub_port(port) - 1;
+
+        if (!BitTest(ctx.claimed, i)) { // free port
+                return dev;
+        }
 
         Lock lck(ctx.lock); 
-        if (auto handle = ctx.devices[port - 1]) {
+        if (auto handle = ctx.devices[i]) {
                 NT_ASSERT(get_device_ctx(handle)->port == port);
                 dev.reset(handle); // adds reference
         }
@@ -424,11 +566,25 @@ wdf::ObjectRef usbip::vhci::find_device(_In_ WDFDEVICE vhci, _In_ int port)
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED void usbip::vhci::destroy_all_devices(_In_ WDFDEVICE vhci)
+{
+        PAGED_CODE();
+        auto index = get_vhci_ctx(vhci)->index;
+
+        for (int i = 1; index >= 0 && i <= ARRAYSIZE(vhci_ctx::devices); ++i) {
+                if (auto dev = find_device(make_port(index, i))) {
+                        device::plugout_and_delete(dev.get<UDECXUSBDEVICE>());
+                }
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::vhci::destroy_all_devices()
 {
         PAGED_CODE();
 
-        for (int port = 1; port <= ARRAYSIZE(vhci_ctx::devices); ++port) {
-                if (auto dev = find_device(vhci, port)) {
+        for (int port = 1; port <= MAX_PORTS; ++port) {
+                if (auto dev = find_device(port)) {
                         device::plugout_and_delete(dev.get<UDECXUSBDEVICE>());
                 }
         }
@@ -457,7 +613,7 @@ PAGED NTSTATUS usbip::DeviceAdd(_In_ WDFDRIVER, _Inout_ WDFDEVICE_INIT *init)
 
         Trace(TRACE_LEVEL_INFORMATION, "vhci %04x", ptr04x(vhci));
         
-        if (auto ctx = get_vhci_ctx(vhci)) {
+        if (auto ctx = get_vhci_ctx(vhci); !ctx->index) { // other instances only add ports
                 plugin_persistent_devices(ctx);
         }
 
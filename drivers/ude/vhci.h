@@ -11,6 +11,8 @@
 #include <wdfusb.h>
 #include <UdeCx.h>
 
+#include <usbip\ch9.h>
+
 namespace usbip
 {
 
@@ -25,13 +27,35 @@ PAGED NTSTATUS DeviceAdd(_In_ WDFDRIVER, _Inout_ WDFDEVICE_INIT *init);
 namespace usbip::vhci
 {
 
+/*
+ * Claim a free roothub port for the speed on the first vhci instance that has one.
+ * @param port claimed port, it must be passed to assign_roothub_port or release_roothub_port
+ * @return vhci instance of the port
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+wdf::ObjectRef select_instance(_In_ usb_device_speed speed, _Out_ int &port);
+
+/*
+ * @param port claimed by select_instance, dev must be created on its vhci instance
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void assign_roothub_port(_In_ UDECXUSBDEVICE dev, _In_ int port);
+
+/*
+ * Release the port claimed by select_instance that was not assigned to a device.
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-int claim_roothub_port(_In_ UDECXUSBDEVICE dev);
+void release_roothub_port(_In_ WDFDEVICE vhci, _In_ int port);
 
+/*
+ * @param port of any vhci instance
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-wdf::ObjectRef find_device(_In_ WDFDEVICE vhci, _In_ int port);
+wdf::ObjectRef find_device(_In_ int port);
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -41,4 +65,11 @@ _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED void destroy_all_devices(_In_ WDFDEVICE vhci);
 
+/*
+ * Of all vhci instances.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void destroy_all_devices();
+
 } // namespace usbip::vhci
@@ -12,6 +12,13 @@
 #include "network.h"
 #include "ioctl.h"
 #include "persistent.h"
+#include "wsk_receive.h"
+#include "statistics.h"
+#include "frame_clock.h"
+#include "urb_trace.h"
+#include "resolver.h"
+#include "driver.h"
+#include "descriptor_cache.h"
 
 #include <usbip\proto_op.h>
 #include <resources\messages.h>
@@ -152,22 +159,9 @@ PAGED auto import_remote_device(_Inout_ device_ctx_ext &ext)
                 d->product = udev.idProduct;
         }
 
-        return 0UL;
-}
-
-_IRQL_requires_same_
-_IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto getaddrinfo(_Out_ ADDRINFOEXW* &result, _In_ device_ctx_ext &ext)
-{
-        PAGED_CODE();
-
-        ADDRINFOEXW hints{};
-        hints.ai_flags = AI_NUMERICSERV;
-        hints.ai_family = AF_UNSPEC;
-        hints.ai_socktype = SOCK_STREAM;
-        hints.ai_protocol = IPPROTO_TCP; // zero isn't work
+        ext.bcdDevice = udev.bcdDevice;
 
-        return wsk::getaddrinfo(result, &ext.node_name, &ext.service_name, &hints);
+        return 0UL;
 }
 
 /*
@@ -215,9 +209,12 @@ PAGED auto set_options(wsk::SOCKET *sock)
         return ok ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
 }
 
+/*
+ * Called for each socket of connect_race before WskConnect.
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto try_connect(wsk::SOCKET *sock, const ADDRINFOEXW &ai, void*)
+PAGED NTSTATUS prepare_socket(wsk::SOCKET *sock, const ADDRINFOEXW &ai, void*)
 {
         PAGED_CODE();
 
@@ -227,56 +224,69 @@ PAGED auto try_connect(wsk::SOCKET *sock, const ADDRINFOEXW &ai, void*)
 
         SOCKADDR_INET any{ static_cast<ADDRESS_FAMILY>(ai.ai_family) }; // see INADDR_ANY, IN6ADDR_ANY_INIT
 
-        if (auto err = bind(sock, reinterpret_cast<SOCKADDR*>(&any))) {
-                Trace(TRACE_LEVEL_ERROR, "bind %!STATUS!", err);
-                return err;
-        }
-
-        auto err = connect(sock, ai.ai_addr);
+        auto err = bind(sock, reinterpret_cast<SOCKADDR*>(&any));
         if (err) {
-                Trace(TRACE_LEVEL_ERROR, "WskConnect %!STATUS!", err);
+                Trace(TRACE_LEVEL_ERROR, "bind %!STATUS!", err);
         }
         return err;
 }
 
+/*
+ * Addresses are connected in parallel (Happy Eyeballs), so a blackholed address
+ * does not delay connection via other ones for the whole TCP connect timeout.
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto connect(_Inout_ device_ctx_ext &ext)
+PAGED auto connect(_Inout_ device_ctx_ext &ext, _In_ WDFDEVICE vhci)
 {
         PAGED_CODE();
 
-        ADDRINFOEXW *ai{};
-        if (auto err = getaddrinfo(ai, ext)) {
-                Trace(TRACE_LEVEL_ERROR, "getaddrinfo %!STATUS!", err);
+        auto start = KeQueryInterruptTime();
+
+        auto addrs = (address_list*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, sizeof(address_list), pooltag);
+        if (!addrs) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate address_list");
+                return ERROR_USBIP_GENERAL;
+        }
+
+        if (auto err = resolve(*get_vhci_ctx(vhci), *addrs, ext.node_name, ext.service_name)) {
+                ExFreePoolWithTag(addrs, pooltag);
                 return ERROR_USBIP_ADDRINFO;
         }
 
+        static const WSK_CLIENT_CONNECTION_DISPATCH dispatch{ WskReceiveEvent }; // enabled for receive_mode::event only
+        auto delay = query_parameter(connection_attempt_delay_value_name, 250); // RFC 8305 recommends 250 ms
+
         NT_ASSERT(!ext.sock);
-        ext.sock = wsk::for_each(WSK_FLAG_CONNECTION_SOCKET, &ext, nullptr, ai, try_connect, nullptr);
+        const ADDRINFOEXW *ai{};
+
+        ext.sock = wsk::connect_race(WSK_FLAG_CONNECTION_SOCKET, &ext, &dispatch, addrs->head(), prepare_socket, nullptr, 
+                                     delay, &ai);
+
+        ext.dev.connect_time = static_cast<UINT32>((KeQueryInterruptTime() - start)/10'000); // to milliseconds
 
-        wsk::free(ai);
+        if (ai) {
+                TraceDbg("%!USTR!:%!USTR!, address %!BIN!, %lu address(es), %u ms", &ext.node_name, &ext.service_name, 
+                          WppBinary(ai->ai_addr, static_cast<USHORT>(ai->ai_addrlen)), addrs->count, ext.dev.connect_time);
+        }
+
+        ExFreePoolWithTag(addrs, pooltag);
         return ext.sock ? 0U : ERROR_USBIP_CONNECT;
 }
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto plugin(_Out_ int &port, _In_ UDECXUSBDEVICE dev)
+PAGED auto plugin(_In_ int port, _In_ UDECXUSBDEVICE dev)
 {
         PAGED_CODE();
 
-        port = vhci::claim_roothub_port(dev);
-        if (!port) {
-                Trace(TRACE_LEVEL_ERROR, "All roothub ports are occupied");
-                return ERROR_USBIP_PORTFULL;
-        }
-
         auto speed = get_device_ctx(dev)->speed();
 
         UDECX_USB_DEVICE_PLUG_IN_OPTIONS options; 
         UDECX_USB_DEVICE_PLUG_IN_OPTIONS_INIT(&options);
 
         auto &portnum = speed < USB_SPEED_SUPER ? options.Usb20PortNumber : options.Usb30PortNumber;
-        portnum = port;
+        portnum = get_roothub_port(port);
 
         if (auto err = UdecxUsbDevicePlugIn(dev, &options)) {
                 Trace(TRACE_LEVEL_ERROR, "UdecxUsbDevicePlugIn %!STATUS!", err);
@@ -304,16 +314,24 @@ struct device_ctx_ext_ptr
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto start_device(_Out_ int &port, _In_ UDECXUSBDEVICE device)
+PAGED auto start_device(_In_ int port, _In_ UDECXUSBDEVICE device)
 {
         PAGED_CODE();
+        auto &dev = *get_device_ctx(device);
+
+        if (dev.recv_mode == receive_mode::event) { // the server does not send anything before the first CMD_SUBMIT
+                if (auto err = wsk::event_callback_control(dev.sock(), WSK_EVENT_RECEIVE, false)) {
+                        Trace(TRACE_LEVEL_ERROR, "event_callback_control %!STATUS!", err);
+                        return ERROR_USBIP_GENERAL;
+                }
+        }
 
         if (auto err = plugin(port, device)) {
                 return err;
         }
 
-        if (auto dev = get_device_ctx(device)) {
-                sched_receive_usbip_header(*dev);
+        if (dev.recv_mode != receive_mode::event) {
+                sched_receive_usbip_header(dev);
         }
 
         return 0UL;
@@ -329,12 +347,14 @@ PAGED auto plugin_hardware(_In_ WDFDEVICE vhci, _Inout_ vhci::ioctl::plugin_hard
         auto &port = r.port;
         r.port = 0;
 
+        auto start = KeQueryInterruptTime();
+
         device_ctx_ext_ptr ext;
         if (NT_ERROR(create_device_ctx_ext(ext.ptr, r))) {
                 return ERROR_USBIP_GENERAL;
         }
 
-        if (auto err = connect(*ext.ptr)) {
+        if (auto err = connect(*ext.ptr, vhci)) {
                 Trace(TRACE_LEVEL_ERROR, "Can't connect to %!USTR!:%!USTR!", &ext->node_name, &ext->service_name);
                 return err;
         }
@@ -345,17 +365,31 @@ PAGED auto plugin_hardware(_In_ WDFDEVICE vhci, _Inout_ vhci::ioctl::plugin_hard
                 return err;
         }
 
+        ext->dev.attach_time = static_cast<UINT32>((KeQueryInterruptTime() - start)/10'000); // to milliseconds
+
+        int claimed;
+        auto hci = vhci::select_instance(ext->dev.speed, claimed); // can differ from vhci
+        if (!hci) {
+                Trace(TRACE_LEVEL_ERROR, "All roothub ports are occupied");
+                return ERROR_USBIP_PORTFULL;
+        }
+
         UDECXUSBDEVICE dev;
-        if (NT_ERROR(device::create(dev, vhci, ext.ptr))) {
+        if (NT_ERROR(device::create(dev, hci.get<WDFDEVICE>(), ext.ptr))) {
+                vhci::release_roothub_port(hci.get<WDFDEVICE>(), claimed);
                 return ERROR_USBIP_GENERAL;
         }
         ext.release(); // now dev owns it
 
-        if (auto err = start_device(port, dev)) {
+        vhci::assign_roothub_port(dev, claimed); // device_cleanup reclaims it
+
+        if (auto err = start_device(claimed, dev)) {
                 WdfObjectDelete(dev); // UdecxUsbDevicePlugIn failed or was not called
                 return err;
         }
 
+        port = claimed;
+
         Trace(TRACE_LEVEL_INFORMATION, "dev %04x -> port %d", ptr04x(dev), port);
         return 0UL;
 }
@@ -390,6 +424,214 @@ PAGED auto plugin_hardware(_In_ WDFREQUEST request)
         return STATUS_SUCCESS;
 }
 
+enum { MAX_BATCH_WORKERS = 8 };
+
+/*
+ * Context space of PLUGIN_HARDWARE_BATCH request.
+ */
+struct plugin_batch_context
+{
+        WDFDEVICE vhci;
+        vhci::ioctl::plugin_hardware_batch *r; // request's buffer
+
+        LONG next; // index of the next device to attach
+        LONG workers; // and the dispatch routine, the last one unmarks the request cancelable
+        LONG refcnt; // one for all workers and one for the cancel routine, the last one completes the request
+        LONG canceled;
+};
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(plugin_batch_context, get_plugin_batch_ctx)
+
+inline auto get_request(_In_ plugin_batch_context *ctx)
+{
+        NT_ASSERT(ctx);
+        return static_cast<WDFREQUEST>(WdfObjectContextGetObject(ctx));
+}
+
+/*
+ * Devices that are being attached are not interrupted, the remaining ones are skipped.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void plugin_batch(_Inout_ plugin_batch_context &ctx)
+{
+        PAGED_CODE();
+
+        for (ULONG i; (i = ULONG(InterlockedIncrement(&ctx.next)) - 1) < ctx.r->count; ) {
+                if (ReadAcquire(&ctx.canceled)) {
+                        break;
+                }
+
+                auto &d = ctx.r->devices[i];
+
+                vhci::ioctl::plugin_hardware req;
+                req.size = sizeof(req);
+                static_cast<vhci::imported_device_location&>(req) = d;
+
+                d.error = plugin_hardware(ctx.vhci, req);
+                d.port = req.port;
+        }
+}
+
+/*
+ * The last one completes the request.
+ * Devices attached before cancellation remain attached, output buffer is not returned in that case.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void release(_Inout_ plugin_batch_context &ctx)
+{
+        if (InterlockedDecrement(&ctx.refcnt)) {
+                return;
+        }
+
+        auto request = get_request(&ctx);
+        auto st = ReadAcquire(&ctx.canceled) ? STATUS_CANCELLED : STATUS_SUCCESS;
+
+        if (NT_SUCCESS(st)) {
+                WdfRequestSetInformation(request, ctx.r->size);
+        }
+
+        TraceDbg("req %04x %!STATUS!", ptr04x(request), st);
+        WdfRequestComplete(request, st);
+}
+
+_Function_class_(EVT_WDF_REQUEST_CANCEL)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void NTAPI plugin_batch_cancel(_In_ WDFREQUEST request)
+{
+        auto &ctx = *get_plugin_batch_ctx(request);
+        TraceDbg("req %04x", ptr04x(request));
+
+        InterlockedExchange(&ctx.canceled, true);
+        release(ctx);
+}
+
+/*
+ * If WdfRequestUnmarkCancelable fails, the cancel routine is running or will be called, 
+ * it releases its own reference.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void release_worker(_Inout_ plugin_batch_context &ctx)
+{
+        PAGED_CODE();
+
+        if (InterlockedDecrement(&ctx.workers)) {
+                return;
+        }
+
+        if (auto err = WdfRequestUnmarkCancelable(get_request(&ctx))) {
+                NT_ASSERT(err == STATUS_CANCELLED);
+        } else {
+                release(ctx); // reference of the cancel routine
+        }
+
+        release(ctx);
+}
+
+_IRQL_requires_same_
+_Function_class_(KSTART_ROUTINE)
+PAGED void plugin_batch_worker(_In_ void *ctx)
+{
+        PAGED_CODE();
+
+        auto &c = *static_cast<plugin_batch_context*>(ctx);
+        plugin_batch(c);
+        release_worker(c);
+}
+
+/*
+ * IoCreateSystemThread references the device object, so the driver can't be unloaded 
+ * while a worker is running.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto start_worker(_Inout_ plugin_batch_context &ctx)
+{
+        PAGED_CODE();
+
+        auto fdo = WdfDeviceWdmGetDeviceObject(ctx.vhci);
+        InterlockedIncrement(&ctx.workers);
+
+        HANDLE handle;
+        auto err = IoCreateSystemThread(fdo, &handle, THREAD_ALL_ACCESS, nullptr, nullptr, nullptr, 
+                                        plugin_batch_worker, &ctx);
+        if (err) {
+                Trace(TRACE_LEVEL_ERROR, "IoCreateSystemThread %!STATUS!", err);
+                InterlockedDecrement(&ctx.workers); // can't reach zero, the caller holds a reference
+        } else {
+                NT_VERIFY(NT_SUCCESS(ZwClose(handle)));
+        }
+
+        return !err;
+}
+
+/*
+ * The request is completed asynchronously by the last worker or by the cancel routine.
+ * It is dispatched by the parallel batch queue, so the default queue is not blocked.
+ * 
+ * @return STATUS_PENDING if the request will be completed later
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS plugin_hardware_batch(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+
+        constexpr auto devices_offset = offsetof(vhci::ioctl::plugin_hardware_batch, devices);
+        vhci::ioctl::plugin_hardware_batch *r{};
+
+        if (size_t length; 
+            auto err = WdfRequestRetrieveInputBuffer(request, devices_offset, reinterpret_cast<PVOID*>(&r), &length)) {
+                return err;
+        } else if (!(r->count && r->count <= MAX_PORTS)) {
+                return STATUS_INVALID_PARAMETER;
+        } else if (r->size != vhci::ioctl::plugin_hardware_batch_size(r->count)) {
+                Trace(TRACE_LEVEL_ERROR, "plugin_hardware_batch.size %lu != plugin_hardware_batch_size(%lu) %Iu", 
+                                          r->size, r->count, vhci::ioctl::plugin_hardware_batch_size(r->count));
+
+                return as_ntstatus(ERROR_USBIP_ABI);
+        } else if (length != r->size) {
+                return STATUS_INVALID_BUFFER_SIZE;
+        }
+
+        if (size_t length; 
+            auto err = WdfRequestRetrieveOutputBuffer(request, r->size, nullptr, &length)) {
+                return err;
+        }
+
+        WDF_OBJECT_ATTRIBUTES attrs;
+        WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attrs, plugin_batch_context);
+
+        plugin_batch_context *ctx{};
+        if (auto err = WdfObjectAllocateContext(request, &attrs, reinterpret_cast<PVOID*>(&ctx))) {
+                Trace(TRACE_LEVEL_ERROR, "WdfObjectAllocateContext %!STATUS!", err);
+                return err;
+        }
+
+        *ctx = plugin_batch_context{ .vhci = get_vhci(request), .r = r, .workers = 1, .refcnt = 2 };
+
+        if (auto err = WdfRequestMarkCancelableEx(request, plugin_batch_cancel)) {
+                NT_ASSERT(err == STATUS_CANCELLED);
+                return err;
+        }
+
+        auto workers = min(r->count, ULONG(MAX_BATCH_WORKERS));
+        ULONG started = 0;
+
+        for ( ; started < workers && start_worker(*ctx); ++started);
+
+        TraceDbg("%lu device(s), %lu worker(s)", r->count, started);
+
+        if (!started) {
+                plugin_batch(*ctx); // synchronously
+        }
+
+        release_worker(*ctx);
+        return STATUS_PENDING;
+}
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED auto plugout_hardware(_In_ WDFREQUEST request)
@@ -410,11 +652,11 @@ PAGED auto plugout_hardware(_In_ WDFREQUEST request)
                 return as_ntstatus(ERROR_USBIP_ABI);
         }
 
-        if (auto vhci = get_vhci(request); r->port <= 0) {
-                vhci::destroy_all_devices(vhci);
+        if (r->port <= 0) {
+                vhci::destroy_all_devices();
         } else if (!is_valid_port(r->port)) {
                 return STATUS_INVALID_PARAMETER;
-        } else if (auto dev = vhci::find_device(vhci, r->port)) {
+        } else if (auto dev = vhci::find_device(r->port)) {
                 device::plugout_and_delete(dev.get<UDECXUSBDEVICE>());
         } else {
                 return STATUS_DEVICE_NOT_CONNECTED;
@@ -446,11 +688,10 @@ PAGED auto get_imported_devices(_In_ WDFREQUEST request)
         auto max_cnt = devices_size/sizeof(*r->devices);
         NT_ASSERT(max_cnt);
 
-        auto vhci = get_vhci(request);
         ULONG cnt = 0;
 
-        for (int port = 1; port <= ARRAYSIZE(vhci_ctx::devices); ++port) {
-                if (auto dev = vhci::find_device(vhci, port)) {
+        for (int port = 1; port <= MAX_PORTS; ++port) {
+                if (auto dev = vhci::find_device(port)) {
                         if (cnt == max_cnt) {
                                 return STATUS_BUFFER_TOO_SMALL;
                         } else if (auto ctx = get_device_ctx(dev.get()); auto err = fill(r->devices[cnt++], *ctx)) {
@@ -503,6 +744,162 @@ PAGED auto driver_registry_path(_In_ WDFREQUEST request)
         return STATUS_SUCCESS;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto get_device_statistics(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+
+        size_t outlen;
+        vhci::ioctl::get_device_statistics *r;
+
+        if (auto err = WdfRequestRetrieveOutputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), &outlen)) {
+                return err;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "get_device_statistics.size %lu != sizeof(get_device_statistics) %Iu", 
+                                          r->size, sizeof(*r));
+
+                return as_ntstatus(ERROR_USBIP_ABI);
+        }
+
+        auto devices_size = outlen - offsetof(vhci::ioctl::get_device_statistics, devices); // size of array
+
+        auto max_cnt = devices_size/sizeof(*r->devices);
+        NT_ASSERT(max_cnt);
+
+        ULONG cnt = 0;
+
+        for (int port = 1; port <= MAX_PORTS; ++port) {
+                if (auto dev = vhci::find_device(port)) {
+                        if (cnt == max_cnt) {
+                                return STATUS_BUFFER_TOO_SMALL;
+                        }
+
+                        auto &ctx = *get_device_ctx(dev.get());
+                        auto &d = r->devices[cnt++];
+
+                        d.port = port;
+                        d.total = ctx.stats;
+                        d.endpoint_count = get_endpoint_statistics(ctx, d.endpoints, ARRAYSIZE(d.endpoints));
+                        get_frame_clock_statistics(ctx, d.frame_clock);
+                }
+        }
+
+        TraceDbg("%lu device(s) reported", cnt);
+
+        auto written = vhci::ioctl::get_device_statistics_size(cnt);
+        NT_ASSERT(written <= outlen);
+        WdfRequestSetInformation(request, written);
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto set_urb_trace(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+
+        vhci::ioctl::set_urb_trace *r{};
+
+        if (size_t length; 
+            auto err = WdfRequestRetrieveInputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), &length)) {
+                return err;
+        } else if (length != sizeof(*r)) {
+                return STATUS_INVALID_BUFFER_SIZE;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "set_urb_trace.size %lu != sizeof(set_urb_trace) %Iu", r->size, sizeof(*r));
+                return as_ntstatus(ERROR_USBIP_ABI);
+        }
+
+        if (r->port > 0) {
+                if (!is_valid_port(r->port)) {
+                        return STATUS_INVALID_PARAMETER;
+                } else if (auto dev = vhci::find_device(r->port)) {
+                        return enable_urb_trace(*get_device_ctx(dev.get()), r->enable);
+                } else {
+                        return STATUS_DEVICE_NOT_CONNECTED;
+                }
+        }
+
+        for (int port = 1; port <= MAX_PORTS; ++port) {
+                if (auto dev = vhci::find_device(port)) {
+                        if (auto err = enable_urb_trace(*get_device_ctx(dev.get()), r->enable)) {
+                                return err;
+                        }
+                }
+        }
+
+        return STATUS_SUCCESS;
+}
+
+/*
+ * METHOD_BUFFERED, input and output share the same buffer.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto get_urb_trace(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+
+        size_t outlen;
+        vhci::ioctl::get_urb_trace *r;
+
+        if (auto err = WdfRequestRetrieveOutputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), &outlen)) {
+                return err;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "get_urb_trace.size %lu != sizeof(get_urb_trace) %Iu", r->size, sizeof(*r));
+                return as_ntstatus(ERROR_USBIP_ABI);
+        } else if (!is_valid_port(r->port)) {
+                return STATUS_INVALID_PARAMETER;
+        }
+
+        auto dev = vhci::find_device(r->port);
+        if (!dev) {
+                return STATUS_DEVICE_NOT_CONNECTED;
+        }
+
+        auto max_cnt = (outlen - offsetof(vhci::ioctl::get_urb_trace, records))/sizeof(*r->records);
+        NT_ASSERT(max_cnt);
+
+        auto cnt = read_urb_trace(*get_device_ctx(dev.get()), r->records, ULONG(max_cnt), r->dropped);
+        TraceDbg("port %d, %lu record(s), dropped %lu", r->port, cnt, r->dropped);
+
+        auto written = vhci::ioctl::get_urb_trace_size(cnt);
+        NT_ASSERT(written <= outlen);
+        WdfRequestSetInformation(request, written);
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto clear_descriptor_cache(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+
+        vhci::ioctl::clear_descriptor_cache *r{};
+
+        if (size_t length; 
+            auto err = WdfRequestRetrieveInputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), &length)) {
+                return err;
+        } else if (length != sizeof(*r)) {
+                return STATUS_INVALID_BUFFER_SIZE;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "clear_descriptor_cache.size %lu != sizeof(clear_descriptor_cache) %Iu", 
+                                          r->size, sizeof(*r));
+                return as_ntstatus(ERROR_USBIP_ABI);
+        }
+
+        for (int port = 1; port <= MAX_PORTS; ++port) {
+                if (auto dev = vhci::find_device(port)) {
+                        usbip::clear_descriptor_cache(*get_device_ctx(dev.get()));
+                }
+        }
+
+        return STATUS_SUCCESS;
+}
+
 /*
  * IRP_MJ_DEVICE_CONTROL
  * 
@@ -543,6 +940,22 @@ void device_control(
         case vhci::ioctl::DRIVER_REGISTRY_PATH:
                 st = driver_registry_path(Request);
                 break;
+        case vhci::ioctl::GET_DEVICE_STATISTICS:
+                st = get_device_statistics(Request);
+                break;
+        case vhci::ioctl::SET_URB_TRACE:
+                st = set_urb_trace(Request);
+                break;
+        case vhci::ioctl::GET_URB_TRACE:
+                st = get_urb_trace(Request);
+                break;
+        case vhci::ioctl::PLUGIN_HARDWARE_BATCH:
+                st = WdfRequestForwardToIoQueue(Request, get_vhci_ctx(WdfIoQueueGetDevice(Queue))->batch_queue);
+                complete = NT_ERROR(st);
+                break;
+        case vhci::ioctl::CLEAR_DESCRIPTOR_CACHE:
+                st = clear_descriptor_cache(Request);
+                break;
         case IOCTL_USB_USER_REQUEST:
                 NT_ASSERT(!has_urb(Request));
                 if (USBUSER_REQUEST_HEADER *hdr; 
@@ -562,6 +975,27 @@ void device_control(
         }
 }
 
+/*
+ * PLUGIN_HARDWARE_BATCH is forwarded here by device_control.
+ */
+_Function_class_(EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void batch_device_control(
+        _In_ WDFQUEUE,
+        _In_ WDFREQUEST Request,
+        _In_ size_t,
+        _In_ size_t,
+        _In_ ULONG IoControlCode)
+{
+        NT_ASSERT(IoControlCode == vhci::ioctl::PLUGIN_HARDWARE_BATCH);
+
+        if (auto st = plugin_hardware_batch(Request); st != STATUS_PENDING) {
+                TraceDbg("%s(%#08lX) %!STATUS!", device_control_name(IoControlCode), IoControlCode, st);
+                WdfRequestComplete(Request, st);
+        }
+}
+
 } // namespace
 
 
@@ -589,3 +1023,39 @@ PAGED NTSTATUS usbip::vhci::create_default_queue(_In_ WDFDEVICE vhci)
         TraceDbg("%04x", ptr04x(queue));
         return STATUS_SUCCESS;
 }
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED DWORD usbip::vhci::plugin_hardware(_In_ WDFDEVICE vhci, _Inout_ ioctl::plugin_hardware &r)
+{
+        PAGED_CODE();
+        return ::plugin_hardware(vhci, r);
+}
+
+/*
+ * Requests are pending until their devices are attached, a sequential queue would block others.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::vhci::create_batch_queue(_In_ WDFDEVICE vhci)
+{
+        PAGED_CODE();
+
+        WDF_IO_QUEUE_CONFIG cfg;
+        WDF_IO_QUEUE_CONFIG_INIT(&cfg, WdfIoQueueDispatchParallel);
+        cfg.EvtIoDeviceControl = batch_device_control;
+
+        WDF_OBJECT_ATTRIBUTES attrs;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attrs);
+        attrs.ParentObject = vhci;
+
+        auto &queue = get_vhci_ctx(vhci)->batch_queue;
+
+        if (auto err = WdfIoQueueCreate(vhci, &cfg, &attrs, &queue)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfIoQueueCreate %!STATUS!", err);
+                return err;
+        }
+
+        TraceDbg("%04x", ptr04x(queue));
+        return STATUS_SUCCESS;
+}
@@ -10,8 +10,29 @@
 namespace usbip::vhci
 {
 
+namespace ioctl
+{
+        struct plugin_hardware;
+}
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS create_default_queue(_In_ WDFDEVICE vhci);
 
+/*
+ * Parallel queue for ioctl::PLUGIN_HARDWARE_BATCH, @see vhci_ctx::batch_queue.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS create_batch_queue(_In_ WDFDEVICE vhci);
+
+/*
+ * Handler of ioctl::PLUGIN_HARDWARE, also used to attach persistent devices.
+ * The default queue is sequential, so it is called directly to attach devices concurrently.
+ * @return zero or ERROR_USBIP_XXX
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED DWORD plugin_hardware(_In_ WDFDEVICE vhci, _Inout_ ioctl::plugin_hardware &r);
+
 } // namespace usbip::vhci
@@ -13,22 +13,119 @@ namespace
 
 using namespace usbip;
 
+/*
+ * Size classes: zero is for non-isoch transfers, class N > 0 has isoc[2^(N - 1)].
+ */
+enum { ISOC_CLASSES = 11, POOL_CLASSES = 1 + ISOC_CLASSES };
+static_assert(1UL << (ISOC_CLASSES - 1) == USBIP_MAX_ISO_PACKETS);
+
+/*
+ * Lookaside lists of a processor, contexts are allocated and freed on the current one.
+ */
+struct cpu_pools
+{
+        LOOKASIDE_LIST_EX list[POOL_CLASSES];
+        wsk_context_stats stats;
+};
+
 ULONG g_tag;
-bool g_initialized;
-LOOKASIDE_LIST_EX g_lookaside;
+ULONG g_cpu_count;
+ULONG g_initialized; // number of initialized lists in g_pools
+cpu_pools *g_pools;
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto& get_cpu_pools()
+{
+        auto cpu = KeGetCurrentProcessorNumberEx(nullptr);
+        NT_ASSERT(cpu < g_cpu_count);
+        return g_pools[cpu];
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto& get_cpu_pools(_In_ const LOOKASIDE_LIST_EX *list)
+{
+        auto cpu = ((char*)list - (char*)g_pools)/sizeof(*g_pools);
+        NT_ASSERT(cpu < g_cpu_count);
+        return g_pools[cpu];
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UCHAR get_pool_class(_In_ ULONG NumberOfPackets)
+{
+        if (!NumberOfPackets) {
+                return 0;
+        } else if (NumberOfPackets >= USBIP_MAX_ISO_PACKETS) {
+                return POOL_CLASSES - 1;
+        } else if (NumberOfPackets == 1) {
+                return 1;
+        }
+
+        ULONG msb;
+        _BitScanReverse(&msb, NumberOfPackets - 1);
+        return UCHAR(msb + 2);
+}
+
+constexpr auto get_capacity(_In_ UCHAR pool_class)
+{
+        return pool_class ? 1UL << (pool_class - 1) : 0;
+}
+
+/*
+ * Allocate isoc[cnt] and build MDLs for it, mdl_isoc describes the whole array.
+ * isoc_alloc_cnt is zero on error, the context remains valid.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS alloc_isoc(_Inout_ wsk_context &ctx, _In_ ULONG cnt)
+{
+        ULONG isoc_len = cnt*sizeof(*ctx.isoc);
+
+        auto isoc = (usbip_iso_packet_descriptor*)ExAllocatePool2(POOL_FLAG_NON_PAGED, isoc_len, g_tag);
+        if (!isoc) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        ctx.mdl_isoc.reset();
+        ctx.mdl_isoc_pool.reset();
+
+        if (ctx.isoc) {
+                ExFreePoolWithTag(ctx.isoc, g_tag);
+        }
+
+        ctx.isoc = isoc;
+        ctx.isoc_alloc_cnt = 0;
+
+        ctx.mdl_isoc_pool = Mdl(isoc, isoc_len);
+        if (auto err = ctx.mdl_isoc_pool.prepare_nonpaged()) {
+                return err;
+        }
+
+        ctx.mdl_isoc = Mdl(ctx.mdl_isoc_pool.get(), 0, isoc_len);
+        if (!ctx.mdl_isoc) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        ctx.isoc_alloc_cnt = cnt;
+        return STATUS_SUCCESS;
+}
 
 _IRQL_requires_same_
 _Function_class_(free_function_ex)
-void free_function_ex(_In_ __drv_freesMem(Mem) void *Buffer, _Inout_ LOOKASIDE_LIST_EX*)
+void free_function_ex(_In_ __drv_freesMem(Mem) void *Buffer, _Inout_ LOOKASIDE_LIST_EX *list)
 {
         auto ctx = static_cast<wsk_context*>(Buffer);
         NT_ASSERT(ctx);
 
-        TraceWSK("%04x, isoc[%Iu]", ptr04x(ctx), ctx->isoc_alloc_cnt);
+        TraceWSK("%04x, isoc[%lu]", ptr04x(ctx), ctx->isoc_alloc_cnt);
+        InterlockedIncrement64(&get_cpu_pools(list).stats.pool_frees);
 
         ctx->mdl_hdr.reset();
         ctx->mdl_buf.reset();
         ctx->mdl_isoc.reset();
+        ctx->mdl_isoc_pool.reset();
 
         if (auto irp = ctx->wsk_irp) {
                 IoFreeIrp(irp);
@@ -41,6 +138,9 @@ void free_function_ex(_In_ __drv_freesMem(Mem) void *Buffer, _Inout_ LOOKASIDE_L
         ExFreePoolWithTag(ctx, g_tag);
 }
 
+/*
+ * The context is created with isoc array and MDLs of its size class, prepare_isoc does not allocate memory.
+ */
 _IRQL_requires_same_
 _Function_class_(allocate_function_ex)
 void *allocate_function_ex(_In_ [[maybe_unused]] POOL_TYPE PoolType, _In_ SIZE_T NumberOfBytes, _In_ ULONG Tag, _Inout_ LOOKASIDE_LIST_EX *list)
@@ -48,12 +148,19 @@ void *allocate_function_ex(_In_ [[maybe_unused]] POOL_TYPE PoolType, _In_ SIZE_T
         NT_ASSERT(PoolType == NonPagedPoolNx);
         NT_ASSERT(Tag == g_tag);
 
+        auto &pools = get_cpu_pools(list);
+        auto pool_class = UCHAR(list - pools.list);
+        NT_ASSERT(pool_class < POOL_CLASSES);
+
         auto ctx = (wsk_context*)ExAllocatePool2(POOL_FLAG_NON_PAGED, NumberOfBytes, Tag);
         if (!ctx) {
                 Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", NumberOfBytes);
                 return nullptr;
         }
 
+        InterlockedIncrement64(&pools.stats.pool_allocs);
+        ctx->pool_class = pool_class;
+
         ctx->mdl_hdr = Mdl(&ctx->hdr, sizeof(ctx->hdr));
 
         if (auto err = ctx->mdl_hdr.prepare_nonpaged()) {
@@ -69,25 +176,36 @@ void *allocate_function_ex(_In_ [[maybe_unused]] POOL_TYPE PoolType, _In_ SIZE_T
                 return nullptr;
         }
 
-        TraceWSK("%04x", ptr04x(ctx));
+        if (auto cnt = get_capacity(pool_class)) {
+                if (auto err = alloc_isoc(*ctx, cnt)) {
+                        Trace(TRACE_LEVEL_ERROR, "isoc[%lu] %!STATUS!", cnt, err);
+                        free_function_ex(ctx, list);
+                        return nullptr;
+                }
+        }
+
+        TraceWSK("%04x, class %d", ptr04x(ctx), pool_class);
         return ctx;
 }
 
 /*
- * If use ExFreeToLookasideListEx in case of error, next ExAllocateFromLookasideListEx will return the same pointer.
- * free_function_ex is used instead in hope that next object in the LookasideList may have required buffer.
+ * prepare_isoc can fail only if it has to grow isoc array, the context is still valid.
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto alloc_wsk_context(_In_ ULONG NumberOfPackets)
 {
-        auto ctx = (wsk_context*)ExAllocateFromLookasideListEx(&g_lookaside);
+        auto &pools = get_cpu_pools();
+        InterlockedIncrement64(&pools.stats.allocs);
+
+        auto list = &pools.list[get_pool_class(NumberOfPackets)];
+        auto ctx = (wsk_context*)ExAllocateFromLookasideListEx(list);
 
         if (!ctx) {
                 Trace(TRACE_LEVEL_ERROR, "ExAllocateFromLookasideListEx error");
         } else if (auto err = prepare_isoc(*ctx, NumberOfPackets)) {
                 Trace(TRACE_LEVEL_ERROR, "prepare_isoc(NumberOfPackets %lu) %!STATUS!", NumberOfPackets, err);
-                free_function_ex(ctx, &g_lookaside);
+                ExFreeToLookasideListEx(&get_cpu_pools().list[ctx->pool_class], ctx);
                 ctx = nullptr;
         }
 
@@ -110,20 +228,68 @@ NTSTATUS usbip::init_wsk_context_list(_In_ ULONG tag)
         }
 
         g_tag = tag;
-        auto err = ExInitializeLookasideListEx(&g_lookaside, allocate_function_ex, free_function_ex, 
-                                               NonPagedPoolNx, 0, sizeof(wsk_context), tag, 0);
+        g_cpu_count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+        g_pools = (cpu_pools*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED, 
+                                               g_cpu_count*sizeof(*g_pools), tag);
+        if (!g_pools) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate pools for %lu processors", g_cpu_count);
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        for (ULONG cpu = 0; cpu < g_cpu_count; ++cpu) {
+                for (auto &list: g_pools[cpu].list) {
+                        if (auto err = ExInitializeLookasideListEx(&list, allocate_function_ex, free_function_ex, 
+                                                                   NonPagedPoolNx, 0, sizeof(wsk_context), tag, 0)) {
+                                delete_wsk_context_list();
+                                return err;
+                        }
+                        ++g_initialized;
+                }
+        }
 
-        g_initialized = !err;
-        return err;
+        return STATUS_SUCCESS;
 }
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void usbip::delete_wsk_context_list()
 {
+        if (!g_pools) {
+                return;
+        }
+
         if (g_initialized) {
-                ExDeleteLookasideListEx(&g_lookaside);
-                g_initialized = false;
+                wsk_context_stats st;
+                get_wsk_context_stats(st);
+
+                Trace(TRACE_LEVEL_INFORMATION, "allocs %I64d, pool_allocs %I64d, pool_frees %I64d, isoc_reallocs %I64d", 
+                        st.allocs, st.pool_allocs, st.pool_frees, st.isoc_reallocs);
+        }
+
+        for (ULONG i = 0; i < g_initialized; ++i) {
+                auto &pools = g_pools[i/POOL_CLASSES];
+                ExDeleteLookasideListEx(&pools.list[i % POOL_CLASSES]);
+        }
+
+        g_initialized = 0;
+
+        ExFreePoolWithTag(g_pools, g_tag);
+        g_pools = nullptr;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::get_wsk_context_stats(_Out_ wsk_context_stats &st)
+{
+        st = {};
+
+        for (ULONG i = 0; g_pools && i < g_cpu_count; ++i) {
+                auto &s = g_pools[i].stats;
+                st.allocs += s.allocs;
+                st.pool_allocs += s.pool_allocs;
+                st.pool_frees += s.pool_frees;
+                st.isoc_reallocs += s.isoc_reallocs;
         }
 }
 
@@ -138,13 +304,15 @@ auto usbip::alloc_wsk_context(
         if (ctx) {
                 ctx->dev = dev;
                 ctx->request = request;
+                ctx->next = nullptr;
         }
 
         return ctx;
 }
 
 /*
- * alloc_wsk_context sets dev, request, is_isoc. It's safe do not clear them.
+ * alloc_wsk_context sets dev, request, next, is_isoc. It's safe do not clear them.
+ * The context is returned to the list of the current processor, not of the one it was allocated on.
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -160,9 +328,13 @@ void usbip::free(_In_opt_ wsk_context *ctx, _In_ bool reuse_irp)
                 IoReuseIrp(ctx->wsk_irp, STATUS_SUCCESS);
         }
 
-        ExFreeToLookasideListEx(&g_lookaside, ctx);
+        ExFreeToLookasideListEx(&get_cpu_pools().list[ctx->pool_class], ctx);
 }
 
+/*
+ * Rebuilds partial mdl_isoc in place if isoc array is large enough.
+ * Otherwise the array grows up to the capacity of the size class of NumberOfPackets.
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS usbip::prepare_isoc(_In_ wsk_context &ctx, _In_ ULONG NumberOfPackets)
@@ -174,32 +346,24 @@ NTSTATUS usbip::prepare_isoc(_In_ wsk_context &ctx, _In_ ULONG NumberOfPackets)
                 return STATUS_SUCCESS;
         }
 
-        ULONG isoc_len = NumberOfPackets*sizeof(*ctx.isoc);
-
         if (ctx.isoc_alloc_cnt < NumberOfPackets) {
-                auto isoc = (usbip_iso_packet_descriptor*)ExAllocatePool2(POOL_FLAG_NON_PAGED, isoc_len, g_tag);
-                if (!isoc) {
-                        return STATUS_INSUFFICIENT_RESOURCES;
-                }
+                InterlockedIncrement64(&get_cpu_pools().stats.isoc_reallocs);
 
-                if (ctx.isoc) {
-                        ExFreePoolWithTag(ctx.isoc, g_tag);
+                auto cnt = max(NumberOfPackets, get_capacity(get_pool_class(NumberOfPackets)));
+                if (auto err = alloc_isoc(ctx, cnt)) {
+                        return err;
                 }
-
-                ctx.isoc = isoc;
-                ctx.isoc_alloc_cnt = NumberOfPackets;
-
-                ctx.mdl_isoc.reset();
         }
 
+        ULONG isoc_len = NumberOfPackets*sizeof(*ctx.isoc);
+
         if (ctx.mdl_isoc.size() != isoc_len) {
-                ctx.mdl_isoc = Mdl(ctx.isoc, isoc_len);
-                if (auto err = ctx.mdl_isoc.prepare_nonpaged()) {
+                if (auto err = ctx.mdl_isoc.rebuild_partial(ctx.mdl_isoc_pool.get(), 0, isoc_len)) {
                         return err;
                 }
-                NT_ASSERT(number_of_packets(ctx) == NumberOfPackets);
         }
 
+        NT_ASSERT(number_of_packets(ctx) == NumberOfPackets);
         return STATUS_SUCCESS;
 }
 
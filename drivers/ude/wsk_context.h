@@ -22,6 +22,8 @@ struct wsk_context
 
         WDFREQUEST request; // can be WDF_NO_HANDLE
         Mdl mdl_buf; // describes URB_FROM_IRP()->TransferBuffer(MDL)
+        wsk_context *next; // send_queue or coalesced PDUs
+        ULONG64 timestamp; // when PDU was queued or sent, @see KeQueryInterruptTime
 
         // preallocated data
 
@@ -30,12 +32,26 @@ struct wsk_context
         Mdl mdl_hdr;
         usbip_header hdr;
 
-        Mdl mdl_isoc;
+        Mdl mdl_isoc_pool; // describes isoc[isoc_alloc_cnt]
+        Mdl mdl_isoc; // partial MDL of mdl_isoc_pool, describes isoc[number_of_packets]
         usbip_iso_packet_descriptor *isoc;
         ULONG isoc_alloc_cnt;
+        UCHAR pool_class; // lookaside list it belongs to, @see get_pool_class
         bool is_isoc;
 };
 
+/*
+ * Allocation-rate counters.
+ * pool_allocs and isoc_reallocs must not grow in a steady state.
+ */
+struct wsk_context_stats
+{
+        LONG64 allocs; // alloc_wsk_context calls
+        LONG64 pool_allocs; // lookaside list misses
+        LONG64 pool_frees; // contexts returned to the system pool
+        LONG64 isoc_reallocs; // isoc array was too small
+};
+
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -45,6 +61,10 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void delete_wsk_context_list();
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void get_wsk_context_stats(_Out_ wsk_context_stats &st);
+
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -14,6 +14,10 @@
 #include "network.h"
 #include "driver.h"
 #include "ioctl.h"
+#include "statistics.h"
+#include "urb_trace.h"
+#include "descriptor_cache.h"
+#include "frame_clock.h"
 
 #include <libdrv\usbd_helper.h>
 #include <libdrv\dbgcommon.h>
@@ -24,6 +28,29 @@
 
 #include <usb.h>
 
+/*
+ * Data received from a server in receive_mode::stream.
+ * Range [head, tail) of data is not parsed yet.
+ */
+struct usbip::receive_buffer
+{
+	Mdl mdl; // describes data
+	ULONG head;
+	ULONG tail;
+	size_t skip; // bytes of payload to discard, request was not found
+	char data[64*1024];
+};
+
+/*
+ * Scratch buffer for receive_mode::header to discard payload of a request that was not found.
+ * Payload is read in chunks, @see device_ctx::drain_size.
+ */
+struct usbip::drain_buffer
+{
+	Mdl mdl; // describes data
+	char data[16*1024];
+};
+
 namespace
 {
 
@@ -103,81 +130,40 @@ inline auto& get_ret_submit(_In_ const wsk_context &ctx)
 }
 
 /*
- * Buffer from the server has no gaps (compacted), SUM(src->actual_length) == actual_length,
- * src->offset is ignored for that reason.
- *
- * For isochronous packets: actual length is the sum of
- * the actual length of the individual, packets, but as
- * the packet offsets are not changed there will be
- * padding between the packets. To optimally use the
- * bandwidth the padding is not transmitted.
- *
- * See:
- * <linux>/drivers/usb/usbip/stub_tx.c, stub_send_ret_submit
- * <linux>/drivers/usb/usbip/usbip_common.c, usbip_pad_iso
+ * @param data compacted payload if it was not received into the buffer, 
+ *        packets are copied from it to their offsets instead of moving them inside the buffer
+ * @see usbip::pdu::unpack_isoc
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto fill_isoc_data(_Inout_ _URB_ISOCH_TRANSFER &r, _In_opt_ UCHAR *buffer, _In_ ULONG length, 
-	_In_ const usbip_iso_packet_descriptor *src)
+	_In_ const usbip_iso_packet_descriptor *src, _In_opt_ const char *data)
 {
 	NT_ASSERT(length <= r.TransferBufferLength);
-	auto dir_out = !buffer;
-
-	for (auto i = LONG64(r.NumberOfPackets) - 1; i >= 0; --i) { // set dd.Status and dd.Length
-
-		auto sd = src + i;
-		auto dd = r.IsoPacket + i;
-
-		dd->Status = sd->status ? to_windows_status_isoch(sd->status) : USBD_STATUS_SUCCESS;
-
-		if (dir_out) {
-			continue; // dd->Length is not used for OUT transfers
-		}
-
-		if (!sd->actual_length) {
-			dd->Length = 0;
-			continue;
-		}
-
-		if (sd->actual_length > sd->length) {
-			Trace(TRACE_LEVEL_ERROR, "actual_length(%u) > length(%u)", sd->actual_length, sd->length);
-			return STATUS_INVALID_PARAMETER;
-		}
-
-		if (sd->offset != dd->Offset) { // buffer is compacted, but offsets are intact
-			Trace(TRACE_LEVEL_ERROR, "src.offset(%u) != dst.Offset(%lu)", sd->offset, dd->Offset);
-			return STATUS_INVALID_PARAMETER;
-		}
 
-		if (length >= sd->actual_length) {
-			length -= sd->actual_length;
-		} else {
-			Trace(TRACE_LEVEL_ERROR, "length(%lu) >= actual_length(%u)", length, sd->actual_length);
-			return STATUS_INVALID_PARAMETER;
-		}
+	for (ULONG i = 0; i < r.NumberOfPackets; ++i) {
+		auto st = src[i].status;
+		r.IsoPacket[i].Status = st ? to_windows_status_isoch(st) : USBD_STATUS_SUCCESS;
+	}
 
-		if (dd->Offset + sd->actual_length > r.TransferBufferLength) {
-			Trace(TRACE_LEVEL_ERROR, "dst.Offset(%lu) + src.actual_length(%u) > r.TransferBufferLength(%lu)",
-				dd->Offset, sd->actual_length, r.TransferBufferLength);
-			return STATUS_INVALID_PARAMETER;
-		}
-		
-		if (dd->Offset < length) { // source buffer has no gaps
-			Trace(TRACE_LEVEL_ERROR, "dst.Offset(%lu) < length(%lu)", dd->Offset, length);
-			return STATUS_INVALID_PARAMETER;
-		}
+	if (!buffer) {
+		return STATUS_SUCCESS; // dd->Length is not used for OUT transfers
+	}
 
-		if (dd->Offset > length) {
-			RtlMoveMemory(buffer + dd->Offset, buffer + length, sd->actual_length);
+	auto place = [buffer, data] (auto dst_offset, auto src_offset, auto len)
+	{
+		if (data) {
+			RtlCopyMemory(buffer + dst_offset, data + src_offset, len);
+		} else if (dst_offset > src_offset) {
+			RtlMoveMemory(buffer + dst_offset, buffer + src_offset, len);
 		}
+	};
 
-		dd->Length = sd->actual_length;
-	}
-
-	if (length && !dir_out) {
-		Trace(TRACE_LEVEL_ERROR, "SUM(actual_length) != actual_length, delta is %lu", length);
-		return STATUS_INVALID_PARAMETER; 
+	auto err = pdu::unpack_isoc(r.IsoPacket, src, r.NumberOfPackets, length, r.TransferBufferLength, place);
+	if (err != pdu::parse_error::none) {
+		Trace(TRACE_LEVEL_ERROR, "%s, actual_length %lu, TransferBufferLength %lu, NumberOfPackets %lu", 
+			pdu::to_string(err), length, r.TransferBufferLength, r.NumberOfPackets);
+		return STATUS_INVALID_PARAMETER;
 	}
 
 	return STATUS_SUCCESS;
@@ -188,7 +174,8 @@ auto fill_isoc_data(_Inout_ _URB_ISOCH_TRANSFER &r, _In_opt_ UCHAR *buffer, _In_
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto isoch_transfer(_In_ wsk_context &ctx, _In_ const usbip_header_ret_submit &ret, _Inout_ URB &urb)
+auto isoch_transfer(
+	_In_ wsk_context &ctx, _In_ const usbip_header_ret_submit &ret, _Inout_ URB &urb, _In_opt_ const char *data)
 {
 	auto cnt = ret.number_of_packets;
 
@@ -199,8 +186,16 @@ auto isoch_transfer(_In_ wsk_context &ctx, _In_ const usbip_header_ret_submit &r
 		r.Hdr.Status = USBD_STATUS_ISOCH_REQUEST_FAILED;
 	}
 
-	if (r.TransferFlags & USBD_START_ISO_TRANSFER_ASAP) {
-		r.StartFrame = ret.start_frame;
+	if (auto &req = *get_request_ctx(ctx.request); req.start_asap) {
+		auto host_frame = get_host_frame_number(req.send_time ? req.send_time : req.submit_time);
+		auto start_frame = ULONG(ret.start_frame);
+
+		add_frame_sample(*ctx.dev, host_frame, start_frame);
+
+		if ((r.TransferFlags & USBD_START_ISO_TRANSFER_ASAP) &&
+		    !to_host_frame(*ctx.dev, r.StartFrame, start_frame, host_frame)) {
+			r.StartFrame = start_frame;
+		}
 	}
 
 	if (cnt >= 0 && ULONG(cnt) == r.NumberOfPackets) {
@@ -222,7 +217,7 @@ auto isoch_transfer(_In_ wsk_context &ctx, _In_ const usbip_header_ret_submit &r
 		NT_ASSERT(length == r.TransferBufferLength);
 	}
 
-	return fill_isoc_data(r, buffer, ret.actual_length, ctx.isoc);
+	return fill_isoc_data(r, buffer, ret.actual_length, ctx.isoc, data);
 }
 
 _IRQL_requires_same_
@@ -251,6 +246,8 @@ auto post_control_transfer(_In_ wsk_context &ctx, _In_ const _URB_CONTROL_TRANSF
 	TraceUrb("bLength %d, %!usb_descriptor_type!%!BIN!", dsc->bLength, dsc->bDescriptorType, 
 		  WppBinary(dsc, USHORT(dsc_len)));
 
+	cache_descriptor(*ctx.dev, get_setup_packet(r), dsc, dsc_len);
+
 	switch (dsc->bDescriptorType) {
 	case USB_DEVICE_DESCRIPTOR_TYPE:
 	{
@@ -316,12 +313,13 @@ enum { RECV_NEXT_USBIP_HDR = STATUS_SUCCESS, RECV_MORE_DATA_REQUIRED = STATUS_PE
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto ret_submit_urb(_Inout_ wsk_context &ctx, _In_ const usbip_header_ret_submit &ret, _Inout_ URB &urb)
+auto ret_submit_urb(
+	_Inout_ wsk_context &ctx, _In_ const usbip_header_ret_submit &ret, _Inout_ URB &urb, _In_opt_ const char *isoc_data)
 {
 	urb.UrbHeader.Status = ret.status ? to_windows_status(ret.status) : USBD_STATUS_SUCCESS;
 
 	if (is_isoch(urb)) {
-		return isoch_transfer(ctx, ret, urb);
+		return isoch_transfer(ctx, ret, urb, isoc_data);
 	}
 
 	auto st = STATUS_SUCCESS;
@@ -338,19 +336,52 @@ auto ret_submit_urb(_Inout_ wsk_context &ctx, _In_ const usbip_header_ret_submit
 	return st;
 }
 
-_Function_class_(device_ctx::received_fn)
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS ret_submit(_Inout_ wsk_context &ctx)
+void complete_ret_submit(_Inout_ wsk_context &ctx, _In_opt_ const char *isoc_data)
 {
 	auto &ret = get_ret_submit(ctx);
 	auto urb = try_get_urb(ctx.request); // IOCTL_INTERNAL_USB_SUBMIT_URB
 
-	auto st = urb ? ret_submit_urb(ctx, ret, *urb) :
+	auto st = urb ? ret_submit_urb(ctx, ret, *urb, isoc_data) :
 		  ret.status ? STATUS_UNSUCCESSFUL : 
 		  STATUS_SUCCESS;
 
 	atomic_complete(ctx.request, st);
+}
+
+_Function_class_(device_ctx::received_fn)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS ret_submit(_Inout_ wsk_context &ctx)
+{
+	complete_ret_submit(ctx, nullptr);
+	return RECV_NEXT_USBIP_HDR;
+}
+
+/*
+ * Isoch payload is entirely in memory (receive_buffer or data indication).
+ * IN packets are copied to their final offsets in the transfer buffer, 
+ * compacted data are not copied to the beginning of the buffer to be moved afterwards.
+ *
+ * @param payload [transfer buffer data] followed by usbip_iso_packet_descriptor[]
+ * @see prepare_wsk_mdl, it must be called before
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS ret_submit_isoc(_Inout_ wsk_context &ctx, _In_ const char *payload, _In_ size_t length)
+{
+	NT_ASSERT(ctx.is_isoc);
+	auto isoc_len = number_of_packets(ctx)*sizeof(*ctx.isoc);
+
+	if (length < isoc_len) {
+		Trace(TRACE_LEVEL_ERROR, "payload size %Iu < isoc size %Iu", length, isoc_len);
+		return STATUS_INVALID_BUFFER_SIZE;
+	}
+
+	RtlCopyMemory(ctx.isoc, payload + length - isoc_len, isoc_len);
+
+	complete_ret_submit(ctx, payload);
 	return RECV_NEXT_USBIP_HDR;
 }
 
@@ -434,26 +465,46 @@ auto prepare_wsk_mdl(_Out_ MDL* &mdl, _Inout_ wsk_context &ctx, _Inout_ URB &urb
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-inline auto alloc_drain_buffer(_Inout_ wsk_context &ctx, _In_ size_t length)
-{  
-	auto &buf = ctx.request;
-	NT_ASSERT(!buf);
-	return buf = (WDFREQUEST)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, length, pooltag); 
+void receive_failed(_Inout_ wsk_context &ctx, _In_ NTSTATUS st)
+{
+	auto &dev = *ctx.dev;
+	dev.drain_size = 0;
+
+	if (auto &req = ctx.request) {
+		NT_ASSERT(dev.received != ret_submit); // never fails
+		atomic_complete(req, STATUS_CANCELLED);
+	}
+	NT_ASSERT(!ctx.request);
+
+	if (auto hdev = get_device(&dev)) {
+		TraceDbg("dev %04x, unplugging after %!STATUS!", ptr04x(hdev), st);
+		device::sched_plugout_and_delete(hdev);
+	}
 }
 
-_Function_class_(device_ctx::received_fn)
+/*
+ * @param st result of device_ctx::received_fn or an error
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS free_drain_buffer(_Inout_ wsk_context &ctx)
-{  
-	auto &buf = ctx.request;
-	NT_ASSERT(buf);
+NTSTATUS after_receive(_Inout_ wsk_context &ctx, _In_ NTSTATUS st)
+{
+	auto &dev = *ctx.dev;
 
-	ExFreePoolWithTag(buf, pooltag);
-	buf = WDF_NO_HANDLE;
+	switch (st) {
+	case RECV_NEXT_USBIP_HDR:
+		if (!dev.unplugged) { // IOCTL_PLUGOUT_HARDWARE set this flag on PASSIVE_LEVEL
+			sched_receive_usbip_header(dev);
+		}
+		break;
+	case RECV_MORE_DATA_REQUIRED:
+		break;
+	default:
+		receive_failed(ctx, st);
+	}
 
-	return RECV_NEXT_USBIP_HDR;
-};
+	return StopCompletion;
+}
 
 _Function_class_(IO_COMPLETION_ROUTINE)
 _IRQL_requires_same_
@@ -472,30 +523,7 @@ NTSTATUS on_receive(
 		  ios.Information ? STATUS_RECEIVE_PARTIAL : 
 		  STATUS_CONNECTION_DISCONNECTED; // EOF
 
-	switch (st) {
-	case RECV_NEXT_USBIP_HDR:
-		if (!dev.unplugged) { // IOCTL_PLUGOUT_HARDWARE set this flag on PASSIVE_LEVEL
-			sched_receive_usbip_header(dev);
-		}
-		[[fallthrough]];
-	case RECV_MORE_DATA_REQUIRED:
-		return StopCompletion;
-	}
-
-	if (dev.received == free_drain_buffer) { // ctx.request is a drain buffer
-		free_drain_buffer(ctx);
-	} else if (auto &req = ctx.request) {
-		NT_ASSERT(dev.received != ret_submit); // never fails
-		atomic_complete(req, STATUS_CANCELLED);
-	}
-	NT_ASSERT(!ctx.request);
-
-	if (auto hdev = get_device(&dev)) {
-		TraceDbg("dev %04x, unplugging after %!STATUS!", ptr04x(hdev), st);
-		device::sched_plugout_and_delete(hdev);
-	}
-
-	return StopCompletion;
+	return after_receive(ctx, st);
 }
 
 /*
@@ -530,6 +558,38 @@ auto receive(_In_ WSK_BUF &buf, _In_ device_ctx::received_fn received, _In_ wsk_
 	return RECV_MORE_DATA_REQUIRED;
 }
 
+_Function_class_(device_ctx::received_fn)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS drained(_Inout_ wsk_context&)
+{
+	return RECV_NEXT_USBIP_HDR; // receive_usbip_header will read the next chunk if drain_size != 0
+}
+
+/*
+ * Receive next chunk of the payload to discard into drain_buffer.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS drain_chunk(_Inout_ wsk_context &ctx)
+{
+	auto &dev = *ctx.dev;
+	auto &db = *dev.drain_buf;
+
+	NT_ASSERT(dev.drain_size);
+	auto cnt = min(dev.drain_size, sizeof(db.data));
+	dev.drain_size -= cnt;
+
+	ctx.is_isoc = false; // can be left from previous request, the chunk can be shorter than the MDL
+
+	WSK_BUF buf{ .Mdl = db.mdl.get(), .Length = cnt };
+	return receive(buf, drained, ctx);
+}
+
+/*
+ * The payload can be large, it is read by chunks through receive_usbip_header workitem
+ * to avoid recursion if a receive completes synchronously.
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS drain_payload(_Inout_ wsk_context &ctx, _In_ size_t length)
@@ -539,22 +599,13 @@ NTSTATUS drain_payload(_Inout_ wsk_context &ctx, _In_ size_t length)
 		return STATUS_INVALID_PARAMETER;
 	}
 
-	if (auto addr = alloc_drain_buffer(ctx, length)) {
-		ctx.mdl_buf = Mdl(addr, ULONG(length));
-	} else {
-		Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", length);
-		return STATUS_INSUFFICIENT_RESOURCES;
-	}
+	auto &dev = *ctx.dev;
+	NT_ASSERT(!dev.drain_size);
 
-	if (auto err = ctx.mdl_buf.prepare_nonpaged()) {
-		NT_ASSERT(err != RECV_MORE_DATA_REQUIRED);
-		Trace(TRACE_LEVEL_ERROR, "prepare_nonpaged %!STATUS!", err);
-		free_drain_buffer(ctx);
-		return err;
-	}
+	dev.discarded_bytes += length;
+	dev.drain_size = length;
 
-	WSK_BUF buf{ .Mdl = ctx.mdl_buf.get(), .Length = length };
-	return receive(buf, free_drain_buffer, ctx);
+	return drain_chunk(ctx);
 }
 
 _IRQL_requires_same_
@@ -573,6 +624,24 @@ NTSTATUS recv_payload(_Inout_ wsk_context &ctx, _In_ size_t length)
 	return receive(buf, ret_submit, ctx);
 }
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void dequeue_request(_Inout_ wsk_context &ctx)
+{
+	auto &hdr = ctx.hdr;
+
+	ctx.request = hdr.base.command == USBIP_RET_SUBMIT ? // request must be completed
+		      device::dequeue_request(*ctx.dev, hdr.base.seqnum) : WDF_NO_HANDLE;
+
+	if (auto req = ctx.request) {
+		get_request_ctx(req)->recv_time = KeQueryInterruptTime();
+	}
+
+	char buf[DBG_USBIP_HDR_BUFSZ];
+	TraceEvents(TRACE_LEVEL_VERBOSE, FLAG_USBIP, "req %04x <- %Iu%s",
+		ptr04x(ctx.request), get_total_size(hdr), dbg_usbip_hdr(buf, sizeof(buf), &hdr, false));
+}
+
 /*
  * For RET_UNLINK irp was completed right after CMD_UNLINK was issued.
  * @see send_cmd_unlink
@@ -587,18 +656,9 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS ret_command(_Inout_ wsk_context &ctx)
 {
-	auto &hdr = ctx.hdr;
+	dequeue_request(ctx);
 
-	ctx.request = hdr.base.command == USBIP_RET_SUBMIT ? // request must be completed
-		      device::dequeue_request(*ctx.dev, hdr.base.seqnum) : WDF_NO_HANDLE;
-
-	{
-		char buf[DBG_USBIP_HDR_BUFSZ];
-		TraceEvents(TRACE_LEVEL_VERBOSE, FLAG_USBIP, "req %04x <- %Iu%s",
-			ptr04x(ctx.request), get_total_size(hdr), dbg_usbip_hdr(buf, sizeof(buf), &hdr, false));
-	}
-
-	if (auto sz = get_payload_size(hdr)) {
+	if (auto sz = get_payload_size(ctx.hdr)) {
 		auto f = ctx.request ? recv_payload : drain_payload;
 		return f(ctx, sz);
 	}
@@ -614,39 +674,318 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto validate_header(_Inout_ usbip_header &hdr)
 {
-	byteswap_header(hdr, swap_dir::net2host);
+	auto err = pdu::parse_ret_header(hdr);
+	if (err != pdu::parse_error::none) {
+		Trace(TRACE_LEVEL_ERROR, "%s, %!usbip_request_type!, seqnum %u", 
+			pdu::to_string(err), hdr.base.command, hdr.base.seqnum);
+	}
+
+	return err == pdu::parse_error::none;
+}
+
+/*
+ * @param offset in MDL chain to copy data to
+ * @return STATUS_SUCCESS if all data were copied 
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto copy_to_mdl(_In_ MDL *mdl, _In_ size_t offset, _In_ const char *data, _In_ ULONG length)
+{
+	for ( ; mdl && length; mdl = mdl->Next) {
 
-	auto &base = hdr.base;
-	auto cmd = static_cast<usbip_request_type>(base.command);
+		auto sz = MmGetMdlByteCount(mdl);
+		if (offset >= sz) {
+			offset -= sz;
+			continue;
+		}
 
-	switch (cmd) {
-	case USBIP_RET_SUBMIT: {
-		auto &ret = hdr.u.ret_submit;
-		if (ret.number_of_packets == number_of_packets_non_isoch) {
-			ret.number_of_packets = 0;
-		} else if (!is_valid_number_of_packets(ret.number_of_packets)) {
-			Trace(TRACE_LEVEL_ERROR, "number_of_packets(%d) is out of range", ret.number_of_packets);
-			return false;
+		auto dest = (char*)MmGetSystemAddressForMdlSafe(mdl, LowPagePriority | MdlMappingNoExecute);
+		if (!dest) {
+			Trace(TRACE_LEVEL_ERROR, "MmGetSystemAddressForMdlSafe error");
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+
+		auto cnt = min(length, sz - ULONG(offset));
+		RtlCopyMemory(dest + offset, data, cnt);
+
+		offset = 0;
+		data += cnt;
+		length -= cnt;
+	}
+
+	return length ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+}
+
+/*
+ * WSK_BUF.Offset must be within the first MDL of the chain.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto make_wsk_buf(_In_ MDL *mdl, _In_ ULONG offset, _In_ size_t length)
+{
+	for (ULONG sz; mdl && offset >= (sz = MmGetMdlByteCount(mdl)); mdl = mdl->Next) {
+		offset -= sz;
+	}
+
+	return WSK_BUF{ .Mdl = mdl, .Offset = offset, .Length = length };
+}
+
+/*
+ * The part of the payload that is already in receive_buffer is copied to URB.
+ * The rest is received directly into URB's transfer buffer, it does not pass through receive_buffer.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS ret_command_stream(_Inout_ wsk_context &ctx, _Inout_ receive_buffer &rb)
+{
+	dequeue_request(ctx);
+	auto sz = get_payload_size(ctx.hdr);
+
+	if (ULONG(sz) != sz) { // copy_to_mdl and make_wsk_buf use ULONG
+		Trace(TRACE_LEVEL_ERROR, "Buffer size truncation: ULONG(%lu) != size_t(%Iu)", ULONG(sz), sz);
+		return STATUS_INVALID_PARAMETER;
+	} else if (!sz) {
+		if (ctx.request) {
+			ret_submit(ctx);
+		}
+		return RECV_NEXT_USBIP_HDR;
+	} else if (!ctx.request) {
+		rb.skip = sz; // parse_buffer will discard it
+		ctx.dev->discarded_bytes += sz;
+		return RECV_NEXT_USBIP_HDR;
+	}
+
+	MDL *mdl{};
+	if (auto err = prepare_wsk_mdl(mdl, ctx, get_urb(ctx.request))) {
+		NT_ASSERT(err != RECV_MORE_DATA_REQUIRED);
+		Trace(TRACE_LEVEL_ERROR, "prepare_wsk_mdl %!STATUS!", err);
+		return err;
+	}
+
+	auto cnt = ULONG(min(sz, rb.tail - rb.head));
+
+	if (cnt == sz && ctx.is_isoc) {
+		auto st = ret_submit_isoc(ctx, rb.data + rb.head, sz);
+		rb.head += cnt;
+		return st;
+	}
+
+	if (auto err = copy_to_mdl(mdl, 0, rb.data + rb.head, cnt)) {
+		Trace(TRACE_LEVEL_ERROR, "copy_to_mdl %!STATUS!", err);
+		return err;
+	}
+
+	rb.head += cnt;
+
+	if (cnt == sz) {
+		return ret_submit(ctx);
+	}
+
+	auto buf = make_wsk_buf(mdl, cnt, sz - cnt);
+	return receive(buf, ret_submit, ctx);
+}
+
+/*
+ * Handle all complete messages in the buffer.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS parse_buffer(_Inout_ wsk_context &ctx)
+{
+	auto &rb = *ctx.dev->recv_buf;
+
+	while (true) {
+		if (auto &skip = rb.skip) {
+			auto cnt = ULONG(min(skip, rb.tail - rb.head));
+			rb.head += cnt;
+			skip -= cnt;
+		}
+
+		if (rb.skip || rb.tail - rb.head < sizeof(ctx.hdr)) {
+			return RECV_NEXT_USBIP_HDR;
+		}
+
+		NT_ASSERT(!ctx.request); // must be completed and zeroed on every cycle
+		ctx.mdl_buf.reset();
+
+		RtlCopyMemory(&ctx.hdr, rb.data + rb.head, sizeof(ctx.hdr));
+		rb.head += sizeof(ctx.hdr);
+
+		if (!validate_header(ctx.hdr)) {
+			return STATUS_INVALID_PARAMETER;
+		}
+
+		if (auto st = ret_command_stream(ctx, rb); st != RECV_NEXT_USBIP_HDR) {
+			return st;
 		}
-	}	break;
-	case USBIP_RET_UNLINK:
-		break;
-	default:
-		Trace(TRACE_LEVEL_ERROR, "USBIP_RET_* expected, got %!usbip_request_type!", cmd);
-		return false;
 	}
+}
 
-	auto ok = is_valid_seqnum(base.seqnum);
+_Function_class_(IO_COMPLETION_ROUTINE)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS on_receive_stream(
+	_In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_Inexpressible_("varies")) void *Context)
+{
+	auto &ctx = *static_cast<wsk_context*>(Context);
+	auto &rb = *ctx.dev->recv_buf;
 
-	if (ok) {
-		base.direction = extract_dir(base.seqnum); // always zero in server response
+	auto &ios = wsk_irp->IoStatus;
+	TraceWSK("%!STATUS!, Information %Iu", ios.Status, ios.Information);
+
+	NTSTATUS st;
+
+	if (NT_ERROR(ios.Status)) {
+		st = ios.Status;
+	} else if (!ios.Information) {
+		st = STATUS_CONNECTION_DISCONNECTED; // EOF
 	} else {
-		Trace(TRACE_LEVEL_ERROR, "Invalid seqnum %u", base.seqnum);
+		NT_ASSERT(ios.Information <= sizeof(rb.data) - rb.tail);
+		rb.tail += ULONG(ios.Information);
+		st = parse_buffer(ctx);
+	}
+
+	return after_receive(ctx, st);
+}
+
+
+/*
+ * Payload will be copied from data indications by parse_indicated.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS ret_command_event(_Inout_ wsk_context &ctx, _Inout_ receive_event_state &st)
+{
+	dequeue_request(ctx);
+
+	st.payload = nullptr;
+	st.offset = 0;
+	st.length = get_payload_size(ctx.hdr);
+
+	if (ULONG(st.length) != st.length) { // parse_indicated copies ULONG chunks
+		Trace(TRACE_LEVEL_ERROR, "Buffer size truncation: ULONG(%lu) != size_t(%Iu)", ULONG(st.length), st.length);
+		return STATUS_INVALID_PARAMETER;
+	} else if (!st.length) {
+		if (ctx.request) {
+			ret_submit(ctx);
+		}
+		st.hdr_len = 0; // next usbip_header
+	} else if (!ctx.request) {
+		ctx.dev->discarded_bytes += st.length; // payload will be discarded
+	} else if (auto err = prepare_wsk_mdl(st.payload, ctx, get_urb(ctx.request))) {
+		Trace(TRACE_LEVEL_ERROR, "prepare_wsk_mdl %!STATUS!", err);
+		return err;
+	} else if (size(st.payload) < st.length) {
+		Trace(TRACE_LEVEL_ERROR, "MDL size %Iu < payload size %Iu", size(st.payload), st.length);
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+/*
+ * Headers are parsed in place, payload is copied directly into URB's transfer buffer.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS parse_indicated(_Inout_ wsk_context &ctx, _In_ const char *data, _In_ ULONG length)
+{
+	auto &st = ctx.dev->recv_event;
+
+	while (length) {
+		if (st.hdr_len < sizeof(ctx.hdr)) {
+			auto cnt = min(length, ULONG(sizeof(ctx.hdr)) - st.hdr_len);
+			RtlCopyMemory(reinterpret_cast<char*>(&ctx.hdr) + st.hdr_len, data, cnt);
+
+			data += cnt;
+			length -= cnt;
+
+			if ((st.hdr_len += cnt) < sizeof(ctx.hdr)) {
+				break;
+			}
+
+			NT_ASSERT(!ctx.request); // must be completed and zeroed on every cycle
+			ctx.mdl_buf.reset();
+
+			if (!validate_header(ctx.hdr)) {
+				return STATUS_INVALID_PARAMETER;
+			}
+
+			if (auto err = ret_command_event(ctx, st)) {
+				return err;
+			}
+
+			continue;
+		}
+
+		if (st.payload && ctx.is_isoc && !st.offset && length >= st.length) {
+			if (auto err = ret_submit_isoc(ctx, data, st.length)) {
+				return err;
+			}
+
+			data += st.length;
+			length -= ULONG(st.length);
+
+			st.hdr_len = 0; // next usbip_header
+			continue;
+		}
+
+		auto cnt = ULONG(min(length, st.length - st.offset));
+
+		if (st.payload) {
+			if (auto err = copy_to_mdl(st.payload, st.offset, data, cnt)) {
+				Trace(TRACE_LEVEL_ERROR, "copy_to_mdl %!STATUS!", err);
+				return err;
+			}
+		}
+
+		data += cnt;
+		length -= cnt;
+
+		if ((st.offset += cnt) == st.length) {
+			if (ctx.request) {
+				ret_submit(ctx);
+			}
+			st.hdr_len = 0; // next usbip_header
+		}
 	}
 
-	return ok;
+	return STATUS_SUCCESS;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS parse_indicated(_Inout_ wsk_context &ctx, _In_ const WSK_BUF &buf)
+{
+	auto offset = buf.Offset;
+	auto length = buf.Length;
+
+	for (auto mdl = buf.Mdl; mdl && length; mdl = mdl->Next) {
+
+		auto sz = MmGetMdlByteCount(mdl);
+		if (offset >= sz) {
+			offset -= sz;
+			continue;
+		}
+
+		auto data = (char*)MmGetSystemAddressForMdlSafe(mdl, LowPagePriority | MdlMappingNoExecute);
+		if (!data) {
+			Trace(TRACE_LEVEL_ERROR, "MmGetSystemAddressForMdlSafe error");
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+
+		auto cnt = ULONG(min(length, sz - offset));
+
+		if (auto err = parse_indicated(ctx, data + offset, cnt)) {
+			return err;
+		}
+
+		offset = 0;
+		length -= cnt;
+	}
+
+	return length ? STATUS_INVALID_BUFFER_SIZE : STATUS_SUCCESS;
+}
 
 /*
  * A WSK application should not call new WSK functions in the context of the IoCompletion routine. 
@@ -665,6 +1004,11 @@ void NTAPI receive_usbip_header(_In_ WDFWORKITEM WorkItem)
 	NT_ASSERT(!ctx.request); // must be completed and zeroed on every cycle
 	ctx.mdl_buf.reset();
 
+	if (ctx.dev->drain_size) {
+		drain_chunk(ctx);
+		return;
+	}
+
 	ctx.mdl_hdr.next(nullptr);
 	WSK_BUF buf{ .Mdl = ctx.mdl_hdr.get(), .Length = sizeof(ctx.hdr) };
 
@@ -676,6 +1020,115 @@ void NTAPI receive_usbip_header(_In_ WDFWORKITEM WorkItem)
 	receive(buf, received, ctx);
 }
 
+/*
+ * Receive all available data, but not less than one byte.
+ * @see receive_usbip_header
+ */
+_Function_class_(EVT_WDF_WORKITEM)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void NTAPI receive_stream(_In_ WDFWORKITEM WorkItem)
+{
+	auto &ctx = *get_wsk_context(WorkItem);
+	auto &dev = *ctx.dev;
+	auto &rb = *dev.recv_buf;
+
+	NT_ASSERT(!ctx.request);
+	ctx.mdl_buf.reset();
+
+	if (auto cnt = rb.tail - rb.head) { // the beginning of usbip_header
+		NT_ASSERT(!rb.skip);
+		NT_ASSERT(cnt < sizeof(ctx.hdr));
+		RtlMoveMemory(rb.data, rb.data + rb.head, cnt);
+	}
+
+	rb.tail -= rb.head;
+	rb.head = 0;
+
+	WSK_BUF buf{ .Mdl = rb.mdl.get(), .Offset = rb.tail, .Length = sizeof(rb.data) - rb.tail };
+	dev.received = nullptr; // on_receive_stream does not use it
+
+	auto irp = ctx.wsk_irp; // do not access ctx or wsk_irp after receive
+	IoReuseIrp(irp, STATUS_SUCCESS);
+
+	IoSetCompletionRoutine(irp, on_receive_stream, &ctx, true, true, true);
+
+	auto st = receive(dev.sock(), &buf, 0, irp);
+	NT_ASSERT(st != STATUS_NOT_SUPPORTED); // on_receive_stream will not be called for this status only
+
+	if (st == STATUS_PENDING) {
+		TraceWSK("up to %Iu bytes", buf.Length);
+	} else {
+		TraceDbg("up to %Iu bytes, %!STATUS!", buf.Length, st);
+	}
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto get_receive_mode()
+{
+	PAGED_CODE();
+	auto val = query_parameter(receive_mode_value_name, ULONG(receive_mode::header));
+
+	switch (auto mode = static_cast<receive_mode>(val)) {
+	case receive_mode::header:
+	case receive_mode::stream:
+	case receive_mode::event:
+		return mode;
+	default:
+		Trace(TRACE_LEVEL_ERROR, "Unexpected %S %lu", receive_mode_value_name, val);
+		return receive_mode::header;
+	}
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto alloc_receive_buffer(_Inout_ device_ctx &dev)
+{
+	PAGED_CODE();
+	NT_ASSERT(!dev.recv_buf);
+
+	auto rb = (receive_buffer*)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(*dev.recv_buf), pooltag);
+	if (!rb) {
+		Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", sizeof(*rb));
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	dev.recv_buf = rb; // zeroed, Mdl is empty
+
+	rb->mdl = Mdl(rb->data, sizeof(rb->data));
+	if (auto err = rb->mdl.prepare_nonpaged()) {
+		Trace(TRACE_LEVEL_ERROR, "prepare_nonpaged %!STATUS!", err);
+		return err;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto alloc_drain_buffer(_Inout_ device_ctx &dev)
+{
+	PAGED_CODE();
+	NT_ASSERT(!dev.drain_buf);
+
+	auto db = (drain_buffer*)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(*dev.drain_buf), pooltag);
+	if (!db) {
+		Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", sizeof(*db));
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	dev.drain_buf = db; // zeroed, Mdl is empty
+
+	db->mdl = Mdl(db->data, sizeof(db->data));
+	if (auto err = db->mdl.prepare_nonpaged()) {
+		Trace(TRACE_LEVEL_ERROR, "prepare_nonpaged %!STATUS!", err);
+		return err;
+	}
+
+	return STATUS_SUCCESS;
+}
+
 } // namespace
 
 
@@ -694,6 +1147,8 @@ void usbip::complete(_In_ WDFREQUEST request, _In_ NTSTATUS status)
 		if (status) {
 			TraceDbg("seqnum %u, %!STATUS!, Information %#Ix", req.seqnum, status, info);
 		}
+		stat_complete(request, status, USBD_STATUS_SUCCESS, nullptr);
+		trace_urb(request, status, USBD_STATUS_SUCCESS, nullptr);
 		WdfRequestComplete(request, status);
 		return;
 	}
@@ -710,6 +1165,9 @@ void usbip::complete(_In_ WDFREQUEST request, _In_ NTSTATUS status)
 			req.seqnum, get_usbd_status(urb_st), status, info);
 	}
 
+	stat_complete(request, status, urb_st, &urb);
+	trace_urb(request, status, urb_st, &urb);
+
 	if (NT_SUCCESS(status)) {
 		UdecxUrbComplete(request, urb_st);
 	} else {
@@ -723,8 +1181,26 @@ PAGED NTSTATUS usbip::init_receive_usbip_header(_In_ device_ctx &ctx)
 {
 	PAGED_CODE();
 
-	WDF_WORKITEM_CONFIG cfg;
-	WDF_WORKITEM_CONFIG_INIT(&cfg, receive_usbip_header);
+	ctx.recv_mode = get_receive_mode();
+	TraceDbg("receive mode %lu", ULONG(ctx.recv_mode));
+
+	switch (ctx.recv_mode) {
+	case receive_mode::header:
+		if (auto err = alloc_drain_buffer(ctx)) {
+			return err;
+		}
+		break;
+	case receive_mode::stream:
+		if (auto err = alloc_receive_buffer(ctx)) {
+			return err;
+		}
+		break;
+	case receive_mode::event:
+		break;
+	}
+
+	WDF_WORKITEM_CONFIG cfg; // is not scheduled for receive_mode::event, but WskReceiveEvent uses its wsk_context
+	WDF_WORKITEM_CONFIG_INIT(&cfg, ctx.recv_mode == receive_mode::stream ? receive_stream : receive_usbip_header);
 	cfg.AutomaticSerialization = false;
 
 	WDF_OBJECT_ATTRIBUTES attrs; // WdfSynchronizationScopeNone is inherited from the driver object
@@ -746,3 +1222,65 @@ PAGED NTSTATUS usbip::init_receive_usbip_header(_In_ device_ctx &ctx)
 
 	return STATUS_INSUFFICIENT_RESOURCES;
 }
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::free_receive_buffer(_Inout_ device_ctx &ctx)
+{
+	PAGED_CODE();
+
+	if (auto &rb = ctx.recv_buf) {
+		rb->mdl.reset();
+		ExFreePoolWithTag(rb, pooltag);
+		rb = nullptr;
+	}
+
+	if (auto &db = ctx.drain_buf) {
+		db->mdl.reset();
+		ExFreePoolWithTag(db, pooltag);
+		db = nullptr;
+	}
+}
+
+/*
+ * The WSK subsystem does not call it concurrently for the same socket.
+ * Indicated data are always accepted entirely or not at all.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS WSKAPI usbip::WskReceiveEvent(
+	_In_opt_ PVOID SocketContext, 
+	_In_ ULONG Flags, 
+	_In_opt_ WSK_DATA_INDICATION *DataIndication,
+	_In_ SIZE_T BytesIndicated,
+	_Inout_ SIZE_T *BytesAccepted)
+{
+	auto &dev = *static_cast<device_ctx_ext*>(SocketContext)->ctx;
+	auto &st = dev.recv_event;
+
+	{
+		char buf[wsk::RECEIVE_EVENT_FLAGS_BUFBZ];
+		TraceWSK("dev %04x, %s, BytesIndicated %Iu", ptr04x(get_device(&dev)), 
+			  wsk::ReceiveEventFlags(buf, sizeof(buf), Flags), BytesIndicated);
+	}
+
+	if (st.failed || dev.unplugged) {
+		return STATUS_DATA_NOT_ACCEPTED;
+	}
+
+	auto &ctx = *get_wsk_context(dev.recv_hdr);
+	auto err = DataIndication ? STATUS_SUCCESS : STATUS_CONNECTION_DISCONNECTED; // graceful disconnect
+
+	for (auto di = DataIndication; di && !err; di = di->Next) {
+		err = parse_indicated(ctx, di->Buffer);
+	}
+
+	if (err) {
+		st.failed = true;
+		NT_ASSERT(!dev.received); // receive() is not used in this mode
+		receive_failed(ctx, err);
+		return DataIndication ? STATUS_DATA_NOT_ACCEPTED : STATUS_SUCCESS;
+	}
+
+	*BytesAccepted = BytesIndicated;
+	return STATUS_SUCCESS;
+}
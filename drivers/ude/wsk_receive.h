@@ -6,6 +6,7 @@
 
 #include <libdrv\codeseg.h>
 #include <libdrv/wdf_cpp.h>
+#include <libdrv\wsk_cpp.h>
 
 namespace usbip
 {
@@ -30,4 +31,20 @@ _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS init_receive_usbip_header(_In_ device_ctx &ctx);
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void free_receive_buffer(_Inout_ device_ctx &ctx);
+
+/*
+ * For receive_mode::event.
+ * @see WSK_CLIENT_CONNECTION_DISPATCH
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS WSKAPI WskReceiveEvent(
+        _In_opt_ PVOID SocketContext, 
+        _In_ ULONG Flags, 
+        _In_opt_ WSK_DATA_INDICATION *DataIndication,
+        _In_ SIZE_T BytesIndicated,
+        _Inout_ SIZE_T *BytesAccepted);
+
 } // namespace usbip
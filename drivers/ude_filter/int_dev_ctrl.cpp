@@ -230,6 +230,19 @@ NTSTATUS irp_completed(_In_ DEVICE_OBJECT*, _In_ IRP *irp, _In_reads_opt_(_Inexp
 	return ContinueCompletion;
 }
 
+/*
+ * The frame number must be the same as QueryBusTime returns, @see query_interface.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+auto get_current_frame_number(_In_ IRP *irp, _Inout_ _URB_GET_CURRENT_FRAME_NUMBER &r)
+{
+	r.FrameNumber = get_host_frame_number();
+	r.Hdr.Status = USBD_STATUS_SUCCESS;
+
+	return CompleteRequest(irp, STATUS_SUCCESS);
+}
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _IRQL_requires_same_
 auto pre_process_irp(_In_ filter_ext &fltr, _In_ IRP *irp)
@@ -261,6 +274,15 @@ NTSTATUS usbip::int_dev_ctrl(_In_ DEVICE_OBJECT *devobj, _In_ IRP *irp)
 		return CompleteRequest(irp, err);
 	}
 
-	auto f = fltr.is_hub ? ForwardIrp : pre_process_irp;
-	return f(fltr, irp);
+	if (fltr.is_hub) {
+		return ForwardIrp(fltr, irp);
+	}
+
+	if (libdrv::DeviceIoControlCode(irp) == IOCTL_INTERNAL_USB_SUBMIT_URB) {
+		if (auto urb = libdrv::urb_from_irp(irp); urb->UrbHeader.Function == URB_FUNCTION_GET_CURRENT_FRAME_NUMBER) {
+			return get_current_frame_number(irp, urb->UrbGetCurrentFrameNumber);
+		}
+	}
+
+	return pre_process_irp(fltr, irp);
 }
@@ -6,6 +6,8 @@
 #include "trace.h"
 #include "query_interface.tmh"
 
+#include <libdrv\usbd_helper.h>
+
 #include <usb.h>
 #include <usbbusif.h>
 
@@ -23,8 +25,7 @@ _Must_inspect_result_ NTSTATUS USB_BUSIFFN QueryBusTime(
 	_Out_opt_ ULONG *CurrentUsbFrame)
 {
 	if (CurrentUsbFrame) {
-		static ULONG dummy;
-		*CurrentUsbFrame = ++dummy; // zero is OK too
+		*CurrentUsbFrame = get_host_frame_number();
 		// TraceDbg("%lu", *CurrentUsbFrame); // too often
 	}
 
@@ -42,15 +43,15 @@ _Function_class_(PUSB_BUSIFFN_QUERY_BUS_TIME_EX)
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _Must_inspect_result_ NTSTATUS USB_BUSIFFN QueryBusTimeEx(
-	_In_opt_ PVOID BusContext,
+	_In_opt_ PVOID,
 	_Out_opt_ PULONG HighSpeedFrameCounter)
 {
-	auto st = QueryBusTime(BusContext, HighSpeedFrameCounter);
-	if (NT_SUCCESS(st)) {
-		*HighSpeedFrameCounter <<= 3;
-		// TraceDbg("%lu", **HighSpeedFrameCounter); // too often
+	if (HighSpeedFrameCounter) {
+		*HighSpeedFrameCounter = ULONG(KeQueryInterruptTime()/1'250); // get_host_frame_number() << 3 | micro-frame
+		// TraceDbg("%lu", *HighSpeedFrameCounter); // too often
 	}
-	return st;
+
+	return STATUS_SUCCESS;
 }
 
 } // namespace
@@ -58,6 +59,8 @@ _Must_inspect_result_ NTSTATUS USB_BUSIFFN QueryBusTimeEx(
 
 /*
  * Audio devices do not work if QueryBusTime returns an error.
+ * Bus time is always substituted, it must be the same as the frame number of URB_FUNCTION_GET_CURRENT_FRAME_NUMBER
+ * because usbip2_ude maps StartFrame of isoch transfers from it.
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
@@ -65,20 +68,15 @@ PAGED void usbip::query_interface(_Inout_ filter_ext &, _Inout_ _USB_BUS_INTERFA
 {
 	PAGED_CODE();
 
-	switch (ULONG dummy; r.Version) {
+	switch (r.Version) {
 	case USB_BUSIF_USBDI_VERSION_3:
-		if (auto st = r.QueryBusTimeEx(r.BusContext, &dummy); NT_ERROR(st)) {
-			TraceDbg("QueryBusTimeEx -> %!STATUS!, substituted", st);
-			r.QueryBusTimeEx = QueryBusTimeEx;
-		}
+		r.QueryBusTimeEx = QueryBusTimeEx;
 		[[fallthrough]];
 	case USB_BUSIF_USBDI_VERSION_2:
 	case USB_BUSIF_USBDI_VERSION_1:
 	case USB_BUSIF_USBDI_VERSION_0:
-		if (auto st = r.QueryBusTime(r.BusContext, &dummy); NT_ERROR(st)) {
-			TraceDbg("QueryBusTime -> %!STATUS!, substituted", st);
-			r.QueryBusTime = QueryBusTime;
-		}
+		r.QueryBusTime = QueryBusTime;
+		TraceDbg("QueryBusTime substituted, USB_BUSIF_USBDI_VERSION_%lu", r.Version);
 		break;
 	default:
 		Trace(TRACE_LEVEL_ERROR, "Unexpected USB_BUSIF_USBDI_VERSION_%lu", r.Version);
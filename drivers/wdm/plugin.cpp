@@ -293,202 +293,314 @@ PAGEABLE auto init_req_get_descr(
         return true;
 }
 
+/*
+ * GET_DESCRIPTOR request of read_descriptors().
+ */
+struct descr_request
+{
+        UCHAR type;
+        UCHAR index;
+        USHORT lang_id;
+
+        usbip::memory pool; // of buf
+        void *buf;
+        USHORT len; // IN: wLength, OUT: actual_length
+
+        seqnum_t seqnum;
+        INT32 status; // of RET_SUBMIT
+        bool done;
+};
+
+/*
+ * The requests are sent by a single send, server's replies are matched by seqnum.
+ * A response with an error (f.e. EPIPE for an absent string) does not fail the call,
+ * check descr_request.status.
+ * 
+ * A socket is read synchronously, so all replies must be received to keep the stream in sync.
+ */
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGEABLE auto read_descr_hdr(vpdo_dev_t &vpdo, UCHAR type, UCHAR index, USHORT lang_id, _Inout_ USHORT &TransferBufferLength)
+PAGEABLE auto read_descriptors(vpdo_dev_t &vpdo, descr_request *v, int cnt)
 {
         PAGED_CODE();
 
-        usbip_header hdr{};
-        if (!init_req_get_descr(hdr, vpdo, type, index, lang_id, TransferBufferLength)) {
-                return ERR_GENERAL;
-        }
+        enum { MAX_REQUESTS = 8 };
+        NT_ASSERT(cnt > 0 && cnt <= MAX_REQUESTS);
 
+        usbip_header hdrs[MAX_REQUESTS]{};
         char buf[DBG_USBIP_HDR_BUFSZ];
-        TraceEvents(TRACE_LEVEL_VERBOSE, FLAG_USBIP, "OUT %Iu%s", get_total_size(hdr), dbg_usbip_hdr(buf, sizeof(buf), &hdr, true));
 
-        byteswap_header(hdr, swap_dir::host2net);
+        for (int i = 0; i < cnt; ++i) {
+                auto &r = v[i];
+                auto &hdr = hdrs[i];
 
-        if (auto err = send(vpdo.sock, usbip::memory::stack, &hdr, sizeof(hdr))) {
-                Trace(TRACE_LEVEL_ERROR, "Send header of %!usb_descriptor_type! %!STATUS!", type, err);
-                return ERR_NETWORK;
+                if (!init_req_get_descr(hdr, vpdo, r.type, r.index, r.lang_id, r.len)) {
+                        return ERR_GENERAL;
+                }
+
+                r.seqnum = hdr.base.seqnum;
+                r.done = false;
+
+                TraceEvents(TRACE_LEVEL_VERBOSE, FLAG_USBIP, "OUT %Iu%s", get_total_size(hdr), dbg_usbip_hdr(buf, sizeof(buf), &hdr, true));
+                byteswap_header(hdr, swap_dir::host2net);
         }
 
-        if (auto err = recv(vpdo.sock, usbip::memory::stack, &hdr, sizeof(hdr))) {
-                Trace(TRACE_LEVEL_ERROR, "Recv header of %!usb_descriptor_type! %!STATUS!", type, err);
+        if (auto err = send(vpdo.sock, usbip::memory::stack, hdrs, cnt*sizeof(*hdrs))) {
+                Trace(TRACE_LEVEL_ERROR, "Send %d request(s) %!STATUS!", cnt, err);
                 return ERR_NETWORK;
         }
 
-        byteswap_header(hdr, swap_dir::net2host);
-        TraceEvents(TRACE_LEVEL_VERBOSE, FLAG_USBIP, "IN %Iu%s", get_total_size(hdr), dbg_usbip_hdr(buf, sizeof(buf), &hdr, true));
+        for (int n = 0; n < cnt; ++n) {
 
-        auto &b = hdr.base;
-        if (!(b.command == USBIP_RET_SUBMIT && extract_num(b.seqnum) == vpdo.seqnum)) {
-                return ERR_PROTOCOL;
-        }
+                usbip_header hdr;
+                if (auto err = recv(vpdo.sock, usbip::memory::stack, &hdr, sizeof(hdr))) {
+                        Trace(TRACE_LEVEL_ERROR, "Recv header %!STATUS!", err);
+                        return ERR_NETWORK;
+                }
 
-        auto &ret = hdr.u.ret_submit;
-        auto actual_length = static_cast<USHORT>(ret.actual_length);
+                byteswap_header(hdr, swap_dir::net2host);
+                TraceEvents(TRACE_LEVEL_VERBOSE, FLAG_USBIP, "IN %Iu%s", get_total_size(hdr), dbg_usbip_hdr(buf, sizeof(buf), &hdr, true));
 
-        if (actual_length <= TransferBufferLength) {
-                TransferBufferLength = actual_length;
-        } else {
-                TransferBufferLength = 0;
-                return ERR_GENERAL;
-        }
+                descr_request *r{};
+                for (int i = 0; i < cnt; ++i) {
+                        if (!v[i].done && v[i].seqnum == hdr.base.seqnum) {
+                                r = v + i;
+                                break;
+                        }
+                }
 
-        return ret.status ? ERR_GENERAL : ERR_NONE;
-}
+                if (!(r && hdr.base.command == USBIP_RET_SUBMIT)) {
+                        Trace(TRACE_LEVEL_ERROR, "Unexpected %!usbip_request_type!, seqnum %u", hdr.base.command, hdr.base.seqnum);
+                        return ERR_PROTOCOL;
+                }
 
-_IRQL_requires_(PASSIVE_LEVEL)
-PAGEABLE auto read_descr(
-        vpdo_dev_t &vpdo, UCHAR type, UCHAR index, USHORT lang_id, usbip::memory pool, _Out_ void *dest, _Inout_ USHORT &len)
-{
-        PAGED_CODE();
+                auto &ret = hdr.u.ret_submit;
+                if (!(ret.actual_length >= 0 && ret.actual_length <= r->len)) {
+                        Trace(TRACE_LEVEL_ERROR, "%!usb_descriptor_type!, actual_length %d > %d", r->type, ret.actual_length, r->len);
+                        return ERR_PROTOCOL;
+                }
 
-        if (auto err = read_descr_hdr(vpdo, type, index, lang_id, len)) {
-                return err;
-        }
+                r->len = static_cast<USHORT>(ret.actual_length);
+                r->status = ret.status;
+                r->done = true;
 
-        if (auto err = recv(vpdo.sock, pool, dest, len)) {
-                Trace(TRACE_LEVEL_ERROR, "%!usb_descriptor_type!, length %d -> %!STATUS!", type, len, err);
-                return ERR_NETWORK;
+                if (!r->len) {
+                        //
+                } else if (auto err = recv(vpdo.sock, r->pool, r->buf, r->len)) {
+                        Trace(TRACE_LEVEL_ERROR, "%!usb_descriptor_type!, length %d -> %!STATUS!", r->type, r->len, err);
+                        return ERR_NETWORK;
+                }
         }
 
         return ERR_NONE;
 }
 
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGEABLE auto read_device_descr(vpdo_dev_t &vpdo)
+PAGEABLE auto read_descr(
+        vpdo_dev_t &vpdo, UCHAR type, UCHAR index, USHORT lang_id, usbip::memory pool, _Out_ void *dest, _Inout_ USHORT &len)
 {
         PAGED_CODE();
-        
-        USHORT len = sizeof(vpdo.descriptor);
 
-        if (auto err = read_descr(vpdo, USB_DEVICE_DESCRIPTOR_TYPE, 0, 0, usbip::memory::nonpaged, &vpdo.descriptor, len)) {
+        descr_request r{ .type = type, .index = index, .lang_id = lang_id, .pool = pool, .buf = dest, .len = len };
+
+        if (auto err = read_descriptors(vpdo, &r, 1)) {
                 return err;
         }
 
-        return len == sizeof(vpdo.descriptor) && is_valid(vpdo.descriptor) ? ERR_NONE : ERR_GENERAL;
+        len = r.len;
+        return r.status ? ERR_GENERAL : ERR_NONE;
 }
 
+enum { MAX_STRING_LENGTH = MAXUCHAR }; // bLength is UCHAR
+struct string_buf { USB_STRING_DESCRIPTOR sd; UCHAR data[MAX_STRING_LENGTH - sizeof(USB_STRING_DESCRIPTOR)]; };
+
+/*
+ * @return false if the string descriptor is invalid
+ */
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGEABLE auto read_config_descr(
-        _Inout_ vpdo_dev_t &vpdo, _In_ usbip::memory pool, _Out_ USB_CONFIGURATION_DESCRIPTOR *cd, _Inout_ USHORT &len)
+PAGEABLE auto save_string(vpdo_dev_t &vpdo, UCHAR idx, const USB_STRING_DESCRIPTOR &sd, USHORT len)
 {
         PAGED_CODE();
-        NT_ASSERT(len >= sizeof(*cd));
 
-        if (auto err = read_descr(vpdo, USB_CONFIGURATION_DESCRIPTOR_TYPE, 0, 0, pool, cd, len)) {
-                return err;
+        if (!(len >= sizeof(USB_COMMON_DESCRIPTOR) && is_valid(sd) && sd.bLength <= len)) { // string length can be zero
+                Trace(TRACE_LEVEL_ERROR, "Index %d, USB_STRING_DESCRIPTOR expected, length %d", idx, len);
+                return false;
         }
 
-        return len >= sizeof(*cd) && is_valid(*cd) ? ERR_NONE : ERR_GENERAL;
-}
-
-_IRQL_requires_(PASSIVE_LEVEL)
-PAGEABLE auto read_config_descr(vpdo_dev_t &vpdo)
-{
-        PAGED_CODE();
-
-        USB_CONFIGURATION_DESCRIPTOR cd{};
-        USHORT len = sizeof(cd);
+        len = sd.bLength;
 
-        if (auto err = read_config_descr(vpdo, usbip::memory::stack, &cd, len)) {
-                return err;
+        if (len == sizeof(USB_COMMON_DESCRIPTOR)) {
+                TraceDbg("Index %d, skip empty string", idx);
+                return true;
         }
 
-        log(cd);
-        len = cd.wTotalLength;
-
-        NT_ASSERT(!vpdo.actconfig);
-        vpdo.actconfig = (USB_CONFIGURATION_DESCRIPTOR*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, 
-                                                                        len, USBIP_VHCI_POOL_TAG);
+        auto sz = len + sizeof(*sd.bString); // + L'\0'
 
-        if (!vpdo.actconfig) {
-                return ERR_GENERAL;
+        auto d = (USB_STRING_DESCRIPTOR*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, sz, USBIP_VHCI_POOL_TAG);
+        if (!d) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", sz);
+                return false;
         }
 
-        if (auto err = read_config_descr(vpdo, usbip::memory::nonpaged, vpdo.actconfig, len)) {
-                return err;
-        }
+        RtlCopyMemory(d, &sd, len);
+        terminate_by_zero(*d);
 
-        return len == cd.wTotalLength ? ERR_NONE : ERR_GENERAL;
+        NT_ASSERT(!vpdo.strings[idx]);
+        vpdo.strings[idx] = d;
+
+        return true;
 }
 
 /*
  * A device should return EPIPE on attempt to read string descriptor with invalid index.
  * But some devices return EPROTO and fail all requests after that with this error.
  * For this reason read existing strings only. 
- * String index 0 should return a list of supported languages (always exists?).
+ * String index 0 (a list of supported languages) is read by read_device_descriptors.
+ *
+ * The maximum length of a string descriptor is requested at once instead of reading its header first.
  */
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGEABLE auto read_string_descriptors(vpdo_dev_t &vpdo)
 {
         PAGED_CODE();
 
+        auto langs = vpdo.strings[0];
+        if (!langs) {
+                return ERR_NONE;
+        }
+
         auto &dd = vpdo.descriptor;
 
-        UCHAR indexes[] { 0, dd.iManufacturer, dd.iProduct, dd.iSerialNumber, 
+        UCHAR indexes[] { dd.iManufacturer, dd.iProduct, dd.iSerialNumber, 
                           vpdo.actconfig ? vpdo.actconfig->iConfiguration : UCHAR(0) };
 
-        for (USHORT lang_id = 0; auto &idx: indexes) {
+        descr_request v[ARRAYSIZE(indexes)];
+        int cnt = 0;
 
-                if (!idx && lang_id) {
+        for (auto lang_id = *langs->bString; auto idx: indexes) { // Language Code Zero, f.e. 0x0409 English - United States
+                if (!idx) {
                         continue;
                 } else if (idx >= ARRAYSIZE(vpdo.strings)) {
                         TraceMsg("Can't save index %d in strings[%d]", idx, ARRAYSIZE(vpdo.strings));
                         continue;
                 }
 
-                USB_STRING_DESCRIPTOR hdr;
-                USHORT len = sizeof(hdr);
+                bool dup = false;
+                for (int i = 0; i < cnt && !dup; dup = v[i++].index == idx);
 
-                if (auto err = read_descr(vpdo, USB_STRING_DESCRIPTOR_TYPE, idx, lang_id, usbip::memory::stack, &hdr, len)) {
-                        break; // EPIPE?
+                if (!dup) {
+                        v[cnt++] = descr_request{ .type = USB_STRING_DESCRIPTOR_TYPE, .index = idx, .lang_id = lang_id, 
+                                                  .pool = usbip::memory::nonpaged, .len = MAX_STRING_LENGTH };
                 }
+        }
 
-                if (!(len >= sizeof(USB_COMMON_DESCRIPTOR) && is_valid(hdr))) { // string length can be zero
-                        Trace(TRACE_LEVEL_ERROR, "USB_STRING_DESCRIPTOR expected, length %d", len);
-                        return ERR_GENERAL;
-                }
+        if (!cnt) {
+                return ERR_NONE;
+        }
 
-                len = hdr.bLength;
-                if (len == sizeof(USB_COMMON_DESCRIPTOR)) {
-                        TraceDbg("Index %d, skip empty string", idx);
-                        continue;
+        auto bufs = (string_buf*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, cnt*sizeof(string_buf), USBIP_VHCI_POOL_TAG);
+        if (!bufs) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", cnt*sizeof(string_buf));
+                return ERR_GENERAL;
+        }
+
+        for (int i = 0; i < cnt; ++i) {
+                v[i].buf = bufs + i;
+        }
+
+        auto ret = read_descriptors(vpdo, v, cnt);
+
+        for (int i = 0; !ret && i < cnt; ++i) {
+                auto &r = v[i];
+
+                if (r.status) {
+                        TraceDbg("Index %d, status %d", r.index, r.status); // EPIPE?
+                } else if (!save_string(vpdo, r.index, bufs[i].sd, r.len)) {
+                        ret = ERR_GENERAL;
+                } else if (auto s = vpdo.strings[r.index]) {
+                        TraceMsg("Index %d, LangId %#x, '%!WSTR!'", r.index, r.lang_id, s->bString);
                 }
+        }
+
+        ExFreePoolWithTag(bufs, USBIP_VHCI_POOL_TAG);
+        return ret;
+}
+
+/*
+ * Device, configuration descriptors and the list of supported languages are requested at once.
+ * Most configuration descriptors fit in the initial buffer, otherwise it is read again with wTotalLength.
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE auto read_device_descriptors(vpdo_dev_t &vpdo)
+{
+        PAGED_CODE();
+
+        const USHORT cfg_bufsz = 512; // most configuration descriptors are shorter
+
+        NT_ASSERT(!vpdo.actconfig);
+        vpdo.actconfig = (USB_CONFIGURATION_DESCRIPTOR*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, 
+                                                                        cfg_bufsz, USBIP_VHCI_POOL_TAG);
+        if (!vpdo.actconfig) {
+                return ERR_GENERAL;
+        }
+
+        string_buf langs;
 
-                auto sz = len + sizeof(*hdr.bString); // + L'\0'
+        descr_request v[] {
+                { .type = USB_DEVICE_DESCRIPTOR_TYPE, .pool = usbip::memory::nonpaged, 
+                  .buf = &vpdo.descriptor, .len = sizeof(vpdo.descriptor) },
+                { .type = USB_CONFIGURATION_DESCRIPTOR_TYPE, .pool = usbip::memory::nonpaged, 
+                  .buf = vpdo.actconfig, .len = cfg_bufsz },
+                { .type = USB_STRING_DESCRIPTOR_TYPE, .pool = usbip::memory::stack, 
+                  .buf = &langs, .len = MAX_STRING_LENGTH },
+        };
 
-                auto sd = (USB_STRING_DESCRIPTOR*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, sz, USBIP_VHCI_POOL_TAG);
-                if (!sd) {
-                        Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", sz);
+        if (auto err = read_descriptors(vpdo, v, ARRAYSIZE(v))) {
+                return err;
+        }
+
+        if (auto &r = v[0]; !(!r.status && r.len == sizeof(vpdo.descriptor) && is_valid(vpdo.descriptor))) {
+                Trace(TRACE_LEVEL_ERROR, "USB_DEVICE_DESCRIPTOR: status %d, length %d", r.status, r.len);
+                return ERR_GENERAL;
+        }
+
+        auto &cd = *vpdo.actconfig;
+
+        if (auto &r = v[1]; !(!r.status && r.len >= sizeof(cd) && is_valid(cd))) {
+                Trace(TRACE_LEVEL_ERROR, "USB_CONFIGURATION_DESCRIPTOR: status %d, length %d", r.status, r.len);
+                return ERR_GENERAL;
+        } else if (r.len == cd.wTotalLength) {
+                // the whole descriptor is read
+        } else if (cd.wTotalLength <= cfg_bufsz) {
+                Trace(TRACE_LEVEL_ERROR, "USB_CONFIGURATION_DESCRIPTOR: wTotalLength %d, length %d", cd.wTotalLength, r.len);
+                return ERR_GENERAL;
+        } else {
+                USHORT len = cd.wTotalLength;
+                TraceDbg("USB_CONFIGURATION_DESCRIPTOR: wTotalLength %d > %d, read again", len, cfg_bufsz);
+
+                ExFreePoolWithTag(vpdo.actconfig, USBIP_VHCI_POOL_TAG);
+                vpdo.actconfig = (USB_CONFIGURATION_DESCRIPTOR*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, 
+                                                                                len, USBIP_VHCI_POOL_TAG);
+                if (!vpdo.actconfig) {
                         return ERR_GENERAL;
                 }
 
-                if (len <= sizeof(hdr)) {
-                        RtlCopyMemory(sd, &hdr, len);
-                } else if (auto err = read_descr(vpdo, USB_STRING_DESCRIPTOR_TYPE, idx, lang_id, usbip::memory::nonpaged, sd, len)) {
-                        ExFreePoolWithTag(sd, USBIP_VHCI_POOL_TAG);
+                if (auto err = read_descr(vpdo, USB_CONFIGURATION_DESCRIPTOR_TYPE, 0, 0, usbip::memory::nonpaged, vpdo.actconfig, len)) {
                         return err;
                 }
 
-                if (len == hdr.bLength && is_valid(*sd) && sd->bLength == len) {
-                        terminate_by_zero(*sd);
-                        NT_ASSERT(!vpdo.strings[idx]);
-                        vpdo.strings[idx] = sd;
-                } else {
-                        Trace(TRACE_LEVEL_ERROR, "length %d", len);
-                        ExFreePoolWithTag(sd, USBIP_VHCI_POOL_TAG);
+                if (!(len == vpdo.actconfig->wTotalLength && is_valid(*vpdo.actconfig))) {
                         return ERR_GENERAL;
                 }
+        }
 
-                if (idx) {
-                        TraceMsg("Index %d, LangId %#x, '%!WSTR!'", idx, lang_id, sd->bString);
-                } else {
-                        TraceMsg("List of supported languages%!BIN!", WppBinary(sd, sd->bLength));
-                        lang_id = *sd->bString; // Supported Language Code Zero, f.e. 0x0409 English - United States
-                }
+        log(*vpdo.actconfig);
+
+        if (auto &r = v[2]; r.status) {
+                TraceDbg("List of supported languages, status %d", r.status); // EPIPE?
+        } else if (!save_string(vpdo, 0, langs.sd, r.len)) {
+                return ERR_GENERAL;
+        } else if (auto sd = vpdo.strings[0]) {
+                TraceMsg("List of supported languages%!BIN!", WppBinary(sd, sd->bLength));
         }
 
         return ERR_NONE;
@@ -511,7 +623,11 @@ PAGEABLE auto fetch_descriptors(vpdo_dev_t &vpdo, const usbip_usb_device &udev)
 {
         PAGED_CODE();
 
-        if (auto err = read_device_descr(vpdo)) {
+        if (auto err = read_device_descriptors(vpdo)) {
+                if (auto &ptr = vpdo.actconfig) {
+                        ExFreePoolWithTag(ptr, USBIP_VHCI_POOL_TAG);
+                        ptr = nullptr;
+                }
                 return err;
         }
 
@@ -524,14 +640,6 @@ PAGEABLE auto fetch_descriptors(vpdo_dev_t &vpdo, const usbip_usb_device &udev)
                 return ERR_GENERAL;
         }
 
-        if (auto err = read_config_descr(vpdo)) {
-                if (auto &ptr = vpdo.actconfig) {
-                        ExFreePoolWithTag(ptr, USBIP_VHCI_POOL_TAG);
-                        ptr = nullptr;
-                }
-                return err;
-        }
-
         TraceDbg("USB_CONFIGURATION_DESCRIPTOR: %!BIN!", WppBinary(vpdo.actconfig, vpdo.actconfig->wTotalLength));
 
         if (is_configured(udev) && !is_same_device(udev, *vpdo.actconfig)) {
@@ -572,10 +680,14 @@ PAGEABLE auto import_remote_device(vpdo_dev_t &vpdo)
 
         vpdo.devid = make_devid(static_cast<UINT16>(udev.busnum), static_cast<UINT16>(udev.devnum));
 
+        auto start = KeQueryInterruptTime();
+
         if (auto err = fetch_descriptors(vpdo, udev)) {
                 return make_error(err);
         }
 
+        TraceMsg("Descriptors are fetched in %I64u ms", (KeQueryInterruptTime() - start)/10'000);
+
         if (auto err = event_callback_control(vpdo.sock, WSK_EVENT_DISCONNECT, false)) {
                 Trace(TRACE_LEVEL_ERROR, "event_callback_control %!STATUS!", err);
                 return make_error(ERR_NETWORK);
@@ -706,19 +818,25 @@ PAGEABLE NTSTATUS plugin_vpdo(vhub_dev_t &vhub, ioctl_usbip_vhci_plugin &r)
                 return STATUS_SUCCESS;
         }
 
+        auto start = KeQueryInterruptTime(); // 100-nanosecond units
+
         if (bool(error = connect(*vpdo))) {
                 Trace(TRACE_LEVEL_ERROR, "Can't connect to %!USTR!:%!USTR!", &vpdo->node_name, &vpdo->service_name);
                 destroy_device(vpdo);
                 return STATUS_SUCCESS;
         }
 
-        Trace(TRACE_LEVEL_INFORMATION, "Connected to %!USTR!:%!USTR!", &vpdo->node_name, &vpdo->service_name);
+        auto connected = KeQueryInterruptTime();
+        Trace(TRACE_LEVEL_INFORMATION, "Connected to %!USTR!:%!USTR! in %I64u ms", 
+                &vpdo->node_name, &vpdo->service_name, (connected - start)/10'000);
 
         if (bool(error = import_remote_device(*vpdo))) {
                 destroy_device(vpdo);
                 return STATUS_SUCCESS;
         }
 
+        TraceMsg("Imported in %I64u ms", (KeQueryInterruptTime() - connected)/10'000);
+
         if (vhub_attach_vpdo(vpdo)) {
                 r.port = make_vport(vpdo->version, vpdo->port);
                 NT_ASSERT(is_valid_vport(r.port));
@@ -3,9 +3,15 @@
 namespace usbip
 {
 
-constexpr auto &tcp_port = "3240";
-constexpr auto &driver_filename = L"usbip2_ude"; // used by filter driver
-constexpr auto &persistent_devices_value_name = L"PersistentDevices";
+inline constexpr auto &tcp_port = "3240";
+inline constexpr auto &driver_filename = L"usbip2_ude"; // used by filter driver
+inline constexpr auto &persistent_devices_value_name = L"PersistentDevices";
+inline constexpr auto &receive_mode_value_name = L"ReceiveMode"; // REG_DWORD, usbip::receive_mode
+inline constexpr auto &max_sends_inflight_value_name = L"MaxSendsInFlight"; // REG_DWORD, per device
+inline constexpr auto &persistent_attach_workers_value_name = L"PersistentAttachWorkers"; // REG_DWORD
+inline constexpr auto &resolver_cache_ttl_value_name = L"ResolverCacheTtl"; // REG_DWORD, seconds, zero disables the cache
+inline constexpr auto &connection_attempt_delay_value_name = L"ConnectionAttemptDelay"; // REG_DWORD, milliseconds
+inline constexpr auto &descriptor_cache_key_name = L"DescriptorCache"; // subkey of Parameters
 
 enum op_status_t // op_common.status
 {
@@ -0,0 +1,276 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "proto.h"
+
+#include <stddef.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define USBIP_PDU_SSE2
+#endif
+
+/*
+ * Header-only codec of USB/IP PDUs without dependencies on kernel or user-mode libraries,
+ * it is used by the ude driver and by the tools that are built on Linux.
+ *
+ * All fields of the headers and iso packet descriptors are 32-bit words (except setup packet),
+ * so the codec works on arrays of UINT32.
+ */
+
+namespace usbip::pdu
+{
+
+enum class swap_dir { host2net, net2host };
+
+inline UINT32 bswap32(UINT32 val)
+{
+#if defined(_MSC_VER)
+	return _byteswap_ulong(val);
+#else
+	return __builtin_bswap32(val);
+#endif
+}
+
+/*
+ * SSE2 is the baseline of x64, it does not require CPU feature detection
+ * and saving of the extended processor state in a kernel.
+ * pshufb (SSSE3) and AVX2 are not used for that reason, a throughput for the max number
+ * of iso packets (16KB of descriptors) is bound by memory anyway.
+ */
+inline void bswap32(UINT32 *v, size_t cnt)
+{
+	size_t i = 0;
+#ifdef USBIP_PDU_SSE2
+	for ( ; i + 4 <= cnt; i += 4) {
+		auto p = reinterpret_cast<__m128i*>(v + i);
+		auto x = _mm_loadu_si128(p);
+
+		x = _mm_or_si128(_mm_slli_epi32(x, 16), _mm_srli_epi32(x, 16)); // swap 16-bit halves
+		x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8)); // swap bytes in halves
+
+		_mm_storeu_si128(p, x);
+	}
+#endif
+	for ( ; i < cnt; ++i) {
+		v[i] = bswap32(v[i]);
+	}
+}
+
+template<typename T>
+inline void bswap32(T &r)
+{
+	static_assert(!(sizeof(r) % sizeof(UINT32)));
+	bswap32(reinterpret_cast<UINT32*>(&r), sizeof(r)/sizeof(UINT32));
+}
+
+inline void byteswap(usbip_iso_packet_descriptor *d, size_t cnt)
+{
+	static_assert(sizeof(*d) == 4*sizeof(UINT32));
+	bswap32(reinterpret_cast<UINT32*>(d), 4*cnt);
+}
+
+/*
+ * The command is read from the header in host byte order, so it is swapped last for host2net.
+ */
+inline void byteswap_header(usbip_header &hdr, swap_dir dir)
+{
+	if (dir == swap_dir::net2host) {
+		bswap32(hdr.base);
+	}
+
+	switch (hdr.base.command) {
+	case USBIP_CMD_SUBMIT: // setup packet is a byte array
+		bswap32(reinterpret_cast<UINT32*>(&hdr.u.cmd_submit), offsetof(usbip_header_cmd_submit, setup)/sizeof(UINT32));
+		break;
+	case USBIP_RET_SUBMIT:
+		bswap32(hdr.u.ret_submit);
+		break;
+	case USBIP_CMD_UNLINK:
+		bswap32(hdr.u.cmd_unlink);
+		break;
+	case USBIP_RET_UNLINK:
+		bswap32(hdr.u.ret_unlink);
+		break;
+	}
+
+	if (dir == swap_dir::host2net) {
+		bswap32(hdr.base);
+	}
+}
+
+constexpr auto extract_num(seqnum_t seqnum) { return seqnum >> 1; }
+constexpr auto extract_dir(seqnum_t seqnum) { return usbip_dir(seqnum & 1); }
+constexpr bool is_valid_seqnum(seqnum_t seqnum) { return extract_num(seqnum); }
+
+inline bool is_valid_command(const usbip_header &hdr)
+{
+	auto cmd = hdr.base.command;
+	return cmd >= USBIP_CMD_SUBMIT && cmd <= USBIP_RET_UNLINK;
+}
+
+/*
+ * Server's responses always have zeroes in usbip_header_basic's devid, direction, ep.
+ * See: <linux>/Documentation/usb/usbip_protocol.rst, usbip_header_basic.
+ *
+ * For a server's response, set hdr.base.direction to the value from the corresponding request,
+ * otherwise the result will be incorrect.
+ */
+inline size_t get_isoc_descr(usbip_iso_packet_descriptor* &isoc, usbip_header &hdr)
+{
+	auto dir_out = hdr.base.direction == USBIP_DIR_OUT;
+
+	auto buf_end = reinterpret_cast<char*>(&hdr + 1);
+	INT32 cnt = 0;
+
+	switch (hdr.base.command) {
+	case USBIP_CMD_SUBMIT:
+		buf_end += dir_out ? hdr.u.cmd_submit.transfer_buffer_length : 0;
+		cnt = hdr.u.cmd_submit.number_of_packets;
+		break;
+	case USBIP_RET_SUBMIT:
+		buf_end += dir_out ? 0 : hdr.u.ret_submit.actual_length; // harmless if direction was not corrected
+		cnt = hdr.u.ret_submit.number_of_packets;
+		break;
+	}
+
+	isoc = reinterpret_cast<usbip_iso_packet_descriptor*>(buf_end);
+	return cnt == number_of_packets_non_isoch ? 0 : cnt;
+}
+
+inline size_t get_total_size(const usbip_header &hdr)
+{
+	usbip_iso_packet_descriptor *isoc{};
+	auto cnt = get_isoc_descr(isoc, const_cast<usbip_header&>(hdr));
+
+	return reinterpret_cast<char*>(isoc + cnt) - reinterpret_cast<const char*>(&hdr);
+}
+
+inline size_t get_payload_size(const usbip_header &hdr)
+{
+	return get_total_size(hdr) - sizeof(hdr);
+}
+
+enum class parse_error
+{
+	none,
+	command, // USBIP_RET_* expected
+	number_of_packets,
+	seqnum,
+	isoc_actual_length, // actual_length > length
+	isoc_offset, // src.offset != dst.Offset
+	isoc_length, // SUM(actual_length) != actual_length
+	isoc_gap, // compacted data can't precede its packet
+	isoc_overflow, // dst.Offset + actual_length > TransferBufferLength
+	actual_length, // RET_SUBMIT.actual_length < 0 or > TransferBufferLength
+};
+
+inline const char* to_string(parse_error err)
+{
+	const char* const v[] {
+		"none", "command", "number_of_packets", "seqnum", 
+		"isoc_actual_length", "isoc_offset", "isoc_length", "isoc_gap", "isoc_overflow", "actual_length"
+	};
+
+	auto i = static_cast<size_t>(err);
+	return i < sizeof(v)/sizeof(*v) ? v[i] : "?";
+}
+
+/*
+ * Convert a server's response header to host byte order and validate it.
+ * number_of_packets of non-isoch transfer is set to zero, direction is restored from seqnum
+ * because it is always zero in server's response.
+ *
+ * If parse_error::none is returned, get_payload_size() fits into ULONG:
+ * actual_length is not negative and number_of_packets is at most USBIP_MAX_ISO_PACKETS.
+ */
+inline auto parse_ret_header(usbip_header &hdr)
+{
+	byteswap_header(hdr, swap_dir::net2host);
+	auto &base = hdr.base;
+
+	switch (base.command) {
+	case USBIP_RET_SUBMIT:
+		if (auto &cnt = hdr.u.ret_submit.number_of_packets; cnt == number_of_packets_non_isoch) {
+			cnt = 0;
+		} else if (!is_valid_number_of_packets(cnt)) {
+			return parse_error::number_of_packets;
+		}
+		if (hdr.u.ret_submit.actual_length < 0) {
+			return parse_error::actual_length; // get_payload_size would wrap
+		}
+		break;
+	case USBIP_RET_UNLINK:
+		break;
+	default:
+		return parse_error::command;
+	}
+
+	if (!is_valid_seqnum(base.seqnum)) {
+		return parse_error::seqnum;
+	}
+
+	base.direction = extract_dir(base.seqnum);
+	return parse_error::none;
+}
+
+/*
+ * Place packets of compacted isoch IN payload to their offsets in transfer buffer.
+ * Buffer from the server has no gaps, SUM(src->actual_length) == length, src->offset must be equal to dst->Offset.
+ *
+ * Packets are walked from the last one, so data can be moved inside the same buffer.
+ * dst[i].Length is set, dst[i].Status is left intact.
+ *
+ * @param dst USBD_ISO_PACKET_DESCRIPTOR or a type with the same Offset, Length fields
+ * @param length of compacted data, actual_length of RET_SUBMIT
+ * @param place called as place(dst_offset, src_offset, length) for each non-empty packet
+ *
+ * See:
+ * <linux>/drivers/usb/usbip/stub_tx.c, stub_send_ret_submit
+ * <linux>/drivers/usb/usbip/usbip_common.c, usbip_pad_iso
+ */
+template<typename D, typename F>
+auto unpack_isoc(
+	D *dst, const usbip_iso_packet_descriptor *src, size_t cnt, 
+	UINT32 length, UINT32 TransferBufferLength, F &&place)
+{
+	while (cnt--) {
+		auto &sd = src[cnt];
+		auto &dd = dst[cnt];
+
+		if (!sd.actual_length) {
+			dd.Length = 0;
+			continue;
+		}
+
+		if (sd.actual_length > sd.length) {
+			return parse_error::isoc_actual_length;
+		} else if (sd.offset != dd.Offset) { // buffer is compacted, but offsets are intact
+			return parse_error::isoc_offset;
+		} else if (length < sd.actual_length) {
+			return parse_error::isoc_length;
+		}
+
+		length -= sd.actual_length; // offset of the packet in compacted data
+
+		if (dd.Offset < length) {
+			return parse_error::isoc_gap;
+		} else if (dd.Offset > TransferBufferLength || sd.actual_length > TransferBufferLength - dd.Offset) {
+			return parse_error::isoc_overflow; // dd.Offset + sd.actual_length can wrap
+		}
+
+		place(dd.Offset, length, sd.actual_length);
+		dd.Length = sd.actual_length;
+	}
+
+	return length ? parse_error::isoc_length : parse_error::none;
+}
+
+} // namespace usbip::pdu
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "pdu_codec.h"
+
+#include <string.h>
+
+/*
+ * Receive state machine of the client. It splits a byte stream from a server into USB/IP messages
+ * and knows nothing about sockets, URBs and memory descriptors, they are behind two abstractions.
+ *
+ * Store is a request store, it owns the requests that wait for RET_SUBMIT:
+ *	sink_type* find(usbip_header &hdr); // dequeue a request, nullptr if not found and for RET_UNLINK
+ *	void complete(usbip_header &hdr, sink_type &sink,
+ *	              const usbip_iso_packet_descriptor *isoc, size_t cnt, parse_error err);
+ *
+ * sink_type is a buffer sink, the transfer buffer of a request:
+ *	size_t size() const; // TransferBufferLength
+ *	void write(size_t offset, const char *data, size_t len); // offset in the payload
+ *
+ * Payload of a request that was not found is discarded. Data of isoch IN transfer is written compacted,
+ * complete() should call unpack_isoc. Iso packet descriptors are passed in host byte order.
+ * If err is not parse_error::none, the request must be failed and the connection closed.
+ *
+ * It is used by the Linux tools to replay and fuzz recorded streams, the driver does not use it.
+ * Header validation is not done here, it is in parse_ret_header that drivers/ude/wsk_receive.cpp
+ * calls in every receive mode, so the checks the tools exercise are the ones the driver runs.
+ */
+
+namespace usbip::pdu
+{
+
+template<typename Store>
+class stream_parser
+{
+public:
+	using sink_type = typename Store::sink_type;
+
+	explicit stream_parser(Store &store) : m_store(store) {}
+
+	/*
+	 * @return parse_error::none if all data were consumed, otherwise the stream is unusable
+	 */
+	parse_error feed(const char *data, size_t len);
+
+	auto messages() const { return m_messages; }
+	auto discarded_bytes() const { return m_discarded; }
+	bool idle() const { return m_state == state::header && !m_got; } // at the boundary of messages
+
+private:
+	enum class state { header, data, isoc, skip };
+
+	Store &m_store;
+	state m_state = state::header;
+	size_t m_got{}; // bytes of the current part
+	size_t m_need = sizeof(m_hdr); // size of the current part
+
+	usbip_header m_hdr;
+	sink_type *m_sink{};
+	size_t m_isoc_cnt{};
+
+	UINT64 m_messages{};
+	UINT64 m_discarded{};
+
+	usbip_iso_packet_descriptor m_isoc[USBIP_MAX_ISO_PACKETS];
+
+	parse_error on_header();
+	void advance();
+};
+
+template<typename Store>
+parse_error stream_parser<Store>::feed(const char *data, size_t len)
+{
+	while (len) {
+		auto cnt = m_need - m_got < len ? m_need - m_got : len;
+
+		switch (m_state) {
+		case state::header:
+			memcpy(reinterpret_cast<char*>(&m_hdr) + m_got, data, cnt);
+			break;
+		case state::data:
+			m_sink->write(m_got, data, cnt);
+			break;
+		case state::isoc:
+			memcpy(reinterpret_cast<char*>(m_isoc) + m_got, data, cnt);
+			break;
+		case state::skip:
+			m_discarded += cnt;
+			break;
+		}
+
+		data += cnt;
+		len -= cnt;
+		m_got += cnt;
+
+		if (m_got < m_need) { // len is zero
+			break;
+		} else if (m_state != state::header) {
+			advance();
+		} else if (auto err = on_header(); err != parse_error::none) {
+			return err;
+		}
+	}
+
+	return parse_error::none;
+}
+
+template<typename Store>
+parse_error stream_parser<Store>::on_header()
+{
+	if (auto err = parse_ret_header(m_hdr); err != parse_error::none) {
+		return err;
+	}
+
+	size_t data_len = 0; // actual_length >= 0, @see parse_ret_header
+	m_isoc_cnt = 0;
+
+	if (m_hdr.base.command == USBIP_RET_SUBMIT) {
+		auto &r = m_hdr.u.ret_submit;
+		m_isoc_cnt = r.number_of_packets; // zero for non-isoch, @see parse_ret_header
+		if (m_hdr.base.direction == USBIP_DIR_IN) {
+			data_len = r.actual_length;
+		}
+	}
+
+	m_sink = m_store.find(m_hdr);
+
+	if (!m_sink) {
+		m_state = state::skip;
+		m_need = data_len + m_isoc_cnt*sizeof(*m_isoc);
+	} else if (data_len > m_sink->size()) {
+		m_store.complete(m_hdr, *m_sink, nullptr, 0, parse_error::actual_length);
+		m_sink = nullptr;
+		return parse_error::actual_length;
+	} else {
+		m_state = state::data;
+		m_need = data_len;
+	}
+
+	m_got = 0;
+	advance();
+
+	return parse_error::none;
+}
+
+/*
+ * Switch to the next part of the message if the current one is complete, skip empty parts.
+ */
+template<typename Store>
+void stream_parser<Store>::advance()
+{
+	if (m_got < m_need) {
+		return;
+	}
+
+	m_got = 0;
+
+	if (m_state == state::data && m_isoc_cnt) {
+		m_state = state::isoc;
+		m_need = m_isoc_cnt*sizeof(*m_isoc);
+		return;
+	}
+
+	if (auto sink = m_sink) {
+		m_sink = nullptr;
+		byteswap(m_isoc, m_isoc_cnt);
+		m_store.complete(m_hdr, *sink, m_isoc, m_isoc_cnt, parse_error::none);
+	}
+
+	++m_messages;
+
+	m_state = state::header;
+	m_need = sizeof(m_hdr);
+}
+
+} // namespace usbip::pdu
@@ -48,10 +48,98 @@ struct imported_device_properties
 
         UINT16 vendor;
         UINT16 product;
+
+        UINT32 connect_time; // milliseconds, name resolution and TCP connect
+        UINT32 attach_time; // milliseconds, connect and import
+        UINT32 attach_attempts; // of persistent attach, zero if the device was attached by a user
+        UINT32 attach_delay; // milliseconds from the start of persistent attach till success
 };
 
 struct imported_device : imported_device_location, imported_device_properties {};
 
+enum { 
+        STATISTICS_ERROR_SLOTS = 8, 
+        STATISTICS_LATENCY_BUCKETS = 24, // the last one is for 2^23 microseconds (8.4 seconds) and above
+        STATISTICS_MAX_ENDPOINTS = 31 // default control pipe, 15 IN and 15 OUT endpoints
+};
+
+struct usbd_status_count
+{
+        LONG status; // USBD_STATUS
+        UINT32 count;
+};
+
+/*
+ * URB counters of an endpoint or a device.
+ */
+struct transfer_statistics
+{
+        UINT64 submitted; // CMD_SUBMIT
+        UINT64 completed;
+
+        UINT64 bytes_in; // of successfully completed URBs
+        UINT64 bytes_out;
+
+        UINT64 unlinks; // CMD_UNLINK
+        UINT64 errors; // URBs completed with an error
+
+        usbd_status_count error_status[STATISTICS_ERROR_SLOTS]; // first distinct USBD_STATUS of errors
+
+        UINT32 inflight; // submitted, but not completed
+        UINT32 max_inflight; // high-water mark
+
+        // histogram of round-trip time, bucket N counts [2^N, 2^(N+1)) microseconds, the first one is [0, 2)
+        UINT64 latency[STATISTICS_LATENCY_BUCKETS];
+};
+
+struct endpoint_statistics : transfer_statistics
+{
+        UINT8 address; // bEndpointAddress
+        UINT8 type; // USBD_PIPE_TYPE
+};
+
+/*
+ * Mapping of host frame numbers to frame numbers of the server,
+ * it is estimated from start_frame of isoch transfers that were submitted with URB_ISO_ASAP.
+ */
+struct frame_clock_statistics
+{
+        UINT32 samples; // since the last resync
+        UINT32 resyncs; // a sample deviated too much from the offset
+        UINT32 modulus; // server frame numbers wrap around at it, zero if there were no samples
+        INT32 offset; // frames, server frame - host frame
+        UINT32 jitter; // microseconds, mean deviation of samples from the offset
+        INT32 drift; // ppm, of server frame clock relative to the host one
+};
+
+struct device_statistics
+{
+        int port;
+        UINT32 endpoint_count;
+        transfer_statistics total; // all endpoints, including removed ones
+        frame_clock_statistics frame_clock;
+        endpoint_statistics endpoints[STATISTICS_MAX_ENDPOINTS]; // the first one is default control pipe
+};
+
+/*
+ * Times are KeQueryInterruptTime in 100-nanosecond units, zero if the stage was not reached.
+ */
+struct urb_trace_record
+{
+        UINT32 seqnum;
+        UINT32 length; // TransferBufferLength
+        LONG status; // NTSTATUS
+        LONG urb_status; // USBD_STATUS
+
+        UINT8 endpoint; // bEndpointAddress
+        UINT8 type; // USBD_PIPE_TYPE
+
+        UINT64 submit_time; // CMD_SUBMIT is queued
+        UINT64 send_time; // WskSend is completed
+        UINT64 recv_time; // RET_SUBMIT header is received
+        UINT64 complete_time; // request is completed
+};
+
 } // namespace usbip::vhci
 
 
@@ -63,6 +151,11 @@ enum class function { // 12 bit
         plugout_hardware, 
         get_imported_devices,
         driver_registry_path,
+        get_device_statistics,
+        set_urb_trace,
+        get_urb_trace,
+        plugin_hardware_batch,
+        clear_descriptor_cache,
 };
 
 constexpr auto make(function id)
@@ -76,6 +169,11 @@ enum {
         PLUGOUT_HARDWARE     = make(function::plugout_hardware),
         GET_IMPORTED_DEVICES = make(function::get_imported_devices),
         DRIVER_REGISTRY_PATH = make(function::driver_registry_path),
+        GET_DEVICE_STATISTICS = make(function::get_device_statistics),
+        SET_URB_TRACE        = make(function::set_urb_trace),
+        GET_URB_TRACE        = make(function::get_urb_trace),
+        PLUGIN_HARDWARE_BATCH = make(function::plugin_hardware_batch),
+        CLEAR_DESCRIPTOR_CACHE = make(function::clear_descriptor_cache),
 };
 
 struct base
@@ -109,4 +207,65 @@ struct driver_registry_path : base
         WCHAR path[MAX_PATH]; // key name max size is 255
 };
 
+struct get_device_statistics : base
+{
+        device_statistics devices[ANYSIZE_ARRAY];
+};
+
+constexpr auto get_device_statistics_size(_In_ ULONG n)
+{
+        return offsetof(get_device_statistics, devices) + n*sizeof(*get_device_statistics::devices);
+}
+
+/*
+ * Ring buffer of urb_trace_record is allocated on the first enable and released with the device.
+ */
+struct set_urb_trace : base
+{
+        int port; // all ports if <= 0
+        bool enable;
+};
+
+/*
+ * Records are read out from the ring, the next call returns newer ones.
+ */
+struct get_urb_trace : base
+{
+        int port; // IN, >= 1
+        UINT32 dropped; // OUT, records that were overwritten before they were read
+        urb_trace_record records[ANYSIZE_ARRAY];
+};
+
+constexpr auto get_urb_trace_size(_In_ ULONG n)
+{
+        return offsetof(get_urb_trace, records) + n*sizeof(*get_urb_trace::records);
+}
+
+struct plugin_hardware_batch_entry : imported_device_location
+{
+        DWORD error; // OUT, zero or ERROR_USBIP_XXX
+};
+
+/*
+ * Devices are attached concurrently, the request completes when all of them are processed.
+ * Use OVERLAPPED I/O to not block the calling thread.
+ * If the request is canceled, devices that are not being attached yet are skipped and
+ * the request fails with ERROR_OPERATION_ABORTED, attached devices remain attached.
+ */
+struct plugin_hardware_batch : base
+{
+        ULONG count; // IN, must not exceed the number of hub ports
+        plugin_hardware_batch_entry devices[ANYSIZE_ARRAY];
+};
+
+constexpr auto plugin_hardware_batch_size(_In_ ULONG n)
+{
+        return offsetof(plugin_hardware_batch, devices) + n*sizeof(*plugin_hardware_batch::devices);
+}
+
+/*
+ * Drops descriptors cached by attached devices, otherwise they are saved to the registry on detach.
+ */
+struct clear_descriptor_cache : base {};
+
 } // namespace usbip::vhci::ioctl
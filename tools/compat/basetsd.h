@@ -0,0 +1,21 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+/*
+ * Subset of Windows <basetsd.h> that is used by the headers of include/usbip,
+ * it allows to build the tools on Linux against unchanged protocol headers.
+ */
+
+#include <stdint.h>
+
+typedef int8_t INT8;
+typedef uint8_t UINT8;
+typedef int16_t INT16;
+typedef uint16_t UINT16;
+typedef int32_t INT32;
+typedef uint32_t UINT32;
+typedef int64_t INT64;
+typedef uint64_t UINT64;
@@ -0,0 +1,524 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * Drives usbip::pdu::stream_parser outside of the driver.
+ *
+ * pdu_replay bench [-n messages] [-c chunk] [-t seconds] [-s seed]
+ *      replays generated RET_SUBMIT/RET_UNLINK stream at full speed, prints messages per second
+ * pdu_replay fuzz [-n iterations] [-s seed]
+ *      mutates headers and iso descriptor tables of generated streams, aborts on a memory error
+ * pdu_replay generate -o file [-n messages] [-s seed]
+ *      writes generated stream to a file
+ * pdu_replay replay -f file [-c chunk]
+ *      parses a recorded stream of a server (data that follow OP_REP_IMPORT)
+ *
+ * Build with -DUSBIP_SANITIZE=ON to run the fuzzer under AddressSanitizer and UBSan.
+ */
+
+#include <usbip/pdu_stream.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+namespace
+{
+
+using namespace usbip;
+using namespace std::chrono;
+
+using rng_type = std::mt19937;
+
+enum { max_lenient_size = 4*1024*1024 }; // of a transfer buffer if requests are not known
+
+[[noreturn]] void die(const char *what, size_t a, size_t b)
+{
+        fprintf(stderr, "%s: %zu, %zu\n", what, a, b);
+        abort();
+}
+
+struct iso_packet // the same fields as USBD_ISO_PACKET_DESCRIPTOR
+{
+        UINT32 Offset;
+        UINT32 Length;
+};
+
+/*
+ * Request that waits for RET_SUBMIT, it is a buffer sink of the stream_parser.
+ */
+struct request
+{
+        seqnum_t seqnum{};
+        std::vector<char> buffer; // size() is TransferBufferLength
+        std::vector<iso_packet> packets;
+        bool pending{};
+
+        size_t size() const { return buffer.size(); }
+
+        void write(size_t offset, const char *data, size_t len)
+        {
+                if (offset > buffer.size() || len > buffer.size() - offset) {
+                        die("write out of transfer buffer", offset, len);
+                }
+                memcpy(buffer.data() + offset, data, len);
+        }
+};
+
+/*
+ * Requests are indexed by extract_num(seqnum) to measure the parser rather than a hash table.
+ * The driver uses its own store, @see device::dequeue_request.
+ */
+struct request_store
+{
+        using sink_type = request;
+
+        std::vector<request> requests;
+
+        bool lenient{}; // any seqnum is found, used for recorded streams
+        request scratch;
+
+        UINT64 completed{};
+        UINT64 bytes{};
+        UINT64 errors[16]{};
+
+        request* find(usbip_header &hdr);
+        void complete(usbip_header &hdr, request &req, const usbip_iso_packet_descriptor *isoc, size_t cnt,
+                      pdu::parse_error err);
+};
+
+request* request_store::find(usbip_header &hdr)
+{
+        if (hdr.base.command != USBIP_RET_SUBMIT) {
+                return nullptr;
+        }
+
+        if (lenient) {
+                auto len = hdr.base.direction == USBIP_DIR_IN ? hdr.u.ret_submit.actual_length : 0;
+                if (len < 0 || len > max_lenient_size) {
+                        return nullptr;
+                }
+                scratch.buffer.resize(len);
+                return &scratch;
+        }
+
+        auto num = pdu::extract_num(hdr.base.seqnum);
+
+        if (num >= requests.size()) {
+                return nullptr;
+        }
+
+        auto &r = requests[num];
+        if (!r.pending || r.seqnum != hdr.base.seqnum) {
+                return nullptr;
+        }
+
+        r.pending = false;
+        return &r;
+}
+
+void request_store::complete(
+        usbip_header &hdr, request &req, const usbip_iso_packet_descriptor *isoc, size_t cnt, pdu::parse_error err)
+{
+        ++completed;
+
+        auto &ret = hdr.u.ret_submit;
+
+        if (err == pdu::parse_error::none && cnt) {
+                if (lenient) { // offsets of the packets are not known till now
+                        req.packets.resize(cnt);
+                        size_t length = 0;
+                        for (size_t i = 0; i < cnt; ++i) {
+                                req.packets[i] = { isoc[i].offset, isoc[i].length };
+                                length = std::max(length, size_t(isoc[i].offset) + isoc[i].length);
+                        }
+                        req.buffer.resize(std::min(length, size_t(max_lenient_size))); // unpack_isoc checks offsets
+                }
+
+                if (cnt != req.packets.size()) {
+                        err = pdu::parse_error::number_of_packets;
+                } else if (hdr.base.direction == USBIP_DIR_IN) {
+                        auto buf = req.buffer.data();
+                        auto tbl = UINT32(req.buffer.size());
+
+                        err = pdu::unpack_isoc(req.packets.data(), isoc, cnt, ret.actual_length, tbl,
+                                [buf, tbl] (auto dst_offset, auto src_offset, auto len)
+                                {
+                                        if (dst_offset > tbl || len > tbl - dst_offset || src_offset > dst_offset) {
+                                                die("isoch packet out of transfer buffer", dst_offset, len);
+                                        }
+                                        memmove(buf + dst_offset, buf + src_offset, len);
+                                });
+                }
+        }
+
+        if (err == pdu::parse_error::none) {
+                bytes += std::max(ret.actual_length, 0);
+        } else {
+                ++errors[static_cast<size_t>(err) % std::size(errors)];
+        }
+}
+
+/*
+ * Stream of server's responses in network byte order and the requests that wait for them.
+ */
+struct workload
+{
+        std::vector<request> requests;
+        std::vector<char> stream;
+        std::vector<size_t> headers; // offsets of messages in stream
+};
+
+void append(std::vector<char> &v, const void *data, size_t len)
+{
+        auto p = static_cast<const char*>(data);
+        v.insert(v.end(), p, p + len);
+}
+
+/*
+ * Mix of bulk IN/OUT, isoch IN/OUT, RET_UNLINK and RET_SUBMIT without a request.
+ */
+workload generate(size_t count, rng_type &rng)
+{
+        workload w;
+        w.requests.resize(count + 1); // seqnum zero is invalid
+
+        std::uniform_int_distribution<int> kind(0, 99);
+        std::uniform_int_distribution<UINT32> bulk_len(0, 16*1024);
+        std::uniform_int_distribution<UINT32> isoc_cnt(1, 32);
+        std::uniform_int_distribution<UINT32> isoc_len(0, 192);
+
+        for (seqnum_t num = 1; num <= count; ++num) {
+                auto k = kind(rng);
+                auto dir_in = k < 60 || (k >= 70 && k < 90);
+                auto isoch = k >= 70 && k < 95;
+
+                auto &r = w.requests[num];
+                r.seqnum = num << 1 | dir_in;
+                r.pending = k < 98; // the rest were unlinked
+
+                usbip_header hdr{};
+                hdr.base.command = k == 99 ? USBIP_RET_UNLINK : USBIP_RET_SUBMIT;
+                hdr.base.seqnum = r.seqnum;
+
+                auto &ret = hdr.u.ret_submit;
+                ret.number_of_packets = number_of_packets_non_isoch;
+
+                std::vector<char> data;
+                std::vector<usbip_iso_packet_descriptor> isoc;
+
+                if (hdr.base.command == USBIP_RET_UNLINK) {
+                        hdr.u.ret_unlink.status = -104; // -ECONNRESET
+                } else if (isoch) {
+                        auto cnt = isoc_cnt(rng);
+                        ret.number_of_packets = cnt;
+
+                        for (UINT32 i = 0; i < cnt; ++i) {
+                                auto offset = UINT32(r.buffer.size());
+                                auto actual = dir_in ? isoc_len(rng) : 192;
+
+                                r.packets.push_back({ offset, 192 });
+                                r.buffer.resize(offset + 192);
+
+                                isoc.push_back({ offset, 192, actual, 0 });
+                                if (dir_in) {
+                                        data.insert(data.end(), actual, char(i));
+                                }
+                                ret.actual_length += actual;
+                        }
+                } else {
+                        auto len = bulk_len(rng);
+                        r.buffer.resize(len);
+                        ret.actual_length = len ? std::uniform_int_distribution<INT32>(0, len)(rng) : 0;
+                        if (dir_in) {
+                                data.resize(ret.actual_length, char(num));
+                        }
+                }
+
+                pdu::byteswap_header(hdr, pdu::swap_dir::host2net);
+                pdu::byteswap(isoc.data(), isoc.size());
+
+                w.headers.push_back(w.stream.size());
+                append(w.stream, &hdr, sizeof(hdr));
+                append(w.stream, data.data(), data.size());
+                append(w.stream, isoc.data(), isoc.size()*sizeof(isoc[0]));
+        }
+
+        return w;
+}
+
+auto feed(pdu::stream_parser<request_store> &parser, const std::vector<char> &stream, size_t chunk)
+{
+        auto err = pdu::parse_error::none;
+
+        for (size_t off = 0; off < stream.size() && err == pdu::parse_error::none; off += chunk) {
+                err = parser.feed(stream.data() + off, std::min(chunk, stream.size() - off));
+        }
+
+        return err;
+}
+
+void print_errors(const request_store &store)
+{
+        for (size_t i = 1; i < std::size(store.errors); ++i) {
+                if (auto n = store.errors[i]) {
+                        printf("  %s: %" PRIu64 "\n", pdu::to_string(pdu::parse_error(i)), n);
+                }
+        }
+}
+
+struct options
+{
+        std::string mode;
+        size_t count = 10'000;
+        size_t chunk = 64*1024; // the size of receive_buffer of the driver
+        unsigned seconds = 3;
+        unsigned seed = 1;
+        const char *file{};
+};
+
+int bench(const options &opts)
+{
+        rng_type rng(opts.seed);
+        auto w = generate(opts.count, rng);
+
+        std::vector<bool> pending;
+        for (auto &r: w.requests) {
+                pending.push_back(r.pending);
+        }
+
+        request_store store;
+        store.requests = std::move(w.requests);
+
+        auto parser = std::make_unique<pdu::stream_parser<request_store>>(store);
+
+        UINT64 passes = 0;
+        auto start = steady_clock::now();
+        auto stop = start + seconds(opts.seconds);
+
+        do {
+                for (size_t i = 0; i < pending.size(); ++i) {
+                        store.requests[i].pending = pending[i];
+                }
+
+                if (auto err = feed(*parser, w.stream, opts.chunk); err != pdu::parse_error::none) {
+                        fprintf(stderr, "unexpected error %s\n", pdu::to_string(err));
+                        return EXIT_FAILURE;
+                }
+
+                ++passes;
+        } while (steady_clock::now() < stop);
+
+        auto secs = duration<double>(steady_clock::now() - start).count();
+
+        printf("%" PRIu64 " messages, %" PRIu64 " completed, %.0f messages/s, %.1f MB/s of stream, chunk %zu\n",
+               parser->messages(), store.completed, parser->messages()/secs,
+               passes*w.stream.size()/secs/1e6, opts.chunk);
+
+        return EXIT_SUCCESS;
+}
+
+/*
+ * A mutated stream must either be parsed or rejected with an error,
+ * parser and unpack_isoc must never access memory out of transfer buffer.
+ * Payload size of a header that parse_ret_header accepts must fit ULONG.
+ */
+int fuzz(const options &opts)
+{
+        rng_type rng(opts.seed);
+        UINT64 rejected = 0;
+        UINT64 messages = 0;
+
+        request_store total;
+
+        const UINT32 values[] { 0, 1, 2, 15, 16, 192, 0x7FFF'FFFF, 0x8000'0000, 0xFFFF'FFFF, 0xFFFF'FFF0, 1024, 1025 };
+
+        for (size_t iter = 0; iter < opts.count; ++iter) {
+                auto w = generate(std::uniform_int_distribution<size_t>(1, 16)(rng), rng);
+                auto &s = w.stream;
+
+                for (int n = std::uniform_int_distribution<int>(1, 4)(rng); n; --n) {
+                        auto hdr = w.headers[rng() % w.headers.size()];
+                        auto next = std::upper_bound(w.headers.begin(), w.headers.end(), hdr);
+                        auto end = next == w.headers.end() ? s.size() : *next;
+
+                        size_t off;
+                        switch (rng() % 4) {
+                        case 0: // any 32-bit field of the header
+                                off = hdr + 4*(rng() % (sizeof(usbip_header)/4));
+                                break;
+                        case 1: // actual_length, number_of_packets
+                                off = hdr + 20 + 4*(rng() % 4 == 0 ? 3 : 1);
+                                break;
+                        default: // iso descriptors or payload
+                                off = end - 4*(1 + rng() % std::max<size_t>(1, (end - hdr)/4 - 12));
+                        }
+
+                        UINT32 val = rng() % 2 ? values[rng() % std::size(values)] : UINT32(rng());
+                        val = pdu::bswap32(val);
+                        memcpy(s.data() + off, &val, sizeof(val));
+                }
+
+                if (rng() % 8 == 0) {
+                        s.resize(rng() % s.size());
+                }
+
+                for (auto off: w.headers) { // the driver relies on this bound, @see wsk_receive.cpp
+                        if (off + sizeof(usbip_header) > s.size()) {
+                                break;
+                        }
+
+                        usbip_header hdr;
+                        memcpy(&hdr, s.data() + off, sizeof(hdr));
+
+                        if (pdu::parse_ret_header(hdr) == pdu::parse_error::none &&
+                            pdu::get_payload_size(hdr) > UINT32_MAX) {
+                                die("payload size does not fit ULONG", off, pdu::get_payload_size(hdr));
+                        }
+                }
+
+                request_store store;
+                store.requests = std::move(w.requests);
+                store.lenient = iter % 2; // transfer buffer is defined by iso descriptors from the stream
+
+                auto parser = std::make_unique<pdu::stream_parser<request_store>>(store);
+
+                if (feed(*parser, s, 1 + rng() % 4096) != pdu::parse_error::none) {
+                        ++rejected;
+                }
+
+                messages += parser->messages();
+                total.completed += store.completed;
+                for (size_t i = 0; i < std::size(store.errors); ++i) {
+                        total.errors[i] += store.errors[i];
+                }
+        }
+
+        printf("%zu iterations, %" PRIu64 " messages, %" PRIu64 " completed, %" PRIu64 " streams rejected\n",
+               opts.count, messages, total.completed, rejected);
+        printf("completed with error:\n");
+        print_errors(total);
+
+        return EXIT_SUCCESS;
+}
+
+int generate_file(const options &opts)
+{
+        rng_type rng(opts.seed);
+        auto w = generate(opts.count, rng);
+
+        auto f = fopen(opts.file, "wb");
+        if (!f) {
+                perror(opts.file);
+                return EXIT_FAILURE;
+        }
+
+        auto ok = fwrite(w.stream.data(), 1, w.stream.size(), f) == w.stream.size();
+        ok = !fclose(f) && ok;
+
+        printf("%zu messages, %zu bytes\n", opts.count, w.stream.size());
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int replay(const options &opts)
+{
+        auto f = fopen(opts.file, "rb");
+        if (!f) {
+                perror(opts.file);
+                return EXIT_FAILURE;
+        }
+
+        std::vector<char> stream;
+        char buf[64*1024];
+
+        for (size_t n; (n = fread(buf, 1, sizeof(buf), f)); ) {
+                append(stream, buf, n);
+        }
+        fclose(f);
+
+        request_store store;
+        store.lenient = true;
+
+        auto parser = std::make_unique<pdu::stream_parser<request_store>>(store);
+
+        auto start = steady_clock::now();
+        auto err = feed(*parser, stream, opts.chunk);
+        auto secs = duration<double>(steady_clock::now() - start).count();
+
+        printf("%" PRIu64 " messages, %" PRIu64 " completed, %" PRIu64 " bytes, %.0f messages/s, %s%s\n",
+               parser->messages(), store.completed, store.bytes, parser->messages()/secs,
+               pdu::to_string(err), parser->idle() ? "" : ", truncated");
+
+        print_errors(store);
+        return err == pdu::parse_error::none ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool parse_options(options &opts, int argc, char *argv[])
+{
+        if (argc < 2) {
+                return false;
+        }
+
+        opts.mode = argv[1];
+        optind = 2;
+
+        for (int ch; (ch = getopt(argc, argv, "n:c:t:s:f:o:")) != -1; ) {
+                switch (ch) {
+                case 'n':
+                        opts.count = strtoul(optarg, nullptr, 0);
+                        break;
+                case 'c':
+                        opts.chunk = std::max(1UL, strtoul(optarg, nullptr, 0));
+                        break;
+                case 't':
+                        opts.seconds = unsigned(strtoul(optarg, nullptr, 0));
+                        break;
+                case 's':
+                        opts.seed = unsigned(strtoul(optarg, nullptr, 0));
+                        break;
+                case 'f':
+                case 'o':
+                        opts.file = optarg;
+                        break;
+                default:
+                        return false;
+                }
+        }
+
+        return optind == argc && opts.count && (opts.file || (opts.mode != "replay" && opts.mode != "generate"));
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+        options opts;
+
+        if (!parse_options(opts, argc, argv)) {
+                // fall through to usage
+        } else if (opts.mode == "bench") {
+                return bench(opts);
+        } else if (opts.mode == "fuzz") {
+                return fuzz(opts);
+        } else if (opts.mode == "generate") {
+                return generate_file(opts);
+        } else if (opts.mode == "replay") {
+                return replay(opts);
+        }
+
+        fprintf(stderr, "Usage: %s bench|fuzz|generate|replay [-n count] [-c chunk] [-t seconds] [-s seed] "
+                        "[-f input] [-o output]\n", argv[0]);
+        return EXIT_FAILURE;
+}
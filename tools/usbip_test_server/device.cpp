@@ -0,0 +1,367 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "device.h"
+#include "output.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace
+{
+
+using namespace usbip::test;
+
+enum { // bDescriptorType
+        USB_DT_DEVICE = 1,
+        USB_DT_CONFIG,
+        USB_DT_STRING,
+        USB_DT_INTERFACE,
+        USB_DT_ENDPOINT,
+        USB_DT_HID = 0x21,
+        USB_DT_REPORT
+};
+
+enum { // bRequest
+        USB_REQ_GET_STATUS,
+        USB_REQ_CLEAR_FEATURE,
+        USB_REQ_SET_FEATURE = 3,
+        USB_REQ_GET_DESCRIPTOR = 6,
+        USB_REQ_GET_CONFIGURATION = 8,
+        USB_REQ_SET_CONFIGURATION,
+        USB_REQ_GET_INTERFACE,
+        USB_REQ_SET_INTERFACE
+};
+
+enum { // HID class requests
+        HID_REQ_GET_REPORT = 1,
+        HID_REQ_GET_IDLE,
+        HID_REQ_GET_PROTOCOL,
+        HID_REQ_SET_REPORT = 9,
+        HID_REQ_SET_IDLE,
+        HID_REQ_SET_PROTOCOL
+};
+
+enum { USB_TYPE_MASK = 0x60, USB_TYPE_STANDARD = 0, USB_TYPE_CLASS = 0x20 };
+enum { USB_RECIP_MASK = 0x1F, USB_RECIP_DEVICE = 0, USB_RECIP_INTERFACE, USB_RECIP_ENDPOINT };
+
+const char *str_manufacturer = "usbip-win2";
+
+/*
+ * Boot protocol mouse with a wheel, 4-byte reports.
+ */
+const UINT8 mouse_report_descr[] {
+        0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00, 0x05, 0x09, 0x19, 0x01, 0x29, 0x03,
+        0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01, 0x81, 0x02, 0x95, 0x01, 0x75, 0x05, 0x81, 0x01,
+        0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x03,
+        0x81, 0x06, 0xC0, 0xC0
+};
+
+void put(std::vector<UINT8> &v, std::initializer_list<UINT8> bytes)
+{
+        v.insert(v.end(), bytes);
+}
+
+void put16(std::vector<UINT8> &v, UINT16 val)
+{
+        put(v, { UINT8(val), UINT8(val >> 8) });
+}
+
+void put_interface(std::vector<UINT8> &v, UINT8 alt, UINT8 num_endpoints, const usbip_usb_interface &intf)
+{
+        put(v, { 9, USB_DT_INTERFACE, 0, alt, num_endpoints,
+                 intf.bInterfaceClass, intf.bInterfaceSubClass, intf.bInterfaceProtocol, 0 });
+}
+
+void put_endpoint(std::vector<UINT8> &v, const endpoint &ep)
+{
+        put(v, { 7, USB_DT_ENDPOINT, ep.address, ep.type });
+        put16(v, ep.max_packet);
+        put(v, { ep.interval });
+}
+
+auto get_product(device_kind kind)
+{
+        const char *v[] { "Bulk source/sink", "HID mouse", "Isoch audio stream" };
+        return v[static_cast<int>(kind)];
+}
+
+} // namespace
+
+
+const char* usbip::test::to_string(device_kind kind)
+{
+        const char *v[] { "bulk", "hid", "audio" };
+        return v[static_cast<int>(kind)];
+}
+
+const char* usbip::test::to_string(endpoint_type type)
+{
+        const char *v[] { "control", "isoch", "bulk", "interrupt" };
+        return v[type & 3];
+}
+
+usbip::test::device::device(const device_config &cfg, UINT32 busnum, UINT32 devnum) :
+        m_cfg(cfg),
+        m_busnum(busnum),
+        m_devnum(devnum),
+        m_busid(format("%u-%u", busnum, devnum))
+{
+        build_descriptors();
+}
+
+void usbip::test::device::build_descriptors()
+{
+        UINT16 product = 0x1000;
+        usbip_usb_interface intf{ 0xFF, 0, 0, 0 }; // vendor specific
+
+        switch (m_cfg.kind) {
+        case device_kind::bulk:
+                m_speed = USB_SPEED_HIGH;
+                m_endpoints = { {0x81, EP_BULK, 512, 0}, {0x02, EP_BULK, 512, 0} };
+                break;
+        case device_kind::hid:
+                m_speed = USB_SPEED_FULL;
+                intf = { 3, 1, 2, 0 }; // HID, boot interface, mouse
+                m_endpoints = { {0x81, EP_INTERRUPT, 4, 8} };
+                m_report_descr.assign(std::begin(mouse_report_descr), std::end(mouse_report_descr));
+                product = 0x1001;
+                break;
+        case device_kind::audio: // 48kHz, 16-bit stereo is 192 bytes per frame
+                m_speed = USB_SPEED_FULL;
+                m_endpoints = { {0x81, EP_ISOCH, 192, 1}, {0x02, EP_ISOCH, 192, 1} };
+                product = 0x1002;
+                break;
+        }
+
+        m_ifaces = { intf };
+
+        auto &d = m_device_descr;
+        put(d, { 18, USB_DT_DEVICE });
+        put16(d, m_speed == USB_SPEED_HIGH ? 0x0200 : 0x0110);
+        put(d, { 0, 0, 0, 64 }); // class is defined by interfaces
+        put16(d, 0x1209); // pid.codes test VID
+        put16(d, product);
+        put16(d, 0x0100);
+        put(d, { 1, 2, 3, 1 }); // iManufacturer, iProduct, iSerialNumber, bNumConfigurations
+
+        auto &c = m_config_descr;
+        put(c, { 9, USB_DT_CONFIG, 0, 0, 1, 1, 0, 0x80, 50 }); // wTotalLength is set below
+
+        auto eps = UINT8(m_endpoints.size());
+
+        if (m_cfg.kind == device_kind::audio) { // zero bandwidth alternate setting
+                put_interface(c, 0, 0, intf);
+                put_interface(c, 1, eps, intf);
+        } else {
+                put_interface(c, 0, eps, intf);
+        }
+
+        if (m_cfg.kind == device_kind::hid) {
+                put(c, { 9, USB_DT_HID, 0x11, 0x01, 0, 1, USB_DT_REPORT });
+                put16(c, UINT16(m_report_descr.size()));
+        }
+
+        for (auto &ep: m_endpoints) {
+                put_endpoint(c, ep);
+        }
+
+        c[2] = UINT8(c.size());
+        c[3] = UINT8(c.size() >> 8);
+}
+
+usbip_usb_device usbip::test::device::get_usb_device() const
+{
+        usbip_usb_device d{};
+
+        auto path = format("/sys/devices/platform/usbip_test_server/usb%u/%s", m_busnum, m_busid.c_str());
+        strncpy(d.path, path.c_str(), sizeof(d.path) - 1);
+        strncpy(d.busid, m_busid.c_str(), sizeof(d.busid) - 1);
+
+        d.busnum = m_busnum;
+        d.devnum = m_devnum;
+        d.speed = m_speed;
+
+        d.idVendor = UINT16(m_device_descr[8] | m_device_descr[9] << 8);
+        d.idProduct = UINT16(m_device_descr[10] | m_device_descr[11] << 8);
+        d.bcdDevice = UINT16(m_device_descr[12] | m_device_descr[13] << 8);
+
+        d.bConfigurationValue = m_configuration;
+        d.bNumConfigurations = 1;
+        d.bNumInterfaces = UINT8(m_ifaces.size());
+
+        return d;
+}
+
+const endpoint* usbip::test::device::find_endpoint(UINT8 address) const noexcept
+{
+        for (auto &ep: m_endpoints) {
+                if (ep.address == address) {
+                        return &ep;
+                }
+        }
+
+        return nullptr;
+}
+
+void usbip::test::device::release() noexcept
+{
+        m_configuration = 0;
+        m_alt_setting = 0;
+        m_busy = false;
+}
+
+int usbip::test::device::get_string(UINT8 index, std::vector<UINT8> &data) const
+{
+        std::string s;
+
+        switch (index) {
+        case 0:
+                data = { 4, USB_DT_STRING, 0x09, 0x04 }; // en-US
+                return 0;
+        case 1:
+                s = str_manufacturer;
+                break;
+        case 2:
+                s = get_product(m_cfg.kind);
+                break;
+        case 3:
+                s = m_busid; // unique per server
+                break;
+        default:
+                return -EPIPE;
+        }
+
+        data = { UINT8(2 + 2*s.size()), USB_DT_STRING };
+        for (auto ch: s) { // UTF-16LE
+                put16(data, UINT8(ch));
+        }
+
+        return 0;
+}
+
+int usbip::test::device::get_descriptor(UINT8 type, UINT8 index, std::vector<UINT8> &data) const
+{
+        switch (type) {
+        case USB_DT_DEVICE:
+                data = m_device_descr;
+                break;
+        case USB_DT_CONFIG:
+                data = m_config_descr;
+                break;
+        case USB_DT_STRING:
+                return get_string(index, data);
+        case USB_DT_HID:
+                if (m_report_descr.empty()) {
+                        return -EPIPE;
+                }
+                data.assign(m_config_descr.begin() + 18, m_config_descr.begin() + 27);
+                break;
+        case USB_DT_REPORT:
+                if (m_report_descr.empty()) {
+                        return -EPIPE;
+                }
+                data = m_report_descr;
+                break;
+        default:
+                return -EPIPE;
+        }
+
+        return 0;
+}
+
+/*
+ * @param data OUT stage of the request on input, IN stage on output
+ * @return URB status, -EPIPE means STALL
+ */
+int usbip::test::device::control(const UINT8 (&setup)[8], std::vector<UINT8> &data)
+{
+        auto type = setup[0];
+        auto req = setup[1];
+        auto value = UINT16(setup[2] | setup[3] << 8);
+        auto length = UINT16(setup[6] | setup[7] << 8);
+
+        auto dir_in = type & 0x80;
+        auto recipient = type & USB_RECIP_MASK;
+        int err = 0;
+
+        if (dir_in) {
+                data.clear();
+        }
+
+        switch (type & USB_TYPE_MASK) {
+        case USB_TYPE_STANDARD:
+                switch (req) {
+                case USB_REQ_GET_DESCRIPTOR:
+                        if (recipient == USB_RECIP_DEVICE || recipient == USB_RECIP_INTERFACE) {
+                                err = get_descriptor(UINT8(value >> 8), UINT8(value), data);
+                        } else {
+                                err = -EPIPE;
+                        }
+                        break;
+                case USB_REQ_GET_STATUS:
+                        data = { 0, 0 };
+                        break;
+                case USB_REQ_CLEAR_FEATURE:
+                case USB_REQ_SET_FEATURE:
+                        break;
+                case USB_REQ_GET_CONFIGURATION:
+                        data = { m_configuration };
+                        break;
+                case USB_REQ_SET_CONFIGURATION:
+                        if (value <= 1) {
+                                m_configuration = UINT8(value);
+                                m_alt_setting = 0;
+                        } else {
+                                err = -EPIPE;
+                        }
+                        break;
+                case USB_REQ_GET_INTERFACE:
+                        data = { m_alt_setting };
+                        break;
+                case USB_REQ_SET_INTERFACE:
+                        if (!value || (value == 1 && m_cfg.kind == device_kind::audio)) {
+                                m_alt_setting = UINT8(value);
+                        } else {
+                                err = -EPIPE;
+                        }
+                        break;
+                default:
+                        err = -EPIPE;
+                }
+                break;
+        case USB_TYPE_CLASS:
+                if (m_cfg.kind != device_kind::hid || recipient != USB_RECIP_INTERFACE) {
+                        err = -EPIPE;
+                } else switch (req) {
+                case HID_REQ_GET_REPORT:
+                        data.assign(4, 0);
+                        break;
+                case HID_REQ_GET_IDLE:
+                        data = { 0 };
+                        break;
+                case HID_REQ_GET_PROTOCOL:
+                        data = { 1 }; // report protocol
+                        break;
+                case HID_REQ_SET_REPORT:
+                case HID_REQ_SET_IDLE:
+                case HID_REQ_SET_PROTOCOL:
+                        break;
+                default:
+                        err = -EPIPE;
+                }
+                break;
+        default:
+                err = -EPIPE;
+        }
+
+        if (err) {
+                data.clear();
+        } else if (dir_in && data.size() > length) {
+                data.resize(length);
+        }
+
+        return err;
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <usbip/proto_op.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace usbip::test
+{
+
+using clock_type = std::chrono::steady_clock;
+
+enum class device_kind { bulk, hid, audio };
+const char* to_string(device_kind kind);
+
+enum endpoint_type : UINT8 { EP_CONTROL, EP_ISOCH, EP_BULK, EP_INTERRUPT }; // bmAttributes & 3
+const char* to_string(endpoint_type type);
+
+enum usb_device_speed { USB_SPEED_UNKNOWN, USB_SPEED_LOW, USB_SPEED_FULL, USB_SPEED_HIGH }; // <linux>/include/uapi/linux/usb/ch9.h
+
+struct endpoint
+{
+        UINT8 address; // bEndpointAddress
+        endpoint_type type;
+        UINT16 max_packet; // wMaxPacketSize
+        UINT8 interval; // bInterval
+};
+
+struct device_config
+{
+        device_kind kind;
+        std::chrono::microseconds latency{}; // added to the completion time of each URB
+        UINT64 bandwidth{}; // bytes per second per endpoint, zero means unlimited
+};
+
+/*
+ * Emulated USB device. It answers standard requests of ep0 and describes its endpoints,
+ * data of the endpoints is generated and consumed by the session.
+ */
+class device
+{
+public:
+        device(const device_config &cfg, UINT32 busnum, UINT32 devnum);
+
+        device(const device&) = delete;
+        device& operator=(const device&) = delete;
+
+        auto& config() const noexcept { return m_cfg; }
+        auto& busid() const noexcept { return m_busid; }
+        auto devid() const noexcept { return (m_busnum << 16) | m_devnum; }
+
+        usbip_usb_device get_usb_device() const; // host byte order
+        auto& interfaces() const noexcept { return m_ifaces; }
+
+        const endpoint* find_endpoint(UINT8 address) const noexcept;
+
+        int control(const UINT8 (&setup)[8], std::vector<UINT8> &data);
+
+        bool acquire() noexcept { return !m_busy.exchange(true); }
+        void release() noexcept;
+
+private:
+        device_config m_cfg;
+        UINT32 m_busnum;
+        UINT32 m_devnum;
+        std::string m_busid;
+        usb_device_speed m_speed;
+
+        std::vector<UINT8> m_device_descr;
+        std::vector<UINT8> m_config_descr;
+        std::vector<UINT8> m_report_descr; // HID
+        std::vector<endpoint> m_endpoints;
+        std::vector<usbip_usb_interface> m_ifaces;
+
+        UINT8 m_configuration{};
+        UINT8 m_alt_setting{};
+        std::atomic<bool> m_busy{};
+
+        void build_descriptors();
+        int get_descriptor(UINT8 type, UINT8 index, std::vector<UINT8> &data) const;
+        int get_string(UINT8 index, std::vector<UINT8> &data) const;
+};
+
+} // namespace usbip::test
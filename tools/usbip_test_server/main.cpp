@@ -0,0 +1,343 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * Stand-in for Linux usbipd with emulated devices, it is used for benchmarking of the client
+ * over loopback or LAN without real hardware.
+ *
+ * usbip_test_server -d bulk:100:40000 -d audio -r 2
+ * usbip list -r <host>
+ * usbip attach -r <host> -b 1-1
+ */
+
+#include "device.h"
+#include "net.h"
+#include "output.h"
+#include "session.h"
+
+#include <cerrno>
+#include <cinttypes>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace
+{
+
+using namespace usbip;
+using namespace usbip::test;
+
+struct options
+{
+        const char *port = tcp_port;
+        session_options session;
+        std::vector<device_config> devices;
+};
+
+using device_list = std::vector<std::unique_ptr<device>>;
+
+void usage(const char *prog)
+{
+        auto &fmt = R"(Usage: %s [-p port] [-r seconds] [-m frame_mask] [-d kind[:latency_us[:bandwidth_KBps]]]...
+  -p port        TCP port, %s by default
+  -r seconds     period of per-endpoint reports, zero disables them, %d by default
+  -m frame_mask  start_frame of isoch transfers wraps at frame_mask + 1, %#x by default
+  -d device      bulk (source/sink), hid (mouse), audio (isoch in/out),
+                 busid of N-th device is 1-N, one device of each kind by default
+)";
+        session_options def;
+        fprintf(stderr, fmt, prog, tcp_port, int(def.report_interval.count()), def.frame_mask);
+}
+
+bool parse_device(const char *spec, device_config &cfg)
+{
+        std::string s(spec);
+        auto kind = s.substr(0, s.find(':'));
+
+        if (kind == "bulk") {
+                cfg.kind = device_kind::bulk;
+        } else if (kind == "hid") {
+                cfg.kind = device_kind::hid;
+        } else if (kind == "audio") {
+                cfg.kind = device_kind::audio;
+        } else {
+                return false;
+        }
+
+        unsigned long latency = 0;
+        unsigned long long bandwidth = 0;
+
+        if (auto pos = s.find(':'); pos != s.npos) {
+                if (sscanf(s.c_str() + pos + 1, "%lu:%llu", &latency, &bandwidth) < 1) {
+                        return false;
+                }
+        }
+
+        cfg.latency = std::chrono::microseconds(latency);
+        cfg.bandwidth = bandwidth*1000;
+        return true;
+}
+
+bool parse_options(options &opts, int argc, char *argv[])
+{
+        for (int ch; (ch = getopt(argc, argv, "p:r:m:d:h")) != -1; ) {
+                switch (ch) {
+                case 'p':
+                        opts.port = optarg;
+                        break;
+                case 'r':
+                        opts.session.report_interval = std::chrono::seconds(strtoul(optarg, nullptr, 0));
+                        break;
+                case 'm':
+                        if (auto mask = strtoul(optarg, nullptr, 0); mask >= 0xFF && mask <= 0xFFFF && !(mask & (mask + 1))) {
+                                opts.session.frame_mask = UINT32(mask);
+                        } else {
+                                fputs("frame_mask must be 2^n - 1 in range [0xFF, 0xFFFF]\n", stderr);
+                                return false;
+                        }
+                        break;
+                case 'd':
+                        if (device_config cfg{}; parse_device(optarg, cfg)) {
+                                opts.devices.push_back(cfg);
+                        } else {
+                                fprintf(stderr, "invalid device '%s'\n", optarg);
+                                return false;
+                        }
+                        break;
+                default:
+                        return false;
+                }
+        }
+
+        if (opts.devices.empty()) {
+                opts.devices = { {device_kind::bulk}, {device_kind::hid}, {device_kind::audio} };
+        }
+
+        return optind == argc;
+}
+
+int listen_socket(const char *port)
+{
+        addrinfo hints{};
+        hints.ai_family = AF_INET6;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+
+        addrinfo *res{};
+        if (auto err = getaddrinfo(nullptr, port, &hints, &res)) {
+                fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+                return -1;
+        }
+
+        int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+
+        if (sock >= 0) {
+                int on = 1;
+                int off = 0;
+                setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+                setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)); // IPv4 as well
+
+                if (bind(sock, res->ai_addr, res->ai_addrlen) || listen(sock, SOMAXCONN)) {
+                        perror("bind/listen");
+                        close(sock);
+                        sock = -1;
+                }
+        } else {
+                perror("socket");
+        }
+
+        freeaddrinfo(res);
+        return sock;
+}
+
+auto peer_name(int sock)
+{
+        sockaddr_storage addr{};
+        socklen_t len = sizeof(addr);
+
+        char host[NI_MAXHOST]{};
+        char serv[NI_MAXSERV]{};
+
+        if (getpeername(sock, reinterpret_cast<sockaddr*>(&addr), &len) ||
+            getnameinfo(reinterpret_cast<sockaddr*>(&addr), len, host, sizeof(host), serv, sizeof(serv),
+                        NI_NUMERICHOST | NI_NUMERICSERV)) {
+                return std::string("?");
+        }
+
+        return format("%s:%s", host, serv);
+}
+
+bool send_op_common(int sock, UINT16 code, UINT32 status)
+{
+        op_common r{ USBIP_VERSION, code, status };
+        PACK_OP_COMMON(true, &r);
+
+        iovec iov{ &r, sizeof(r) };
+        return send_all(sock, &iov, 1);
+}
+
+/*
+ * <linux>/tools/usb/usbip/src/usbipd.c, recv_request_devlist
+ */
+void devlist(int sock, const device_list &devices)
+{
+        std::vector<char> buf;
+
+        auto append = [&buf] (const auto &obj)
+        {
+                auto p = reinterpret_cast<const char*>(&obj);
+                buf.insert(buf.end(), p, p + sizeof(obj));
+        };
+
+        op_common r{ USBIP_VERSION, OP_REP_DEVLIST, ST_OK };
+        PACK_OP_COMMON(true, &r);
+        append(r);
+
+        op_devlist_reply reply{ UINT32(devices.size()) };
+        PACK_OP_DEVLIST_REPLY(true, &reply);
+        append(reply);
+
+        for (auto &dev: devices) {
+                auto udev = dev->get_usb_device();
+                usbip_net_pack_usb_device(true, &udev);
+                append(udev);
+
+                for (auto intf: dev->interfaces()) {
+                        usbip_net_pack_usb_interface(true, &intf);
+                        append(intf);
+                }
+        }
+
+        iovec iov{ buf.data(), buf.size() };
+        send_all(sock, &iov, 1);
+}
+
+/*
+ * <linux>/tools/usb/usbip/src/usbipd.c, recv_request_import
+ */
+device* import(int sock, const device_list &devices)
+{
+        op_import_request req{};
+        if (!recv_all(sock, &req, sizeof(req))) {
+                return nullptr;
+        }
+        req.busid[sizeof(req.busid) - 1] = '\0';
+
+        device *dev{};
+        UINT32 status = ST_NODEV;
+
+        for (auto &d: devices) {
+                if (d->busid() == req.busid) {
+                        if (d->acquire()) {
+                                dev = d.get();
+                                status = ST_OK;
+                        } else {
+                                status = ST_DEV_BUSY;
+                        }
+                        break;
+                }
+        }
+
+        if (!send_op_common(sock, OP_REP_IMPORT, status) || !dev) {
+                return nullptr;
+        }
+
+        op_import_reply reply{ dev->get_usb_device() };
+        PACK_OP_IMPORT_REPLY(true, &reply);
+
+        if (iovec iov{ &reply, sizeof(reply) }; !send_all(sock, &iov, 1)) {
+                dev->release();
+                return nullptr;
+        }
+
+        return dev;
+}
+
+void serve(int sock, const device_list &devices, const session_options &opts)
+{
+        auto peer = peer_name(sock);
+
+        op_common req{};
+        if (!recv_all(sock, &req, sizeof(req))) {
+                close(sock);
+                return;
+        }
+        PACK_OP_COMMON(false, &req);
+
+        if (req.version != USBIP_VERSION) {
+                print(format("%s: unsupported version %#x\n", peer.c_str(), req.version));
+        } else switch (req.code) {
+        case OP_REQ_DEVLIST:
+                devlist(sock, devices);
+                break;
+        case OP_REQ_IMPORT:
+                if (auto dev = import(sock, devices)) {
+                        int on = 1;
+                        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+                        print(format("%s: %s imported\n", peer.c_str(), dev->busid().c_str()));
+                        session(sock, *dev, opts).run();
+                        print(format("%s: %s released\n", peer.c_str(), dev->busid().c_str()));
+
+                        dev->release();
+                }
+                break;
+        default:
+                print(format("%s: unexpected op code %#x\n", peer.c_str(), req.code));
+        }
+
+        close(sock);
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+        options opts;
+        if (!parse_options(opts, argc, argv)) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        signal(SIGPIPE, SIG_IGN);
+
+        device_list devices;
+        for (auto &cfg: opts.devices) {
+                auto &dev = devices.emplace_back(std::make_unique<device>(cfg, 1, UINT32(devices.size() + 1)));
+                auto bw = cfg.bandwidth ? format("%" PRIu64 "KB/s", cfg.bandwidth/1000) : "unlimited";
+                print(format("%s %s, latency %ldus, bandwidth %s\n", dev->busid().c_str(), to_string(cfg.kind),
+                             long(cfg.latency.count()), bw.c_str()));
+        }
+
+        auto sock = listen_socket(opts.port);
+        if (sock < 0) {
+                return EXIT_FAILURE;
+        }
+
+        print(format("listening on port %s\n", opts.port));
+
+        while (true) {
+                auto s = accept(sock, nullptr, nullptr);
+                if (s >= 0) {
+                        std::thread(serve, s, std::cref(devices), std::cref(opts.session)).detach();
+                } else if (errno != EINTR) {
+                        perror("accept");
+                        break;
+                }
+        }
+
+        close(sock);
+        return EXIT_FAILURE;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "net.h"
+
+#include <cerrno>
+#include <sys/socket.h>
+
+bool usbip::test::recv_all(int sock, void *buf, size_t len)
+{
+        for (auto p = static_cast<char*>(buf); len; ) {
+                if (auto n = recv(sock, p, len, 0); n > 0) {
+                        p += n;
+                        len -= n;
+                } else if (n < 0 && errno == EINTR) {
+                        continue;
+                } else {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+bool usbip::test::send_all(int sock, iovec *iov, int cnt)
+{
+        while (cnt) {
+                msghdr msg{};
+                msg.msg_iov = iov;
+                msg.msg_iovlen = cnt;
+
+                auto n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return false;
+                }
+
+                for ( ; cnt && size_t(n) >= iov->iov_len; ++iov, --cnt) {
+                        n -= iov->iov_len;
+                }
+
+                if (cnt) {
+                        iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+                        iov->iov_len -= n;
+                }
+        }
+
+        return true;
+}
@@ -0,0 +1,16 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <sys/uio.h>
+
+namespace usbip::test
+{
+
+bool recv_all(int sock, void *buf, size_t len);
+bool send_all(int sock, iovec *iov, int cnt); // modifies iov
+
+} // namespace usbip::test
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "output.h"
+
+#include <cstdarg>
+#include <cstdio>
+
+std::string usbip::test::format(const char *fmt, ...)
+{
+        va_list args;
+
+        va_start(args, fmt);
+        auto len = vsnprintf(nullptr, 0, fmt, args);
+        va_end(args);
+
+        std::string s;
+        if (len <= 0) {
+                return s;
+        }
+
+        s.resize(len);
+
+        va_start(args, fmt);
+        vsnprintf(s.data(), len + 1, fmt, args);
+        va_end(args);
+
+        return s;
+}
+
+void usbip::test::print(const std::string &s)
+{
+        fputs(s.c_str(), stdout);
+        fflush(stdout);
+}
@@ -0,0 +1,19 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <string>
+
+namespace usbip::test
+{
+
+/*
+ * std::format is not available in libstdc++ before GCC 13.
+ */
+[[gnu::format(printf, 1, 2)]] std::string format(const char *fmt, ...);
+
+void print(const std::string &s); // stdout
+
+} // namespace usbip::test
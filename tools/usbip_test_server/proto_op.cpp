@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include <usbip/proto_op.h>
+#include <arpa/inet.h>
+
+/*
+ * The same as userspace/libusbip/src/proto_op.cpp, but without intrinsics of MSVC.
+ */
+
+void usbip_net_pack_uint32_t(int, UINT32 *num)
+{
+        *num = htonl(*num);
+}
+
+void usbip_net_pack_uint16_t(int, UINT16 *num)
+{
+        *num = htons(*num);
+}
+
+void usbip_net_pack_usb_device(int pack, usbip_usb_device *udev)
+{
+        usbip_net_pack_uint32_t(pack, &udev->busnum);
+        usbip_net_pack_uint32_t(pack, &udev->devnum);
+        usbip_net_pack_uint32_t(pack, &udev->speed);
+
+        usbip_net_pack_uint16_t(pack, &udev->idVendor);
+        usbip_net_pack_uint16_t(pack, &udev->idProduct);
+        usbip_net_pack_uint16_t(pack, &udev->bcdDevice);
+}
+
+void usbip_net_pack_usb_interface(int, usbip_usb_interface*)
+{
+        /* UINT8 members need nothing */
+}
@@ -0,0 +1,561 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "session.h"
+#include "net.h"
+#include "output.h"
+
+#include <usbip/pdu_codec.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <map>
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+namespace
+{
+
+using namespace usbip::test;
+using namespace std::chrono;
+
+enum { URB_ISO_ASAP = 0x0002 }; // <linux>/include/linux/usb.h
+enum { MAX_TRANSFER_BUFFER_LENGTH = 16*1024*1024 };
+enum { COMPLETED_HISTORY = 4096 }; // seqnums of completed URBs to tell late unlinks from bogus ones
+
+auto to_us(clock_type::duration d)
+{
+        return static_cast<UINT32>(duration_cast<microseconds>(d).count());
+}
+
+auto percentile(std::vector<UINT32> &v, double p)
+{
+        if (v.empty()) {
+                return UINT32();
+        }
+
+        auto n = static_cast<size_t>(p*(v.size() - 1));
+        std::nth_element(v.begin(), v.begin() + n, v.end());
+        return v[n];
+}
+
+} // namespace
+
+
+struct usbip::test::session::urb
+{
+        usbip_header hdr; // CMD_SUBMIT in host byte order
+        ep_key key;
+        endpoint_type type = EP_CONTROL;
+
+        clock_type::time_point received;
+        clock_type::time_point due;
+
+        INT32 status{};
+        INT32 actual_length{};
+        INT32 start_frame{};
+        INT32 error_count{};
+
+        std::vector<UINT8> data; // payload of OUT transfer on input, data of IN transfer on output
+        std::vector<usbip_iso_packet_descriptor> iso; // host byte order
+
+        auto dir_in() const { return hdr.base.direction == USBIP_DIR_IN; }
+};
+
+usbip::test::session::session(int sock, device &dev, const session_options &opts) :
+        m_sock(sock),
+        m_dev(dev),
+        m_opts(opts)
+{
+        if (auto period = m_opts.frame_mask + 1ULL; period > 1000) {
+                m_frame_offset = period - 1000; // the first wrap of start_frame happens in a second
+        }
+}
+
+usbip::test::session::~session() = default;
+
+void usbip::test::session::run()
+{
+        std::thread thr(&session::completion, this);
+
+        while (read_pdu()) {}
+
+        {
+                std::lock_guard lck(m_mtx);
+                m_stop = true;
+        }
+
+        m_cv.notify_all();
+        thr.join();
+
+        report(true);
+}
+
+bool usbip::test::session::read_pdu()
+{
+        usbip_header hdr;
+        if (!recv_all(m_sock, &hdr, sizeof(hdr))) {
+                return false;
+        }
+
+        pdu::byteswap_header(hdr, pdu::swap_dir::net2host);
+
+        switch (auto cmd = hdr.base.command) {
+        case USBIP_CMD_SUBMIT:
+                return cmd_submit(hdr);
+        case USBIP_CMD_UNLINK:
+                return cmd_unlink(hdr);
+        default:
+                print(format("%s: unexpected command %u, seqnum %u\n", m_dev.busid().c_str(), cmd, hdr.base.seqnum));
+                return false;
+        }
+}
+
+bool usbip::test::session::cmd_submit(usbip_header &hdr)
+{
+        auto &cmd = hdr.u.cmd_submit;
+
+        auto cnt = cmd.number_of_packets == number_of_packets_non_isoch ? 0 : cmd.number_of_packets;
+        if (!is_valid_number_of_packets(cnt)) {
+                print(format("%s: seqnum %u, invalid number_of_packets %d\n",
+                              m_dev.busid().c_str(), hdr.base.seqnum, cmd.number_of_packets));
+                return false;
+        }
+
+        if (cmd.transfer_buffer_length < 0 || cmd.transfer_buffer_length > MAX_TRANSFER_BUFFER_LENGTH) {
+                print(format("%s: seqnum %u, invalid transfer_buffer_length %d\n",
+                              m_dev.busid().c_str(), hdr.base.seqnum, cmd.transfer_buffer_length));
+                return false;
+        }
+
+        auto u = std::make_unique<urb>();
+        u->hdr = hdr;
+        u->key = make_key(hdr.base.ep, hdr.base.direction);
+
+        if (!u->dir_in()) {
+                u->data.resize(cmd.transfer_buffer_length);
+                if (!recv_all(m_sock, u->data.data(), u->data.size())) {
+                        return false;
+                }
+        }
+
+        if (cnt) {
+                u->iso.resize(cnt);
+                if (!recv_all(m_sock, u->iso.data(), cnt*sizeof(u->iso[0]))) {
+                        return false;
+                }
+                pdu::byteswap(u->iso.data(), cnt);
+        }
+
+        u->received = clock_type::now();
+        execute(*u);
+
+        {
+                std::lock_guard lck(m_mtx);
+
+                auto seqnum = hdr.base.seqnum;
+                if (m_pending.contains(seqnum)) {
+                        print(format("%s: seqnum %u is already pending\n", m_dev.busid().c_str(), seqnum));
+                        return false;
+                }
+
+                m_queue.push({u->due, seqnum});
+                m_pending.emplace(seqnum, std::move(u));
+        }
+
+        m_cv.notify_one();
+        return true;
+}
+
+/*
+ * <linux>/drivers/usb/usbip/stub_rx.c, stub_recv_cmd_unlink
+ */
+bool usbip::test::session::cmd_unlink(const usbip_header &hdr)
+{
+        auto seqnum = hdr.u.cmd_unlink.seqnum;
+        INT32 status = 0;
+
+        std::unique_lock lck(m_mtx);
+
+        if (auto i = m_pending.find(seqnum); i != m_pending.end()) {
+                ++m_stats[i->second->key].unlinked;
+                m_pending.erase(i); // its item in m_queue will be skipped
+                status = -ECONNRESET;
+        } else if (auto c = m_completed.find(seqnum); c != m_completed.end()) {
+                ++m_stats[c->second].unlink_late;
+        } else {
+                ++m_unlink_unknown;
+        }
+
+        std::lock_guard send_lck(m_send_mtx);
+        lck.unlock();
+
+        return send_ret_unlink(hdr.base.seqnum, status);
+}
+
+void usbip::test::session::execute(urb &u)
+{
+        auto &base = u.hdr.base;
+        u.due = u.received + m_dev.config().latency;
+
+        if (!base.ep) {
+                control(u);
+                return;
+        }
+
+        auto ep = m_dev.find_endpoint(UINT8(base.ep | (u.dir_in() ? 0x80 : 0)));
+
+        if (!ep) {
+                u.status = -EPIPE;
+        } else if ((ep->type == EP_ISOCH) != !u.iso.empty()) {
+                u.status = -EINVAL;
+        } else {
+                u.type = ep->type;
+                auto &st = m_ep[u.key];
+
+                switch (ep->type) {
+                case EP_BULK:
+                        bulk(u, *ep, st);
+                        break;
+                case EP_INTERRUPT:
+                        interrupt(u, *ep, st);
+                        break;
+                case EP_ISOCH:
+                        isoch(u, *ep, st);
+                        break;
+                case EP_CONTROL:
+                        u.status = -EPIPE;
+                }
+        }
+
+        if (u.status) {
+                u.data.clear();
+                u.actual_length = 0;
+        }
+}
+
+void usbip::test::session::control(urb &u)
+{
+        auto &cmd = u.hdr.u.cmd_submit;
+
+        u.status = m_dev.control(cmd.setup, u.data);
+
+        if (!u.dir_in()) {
+                u.actual_length = u.status ? 0 : static_cast<INT32>(u.data.size());
+                u.data.clear();
+        } else if (u.data.size() > size_t(cmd.transfer_buffer_length)) {
+                u.status = -EOVERFLOW;
+                u.data.clear();
+        } else {
+                u.actual_length = static_cast<INT32>(u.data.size());
+        }
+}
+
+/*
+ * Source of IN and sink of OUT data limited by the bandwidth.
+ */
+void usbip::test::session::bulk(urb &u, const endpoint&, endpoint_state &st)
+{
+        auto len = u.dir_in() ? size_t(u.hdr.u.cmd_submit.transfer_buffer_length) : u.data.size();
+        u.due = transfer(st, len);
+
+        if (u.dir_in()) {
+                u.data.assign(len, st.pattern++);
+        } else {
+                u.data.clear();
+        }
+
+        u.actual_length = static_cast<INT32>(len);
+}
+
+/*
+ * Mouse reports are generated at bInterval, the cursor moves along a square.
+ */
+void usbip::test::session::interrupt(urb &u, const endpoint &ep, endpoint_state &st)
+{
+        auto len = u.dir_in() ? std::min(size_t(u.hdr.u.cmd_submit.transfer_buffer_length), size_t(ep.max_packet)) :
+                                u.data.size();
+
+        u.due = std::max(transfer(st, len), st.next_slot);
+        st.next_slot = u.due + milliseconds(ep.interval); // full speed
+
+        if (u.dir_in()) {
+                auto side = (st.pattern++ >> 5) & 3;
+                auto dx = UINT8(side == 0 ? 2 : side == 2 ? -2 : 0);
+                auto dy = UINT8(side == 1 ? 2 : side == 3 ? -2 : 0);
+
+                u.data = { 0, dx, dy, 0 };
+                u.data.resize(len);
+        } else {
+                u.data.clear();
+        }
+
+        u.actual_length = static_cast<INT32>(len);
+}
+
+/*
+ * One packet per frame, each frame lasts 1ms. URB_ISO_ASAP transfer starts at the next free frame,
+ * otherwise start_frame is used. Packets of the frames that have already passed get -EXDEV.
+ * Data of IN transfer is compacted as Linux stub driver does.
+ *
+ * <linux>/drivers/usb/usbip/stub_tx.c, stub_send_ret_submit
+ */
+void usbip::test::session::isoch(urb &u, const endpoint &ep, endpoint_state &st)
+{
+        auto &cmd = u.hdr.u.cmd_submit;
+        auto mask = m_opts.frame_mask;
+
+        auto cnt = u.iso.size();
+        auto now = static_cast<INT64>(current_frame(u.received));
+        INT64 first{};
+
+        if (cmd.transfer_flags & URB_ISO_ASAP) {
+                first = std::max(now + 1, INT64(st.next_frame));
+        } else if (auto delta = (UINT32(cmd.start_frame) - UINT32(now)) & mask; delta <= mask/2) {
+                first = now + delta;
+        } else {
+                first = now + delta - (mask + 1LL);
+        }
+
+        st.next_frame = std::max(st.next_frame, UINT64(first + cnt));
+
+        auto tbl = UINT32(cmd.transfer_buffer_length);
+        std::vector<UINT8> data;
+        UINT32 total = 0;
+
+        for (size_t i = 0; i < cnt; ++i) {
+                auto &d = u.iso[i];
+                d.actual_length = 0;
+                d.status = 0;
+
+                if (first + INT64(i) <= now) {
+                        d.status = UINT32(-EXDEV);
+                } else if (d.offset > tbl || d.length > tbl - d.offset) {
+                        d.status = UINT32(-EMSGSIZE);
+                } else {
+                        auto n = u.dir_in() ? std::min(d.length, UINT32(ep.max_packet)) : d.length;
+                        if (u.dir_in()) {
+                                data.insert(data.end(), n, st.pattern++);
+                        }
+                        d.actual_length = n;
+                        total += n;
+                }
+
+                u.error_count += !!d.status;
+        }
+
+        u.data = std::move(data);
+        u.actual_length = static_cast<INT32>(total);
+        u.start_frame = static_cast<INT32>(first & mask);
+        u.due = frame_time(std::max(first + INT64(cnt), now)) + m_dev.config().latency;
+}
+
+clock_type::time_point usbip::test::session::transfer(endpoint_state &st, size_t bytes)
+{
+        auto start = std::max(clock_type::now(), st.busy_until);
+
+        if (auto bw = m_dev.config().bandwidth) {
+                start += nanoseconds(bytes*1'000'000'000ULL/bw);
+        }
+
+        st.busy_until = start;
+        return start + m_dev.config().latency;
+}
+
+UINT64 usbip::test::session::current_frame(clock_type::time_point t) const
+{
+        return m_frame_offset + duration_cast<milliseconds>(t - m_start).count();
+}
+
+clock_type::time_point usbip::test::session::frame_time(UINT64 frame) const
+{
+        return m_start + milliseconds(frame - m_frame_offset);
+}
+
+void usbip::test::session::remember_completed(seqnum_t seqnum, ep_key key)
+{
+        m_completed[seqnum] = key;
+        m_completed_order.push_back(seqnum);
+
+        if (m_completed_order.size() > COMPLETED_HISTORY) {
+                m_completed.erase(m_completed_order.front());
+                m_completed_order.pop_front();
+        }
+}
+
+void usbip::test::session::completion()
+{
+        auto &period = m_opts.report_interval;
+        auto next_report = period.count() ? clock_type::now() + period : clock_type::time_point::max();
+
+        std::unique_lock lck(m_mtx);
+
+        while (!m_stop) {
+                auto now = clock_type::now();
+
+                if (now >= next_report) {
+                        lck.unlock();
+                        report(false);
+                        lck.lock();
+                        next_report = std::max(next_report + period, now);
+                        continue;
+                }
+
+                if (m_queue.empty() || m_queue.top().due > now) {
+                        auto wake = m_queue.empty() ? next_report : std::min(next_report, m_queue.top().due);
+                        if (wake == clock_type::time_point::max()) {
+                                m_cv.wait(lck);
+                        } else {
+                                m_cv.wait_until(lck, wake);
+                        }
+                        continue;
+                }
+
+                auto seqnum = m_queue.top().seqnum;
+                m_queue.pop();
+
+                auto i = m_pending.find(seqnum);
+                if (i == m_pending.end()) { // unlinked
+                        continue;
+                }
+
+                auto u = std::move(i->second);
+                m_pending.erase(i);
+
+                std::unique_lock send_lck(m_send_mtx);
+                lck.unlock();
+
+                auto ok = send_ret_submit(*u);
+                auto latency = to_us(clock_type::now() - u->received);
+
+                send_lck.unlock();
+                lck.lock();
+
+                if (!ok) {
+                        shutdown(m_sock, SHUT_RDWR); // read_pdu will fail
+                        break;
+                }
+
+                auto &s = m_stats[u->key];
+                s.type = u->type;
+
+                ++s.urbs;
+                s.bytes += u->actual_length;
+                s.errors += u->status || u->error_count;
+                s.latency_sum += latency;
+                s.latency_max = std::max(s.latency_max, latency);
+
+                ++s.window_urbs;
+                s.window_bytes += u->actual_length;
+                s.window_latency.push_back(latency);
+
+                remember_completed(seqnum, u->key);
+        }
+}
+
+bool usbip::test::session::send_ret_submit(urb &u)
+{
+        usbip_header hdr{};
+
+        hdr.base.command = USBIP_RET_SUBMIT;
+        hdr.base.seqnum = u.hdr.base.seqnum;
+
+        auto &r = hdr.u.ret_submit;
+        r.status = u.status;
+        r.actual_length = u.actual_length;
+        r.start_frame = u.start_frame;
+        r.number_of_packets = u.hdr.u.cmd_submit.number_of_packets;
+        r.error_count = u.error_count;
+
+        pdu::byteswap_header(hdr, pdu::swap_dir::host2net);
+        pdu::byteswap(u.iso.data(), u.iso.size());
+
+        iovec iov[3]{ {&hdr, sizeof(hdr)} };
+        int cnt = 1;
+
+        if (!u.data.empty()) { // IN, data.size() == actual_length
+                iov[cnt++] = { u.data.data(), u.data.size() };
+        }
+
+        if (!u.iso.empty()) {
+                iov[cnt++] = { u.iso.data(), u.iso.size()*sizeof(u.iso[0]) };
+        }
+
+        return send_all(m_sock, iov, cnt);
+}
+
+bool usbip::test::session::send_ret_unlink(seqnum_t seqnum, INT32 status)
+{
+        usbip_header hdr{};
+
+        hdr.base.command = USBIP_RET_UNLINK;
+        hdr.base.seqnum = seqnum;
+        hdr.u.ret_unlink.status = status;
+
+        pdu::byteswap_header(hdr, pdu::swap_dir::host2net);
+
+        iovec iov{ &hdr, sizeof(hdr) };
+        return send_all(m_sock, &iov, 1);
+}
+
+/*
+ * @param total since the import of the device, otherwise since the previous report
+ */
+void usbip::test::session::report(bool total)
+{
+        std::lock_guard lck(m_mtx);
+
+        auto now = clock_type::now();
+        auto secs = duration<double>(now - (total ? m_start : m_window_start)).count();
+        m_window_start = now;
+
+        if (secs <= 0) {
+                return;
+        }
+
+        auto s = format("%s %s%s, %.1fs\n", m_dev.busid().c_str(), to_string(m_dev.config().kind),
+                        total ? " total" : "", secs);
+
+        std::map<ep_key, endpoint_stats*> sorted;
+        for (auto &[key, st]: m_stats) {
+                sorted.emplace(key, &st);
+        }
+
+        for (auto [key, st]: sorted) {
+                auto urbs = total ? st->urbs : st->window_urbs;
+                auto bytes = total ? st->bytes : st->window_bytes;
+
+                s += format("  ep %2u %-3s %-9s urbs %8" PRIu64 ", %8.2f MB/s, %7.0f urb/s, ",
+                             key >> 1, key & 1 ? "in" : "out", to_string(st->type),
+                                 urbs, bytes/secs/1e6, urbs/secs);
+
+                if (total) {
+                        s += format("latency mean %" PRIu64 "us max %uus",
+                                     st->urbs ? st->latency_sum/st->urbs : 0, st->latency_max);
+                } else {
+                        auto &v = st->window_latency;
+                        UINT64 sum = 0;
+                        for (auto i: v) {
+                                sum += i;
+                        }
+                        s += format("latency mean %" PRIu64 "us p99 %uus", v.empty() ? 0 : sum/v.size(), percentile(v, 0.99));
+                }
+
+                s += format(", errors %" PRIu64 ", unlinked %" PRIu64 ", unlinked late %" PRIu64 "\n",
+                            st->errors, st->unlinked, st->unlink_late);
+
+                st->window_urbs = 0;
+                st->window_bytes = 0;
+                st->window_latency.clear();
+        }
+
+        if (total && m_unlink_unknown) {
+                s += format("  unlinks of unknown seqnum %" PRIu64 "\n", m_unlink_unknown);
+        }
+
+        print(s);
+}
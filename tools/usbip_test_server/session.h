@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "device.h"
+
+#include <usbip/proto.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+
+namespace usbip::test
+{
+
+struct session_options
+{
+        std::chrono::seconds report_interval{5}; // zero disables periodic reports
+        UINT32 frame_mask = 0x7FF; // start_frame of isoch transfers wraps at frame_mask + 1
+};
+
+/*
+ * Serves an imported device over the connected socket until the client disconnects.
+ *
+ * The reading thread parses CMD_SUBMIT/CMD_UNLINK, executes the transfer at once and computes
+ * when it is completed according to the latency, bandwidth and the schedule of the endpoint.
+ * The completion thread sends RET_SUBMIT when its time comes. URB that is still pending
+ * is unlinked as Linux stub driver does: RET_UNLINK with -ECONNRESET and no RET_SUBMIT.
+ */
+class session
+{
+public:
+        session(int sock, device &dev, const session_options &opts);
+        ~session();
+
+        session(const session&) = delete;
+        session& operator=(const session&) = delete;
+
+        void run();
+
+private:
+        struct urb;
+
+        struct endpoint_state
+        {
+                clock_type::time_point busy_until; // bandwidth limit
+                clock_type::time_point next_slot; // interrupt polling
+                UINT64 next_frame{}; // isoch schedule
+                UINT8 pattern{}; // of generated data
+        };
+
+        struct endpoint_stats
+        {
+                endpoint_type type{};
+                UINT64 urbs{};
+                UINT64 bytes{};
+                UINT64 errors{};
+                UINT64 unlinked{}; // URB was pending, -ECONNRESET
+                UINT64 unlink_late{}; // URB was completed already
+                UINT64 latency_sum{}; // microseconds
+                UINT32 latency_max{};
+
+                UINT64 window_urbs{};
+                UINT64 window_bytes{};
+                std::vector<UINT32> window_latency; // microseconds
+        };
+
+        using ep_key = UINT32; // (ep << 1) | direction
+        static auto make_key(UINT32 ep, UINT32 dir) { return ep_key(ep << 1 | dir); }
+
+        struct due_item
+        {
+                clock_type::time_point due;
+                seqnum_t seqnum;
+                bool operator > (const due_item &r) const { return due > r.due; }
+        };
+
+        int m_sock;
+        device &m_dev;
+        session_options m_opts;
+        clock_type::time_point m_start = clock_type::now();
+        UINT64 m_frame_offset{}; // current_frame(m_start)
+
+        std::unordered_map<ep_key, endpoint_state> m_ep; // reading thread only
+
+        std::mutex m_mtx; // guards the members below
+        std::condition_variable m_cv;
+        bool m_stop{};
+        std::unordered_map<seqnum_t, std::unique_ptr<urb>> m_pending;
+        std::priority_queue<due_item, std::vector<due_item>, std::greater<>> m_queue;
+        std::unordered_map<ep_key, endpoint_stats> m_stats;
+        std::unordered_map<seqnum_t, ep_key> m_completed; // to attribute late unlinks
+        std::deque<seqnum_t> m_completed_order;
+        UINT64 m_unlink_unknown{};
+        clock_type::time_point m_window_start = m_start;
+
+        std::mutex m_send_mtx; // acquired while m_mtx is held to keep the order of RET_SUBMIT and RET_UNLINK
+
+        bool read_pdu();
+        bool cmd_submit(usbip_header &hdr);
+        bool cmd_unlink(const usbip_header &hdr);
+
+        void execute(urb &u);
+        void control(urb &u);
+        void bulk(urb &u, const endpoint &ep, endpoint_state &st);
+        void interrupt(urb &u, const endpoint &ep, endpoint_state &st);
+        void isoch(urb &u, const endpoint &ep, endpoint_state &st);
+
+        clock_type::time_point transfer(endpoint_state &st, size_t bytes);
+        UINT64 current_frame(clock_type::time_point t) const;
+        clock_type::time_point frame_time(UINT64 frame) const;
+
+        void completion();
+        void remember_completed(seqnum_t seqnum, ep_key key);
+
+        bool send_ret_submit(urb &u);
+        bool send_ret_unlink(seqnum_t seqnum, INT32 status);
+
+        void report(bool total);
+};
+
+} // namespace usbip::test
@@ -32,4 +32,12 @@ USBIP_API bool set_persistent(_In_ HANDLE dev, _In_ const std::vector<device_loc
  */
 USBIP_API std::vector<device_location> get_persistent(_In_ HANDLE dev, _Out_ bool &success);
 
+/**
+ * Remove descriptors of remote devices cached by the driver, in memory and in the registry.
+ * Devices will fetch them from a server on the next attach.
+ * @param dev handle of the driver device
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool clear_descriptor_cache(_In_ HANDLE dev);
+
 } // namespace usbip::vhci
@@ -8,7 +8,11 @@
 #include "win_socket.h"
 
 #include <usbspec.h>
+#include <chrono>
+#include <functional>
 #include <string>
+#include <string_view>
+#include <vector>
 
 namespace usbip
 {
@@ -36,6 +40,33 @@ struct usb_device
         UINT8 bNumInterfaces;
 };
 
+/*
+ * The same as usb_device, but the strings are not copied.
+ * The views are valid during a callback only.
+ */
+struct usb_device_view
+{
+        std::string_view path;
+        std::string_view busid;
+
+        UINT32 busnum;
+        UINT32 devnum;
+        USB_DEVICE_SPEED speed;
+
+        UINT16 idVendor;
+        UINT16 idProduct;
+        UINT16 bcdDevice; // Device Release Number
+
+        UINT8 bDeviceClass;
+        UINT8 bDeviceSubClass;
+        UINT8 bDeviceProtocol;
+
+        UINT8 bConfigurationValue;
+
+        UINT8 bNumConfigurations;
+        UINT8 bNumInterfaces;
+};
+
 struct usb_interface 
 {
         UINT8 bInterfaceClass;
@@ -88,4 +119,55 @@ USBIP_API bool enum_exportable_devices(
         _In_ const usb_interface_f &on_intf,
         _In_opt_ const usb_device_cnt_f &on_dev_cnt = nullptr);
 
+using usb_device_view_f = std::function<void(_In_ int idx, _In_ const usb_device_view &dev)>;
+using usb_interface_view_f = std::function<void(_In_ int dev_idx, _In_ const usb_device_view &dev, int idx, const usb_interface &intf)>;
+
+/**
+ * The same as enum_exportable_devices, but usb_device strings are not copied.
+ * The reply is read in large chunks and parsed in place.
+ */
+USBIP_API bool enum_exportable_devices_view(
+        _In_ SOCKET s, 
+        _In_ const usb_device_view_f &on_dev, 
+        _In_ const usb_interface_view_f &on_intf,
+        _In_opt_ const usb_device_cnt_f &on_dev_cnt = nullptr);
+
+struct exportable_device
+{
+        usb_device device;
+        std::vector<usb_interface> interfaces;
+};
+
+/**
+ * @param host as passed to discover_devices
+ * @param error zero, Windows Sockets error or ERROR_USBIP_XXX
+ * @param devices exportable devices of the host
+ */
+using host_devices_f = std::function<void(_In_ const std::string &host, _In_ DWORD error, 
+                                          _In_ const std::vector<exportable_device> &devices)>;
+
+/**
+ * Query exportable devices of the hosts concurrently.
+ * The callback is called as soon as a host is done, calls are serialized.
+ * @param hosts names or IP addresses
+ * @param service TCP/IP port number or symbolic name
+ * @param timeout for connect and the reply of each host, name resolution is not limited
+ * @param on_host will be called for every host, it must not throw
+ * @param max_threads number of hosts queried at the same time
+ */
+USBIP_API void discover_devices(
+        _In_ const std::vector<std::string> &hosts, 
+        _In_ const char *service,
+        _In_ std::chrono::milliseconds timeout,
+        _In_ const host_devices_f &on_host,
+        _In_ unsigned int max_threads = 64);
+
+/**
+ * Read hosts for discover_devices from a text file.
+ * One host per line, empty lines and lines that start with '#' are skipped.
+ * @param path of the file
+ * @param success call GetLastError() if false is returned
+ */
+USBIP_API std::vector<std::string> read_hosts(_In_ const std::wstring &path, _Out_ bool &success);
+
 } // namespace usbip
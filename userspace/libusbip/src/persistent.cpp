@@ -198,3 +198,33 @@ auto usbip::vhci::get_persistent(_In_ HANDLE dev, _Out_ bool &success) -> std::v
 
         return devs;
 }
+
+bool usbip::vhci::clear_descriptor_cache(_In_ HANDLE dev)
+{
+        ioctl::clear_descriptor_cache r;
+        r.size = sizeof(r);
+
+        DWORD BytesReturned; // must be set if the last arg is NULL
+        if (!DeviceIoControl(dev, ioctl::CLEAR_DESCRIPTOR_CACHE, &r, sizeof(r), nullptr, 0, &BytesReturned, nullptr)) {
+                return false; // otherwise attached devices will save their caches on detach
+        }
+
+        auto [key, subkey] = driver_registry_path(dev);
+        if (subkey.empty()) {
+                return false;
+        }
+
+        subkey += parameters_key_name;
+        subkey += L'\\';
+        subkey += descriptor_cache_key_name;
+
+        auto err = RegDeleteTree(key, subkey.c_str());
+        if (err == ERROR_FILE_NOT_FOUND) {
+                err = ERROR_SUCCESS; // nothing is cached yet
+        } else if (err) {
+                libusbip::output(L"RegDeleteTree('{}') error {:#x}", subkey, err);
+                SetLastError(err);
+        }
+
+        return !err;
+}
@@ -15,10 +15,29 @@
 #include <ws2tcpip.h>
 #include <mstcpip.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
 namespace
 {
 
 using namespace usbip;
+using steady_clock = std::chrono::steady_clock;
+
+/*
+ * @return milliseconds, zero if the deadline has passed
+ */
+auto remaining(_In_ steady_clock::time_point deadline)
+{
+	auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - steady_clock::now()).count();
+	return ms > 0 ? static_cast<DWORD>(ms) : 0UL;
+}
 
 inline auto do_setsockopt(_In_ SOCKET s, _In_ int level, _In_ int optname, _In_ int optval)
 {
@@ -72,31 +91,85 @@ auto set_keepalive(_In_ SOCKET s, _In_ ULONG timeout, _In_ ULONG interval)
 	return !err;
 }
 
-auto recv(_In_ SOCKET s, _In_ void *buf, _In_ size_t len, _Out_opt_ bool *eof = nullptr)
+/*
+ * Reads a reply in large chunks instead of a recv(MSG_WAITALL) per record, 
+ * records are parsed in place.
+ */
+class recv_buffer
 {
-	assert(s != INVALID_SOCKET);
+public:
+	/*
+	 * @param deadline of the reply, time_point{} means no deadline
+	 */
+	explicit recv_buffer(_In_ SOCKET s, _In_ steady_clock::time_point deadline = {}) : 
+		m_sock(s), m_deadline(deadline), m_buf(64*1024) { assert(s != INVALID_SOCKET); }
+
+	/*
+	 * @return pointer to len bytes that is valid till the next call, nullptr if an error
+	 */
+	void *get(_In_ size_t len);
+
+private:
+	SOCKET m_sock;
+	steady_clock::time_point m_deadline;
+	std::vector<char> m_buf;
+
+	bool set_timeout();
+	size_t m_pos{}; // of unread data
+	size_t m_end{}; // of received data
+};
+
+bool recv_buffer::set_timeout()
+{
+	if (m_deadline == steady_clock::time_point{}) {
+		return true;
+	}
+
+	auto ms = remaining(m_deadline);
+	if (!ms) {
+		libusbip::output("recv timeout");
+		SetLastError(WSAETIMEDOUT);
+		return false;
+	}
+
+	return do_setsockopt(m_sock, SOL_SOCKET, SO_RCVTIMEO, static_cast<int>(ms));
+}
+
+void* recv_buffer::get(_In_ size_t len)
+{
+	assert(len <= m_buf.size());
 
-	if (eof) {
-		*eof = false;
+	if (m_end - m_pos < len) {
+		std::memmove(m_buf.data(), m_buf.data() + m_pos, m_end - m_pos);
+		m_end -= m_pos;
+		m_pos = 0;
 	}
 
-	switch (auto ret = ::recv(s, static_cast<char*>(buf), static_cast<int>(len), MSG_WAITALL)) {
-	case SOCKET_ERROR:
-		if (wsa_set_last_error wsa; wsa) {
-			libusbip::output("recv error {:#x}", wsa.error);
+	while (m_end < m_pos + len) { // does not wait for more data than requested
+		if (!set_timeout()) {
+			return nullptr;
 		}
-		return false;
-	case 0: // connection has been gracefully closed
-		if (len) {
-			libusbip::output("recv EOF");
-			if (eof) {
-				*eof = true;
+
+		auto avail = static_cast<int>(m_buf.size() - m_end);
+
+		switch (auto ret = ::recv(m_sock, m_buf.data() + m_end, avail, 0)) {
+		case SOCKET_ERROR:
+			if (wsa_set_last_error wsa; wsa) {
+				libusbip::output("recv error {:#x}", wsa.error);
 			}
+			return nullptr;
+		case 0: // connection has been gracefully closed
+			libusbip::output("recv EOF");
+			SetLastError(ERROR_HANDLE_EOF);
+			return nullptr;
+		default:
+			m_end += ret;
 		}
-		[[fallthrough]];
-	default:
-		return ret == len;
 	}
+
+	auto p = m_buf.data() + m_pos;
+	m_pos += len;
+	return p;
 }
 
 auto send(_In_ SOCKET s, _In_ const void *buf, _In_ size_t len)
@@ -134,33 +207,40 @@ auto send_op_common(_In_ SOCKET s, _In_ uint16_t code)
 	return send(s, &r, sizeof(r));
 }
 
-auto recv_op_common(_In_ SOCKET s, _In_ uint16_t expected_code)
+auto recv_op_common(_Inout_ recv_buffer &buf, _In_ uint16_t expected_code)
 {
-	assert(s != INVALID_SOCKET);
-
-	op_common r{};
-	if (recv(s, &r, sizeof(r))) {
-		PACK_OP_COMMON(false, &r);
+	auto r = static_cast<op_common*>(buf.get(sizeof(op_common)));
+	if (r) {
+		PACK_OP_COMMON(false, r);
 	} else {
 		return GetLastError();
 	}
 
-	if (r.version != USBIP_VERSION) {
+	if (r->version != USBIP_VERSION) {
 		return ERROR_USBIP_VERSION;
 	}
 
-	if (r.code != expected_code) {
+	if (r->code != expected_code) {
 		return ERROR_USBIP_PROTOCOL;
 	}
 
-	return op_status_error(static_cast<op_status_t>(r.status));
+	return op_status_error(static_cast<op_status_t>(r->status));
+}
+
+/*
+ * The strings are not guaranteed to be null-terminated.
+ */
+template<size_t N>
+inline auto as_string_view(_In_ const char (&s)[N])
+{
+	return std::string_view(s, strnlen(s, N));
 }
 
-auto as_usb_device(_In_ const usbip_usb_device &d)
+auto as_usb_device_view(_In_ const usbip_usb_device &d)
 {
-	return usb_device {
-		.path = d.path,
-		.busid = d.busid,
+	return usb_device_view {
+		.path = as_string_view(d.path),
+		.busid = as_string_view(d.busid),
 
 		.busnum = d.busnum,
 		.devnum = d.devnum,
@@ -181,15 +261,95 @@ auto as_usb_device(_In_ const usbip_usb_device &d)
 	};
 }
 
-} // namespace
+/*
+ * Capacity of the strings is reused.
+ */
+void assign(_Inout_ usb_device &dst, _In_ const usb_device_view &src)
+{
+	dst.path = src.path;
+	dst.busid = src.busid;
 
+	dst.busnum = src.busnum;
+	dst.devnum = src.devnum;
+	dst.speed = src.speed;
 
-const char* usbip::get_tcp_port() noexcept
+	dst.idVendor = src.idVendor;
+	dst.idProduct = src.idProduct;
+	dst.bcdDevice = src.bcdDevice;
+
+	dst.bDeviceClass = src.bDeviceClass;
+	dst.bDeviceSubClass = src.bDeviceSubClass;
+	dst.bDeviceProtocol = src.bDeviceProtocol;
+
+	dst.bConfigurationValue = src.bConfigurationValue;
+
+	dst.bNumConfigurations = src.bNumConfigurations;
+	dst.bNumInterfaces = src.bNumInterfaces;
+}
+
+/*
+ * A socket is switched to non-blocking mode to connect with a timeout.
+ * @param deadline time_point{} means no deadline
+ */
+auto connect_socket(_In_ SOCKET s, _In_ const addrinfo &ai, _In_ steady_clock::time_point deadline)
 {
-	return tcp_port;
+	if (deadline == steady_clock::time_point{}) {
+		if (::connect(s, ai.ai_addr, int(ai.ai_addrlen))) {
+			wsa_set_last_error wsa;
+			return false;
+		}
+		return true;
+	}
+
+	if (u_long nonblocking = true; ioctlsocket(s, FIONBIO, &nonblocking)) {
+		wsa_set_last_error wsa;
+		return false;
+	}
+
+	if (!::connect(s, ai.ai_addr, int(ai.ai_addrlen))) {
+		//
+	} else if (auto err = WSAGetLastError(); err != WSAEWOULDBLOCK) {
+		SetLastError(err);
+		return false;
+	} else {
+		fd_set wr;
+		FD_ZERO(&wr);
+		FD_SET(s, &wr);
+
+		fd_set ex;
+		FD_ZERO(&ex);
+		FD_SET(s, &ex);
+
+		auto ms = remaining(deadline);
+		timeval tv{ .tv_sec = long(ms/1000), .tv_usec = long(ms%1000*1000) };
+
+		if (auto ret = select(0, nullptr, &wr, &ex, &tv); ret == SOCKET_ERROR) {
+			wsa_set_last_error wsa;
+			return false;
+		} else if (!ret) {
+			SetLastError(WSAETIMEDOUT);
+			return false;
+		} else if (FD_ISSET(s, &ex)) {
+			int optval{};
+			int optlen = sizeof(optval);
+			getsockopt(s, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&optval), &optlen);
+			SetLastError(optval ? optval : WSAECONNREFUSED);
+			return false;
+		}
+	}
+
+	if (u_long nonblocking = false; ioctlsocket(s, FIONBIO, &nonblocking)) {
+		wsa_set_last_error wsa;
+		return false;
+	}
+
+	return true;
 }
 
-auto usbip::connect(_In_ const char *hostname, _In_ const char *service) -> Socket
+/*
+ * @param deadline time_point{} means no deadline
+ */
+auto connect_until(_In_ const char *hostname, _In_ const char *service, _In_ steady_clock::time_point deadline)
 {
 	Socket sock;
 
@@ -225,9 +385,9 @@ auto usbip::connect(_In_ const char *hostname, _In_ const char *service) -> Sock
 			break;
 		}
 
-		if (connect(sock.get(), r->ai_addr, int(r->ai_addrlen))) {
-			wsa_set_last_error wsa;
-			libusbip::output("connect {}:{} error {:#x}", hostname, service, wsa.error);
+		if (!connect_socket(sock.get(), *r, deadline)) {
+			set_last_error save;
+			libusbip::output("connect {}:{} error {:#x}", hostname, service, save.error);
 			sock.close();
 		} else {
 			break;
@@ -237,10 +397,11 @@ auto usbip::connect(_In_ const char *hostname, _In_ const char *service) -> Sock
 	return sock;
 }
 
-bool usbip::enum_exportable_devices(
+auto enum_devices(
+	_Inout_ recv_buffer &buf,
 	_In_ SOCKET s, 
-	_In_ const usb_device_f &on_dev, 
-	_In_ const usb_interface_f &on_intf,
+	_In_ const usb_device_view_f &on_dev, 
+	_In_ const usb_interface_view_f &on_intf,
 	_In_opt_ const usb_device_cnt_f &on_dev_cnt)
 {
 	assert(s != INVALID_SOCKET);
@@ -249,53 +410,204 @@ bool usbip::enum_exportable_devices(
 		return false;
 	}
 
-	if (auto err = recv_op_common(s, OP_REP_DEVLIST)) {
+	if (auto err = recv_op_common(buf, OP_REP_DEVLIST)) {
 		SetLastError(err);
 		return false;
 	}
 
-	op_devlist_reply reply{};
-	
-	if (recv(s, &reply, sizeof(reply))) {
-		PACK_OP_DEVLIST_REPLY(false, &reply);
+	auto reply = static_cast<op_devlist_reply*>(buf.get(sizeof(op_devlist_reply)));
+	if (reply) {
+		PACK_OP_DEVLIST_REPLY(false, reply);
 	} else {
 		return false;
 	}
 
-	libusbip::output("{} exportable device(s)", reply.ndev);
-	assert(reply.ndev <= INT_MAX);
+	auto ndev = reply->ndev;
+
+	libusbip::output("{} exportable device(s)", ndev);
+	assert(ndev <= INT_MAX);
 
 	if (on_dev_cnt) {
-		on_dev_cnt(reply.ndev);
+		on_dev_cnt(ndev);
 	}
 
-	usb_device lib_dev;
-
-	for (UINT32 i = 0; i < reply.ndev; ++i) {
+	for (UINT32 i = 0; i < ndev; ++i) {
 
-		usbip_usb_device dev{};
+		usbip_usb_device dev; // the buffer can be overwritten by the next get()
 
-		if (recv(s, &dev, sizeof(dev))) {
+		if (auto p = buf.get(sizeof(dev))) {
+			memcpy(&dev, p, sizeof(dev));
 			usbip_net_pack_usb_device(false, &dev);
-			lib_dev = as_usb_device(dev);
-			on_dev(i, lib_dev);
 		} else {
 			return false;
 		}
 
-		for (int j = 0; j < dev.bNumInterfaces; ++j) {
+		auto view = as_usb_device_view(dev);
+		on_dev(i, view);
 
-			usbip_usb_interface intf{};
+		for (int j = 0; j < view.bNumInterfaces; ++j) {
 
-			if (recv(s, &intf, sizeof(intf))) {
-				usbip_net_pack_usb_interface(false, &intf);
-				static_assert(sizeof(intf) == sizeof(usb_interface));
-				on_intf(i, lib_dev, j, reinterpret_cast<usb_interface&>(intf));
-			} else {
+			auto intf = static_cast<usbip_usb_interface*>(buf.get(sizeof(usbip_usb_interface)));
+			if (!intf) {
 				return false;
 			}
+
+			usbip_net_pack_usb_interface(false, intf);
+			static_assert(sizeof(*intf) == sizeof(usb_interface));
+			on_intf(i, view, j, *reinterpret_cast<usb_interface*>(intf));
 		}
 	}
 
 	return true;
 }
+
+auto discover_host(
+	_Out_ std::vector<exportable_device> &devices, _In_ const std::string &host, _In_ const char *service, 
+	_In_ steady_clock::time_point deadline) -> DWORD
+{
+	auto sock = connect_until(host.c_str(), service, deadline);
+	if (!sock) {
+		return GetLastError();
+	}
+
+	auto on_dev = [&devices] (int, const usb_device_view &dev)
+	{
+		auto &d = devices.emplace_back();
+		assign(d.device, dev);
+		d.interfaces.reserve(dev.bNumInterfaces);
+	};
+
+	auto on_intf = [&devices] (int, const usb_device_view&, int, const usb_interface &intf)
+	{
+		devices.back().interfaces.push_back(intf);
+	};
+
+	auto on_dev_cnt = [&devices] (int count) { devices.reserve(count); };
+
+	recv_buffer buf(sock.get(), deadline);
+	return enum_devices(buf, sock.get(), on_dev, on_intf, on_dev_cnt) ? 0 : GetLastError();
+}
+
+inline auto trim(_In_ std::string_view s)
+{
+	const auto ws = " \t\r\n";
+
+	if (auto pos = s.find_first_not_of(ws); pos == s.npos) {
+		return std::string_view();
+	} else {
+		s.remove_prefix(pos);
+	}
+
+	return s.substr(0, s.find_last_not_of(ws) + 1);
+}
+
+} // namespace
+
+
+const char* usbip::get_tcp_port() noexcept
+{
+	return tcp_port;
+}
+
+auto usbip::connect(_In_ const char *hostname, _In_ const char *service) -> Socket
+{
+	return connect_until(hostname, service, steady_clock::time_point{});
+}
+
+bool usbip::enum_exportable_devices_view(
+	_In_ SOCKET s, 
+	_In_ const usb_device_view_f &on_dev, 
+	_In_ const usb_interface_view_f &on_intf,
+	_In_opt_ const usb_device_cnt_f &on_dev_cnt)
+{
+	recv_buffer buf(s);
+	return enum_devices(buf, s, on_dev, on_intf, on_dev_cnt);
+}
+
+bool usbip::enum_exportable_devices(
+	_In_ SOCKET s, 
+	_In_ const usb_device_f &on_dev, 
+	_In_ const usb_interface_f &on_intf,
+	_In_opt_ const usb_device_cnt_f &on_dev_cnt)
+{
+	usb_device lib_dev;
+
+	auto dev_f = [&lib_dev, &on_dev] (int idx, const usb_device_view &dev)
+	{
+		assign(lib_dev, dev);
+		on_dev(idx, lib_dev);
+	};
+
+	auto intf_f = [&lib_dev, &on_intf] (int dev_idx, const usb_device_view&, int idx, const usb_interface &intf)
+	{
+		on_intf(dev_idx, lib_dev, idx, intf);
+	};
+
+	return enum_exportable_devices_view(s, dev_f, intf_f, on_dev_cnt);
+}
+
+/*
+ * Each thread queries hosts one by one, the calling thread is one of them.
+ */
+void usbip::discover_devices(
+	_In_ const std::vector<std::string> &hosts, 
+	_In_ const char *service,
+	_In_ std::chrono::milliseconds timeout,
+	_In_ const host_devices_f &on_host,
+	_In_ unsigned int max_threads)
+{
+	std::atomic<size_t> next{};
+	std::mutex mtx; // serializes on_host
+
+	auto worker = [&]
+	{
+		for (size_t i; (i = next++) < hosts.size(); ) {
+			auto &host = hosts[i];
+			std::vector<exportable_device> devices;
+
+			auto err = discover_host(devices, host, service, steady_clock::now() + timeout);
+
+			std::lock_guard lock(mtx);
+			on_host(host, err, devices);
+		}
+	};
+
+	auto cnt = std::clamp(size_t(max_threads), size_t(1), hosts.size() ? hosts.size() : 1);
+	std::vector<std::jthread> threads; // joined by destructor
+
+	try {
+		threads.reserve(cnt - 1);
+		while (threads.size() < cnt - 1) {
+			threads.emplace_back(worker);
+		}
+	} catch (std::system_error &e) {
+		libusbip::output("{} thread(s) started, {}", threads.size(), e.what());
+	}
+
+	worker();
+}
+
+std::vector<std::string> usbip::read_hosts(_In_ const std::wstring &path, _Out_ bool &success)
+{
+	success = false;
+	std::vector<std::string> hosts;
+
+	std::ifstream f(path);
+	if (!f) {
+		SetLastError(ERROR_OPEN_FAILED);
+		return hosts;
+	}
+
+	for (std::string line; std::getline(f, line); ) {
+		if (auto s = trim(line); !(s.empty() || s.starts_with('#'))) {
+			hosts.emplace_back(s);
+		}
+	}
+
+	success = !f.bad();
+	if (!success) {
+		SetLastError(ERROR_READ_FAULT);
+	}
+
+	return hosts;
+}
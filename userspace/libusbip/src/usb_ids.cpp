@@ -3,52 +3,24 @@
  */
 
 #include "usb_ids.h"
+#include "usb_ids_index.h"
 
-#include <cassert>
-#include <functional>
+#include <cstring>
 
 namespace
 {
 
-uint16_t remove_prefix_hex(std::string_view &s)
-{
-        char *end{};
-
-        errno = 0;
-        auto n = strtol(s.data(), &end, 16); // FIXME: doesn't respect s.size()
-
-        if (errno || end == s.data()) {
-		return 0;
-	}
-
-	size_t cnt = end - s.data();
-        if (cnt > s.size()) {
-                return 0;
-        }
-
-        s.remove_prefix(cnt);
-        return static_cast<uint16_t>(n);
-}
+using namespace usbip::usb_ids_index;
 
-using line_f = std::function<bool(std::string_view&, std::string_view&)>;
-
-void for_each_line(std::string_view text, const line_f &f)
+/*
+ * Resource data could be unaligned.
+ */
+template<typename T>
+inline auto read(_In_ const char *p) noexcept
 {
-        while (!text.empty()) {
-                auto pos = text.find('\n');
-                if (pos == text.npos) {
-                        std::string_view tail;
-                        f(text, tail);
-                        break;
-                }
-
-                auto line = text.substr(0, pos ? pos - 1 : 0); // rstrip '\n'
-                text.remove_prefix(++pos);
-
-                if (!line.empty() && f(line, text)) {
-                        break;
-                }
-        }
+        T val;
+        memcpy(&val, p, sizeof(val));
+        return val;
 }
 
 } // namespace
@@ -119,15 +91,18 @@ DWORD win::Resource::size(HMODULE hModule) const noexcept{ return m_impl->size(h
 std::string_view win::Resource::str() const noexcept { return m_impl->str(); }
 
 
+/*
+ * Lookups are binary searches in the index, nothing is allocated.
+ */
 class usbip::UsbIds::Impl
 {
 public:
-        Impl(std::string_view content) { load(content); }
+        Impl() = default;
 
-        auto operator!() const noexcept { return m_vendor.empty() || m_class.empty(); } 
+        auto operator!() const noexcept { return m_data.empty(); } 
         explicit operator bool() const noexcept { return !!*this; }
 
-        void load(std::string_view content);
+        void load_index(std::string_view index);
 
         std::pair<std::string_view, std::string_view> find_product(uint16_t vid, uint16_t pid) const noexcept;
 
@@ -135,156 +110,102 @@ public:
                 find_class_subclass_proto(uint8_t class_id, uint8_t subclass_id, uint8_t prot_id) const noexcept;
 
 private:
-        using products_t = std::unordered_map<uint16_t, std::string_view>;
-        using vendors_t = std::unordered_map<uint16_t, std::pair<std::string_view, products_t>>;
-        vendors_t m_vendor;
+        std::string_view m_data; // empty if the index is invalid
+        header m_hdr{};
 
-        using proto_t = std::unordered_map<uint8_t, std::string_view>;
-        using subclass_t = std::unordered_map<uint8_t, std::pair<std::string_view, proto_t>>;
-        using class_t = std::unordered_map<uint8_t, std::pair<std::string_view, subclass_t>>;
-        class_t m_class;
-
-        bool parse_vid_pid(uint16_t &vid, uint16_t &pid, std::string_view &line, std::string_view &tail);
-        bool parse_class_sub_proto(uint8_t &cls, uint8_t &subcls, std::string_view &line, std::string_view &tail);
+        std::string_view find(const table &t, uint32_t key) const noexcept;
 };
 
-void usbip::UsbIds::Impl::load(std::string_view content)
+void usbip::UsbIds::Impl::load_index(std::string_view index)
 {
-        uint16_t vid{};
-        uint16_t pid{};
-        
-        auto f = [this, &vid, &pid] (auto&&... args) 
-        { 
-                return parse_vid_pid(vid, pid, std::forward<decltype(args)>(args)...); 
-        };
-        
-        for_each_line(content, std::move(f));
-}
+        m_data = {};
 
-bool usbip::UsbIds::Impl::parse_vid_pid(
-        uint16_t &vid, uint16_t &pid, std::string_view &line, std::string_view &tail)
-{
-        if (line.starts_with("# List of known device classes, subclasses and protocols")) {
-                uint8_t cls{};
-                uint8_t subcls{};
-                auto f = [this, &cls, &subcls] (auto&&... args) 
-                { 
-                        return parse_class_sub_proto(cls, subcls, std::forward<decltype(args)>(args)...); 
-                };
-                for_each_line(tail, std::move(f));
-                return true;
-        } else if (line.starts_with('#')) {
-                // continue;
-        } else if (line.starts_with("\t\t")) {
-                assert(!"\\t\\t detected");
-        } else if (line.starts_with('\t')) {
-                line.remove_prefix(1);
-                if (bool(pid = remove_prefix_hex(line))) {
-                        line.remove_prefix(2); // device_name
-                        auto &prod = m_vendor[vid].second;
-                        auto [it, inserted] = prod.emplace(pid, line);
-                        assert(inserted);
-                }
-        } else if (bool(vid = remove_prefix_hex(line))) {
-                line.remove_prefix(2); // vendor_name
-                auto [it, inserted] = m_vendor.emplace(vid, std::make_pair(line, products_t()));
-                assert(inserted);
+        if (index.size() < sizeof(m_hdr) || index.back()) {
+                return;
         }
 
-        return false;
-}
+        auto hdr = read<header>(index.data());
+        if (hdr.magic != magic || hdr.version != version) {
+                return;
+        }
 
-bool usbip::UsbIds::Impl::parse_class_sub_proto(
-        uint8_t &cls, uint8_t &subcls, std::string_view &line, std::string_view&)
-{
-        if (line.starts_with("# List of Audio Class Terminal Types")) {
-                return true;
-        } else if (line.starts_with('#')) {
-                // continue;
-        } else if (line.starts_with("\t\t")) {
-                line.remove_prefix(2);
-                if (auto prot = (uint8_t)remove_prefix_hex(line)) {
-                        line.remove_prefix(2);
-                        auto &sub = m_class[cls].second;
-                        auto &proto = sub[subcls].second;
-                        auto [it, inserted] = proto.emplace(prot, line);
-                        assert(inserted);
-                }
-        } else if (line.starts_with('\t')) {
-                line.remove_prefix(1);
-                if (bool(subcls = (uint8_t)remove_prefix_hex(line))) {
-                        line.remove_prefix(2);
-                        auto &sub = m_class[cls].second;
-                        auto [it, inserted] = sub.emplace(subcls, std::make_pair(line, proto_t()));
-                        assert(inserted);
-                }
-        } else if (line.starts_with("C ")) {
-                line.remove_prefix(2);
-                if (bool(cls = (uint8_t)remove_prefix_hex(line))) {
-                        line.remove_prefix(2);
-                        auto [it, inserted] = m_class.emplace(cls, std::make_pair(line, subclass_t()));
-                        assert(inserted);
+        for (auto &t: { hdr.vendors, hdr.products, hdr.classes }) {
+                if (t.offset > index.size() || t.count > (index.size() - t.offset)/sizeof(entry)) {
+                        return;
                 }
         }
 
-        return false;
+        m_hdr = hdr;
+        m_data = index;
 }
 
-std::pair<std::string_view, std::string_view> 
-usbip::UsbIds::Impl::find_product(uint16_t vid, uint16_t pid) const noexcept
+std::string_view usbip::UsbIds::Impl::find(const table &t, uint32_t key) const noexcept
 {
-        std::pair<std::string_view, std::string_view> res;
-
-        auto v = m_vendor.find(vid);
-        if (v == m_vendor.end()) {
-                return res;
+        if (m_data.empty()) {
+                return {};
         }
 
-        res.first = v->second.first;
-        auto &prod = v->second.second;
+        auto entries = m_data.data() + t.offset;
 
-        auto p = prod.find(pid);
-        if (p != prod.end()) {
-                res.second = p->second;
+        for (uint32_t lo = 0, hi = t.count; lo < hi; ) {
+                auto mid = lo + (hi - lo)/2;
+                auto e = read<entry>(entries + mid*sizeof(entry));
+
+                if (e.key < key) {
+                        lo = mid + 1;
+                } else if (e.key > key) {
+                        hi = mid;
+                } else if (e.name < m_data.size()) {
+                        return m_data.data() + e.name; // the last byte of the index is zero
+                } else {
+                        break;
+                }
         }
 
-        return res;
+        return {};
 }
 
+std::pair<std::string_view, std::string_view> 
+usbip::UsbIds::Impl::find_product(uint16_t vid, uint16_t pid) const noexcept
+{
+        return { find(m_hdr.vendors, vendor_key(vid)), find(m_hdr.products, product_key(vid, pid)) };
+}
+
+/*
+ * Subclass and protocol are not looked up if the upper level is unknown.
+ */
 std::tuple<std::string_view, std::string_view, std::string_view> 
 usbip::UsbIds::Impl::find_class_subclass_proto(
         uint8_t class_id, uint8_t subclass_id, uint8_t prot_id) const noexcept
 {
-        std::tuple<std::string_view, std::string_view, std::string_view>  res;
+        std::tuple<std::string_view, std::string_view, std::string_view> res;
+        auto &[c, s, p] = res;
 
-        auto c = m_class.find(class_id);
-        if (c == m_class.end()) {
+        c = find(m_hdr.classes, class_key(level::class_, class_id));
+        if (c.empty()) {
                 return res;
         }
 
-        std::get<0>(res) = c->second.first;
-        auto &subcls = c->second.second;
-
-        auto s = subcls.find(subclass_id);
-        if (s == subcls.end()) {
+        s = find(m_hdr.classes, class_key(level::subclass, class_id, subclass_id));
+        if (s.empty()) {
                 return res;
         }
 
-        std::get<1>(res) = s->second.first;
-        auto &prot = s->second.second;
-
-        auto p = prot.find(prot_id);
-        if (p != prot.end()) {
-                std::get<2>(res) = p->second;
-        }
-
+        p = find(m_hdr.classes, class_key(level::protocol, class_id, subclass_id, prot_id));
         return res;
 }
 
 
-usbip::UsbIds::UsbIds(std::string_view content) : m_impl(new Impl(content)) {}
+usbip::UsbIds::UsbIds() : m_impl(new Impl) {}
 usbip::UsbIds::~UsbIds() { delete m_impl; }
 
+auto usbip::UsbIds::from_index(std::string_view index) -> UsbIds
+{
+        UsbIds ids;
+        ids.load_index(index);
+        return ids;
+}
+
 auto usbip::UsbIds::operator =(UsbIds&& obj) noexcept -> UsbIds&
 {
         if (&obj != this) {
@@ -298,7 +219,7 @@ auto usbip::UsbIds::operator =(UsbIds&& obj) noexcept -> UsbIds&
 usbip::UsbIds::operator bool() const noexcept { return static_cast<bool>(*m_impl); }
 bool usbip::UsbIds::operator !() const noexcept { return !*m_impl; }
 
-void usbip::UsbIds::load(std::string_view content) { m_impl->load(content); }
+void usbip::UsbIds::load_index(std::string_view index) { m_impl->load_index(index); }
 
 std::pair<std::string_view, std::string_view> 
 usbip::UsbIds::find_product(uint16_t vid, uint16_t pid) const noexcept 
@@ -53,12 +53,18 @@ private:
 namespace usbip
 {
 
+/*
+ * Lookups in the binary index compiled from usb.ids by usbids.exe, @see usb_ids_index.h.
+ * The text of usb.ids is not accepted. The index is not copied, it must outlive the object.
+ */
 class USBIP_API UsbIds
 {
 public:
-	UsbIds(std::string_view content);
+	UsbIds();
 	~UsbIds();
 
+	static UsbIds from_index(std::string_view index);
+
 	UsbIds(const UsbIds&) = delete;
 	UsbIds& operator =(const UsbIds&) = delete;
 
@@ -68,7 +74,10 @@ public:
 	explicit operator bool() const noexcept;
 	bool operator !() const noexcept;
 
-	void load(std::string_view content);
+	/*
+	 * The object becomes empty if the index is malformed.
+	 */
+	void load_index(std::string_view index);
 
 	std::pair<std::string_view, std::string_view> find_product(uint16_t vid, uint16_t pid) const noexcept;
 
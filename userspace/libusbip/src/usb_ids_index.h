@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/*
+ * Binary index of usb.ids, it is made by usbids.exe at build time.
+ *
+ * Tables are arrays of entry sorted by key.
+ * Offsets are from the beginning of the index, name is the offset of null-terminated UTF-8 string.
+ * The last byte of the index is always zero.
+ */
+namespace usbip::usb_ids_index
+{
+
+constexpr uint32_t magic = 0x58444955; // "UIDX"
+constexpr uint32_t version = 1;
+
+struct entry
+{
+        uint32_t key;
+        uint32_t name;
+};
+static_assert(sizeof(entry) == 8);
+
+struct table
+{
+        uint32_t offset;
+        uint32_t count;
+};
+
+struct header
+{
+        uint32_t magic;
+        uint32_t version;
+
+        table vendors; // vendor_key
+        table products; // product_key
+        table classes; // class_key
+};
+
+constexpr uint32_t vendor_key(uint16_t vid) { return vid; }
+constexpr uint32_t product_key(uint16_t vid, uint16_t pid) { return uint32_t(vid) << 16 | pid; }
+
+enum class level : uint8_t { class_ = 1, subclass, protocol };
+
+constexpr uint32_t class_key(level lvl, uint8_t class_id, uint8_t subclass_id = 0, uint8_t prot_id = 0)
+{
+        return uint32_t(lvl) << 24 | uint32_t(class_id) << 16 | uint32_t(subclass_id) << 8 | prot_id;
+}
+
+} // namespace usbip::usb_ids_index
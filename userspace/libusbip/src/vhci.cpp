@@ -10,6 +10,8 @@
 #include <resources\messages.h>
 #include <cfgmgr32.h>
 
+#include <algorithm>
+
 #include <initguid.h>
 #include <usbip\vhci.h>
 
@@ -56,6 +58,10 @@ void assign(_Out_ std::vector<imported_device> &dst, _In_ const vhci::imported_d
                         .speed = win_speed(s.speed),
                         .vendor = s.vendor,
                         .product = s.product,
+                        .connect_time = s.connect_time,
+                        .attach_time = s.attach_time,
+                        .attach_attempts = s.attach_attempts,
+                        .attach_delay = s.attach_delay,
                 };
 
                 {       // imported_device_location
@@ -75,6 +81,136 @@ void assign(_Out_ std::vector<imported_device> &dst, _In_ const vhci::imported_d
         }
 }
 
+/*
+ * @return upper bound of the histogram bucket in microseconds
+ */
+UINT64 get_percentile(_In_ const UINT64 (&latency)[vhci::STATISTICS_LATENCY_BUCKETS], _In_ int percent)
+{
+        UINT64 total = 0;
+        for (auto cnt: latency) {
+                total += cnt;
+        }
+
+        if (!total) {
+                return 0;
+        }
+
+        auto rank = (total*percent + 99)/100; // ceil
+        UINT64 sum = 0;
+
+        for (size_t i = 0; i < ARRAYSIZE(latency); ++i) {
+                if ((sum += latency[i]) >= rank) {
+                        return 2ULL << i;
+                }
+        }
+
+        return 2ULL << (ARRAYSIZE(latency) - 1);
+}
+
+void assign(_Out_ transfer_statistics &dst, _In_ const vhci::transfer_statistics &src)
+{
+        dst.submitted = src.submitted;
+        dst.completed = src.completed;
+        dst.bytes_in = src.bytes_in;
+        dst.bytes_out = src.bytes_out;
+        dst.unlinks = src.unlinks;
+        dst.errors = src.errors;
+
+        dst.errors_by_status.clear();
+        for (auto &i: src.error_status) {
+                if (i.count) {
+                        dst.errors_by_status.push_back({ .status = i.status, .count = i.count });
+                }
+        }
+
+        dst.inflight = src.inflight;
+        dst.max_inflight = src.max_inflight;
+
+        dst.latency_p50 = get_percentile(src.latency, 50);
+        dst.latency_p90 = get_percentile(src.latency, 90);
+        dst.latency_p99 = get_percentile(src.latency, 99);
+}
+
+void assign(_Out_ frame_clock_statistics &dst, _In_ const vhci::frame_clock_statistics &src)
+{
+        dst.samples = src.samples;
+        dst.resyncs = src.resyncs;
+        dst.modulus = src.modulus;
+        dst.offset = src.offset;
+        dst.jitter = src.jitter;
+        dst.drift = src.drift;
+}
+
+void assign(_Out_ std::vector<device_statistics> &dst, _In_ const vhci::device_statistics *src, _In_ size_t cnt)
+{
+        assert(dst.empty());
+        dst.reserve(cnt);
+
+        for (size_t i = 0; i < cnt; ++i) {
+                auto &s = src[i];
+                device_statistics d{ .port = s.port };
+
+                assign(d.total, s.total);
+                assign(d.frame_clock, s.frame_clock);
+
+                size_t n = s.endpoint_count;
+                if (n > ARRAYSIZE(s.endpoints)) [[unlikely]] {
+                        n = ARRAYSIZE(s.endpoints);
+                }
+                d.endpoints.resize(n);
+
+                for (size_t j = 0; j < n; ++j) {
+                        auto &e = s.endpoints[j];
+                        auto &r = d.endpoints[j];
+
+                        assign(r, e);
+                        r.address = e.address;
+                        r.type = e.type;
+                }
+
+                dst.push_back(std::move(d));
+        }
+}
+
+void assign(_Out_ std::vector<urb_trace_record> &dst, _In_ const vhci::urb_trace_record *src, _In_ size_t cnt)
+{
+        assert(dst.empty());
+        dst.reserve(cnt);
+
+        for (size_t i = 0; i < cnt; ++i) {
+                auto &s = src[i];
+
+                dst.push_back({
+                        .seqnum = s.seqnum,
+                        .length = s.length,
+                        .status = s.status,
+                        .urb_status = s.urb_status,
+                        .endpoint = s.endpoint,
+                        .type = s.type,
+                        .submit_time = s.submit_time,
+                        .send_time = s.send_time,
+                        .recv_time = s.recv_time,
+                        .complete_time = s.complete_time,
+                });
+        }
+}
+
+/*
+ * @param from, to in 100-nanosecond units
+ */
+void add_latency(_Inout_ urb_latency_histogram::buckets &v, _In_ UINT64 from, _In_ UINT64 to)
+{
+        if (!(from && to >= from)) {
+                return;
+        }
+
+        auto usec = (to - from)/10;
+        size_t i = 0;
+
+        for ( ; usec && i < v.size() - 1; usec >>= 1, ++i);
+        ++v[i];
+}
+
 auto get_path()
 {
         auto guid = const_cast<GUID*>(&vhci::GUID_DEVINTERFACE_USB_HOST_CONTROLLER);
@@ -95,13 +231,11 @@ auto get_path()
                 switch (auto err = CM_Get_Device_Interface_List(guid, nullptr, multi_sz.data(), cch, CM_GET_DEVICE_INTERFACE_LIST_PRESENT)) {
                 case CR_SUCCESS:
                         if (auto v = split_multi_sz(multi_sz); auto n = v.size()) {
-                                if (n == 1) {
-                                        path = v.front();
-                                        assert(!path.empty());
-                                } else {
+                                if (n > 1) { // any instance of the driver serves the ports of all instances
                                         libusbip::output("CM_Get_Device_Interface_List: {} paths returned", n);
-                                        SetLastError(ERROR_USBIP_DEVICE_INTERFACE_LIST);
                                 }
+                                path = *std::min_element(v.begin(), v.end());
+                                assert(!path.empty());
                         } else {
                                 assert(multi_sz.size() == 1); // if not found, returns CR_SUCCESS and ""
                                 assert(!multi_sz.front());
@@ -205,6 +339,67 @@ int usbip::vhci::attach(_In_ HANDLE dev, _In_ const device_location &location)
         return 0;
 }
 
+/*
+ * OVERLAPPED is used in case the handle was opened with FILE_FLAG_OVERLAPPED.
+ */
+std::vector<usbip::attach_result> usbip::vhci::attach(
+        _In_ HANDLE dev, _In_ std::span<const device_location> locations, _Out_ bool &success)
+{
+        success = false;
+        std::vector<attach_result> result;
+
+        auto cnt = static_cast<ULONG>(locations.size());
+        if (!cnt) {
+                success = true;
+                return result;
+        }
+
+        std::vector<char> buf(ioctl::plugin_hardware_batch_size(cnt));
+
+        auto r = reinterpret_cast<ioctl::plugin_hardware_batch*>(buf.data());
+        r->size = ULONG(buf.size());
+        r->count = cnt;
+
+        for (ULONG i = 0; i < cnt; ++i) {
+                ioctl::plugin_hardware tmp{};
+                if (!init(tmp, locations[i])) {
+                        SetLastError(ERROR_INVALID_PARAMETER);
+                        return result;
+                }
+                static_cast<imported_device_location&>(r->devices[i]) = tmp;
+        }
+
+        auto event = CreateEvent(nullptr, true, false, nullptr);
+        if (!event) {
+                return result;
+        }
+        Handle close_event(event);
+
+        OVERLAPPED overlapped{ .hEvent = event };
+        DWORD BytesReturned{};
+
+        if (!(DeviceIoControl(dev, ioctl::PLUGIN_HARDWARE_BATCH, r, DWORD(buf.size()), 
+                              r, DWORD(buf.size()), &BytesReturned, &overlapped) ||
+              (GetLastError() == ERROR_IO_PENDING && 
+               GetOverlappedResult(dev, &overlapped, &BytesReturned, true)))) {
+                return result;
+        }
+
+        if (BytesReturned != buf.size()) [[unlikely]] {
+                SetLastError(ERROR_USBIP_DRIVER_RESPONSE);
+                return result;
+        }
+
+        result.reserve(cnt);
+        for (ULONG i = 0; i < cnt; ++i) {
+                auto &d = r->devices[i];
+                result.push_back({ .port = d.port, .error = d.error });
+        }
+
+        success = true;
+        return result;
+}
+
 bool usbip::vhci::detach(_In_ HANDLE dev, _In_ int port)
 {
         ioctl::plugout_hardware r { .port = port };
@@ -213,3 +408,106 @@ bool usbip::vhci::detach(_In_ HANDLE dev, _In_ int port)
         DWORD BytesReturned; // must be set if the last arg is NULL
         return DeviceIoControl(dev, ioctl::PLUGOUT_HARDWARE, &r, sizeof(r), nullptr, 0, &BytesReturned, nullptr);
 }
+
+std::vector<usbip::device_statistics> usbip::vhci::get_statistics(_In_ HANDLE dev, _Out_ bool &success)
+{
+        success = false;
+        std::vector<usbip::device_statistics> result;
+
+        constexpr auto devices_offset = offsetof(ioctl::get_device_statistics, devices);
+
+        ioctl::get_device_statistics *r{};
+        std::vector<char> buf;
+
+        for (auto cnt = 4; true; cnt <<= 1) {
+                buf.resize(ioctl::get_device_statistics_size(cnt));
+
+                r = reinterpret_cast<ioctl::get_device_statistics*>(buf.data());
+                r->size = sizeof(*r);
+
+                if (DWORD BytesReturned; // must be set if the last arg is NULL
+                    DeviceIoControl(dev, ioctl::GET_DEVICE_STATISTICS, r, sizeof(r->size), 
+                                    buf.data(), DWORD(buf.size()), &BytesReturned, nullptr)) {
+
+                        if (BytesReturned < devices_offset) [[unlikely]] {
+                                SetLastError(ERROR_USBIP_DRIVER_RESPONSE);
+                                return result;
+                        }
+                                
+                        buf.resize(BytesReturned);
+                        break;
+
+                } else if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+                        return result;
+                }
+        }
+
+        auto devices_size = buf.size() - devices_offset;
+        success = !(devices_size % sizeof(*r->devices));
+
+        if (!success) {
+                libusbip::output("{}: N*sizeof(device_statistics) != {}", __func__, devices_size);
+                SetLastError(ERROR_USBIP_DRIVER_RESPONSE);
+        } else if (auto cnt = devices_size/sizeof(*r->devices)) {
+                assign(result, r->devices, cnt);
+        }
+
+        return result;
+}
+
+bool usbip::vhci::set_urb_trace(_In_ HANDLE dev, _In_ int port, _In_ bool enable)
+{
+        ioctl::set_urb_trace r { .port = port, .enable = enable };
+        r.size = sizeof(r);
+
+        DWORD BytesReturned; // must be set if the last arg is NULL
+        return DeviceIoControl(dev, ioctl::SET_URB_TRACE, &r, sizeof(r), nullptr, 0, &BytesReturned, nullptr);
+}
+
+std::vector<usbip::urb_trace_record> usbip::vhci::get_urb_trace(
+        _In_ HANDLE dev, _In_ int port, _Out_ UINT32 &dropped, _Out_ bool &success)
+{
+        dropped = 0;
+        success = false;
+        std::vector<urb_trace_record> result;
+
+        constexpr auto records_offset = offsetof(ioctl::get_urb_trace, records);
+        std::vector<char> buf(ioctl::get_urb_trace_size(4096)); // capacity of the driver's ring
+
+        auto r = reinterpret_cast<ioctl::get_urb_trace*>(buf.data());
+        r->size = sizeof(*r);
+        r->port = port;
+
+        DWORD BytesReturned; // must be set if the last arg is NULL
+        if (!DeviceIoControl(dev, ioctl::GET_URB_TRACE, r, DWORD(records_offset), 
+                             buf.data(), DWORD(buf.size()), &BytesReturned, nullptr)) {
+                return result;
+        }
+
+        auto records_size = BytesReturned - records_offset;
+        success = BytesReturned >= records_offset && !(records_size % sizeof(*r->records));
+
+        if (!success) {
+                libusbip::output("{}: N*sizeof(urb_trace_record) != {}", __func__, BytesReturned);
+                SetLastError(ERROR_USBIP_DRIVER_RESPONSE);
+        } else {
+                dropped = r->dropped;
+                assign(result, r->records, records_size/sizeof(*r->records));
+        }
+
+        return result;
+}
+
+auto usbip::make_histogram(_In_ const std::vector<urb_trace_record> &records) -> urb_latency_histogram
+{
+        urb_latency_histogram h{};
+
+        for (auto &r: records) {
+                add_latency(h.queue, r.submit_time, r.send_time);
+                add_latency(h.server, r.send_time, r.recv_time);
+                add_latency(h.receive, r.recv_time, r.complete_time);
+                add_latency(h.total, r.submit_time, r.complete_time);
+        }
+
+        return h;
+}
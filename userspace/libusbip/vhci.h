@@ -8,6 +8,8 @@
 #include "win_handle.h"
 #include <usbspec.h>
 
+#include <array>
+#include <span>
 #include <string>
 #include <vector>
 
@@ -25,6 +27,12 @@ struct device_location
         std::string busid;
 };
 
+struct attach_result
+{
+        int port; // hub port number, >= 1 or zero if an error
+        DWORD error; // zero or ERROR_USBIP_XXX
+};
+
 struct imported_device
 {
         device_location location;
@@ -35,8 +43,107 @@ struct imported_device
 
         UINT16 vendor;
         UINT16 product;
+
+        UINT32 connect_time; // milliseconds, name resolution and TCP connect
+        UINT32 attach_time; // milliseconds, connect and import
+        UINT32 attach_attempts; // of persistent attach, zero if the device was attached by a user
+        UINT32 attach_delay; // milliseconds from the start of persistent attach till success
+};
+
+struct usbd_status_count
+{
+        LONG status; // USBD_STATUS
+        UINT32 count;
+};
+
+/*
+ * Latencies are round-trip times of URBs in microseconds.
+ * Percentiles are estimated by the driver's histogram which has power of two buckets,
+ * upper bound of the bucket is reported.
+ */
+struct transfer_statistics
+{
+        UINT64 submitted;
+        UINT64 completed;
+
+        UINT64 bytes_in;
+        UINT64 bytes_out;
+
+        UINT64 unlinks;
+        UINT64 errors;
+        std::vector<usbd_status_count> errors_by_status;
+
+        UINT32 inflight;
+        UINT32 max_inflight;
+
+        UINT64 latency_p50;
+        UINT64 latency_p90;
+        UINT64 latency_p99;
+};
+
+struct endpoint_statistics : transfer_statistics
+{
+        UINT8 address; // bEndpointAddress
+        UINT8 type; // USBD_PIPE_TYPE
+};
+
+/*
+ * Mapping of host frame numbers to frame numbers of the server, it is used by isoch transfers.
+ * All members are zero if the device did not complete isoch transfers that were submitted with ASAP flag.
+ */
+struct frame_clock_statistics
+{
+        UINT32 samples; // since the last resync
+        UINT32 resyncs;
+        UINT32 modulus; // server frame numbers wrap around at it
+        INT32 offset; // frames, server frame - host frame
+        UINT32 jitter; // microseconds
+        INT32 drift; // ppm, of server frame clock relative to the host one
+};
+
+struct device_statistics
+{
+        int port; // hub port number, >= 1
+        transfer_statistics total;
+        frame_clock_statistics frame_clock;
+        std::vector<endpoint_statistics> endpoints; // the first one is default control pipe
+};
+
+/*
+ * Timestamps are in 100-nanosecond units, @see QueryInterruptTime.
+ * send_time and recv_time are zero if the request did not reach these stages.
+ */
+struct urb_trace_record
+{
+        UINT32 seqnum;
+        UINT32 length; // TransferBufferLength
+        LONG status; // NTSTATUS
+        LONG urb_status; // USBD_STATUS
+
+        UINT8 endpoint; // bEndpointAddress
+        UINT8 type; // USBD_PIPE_TYPE
+
+        UINT64 submit_time; // CMD_SUBMIT is queued
+        UINT64 send_time; // CMD_SUBMIT is sent
+        UINT64 recv_time; // RET_SUBMIT is received
+        UINT64 complete_time; // request is completed
 };
 
+/*
+ * Bucket N counts latencies in [2^(N-1), 2^N) microseconds, the last one also counts longer latencies.
+ */
+struct urb_latency_histogram
+{
+        using buckets = std::array<UINT64, 24>;
+
+        buckets queue; // submit_time -> send_time
+        buckets server; // send_time -> recv_time
+        buckets receive; // recv_time -> complete_time
+        buckets total; // submit_time -> complete_time
+};
+
+USBIP_API urb_latency_histogram make_histogram(_In_ const std::vector<urb_trace_record> &records);
+
 } // namespace usbip
 
 
@@ -63,6 +170,16 @@ USBIP_API std::vector<imported_device> get_imported_devices(_In_ HANDLE dev, _Ou
  */
 USBIP_API int attach(_In_ HANDLE dev, _In_ const device_location &location);
 
+/**
+ * Attach devices concurrently.
+ * @param dev handle of the driver device
+ * @param locations remote devices to attach to
+ * @param success call GetLastError() if false is returned
+ * @return result for each location, in the same order
+ */
+USBIP_API std::vector<attach_result> attach(
+        _In_ HANDLE dev, _In_ std::span<const device_location> locations, _Out_ bool &success);
+
 /**
  * @param dev handle of the driver device
  * @param port hub port number, <= 0 means detach all ports
@@ -70,4 +187,29 @@ USBIP_API int attach(_In_ HANDLE dev, _In_ const device_location &location);
  */
 USBIP_API bool detach(_In_ HANDLE dev, _In_ int port);
 
+/**
+ * @param dev handle of the driver device
+ * @param success call GetLastError() if false is returned
+ * @return performance counters of imported devices
+ */
+USBIP_API std::vector<device_statistics> get_statistics(_In_ HANDLE dev, _Out_ bool &success);
+
+/**
+ * Start or stop recording of completed URBs.
+ * @param dev handle of the driver device
+ * @param port hub port number, <= 0 means all ports
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool set_urb_trace(_In_ HANDLE dev, _In_ int port, _In_ bool enable);
+
+/**
+ * Read out recorded URBs, the next call returns newer ones.
+ * @param dev handle of the driver device
+ * @param port hub port number, >= 1
+ * @param dropped records that were overwritten before they were read
+ * @param success call GetLastError() if false is returned
+ */
+USBIP_API std::vector<urb_trace_record> get_urb_trace(
+        _In_ HANDLE dev, _In_ int port, _Out_ UINT32 &dropped, _Out_ bool &success);
+
 } // namespace usbip::vhci
@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * Compiles usb.ids into the binary index, see usb_ids_index.h.
+ * Usage: usbids <usb.ids> <output>
+ */
+
+#include <libusbip\src\usb_ids_index.h>
+
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+using namespace usbip::usb_ids_index;
+
+struct record
+{
+        uint32_t key;
+        std::string_view name;
+};
+
+/*
+ * @param s "XXXX  name", the number of hex digits is ndigits
+ */
+auto parse(_Out_ uint32_t &id, _Out_ std::string_view &name, _In_ std::string_view s, _In_ size_t ndigits)
+{
+        if (s.size() < ndigits + 2 || s[ndigits] != ' ') {
+                return false;
+        }
+
+        auto last = s.data() + ndigits;
+        if (auto [ptr, ec] = std::from_chars(s.data(), last, id, 16); ec != std::errc() || ptr != last) {
+                return false;
+        }
+
+        name = s.substr(ndigits);
+        name.remove_prefix(std::min(name.find_first_not_of(' '), name.size()));
+
+        return !name.empty();
+}
+
+/*
+ * Vendors and products are listed first, then device classes, then other sections which are skipped.
+ */
+class parser
+{
+public:
+        void line(_In_ std::string_view s);
+
+        std::vector<record> vendors;
+        std::vector<record> products;
+        std::vector<record> classes;
+
+private:
+        enum { VENDORS, CLASSES, OTHER } m_section = VENDORS;
+        uint32_t m_id{}; // of vendor or class
+        uint32_t m_sub{}; // subclass
+        bool m_valid{}; // m_id, m_sub are set
+
+        void vendor_line(_In_ std::string_view s);
+        void class_line(_In_ std::string_view s);
+};
+
+void parser::line(_In_ std::string_view s)
+{
+        if (s.empty() || s.starts_with('#')) {
+                return;
+        }
+
+        if (s[0] != '\t') { // top-level line changes the section
+                if (s.starts_with("C ")) {
+                        m_section = CLASSES;
+                } else if (m_section != VENDORS) {
+                        m_section = OTHER;
+                }
+        }
+
+        switch (m_section) {
+        case VENDORS:
+                vendor_line(s);
+                break;
+        case CLASSES:
+                class_line(s);
+                break;
+        case OTHER:
+                break;
+        }
+}
+
+void parser::vendor_line(_In_ std::string_view s)
+{
+        uint32_t id{};
+        std::string_view name;
+
+        if (s.starts_with("\t\t")) {
+                // interface
+        } else if (s.starts_with('\t')) {
+                if (m_valid && parse(id, name, s.substr(1), 4)) {
+                        products.push_back({ product_key(uint16_t(m_id), uint16_t(id)), name });
+                }
+        } else if ((m_valid = parse(id, name, s, 4))) {
+                m_id = id;
+                vendors.push_back({ vendor_key(uint16_t(id)), name });
+        }
+}
+
+void parser::class_line(_In_ std::string_view s)
+{
+        uint32_t id{};
+        std::string_view name;
+
+        if (s.starts_with("\t\t")) {
+                if (m_valid && parse(id, name, s.substr(2), 2)) {
+                        classes.push_back({ class_key(level::protocol, uint8_t(m_id), uint8_t(m_sub), uint8_t(id)), name });
+                }
+        } else if (s.starts_with('\t')) {
+                if (m_valid && parse(id, name, s.substr(1), 2)) {
+                        m_sub = id;
+                        classes.push_back({ class_key(level::subclass, uint8_t(m_id), uint8_t(id)), name });
+                }
+        } else if ((m_valid = parse(id, name, s.substr(2), 2))) {
+                m_id = id;
+                classes.push_back({ class_key(level::class_, uint8_t(id)), name });
+        }
+}
+
+/*
+ * The first record of duplicate keys is kept.
+ */
+void sort(_Inout_ std::vector<record> &v)
+{
+        std::stable_sort(v.begin(), v.end(), [] (auto &a, auto &b) { return a.key < b.key; });
+
+        auto last = std::unique(v.begin(), v.end(), [] (auto &a, auto &b) { return a.key == b.key; });
+        v.erase(last, v.end());
+}
+
+template<typename T>
+void append(_Inout_ std::vector<char> &buf, _In_ const T &val)
+{
+        auto p = reinterpret_cast<const char*>(&val);
+        buf.insert(buf.end(), p, p + sizeof(val));
+}
+
+auto make_index(_In_ const parser &p)
+{
+        header hdr{};
+        hdr.magic = magic;
+        hdr.version = version;
+
+        auto offset = uint32_t(sizeof(hdr));
+
+        for (auto [t, v]: { std::make_pair(&hdr.vendors, &p.vendors),
+                            std::make_pair(&hdr.products, &p.products),
+                            std::make_pair(&hdr.classes, &p.classes) }) {
+                *t = table{ .offset = offset, .count = uint32_t(v->size()) };
+                offset += uint32_t(v->size()*sizeof(entry));
+        }
+
+        std::vector<char> buf;
+        std::vector<char> strings;
+
+        append(buf, hdr);
+
+        for (auto v: { &p.vendors, &p.products, &p.classes }) {
+                for (auto &r: *v) {
+                        entry e{ .key = r.key, .name = offset + uint32_t(strings.size()) };
+                        append(buf, e);
+
+                        strings.insert(strings.end(), r.name.begin(), r.name.end());
+                        strings.push_back('\0');
+                }
+        }
+
+        buf.insert(buf.end(), strings.begin(), strings.end());
+        buf.push_back('\0'); // if there are no strings
+
+        return buf;
+}
+
+} // namespace
+
+
+int main(int argc, char* argv[])
+{
+        if (argc != 3) {
+                fprintf(stderr, "Usage: %s <usb.ids> <output>\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        std::ifstream in(argv[1], std::ios::binary);
+        if (!in) {
+                fprintf(stderr, "Can't open '%s'\n", argv[1]);
+                return EXIT_FAILURE;
+        }
+
+        std::string text(std::istreambuf_iterator<char>(in), {});
+        parser p;
+
+        for (std::string_view tail(text); !tail.empty(); ) {
+                auto pos = tail.find('\n');
+                auto s = tail.substr(0, pos);
+
+                if (s.ends_with('\r')) {
+                        s.remove_suffix(1);
+                }
+
+                p.line(s);
+                tail.remove_prefix(pos == tail.npos ? tail.size() : pos + 1);
+        }
+
+        for (auto v: { &p.vendors, &p.products, &p.classes }) {
+                sort(*v);
+        }
+
+        auto buf = make_index(p);
+
+        std::ofstream out(argv[2], std::ios::binary | std::ios::trunc);
+        if (!out.write(buf.data(), buf.size())) {
+                fprintf(stderr, "Can't write '%s'\n", argv[2]);
+                return EXIT_FAILURE;
+        }
+
+        printf("%s: %zu vendors, %zu products, %zu classes, %zu bytes\n", argv[2],
+                p.vendors.size(), p.products.size(), p.classes.size(), buf.size());
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "usbip.h"
+
+#include <libusbip\vhci.h>
+#include <libusbip\persistent.h>
+
+#include <spdlog\spdlog.h>
+
+bool usbip::cmd_cache(void *p)
+{
+        auto &args = *reinterpret_cast<cache_args*>(p); 
+        assert(args.clear);
+
+        auto dev = vhci::open();
+        if (!dev) {
+                spdlog::error(GetLastErrorMsg());
+                return false;
+        }
+
+        auto ok = vhci::clear_descriptor_cache(dev.get());
+        if (!ok) {
+                spdlog::error(GetLastErrorMsg());
+        }
+
+        return ok;
+}
@@ -7,9 +7,12 @@
 
 #include <libusbip\vhci.h>
 #include <libusbip\persistent.h>
+#include <libusbip\src\strconv.h>
 
 #include <spdlog\spdlog.h>
 
+#include <charconv>
+
 namespace
 {
 
@@ -23,7 +26,8 @@ void on_device_count(int count)
 	}
 }
 
-void on_device(int, const usb_device &d)
+template<typename Device>
+void on_device(int, const Device &d)
 {
 	auto &ids = get_ids();
 	auto prod = get_product(ids, d.idVendor, d.idProduct);
@@ -44,7 +48,8 @@ void on_device(int, const usb_device &d)
 	printf(lines.c_str());
 }
 
-void on_interface(int, const usb_device &d, int idx, const usb_interface &r)
+template<typename Device>
+void on_interface(int, const Device &d, int idx, const usb_interface &r)
 {
 	auto &ids = get_ids();
 	auto csp = get_class(ids, r.bInterfaceClass, r.bInterfaceSubClass, r.bInterfaceProtocol);
@@ -57,6 +62,137 @@ void on_interface(int, const usb_device &d, int idx, const usb_interface &r)
 	printf(s.c_str());
 }
 
+struct device_filter
+{
+	int vid = -1;
+	int pid = -1;
+	int class_ = -1;
+};
+
+auto parse_hex(_Out_ int &val, _In_ std::string_view s)
+{
+	unsigned int v{};
+	auto end = s.data() + s.size();
+
+	auto [ptr, ec] = std::from_chars(s.data(), end, v, 16);
+	if (ec != std::errc() || ptr != end || v > USHRT_MAX) {
+		return false;
+	}
+
+	val = static_cast<int>(v);
+	return true;
+}
+
+/*
+ * @param id VID[:PID]
+ */
+auto parse_id(_Inout_ device_filter &f, _In_ std::string_view id)
+{
+	auto pos = id.find(':');
+
+	if (!parse_hex(f.vid, id.substr(0, pos))) {
+		return false;
+	}
+
+	return pos == id.npos || parse_hex(f.pid, id.substr(pos + 1));
+}
+
+auto match(_In_ const device_filter &f, _In_ const exportable_device &d)
+{
+	auto &dev = d.device;
+
+	if ((f.vid >= 0 && dev.idVendor != f.vid) || (f.pid >= 0 && dev.idProduct != f.pid)) {
+		return false;
+	}
+
+	if (f.class_ < 0 || dev.bDeviceClass == f.class_) {
+		return true;
+	}
+
+	for (auto &i: d.interfaces) {
+		if (i.bInterfaceClass == f.class_) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Results are printed as soon as a host replies.
+ * @return false if none of the hosts replied
+ */
+auto list_hosts(_In_ const list_args &args)
+{
+	device_filter filter{ .class_ = args.class_ };
+
+	if (!(args.id.empty() || parse_id(filter, args.id))) {
+		spdlog::error("invalid VID[:PID] '{}'", args.id);
+		return false;
+	}
+
+	auto hosts = args.hosts;
+
+	if (!args.hosts_file.empty()) {
+		bool success{};
+		auto v = read_hosts(utf8_to_wchar(args.hosts_file), success);
+		if (!success) {
+			spdlog::error("'{}' {}", args.hosts_file, GetLastErrorMsg());
+			return false;
+		}
+		hosts.insert(hosts.end(), v.begin(), v.end());
+	}
+
+	if (hosts.empty()) {
+		spdlog::error("--hosts or --hosts-file is required");
+		return false;
+	}
+
+	size_t failed = 0; // calls of on_host are serialized
+
+	auto on_host = [&filter, &failed] (auto &host, auto error, auto &devices)
+	{
+		if (error) {
+			spdlog::warn("{}: {}", host, GetLastErrorMsg(error));
+			++failed;
+			return;
+		}
+
+		auto header = false;
+		int idx = 0;
+
+		for (auto &d: devices) {
+			if (!match(filter, d)) {
+				continue;
+			} else if (!header) {
+				printf("%s\n%s\n", host.c_str(), std::string(host.size(), '=').c_str());
+				header = true;
+			}
+
+			on_device(idx, d.device);
+			for (int j = 0; j < int(d.interfaces.size()); ++j) {
+				on_interface(idx, d.device, j, d.interfaces[j]);
+			}
+			++idx;
+		}
+
+		fflush(stdout);
+	};
+
+	spdlog::debug("{} host(s), timeout {} ms", hosts.size(), args.timeout);
+
+	discover_devices(hosts, global_args.tcp_port.c_str(), std::chrono::milliseconds(args.timeout), on_host);
+
+	if (failed == hosts.size()) {
+		spdlog::error("none of {} host(s) replied", hosts.size());
+		return false;
+	} else if (failed) {
+		spdlog::warn("{} of {} host(s) did not reply", failed, hosts.size());
+	}
+
+	return true;
+}
+
 auto list_stashed_devices()
 {
 	bool success{};
@@ -80,6 +216,8 @@ bool usbip::cmd_list(void *p)
 	auto &args = *reinterpret_cast<list_args*>(p);
 	if (args.stashed) {
 		return list_stashed_devices();
+	} else if (args.remote.empty()) {
+		return list_hosts(args);
 	}
 
 	auto sock = connect(args.remote.c_str(), global_args.tcp_port.c_str());
@@ -90,7 +228,8 @@ bool usbip::cmd_list(void *p)
 
 	spdlog::debug("connected to {}:{}", args.remote, global_args.tcp_port);
 
-	if (!enum_exportable_devices(sock.get(), on_device, on_interface, on_device_count)) {
+	if (!enum_exportable_devices_view(sock.get(), on_device<usb_device_view>, on_interface<usb_device_view>, 
+					  on_device_count)) {
 		spdlog::error(GetLastErrorMsg());
 		return false;
 	}
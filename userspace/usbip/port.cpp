@@ -34,6 +34,12 @@ void print(const imported_device &d)
                                 loc.hostname, loc.service, loc.busid,
                                 bus, dev);
 
+        msg += std::format("           -> attached in {} ms, connected in {} ms", d.attach_time, d.connect_time);
+        if (d.attach_attempts) {
+                msg += std::format(", persistent attempt #{} after {} ms", d.attach_attempts, d.attach_delay);
+        }
+        msg += '\n';
+
         printf(msg.c_str());
 }
 
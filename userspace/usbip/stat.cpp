@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "usbip.h"
+
+#include <libusbip\vhci.h>
+
+#include <format>
+#include <spdlog\spdlog.h>
+
+namespace
+{
+
+using namespace usbip;
+
+const char* get_pipe_type_str(UINT8 type) noexcept
+{
+        const char *v[] = { "control", "isoch", "bulk", "interrupt" }; // USBD_PIPE_TYPE
+        return type < ARRAYSIZE(v) ? v[type] : "?";
+}
+
+void print(_In_ const transfer_statistics &s, _In_ const char *indent)
+{
+        constexpr auto &fmt = R"({0}submitted {1}, completed {2}, in-flight {3} (max {4}), unlinks {5}, errors {6}
+{0}bytes in {7}, out {8}
+{0}latency p50 {9}us, p90 {10}us, p99 {11}us
+)";
+        auto msg = std::format(fmt, indent, 
+                               s.submitted, s.completed, s.inflight, s.max_inflight, s.unlinks, s.errors,
+                               s.bytes_in, s.bytes_out,
+                               s.latency_p50, s.latency_p90, s.latency_p99);
+
+        for (auto &e: s.errors_by_status) {
+                msg += std::format("{}USBD_STATUS {:#010x}: {}\n", indent, static_cast<UINT32>(e.status), e.count);
+        }
+
+        fputs(msg.c_str(), stdout);
+}
+
+void print(_In_ const frame_clock_statistics &c, _In_ const char *indent)
+{
+        if (c.modulus) {
+                printf("%sframe clock: offset %d, modulus %u, jitter %uus, drift %dppm, samples %u, resyncs %u\n",
+                        indent, c.offset, c.modulus, c.jitter, c.drift, c.samples, c.resyncs);
+        }
+}
+
+void print(_In_ const device_statistics &d, _In_ bool endpoints)
+{
+        printf("Port %02d:\n", d.port);
+        print(d.total, "         ");
+        print(d.frame_clock, "         ");
+
+        if (!endpoints) {
+                return;
+        }
+
+        for (auto &e: d.endpoints) {
+                printf("    endpoint %#04x %s\n", e.address, get_pipe_type_str(e.type));
+                print(e, "         ");
+        }
+}
+
+} // namespace
+
+
+bool usbip::cmd_stat(void *p)
+{
+        auto &args = *reinterpret_cast<stat_args*>(p); 
+
+        auto dev = vhci::open();
+        if (!dev) {
+                spdlog::error(GetLastErrorMsg());
+                return false;
+        }
+
+        bool success;
+
+        auto devices = vhci::get_statistics(dev.get(), success);
+        if (!success) {
+                spdlog::error(GetLastErrorMsg());
+                return false;
+        }
+
+        spdlog::debug("statistics of {} imported usb device(s)", devices.size());
+
+        auto &ports = args.ports; 
+        auto found = false;
+
+        for (auto &d: devices) {
+                assert(d.port);
+                if (ports.empty() || ports.contains(d.port)) {
+                        if (!found) {
+                                found = true;
+                                printf("Imported USB devices statistics\n"
+                                       "===============================\n");
+                        }
+                        print(d, args.endpoints);
+                }
+        }
+
+        return found || ports.empty();
+}
@@ -27,7 +27,7 @@ namespace
 
 using namespace usbip;
 
-const auto MAX_HUB_PORTS = 127;
+const auto MAX_HUB_PORTS = 16*60; // instances of the driver * ports of each, @see drivers/ude/context.h
 
 auto get_ids_data()
 {
@@ -102,6 +102,21 @@ void add_cmd_list(CLI::App &app)
 
 	cmd->add_option_group("stashed", "List stashed USB devices")
 		->add_flag("-s,--stashed", r.stashed, "List devices stashed by 'port --stash'");
+
+	auto hosts = cmd->add_option_group("hosts", "List exportable USB devices of many remotes concurrently");
+
+	hosts->add_option("-H,--hosts", r.hosts, "Hostnames/IPs of USB/IP servers");
+
+	hosts->add_option("-f,--hosts-file", r.hosts_file, "File with a hostname/IP per line")
+		->check(CLI::ExistingFile);
+
+	hosts->add_option("-i,--id", r.id, "Show devices with this VID[:PID], hex numbers");
+	hosts->add_option("-c,--class", r.class_, "Show devices that have this device or interface class")
+		->check(CLI::Range(0, UINT8_MAX));
+
+	hosts->add_option("-w,--timeout", r.timeout, "Timeout for each host in milliseconds")
+		->check(CLI::Range(100U, 600'000U))
+		->capture_default_str();
 }
 
 void add_cmd_port(CLI::App &app)
@@ -119,6 +134,31 @@ void add_cmd_port(CLI::App &app)
 		->expected(1, MAX_HUB_PORTS);
 }
 
+void add_cmd_stat(CLI::App &app)
+{
+	static stat_args r;
+
+	auto cmd = app.add_subcommand("stat", "Show performance counters of imported USB devices")
+		->callback(pack(cmd_stat, &r));
+
+	cmd->add_flag("-e,--endpoints", r.endpoints, "Show counters of each endpoint");
+	
+	cmd->add_option("number", r.ports, "Hub port number")
+		->check(CLI::Range(1, MAX_HUB_PORTS))
+		->expected(1, MAX_HUB_PORTS);
+}
+
+void add_cmd_cache(CLI::App &app)
+{
+	static cache_args r;
+
+	auto cmd = app.add_subcommand("cache", "Manage descriptors of remote devices cached by the driver")
+		->callback(pack(cmd_cache, &r))
+		->require_option(1);
+
+	cmd->add_flag("-c,--clear", r.clear, "Remove cached descriptors, they will be fetched on the next attach");
+}
+
 void init(CLI::App &app, const wchar_t *program)
 {
 	app.set_version_flag("-V,--version", get_version(program));
@@ -141,7 +181,7 @@ auto& get_resource_module() noexcept
 
 void init_spdlog()
 {
-	set_default_logger(spdlog::stderr_color_st("stderr"));
+	set_default_logger(spdlog::stderr_color_mt("stderr")); // libusbip::output can be called by "list --hosts" threads
 	spdlog::set_pattern("%^%l%$: %v");
 
 	using fn = void(const std::string&);
@@ -167,7 +207,7 @@ std::string usbip::GetLastErrorMsg(unsigned long msg_id)
 
 const UsbIds& usbip::get_ids()
 {
-	static UsbIds ids(get_ids_data());
+	static auto ids = UsbIds::from_index(get_ids_data());
 	assert(ids);
 	return ids;
 }
@@ -195,6 +235,8 @@ int wmain(int argc, wchar_t *argv[])
 	add_cmd_detach(app);
 	add_cmd_list(app);
 	add_cmd_port(app);
+	add_cmd_stat(app);
+	add_cmd_cache(app);
 
 	app.require_subcommand(1);
 	CLI11_PARSE(app, argc, argv);
@@ -6,6 +6,7 @@
 
 #include <string>
 #include <set>
+#include <vector>
 
 #include <libusbip\remote.h>
 
@@ -50,6 +51,13 @@ struct list_args
 
         // --stashed
         bool stashed;
+
+        // --hosts
+        std::vector<std::string> hosts;
+        std::string hosts_file;
+        std::string id; // VID[:PID]
+        int class_ = -1;
+        unsigned int timeout = 3000; // milliseconds
 };
 command_t cmd_list;
 
@@ -60,4 +68,17 @@ struct port_args
 };
 command_t cmd_port;
 
+struct stat_args
+{
+        std::set<int> ports;
+        bool endpoints;
+};
+command_t cmd_stat;
+
+struct cache_args
+{
+        bool clear;
+};
+command_t cmd_cache;
+
 } // namespace usbip